@@ -295,7 +295,8 @@ static int32 dtlsClientConnection(sslKeys_t *keys, sslSessionId_t *sid)
 	memset(&options, 0x0, sizeof(sslSessOpts_t));
 	options.versionFlag = SSL_FLAGS_DTLS;
 	options.trustedCAindication = 1;
-
+	/* Take a connection ID from the server but don't ask it to use one */
+	options.dtlsCidLen = -1;
 
 	/* We are passing the IP address of the server as the expected name */
 	/* To skip certificate subject name tests, pass NULL instead of g_ip */
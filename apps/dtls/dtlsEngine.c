@@ -0,0 +1,838 @@
+/**
+ *	@file    dtlsEngine.c
+ *	@version ee35b93 (HEAD -> master)
+ *
+ *	Reusable DTLS server engine.  Demultiplexes datagrams on one UDP socket
+ *	to per-peer sessions through a hashed peer table, reading and writing
+ *	in batches where the platform allows.
+ */
+/*
+ *	Copyright (c) 2014-2016 INSIDE Secure Corporation
+ *	Copyright (c) PeerSec Networks, 2002-2011
+ *	All Rights Reserved
+ *
+ *	The latest version of this code is available at http://www.matrixssl.org
+ *
+ *	This software is open source; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This General Public License does NOT permit incorporating this software
+ *	into proprietary programs.  If you are unable to comply with the GPL, a
+ *	commercial license for this software may be purchased from INSIDE at
+ *	http://www.insidesecure.com/
+ *
+ *	This program is distributed in WITHOUT ANY WARRANTY; without even the
+ *	implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *	See the GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *	http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* recvmmsg, sendmmsg */
+#endif
+
+#include "dtlsEngine.h"
+
+#if defined(USE_DTLS) && defined(USE_SERVER_SIDE_SSL)
+
+static void flushSends(dtlsEngine_t *eng);
+static void queueSend(dtlsEngine_t *eng, const struct sockaddr *addr,
+				socklen_t addrLen, unsigned char *buf, uint32 len, int lossFlags);
+
+#define DTLS_PEER_ID_LEN	18	/* IPv6 address and port */
+
+/******************************************************************************/
+/*
+	Peer table
+*/
+/* The parts of an address that identify a peer */
+static const unsigned char *addrKey(const struct sockaddr *addr,
+				socklen_t addrLen, uint32_t *keyLen, uint16_t *port)
+{
+	if (addr->sa_family == AF_INET && addrLen >= sizeof(struct sockaddr_in)) {
+		*keyLen = 4;
+		*port = ((const struct sockaddr_in *)addr)->sin_port;
+		return (const unsigned char *)
+			&((const struct sockaddr_in *)addr)->sin_addr;
+	}
+#ifdef AF_INET6
+	if (addr->sa_family == AF_INET6 &&
+			addrLen >= sizeof(struct sockaddr_in6)) {
+		*keyLen = 16;
+		*port = ((const struct sockaddr_in6 *)addr)->sin6_port;
+		return (const unsigned char *)
+			&((const struct sockaddr_in6 *)addr)->sin6_addr;
+	}
+#endif
+	return NULL;
+}
+
+/*
+	FNV-1a over address and port, seeded per engine so a remote party
+	can't aim many addresses at one bucket, then mixed so the low bits
+	used as the bucket index depend on every input byte.
+*/
+static uint32_t peerHash(const dtlsEngine_t *eng, const unsigned char *key,
+				uint32_t keyLen, uint16_t port)
+{
+	uint32_t	h = 2166136261U ^ eng->hashSeed;
+
+	while (keyLen-- > 0) {
+		h = (h ^ *key++) * 16777619U;
+	}
+	h = (h ^ (port & 0xFF)) * 16777619U;
+	h = (h ^ (port >> 8)) * 16777619U;
+	h ^= h >> 16;
+	h *= 0x85EBCA6BU;
+	h ^= h >> 13;
+	return h;
+}
+
+static int32 samePeer(const dtlsPeer_t *peer, const struct sockaddr *addr,
+				const unsigned char *key, uint32_t keyLen, uint16_t port)
+{
+	const unsigned char	*pkey;
+	uint32_t			pkeyLen;
+	uint16_t			pport;
+
+	if (peer->addr.ss_family != addr->sa_family) {
+		return 0;
+	}
+	pkey = addrKey((const struct sockaddr *)&peer->addr, peer->addrLen,
+		&pkeyLen, &pport);
+	return pkey != NULL && pkeyLen == keyLen && pport == port &&
+		memcmp(pkey, key, keyLen) == 0;
+}
+
+dtlsPeer_t *dtlsEngineFindPeer(dtlsEngine_t *eng, const struct sockaddr *addr,
+				socklen_t addrLen)
+{
+	const unsigned char	*key;
+	dtlsPeer_t			*peer;
+	uint32_t			keyLen, h;
+	uint16_t			port;
+
+	if ((key = addrKey(addr, addrLen, &keyLen, &port)) == NULL) {
+		return NULL;
+	}
+	h = peerHash(eng, key, keyLen, port);
+	for (peer = eng->buckets[h & eng->bucketMask]; peer; peer = peer->next) {
+		if (peer->hash == h && samePeer(peer, addr, key, keyLen, port)) {
+			return peer;
+		}
+	}
+	return NULL;
+}
+
+/* Address and port as the identity bound into DTLS cookies */
+static uint16_t peerId(const unsigned char *key, uint32_t keyLen,
+				uint16_t port, unsigned char id[DTLS_PEER_ID_LEN])
+{
+	memcpy(id, key, keyLen);
+	memcpy(id + keyLen, &port, sizeof(port));
+	return (uint16_t)(keyLen + sizeof(port));
+}
+
+/*
+	Answer a ClientHello from an unknown address with a HelloVerifyRequest
+	without allocating anything.  PS_SUCCESS once the client has proven it
+	can receive at the address, and only then does it get a session.
+*/
+static int32 cookieExchange(dtlsEngine_t *eng, const struct sockaddr *addr,
+				socklen_t addrLen, const unsigned char *buf, uint32 len)
+{
+	const unsigned char	*key;
+	unsigned char		id[DTLS_PEER_ID_LEN], hvr[64];
+	uint32				hvrLen;
+	uint32_t			keyLen;
+	uint16_t			port;
+	int32				rc;
+
+	if ((key = addrKey(addr, addrLen, &keyLen, &port)) == NULL) {
+		return PS_ARG_FAIL;
+	}
+	hvrLen = sizeof(hvr);
+	rc = matrixDtlsCheckCookie(buf, len, id, peerId(key, keyLen, port, id),
+		hvr, &hvrLen);
+	if (rc == MATRIXSSL_REQUEST_SEND) {
+		queueSend(eng, addr, addrLen, hvr, hvrLen, MIN_WAIT_SECS);
+	}
+	return rc;
+}
+
+/* Slot index and a fresh random tag, so a reused slot gets a new CID */
+static int32 peerCid(dtlsEngine_t *eng, dtlsPeer_t *peer)
+{
+	uint32_t	slot = (uint32_t)(peer - eng->peers);
+
+	peer->cid[0] = (unsigned char)(slot >> 24);
+	peer->cid[1] = (unsigned char)(slot >> 16);
+	peer->cid[2] = (unsigned char)(slot >> 8);
+	peer->cid[3] = (unsigned char)slot;
+	return matrixCryptoGetPrngData(peer->cid + 4, DTLS_ENGINE_CID_LEN - 4,
+		NULL);
+}
+
+/*
+	The live peer a CID record names, or NULL.  Only the table slot is
+	trusted from the header; the record MAC is what proves the sender.
+*/
+static dtlsPeer_t *findPeerByCid(dtlsEngine_t *eng, const unsigned char *buf,
+				uint32 len)
+{
+	const unsigned char	*cid;
+	dtlsPeer_t			*peer;
+	uint32_t			slot;
+
+	if (!eng->useCid || matrixDtlsGetConnectionId(buf, len,
+			DTLS_ENGINE_CID_LEN, &cid) < 0) {
+		return NULL;
+	}
+	slot = ((uint32_t)cid[0] << 24) | ((uint32_t)cid[1] << 16) |
+		((uint32_t)cid[2] << 8) | cid[3];
+	if (slot >= eng->maxPeers) {
+		return NULL;
+	}
+	peer = &eng->peers[slot];
+	if (peer->ssl == NULL ||
+			memcmp(peer->cid, cid, DTLS_ENGINE_CID_LEN) != 0) {
+		return NULL;
+	}
+	return peer;
+}
+
+/*
+	Move a peer to the address its authenticated records now come from.
+	Called only after the session accepted a record, so a forged header
+	can't redirect a peer's traffic.
+*/
+static void movePeer(dtlsEngine_t *eng, dtlsPeer_t *peer,
+				const struct sockaddr *addr, socklen_t addrLen)
+{
+	const unsigned char	*key;
+	dtlsPeer_t			**pp;
+	uint32_t			keyLen;
+	uint16_t			port;
+
+	if ((key = addrKey(addr, addrLen, &keyLen, &port)) == NULL ||
+			samePeer(peer, addr, key, keyLen, port) ||
+			dtlsEngineFindPeer(eng, addr, addrLen) != NULL) {
+		return;
+	}
+	psTraceDtls("Peer moved to a new address\n");
+	for (pp = &eng->buckets[peer->hash & eng->bucketMask]; *pp != peer;
+			pp = &(*pp)->next);
+	*pp = peer->next;
+	memcpy(&peer->addr, addr, addrLen);
+	peer->addrLen = addrLen;
+	peer->hash = peerHash(eng, key, keyLen, port);
+	peer->next = eng->buckets[peer->hash & eng->bucketMask];
+	eng->buckets[peer->hash & eng->bucketMask] = peer;
+}
+
+/* Start a new server session for addr.  NULL if the table is full. */
+static dtlsPeer_t *newPeer(dtlsEngine_t *eng, const struct sockaddr *addr,
+				socklen_t addrLen)
+{
+	const unsigned char	*key;
+	unsigned char		id[DTLS_PEER_ID_LEN];
+	dtlsPeer_t			*peer;
+	ssl_t				*ssl;
+	uint32_t			keyLen;
+	uint16_t			port;
+	int32				rc;
+
+	if ((key = addrKey(addr, addrLen, &keyLen, &port)) == NULL ||
+			(peer = eng->freePeers) == NULL) {
+		return NULL;
+	}
+	eng->options.dtlsPeerId = id;
+	eng->options.dtlsPeerIdLen = peerId(key, keyLen, port, id);
+	if (eng->useCid) {
+		if (peerCid(eng, peer) < 0) {
+			eng->options.dtlsPeerId = NULL;
+			eng->options.dtlsPeerIdLen = 0;
+			return NULL;
+		}
+		eng->options.dtlsCid = peer->cid;
+		eng->options.dtlsCidLen = DTLS_ENGINE_CID_LEN;
+	}
+	rc = matrixSslNewServerSession(&ssl, eng->keys, eng->certCb,
+		&eng->options);
+	eng->options.dtlsPeerId = NULL;
+	eng->options.dtlsPeerIdLen = 0;
+	eng->options.dtlsCid = NULL;
+	eng->options.dtlsCidLen = 0;
+	if (rc < 0) {
+		return NULL;
+	}
+	eng->freePeers = peer->next;
+	memcpy(&peer->addr, addr, addrLen);
+	peer->addrLen = addrLen;
+	peer->hash = peerHash(eng, key, keyLen, port);
+	peer->timeout = MIN_WAIT_SECS;
+	peer->connStatus = 0;
+	peer->userPtr = NULL;
+	psGetTime(&peer->lastRecvTime, NULL);
+	peer->ssl = ssl;
+	peer->next = eng->buckets[peer->hash & eng->bucketMask];
+	eng->buckets[peer->hash & eng->bucketMask] = peer;
+	eng->numPeers++;
+	return peer;
+}
+
+/*
+	Queue a datagram for addr.  The data is copied since the flight
+	buffer moves on with matrixDtlsSentData.  lossFlags is only for the
+	DTLS_PACKET_LOSS_TEST hook in udpSend.
+*/
+static void queueSend(dtlsEngine_t *eng, const struct sockaddr *addr,
+				socklen_t addrLen, unsigned char *buf, uint32 len, int lossFlags)
+{
+#ifdef DTLS_PACKET_LOSS_TEST
+	if (udpSend(eng->fd, buf, len, addr, addrLen,
+			lossFlags, eng->packetLossProb, NULL) < 0) {
+		psTraceDtls("udpSend error.  Ignoring\n");
+	}
+#else
+	PS_PARAMETER_UNUSED(lossFlags);
+	if (len > eng->rxSize[0]) {
+		/* Larger than a PMTU datagram, so no batch slot fits it */
+		if (sendto(eng->fd, buf, len, 0, addr, addrLen) < 0) {
+			psTraceDtls("sendto error.  Ignoring\n");
+		}
+		return;
+	}
+	if (eng->txCount == eng->batch) {
+		flushSends(eng);
+	}
+	memcpy(eng->txBuf[eng->txCount], buf, len);
+	eng->txLen[eng->txCount] = len;
+	memcpy(&eng->txAddr[eng->txCount], addr, addrLen);
+	eng->txAddrLen[eng->txCount] = addrLen;
+	eng->txCount++;
+#endif /* DTLS_PACKET_LOSS_TEST */
+}
+
+/*
+	Send whatever is queued.  DTLS handles lost datagrams with flight
+	resends, so a full socket buffer just drops the rest of the batch.
+*/
+static void flushSends(dtlsEngine_t *eng)
+{
+	uint32_t	i;
+#ifdef DTLS_USE_MMSG
+	int			n;
+
+	for (i = 0; i < eng->txCount; i++) {
+		eng->txIov[i].iov_base = eng->txBuf[i];
+		eng->txIov[i].iov_len = eng->txLen[i];
+		memset(&eng->txMsg[i], 0x0, sizeof(struct mmsghdr));
+		eng->txMsg[i].msg_hdr.msg_name = &eng->txAddr[i];
+		eng->txMsg[i].msg_hdr.msg_namelen = eng->txAddrLen[i];
+		eng->txMsg[i].msg_hdr.msg_iov = &eng->txIov[i];
+		eng->txMsg[i].msg_hdr.msg_iovlen = 1;
+	}
+	for (i = 0; i < eng->txCount; i += n) {
+		if ((n = sendmmsg(eng->fd, &eng->txMsg[i], eng->txCount - i,
+				MSG_DONTWAIT)) <= 0) {
+			if (n < 0 && SOCKET_ERRNO == EINTR) {
+				n = 0;
+				continue;
+			}
+			psTraceIntDtls("sendmmsg error %d.  Dropping batch\n", SOCKET_ERRNO);
+			break;
+		}
+		psTraceIntDtls("Sent %d datagrams\n", n);
+	}
+#else
+	for (i = 0; i < eng->txCount; i++) {
+		if (sendto(eng->fd, eng->txBuf[i], eng->txLen[i], 0,
+				(struct sockaddr *)&eng->txAddr[i], eng->txAddrLen[i]) < 0) {
+			psTraceDtls("sendto error.  Ignoring\n");
+		}
+	}
+#endif /* DTLS_USE_MMSG */
+	eng->txCount = 0;
+}
+
+void dtlsEngineClosePeer(dtlsEngine_t *eng, dtlsPeer_t *peer)
+{
+	dtlsPeer_t		**pp;
+	unsigned char	*buf;
+	int32			len;
+
+	/* Quick attempt to send a closure alert, don't worry about failure */
+	if (matrixSslEncodeClosureAlert(peer->ssl) >= 0) {
+		if ((len = matrixDtlsGetOutdata(peer->ssl, &buf)) > 0) {
+			queueSend(eng, (struct sockaddr *)&peer->addr, peer->addrLen, buf, len, MAX_WAIT_SECS);
+			matrixDtlsSentData(peer->ssl, len);
+		}
+	}
+	matrixSslDeleteSession(peer->ssl);
+
+	for (pp = &eng->buckets[peer->hash & eng->bucketMask]; *pp != peer;
+			pp = &(*pp)->next);
+	*pp = peer->next;
+	memset(peer, 0x0, sizeof(dtlsPeer_t));
+	peer->next = eng->freePeers;
+	eng->freePeers = peer;
+	eng->numPeers--;
+}
+
+/*
+	Send the peer's pending flight.  PS_FAILURE if that closed the peer.
+*/
+static int32 sendFlight(dtlsEngine_t *eng, dtlsPeer_t *peer, int lossFlags)
+{
+	unsigned char	*buf;
+	int32			len, rc;
+
+	while ((len = matrixDtlsGetOutdata(peer->ssl, &buf)) > 0) {
+		queueSend(eng, (struct sockaddr *)&peer->addr, peer->addrLen, buf, len, lossFlags);
+		/* Always indicate the entire datagram was sent as
+		there is no way for DTLS to handle partial records.
+		Resends and timeouts will handle any problems */
+		rc = matrixDtlsSentData(peer->ssl, len);
+		if (rc < 0 || rc == MATRIXSSL_REQUEST_CLOSE) {
+			psTraceDtls("Got REQUEST_CLOSE out of SentData\n");
+			dtlsEngineClosePeer(eng, peer);
+			return PS_FAILURE;
+		}
+		if (rc == MATRIXSSL_HANDSHAKE_COMPLETE) {
+			/* This is the standard handshake case */
+			psTraceDtls("Got HANDSHAKE_COMPLETE out of SentData\n");
+			break;
+		}
+		/* SSL_REQUEST_SEND is handled by loop logic */
+	}
+	return PS_SUCCESS;
+}
+
+/*
+	Give one received datagram to its peer's session.  The datagram is in
+	batch slot i and is swapped into the session as its read buffer rather
+	than copied, unless the session still holds part of a previous one.
+*/
+static void deliver(dtlsEngine_t *eng, dtlsPeer_t *peer, uint32_t i,
+				uint32 recvLen)
+{
+	ssl_t			*ssl = peer->ssl;
+	unsigned char	*buf, *p;
+	uint32			len, pmtu;
+	int32			rc;
+
+	pmtu = (uint32)matrixDtlsGetPmtu();
+	if (eng->rxSize[i] < pmtu) {
+		/* Slot left short by a failed grow below, so copy instead */
+		rc = PS_PENDING;
+	} else {
+		rc = matrixDtlsSwapReadbuf(ssl, &eng->rxBuf[i], &eng->rxSize[i]);
+	}
+	if (rc == PS_PENDING) {
+		if ((uint32)matrixSslGetReadbuf(ssl, &buf) < recvLen) {
+			psTraceDtls("No room for datagram.  Dropping\n");
+			return;
+		}
+		memcpy(buf, eng->rxBuf[i], recvLen);
+	} else if (rc < 0) {
+		dtlsEngineClosePeer(eng, peer);
+		return;
+	} else if (eng->rxSize[i] < pmtu) {
+		/* The session's old buffer is too small for the next batch */
+		if ((p = psRealloc(eng->rxBuf[i], pmtu, NULL)) == NULL &&
+				(p = psMalloc(NULL, pmtu)) != NULL && eng->rxBuf[i]) {
+			psFree(eng->rxBuf[i], NULL);
+		}
+		if (p != NULL) {
+			eng->rxBuf[i] = p;
+			eng->rxSize[i] = pmtu;
+		} else {
+			psTraceIntDtls("Receive slot %d stays short, datagrams will be copied\n",
+				(int32)i);
+		}
+	}
+
+	/*	Notify SSL state machine that we've received more data into the
+		ssl buffer */
+	if ((rc = matrixSslReceivedData(ssl, recvLen, &buf, &len)) < 0) {
+		dtlsEngineClosePeer(eng, peer);
+		return;
+	}
+	/* Update last activity time and reset timeout*/
+	psGetTime(&peer->lastRecvTime, NULL);
+	peer->timeout = MIN_WAIT_SECS;
+
+	for (;;) {
+		switch (rc) {
+		case MATRIXSSL_HANDSHAKE_COMPLETE:
+			/* This is a resumed handshake case which means we are
+			the last to receive handshake flights and we know the
+			handshake is complete.  However, the internal workings
+			will not flag us officially complete until we receive
+			application data from the peer so we need a local flag
+			to handle this case so we are not resending our final
+			flight */
+			peer->connStatus = RESUMED_HANDSHAKE_COMPLETE;
+			psTraceDtls("Got HANDSHAKE_COMPLETE out of ReceivedData\n");
+			return;
+		case MATRIXSSL_APP_DATA:
+			/* Now safe to clear the connStatus flag that was keeping
+			track of the state between receiving the final flight of
+			a resumed handshake and receiving application data.  The
+			reciept of app data has now internally disabled flight
+			resends */
+			peer->connStatus = 0;
+			if (eng->useCid) {
+				movePeer(eng, peer, (struct sockaddr *)&eng->rxAddr[i],
+					eng->rxAddrLen[i]);
+			}
+			if (eng->appDataCb && eng->appDataCb(eng, peer, buf, len) < 0) {
+				dtlsEngineClosePeer(eng, peer);
+				return;
+			}
+			break;
+		case MATRIXSSL_REQUEST_SEND:
+			/* Still handshaking with this particular client */
+			sendFlight(eng, peer, peer->timeout);
+			return;
+		case MATRIXSSL_REQUEST_RECV:
+			psTraceDtls("Got REQUEST_RECV from ReceivedData\n");
+			return;
+		case MATRIXSSL_RECEIVED_ALERT:
+			/* The first byte of the buffer is the level */
+			/* The second byte is the description */
+			if (*buf == SSL_ALERT_LEVEL_FATAL) {
+				psTraceIntDtls("Fatal alert: %d, closing connection.\n",
+							*(buf + 1));
+				dtlsEngineClosePeer(eng, peer);
+				return;
+			}
+			/* Closure alert is normal (and best) way to close */
+			if (*(buf + 1) == SSL_ALERT_CLOSE_NOTIFY) {
+				dtlsEngineClosePeer(eng, peer);
+				return;
+			}
+			psTraceIntDtls("Warning alert: %d\n", *(buf + 1));
+			break;
+		default:
+			return;
+		}
+		if ((rc = matrixSslProcessedData(ssl, &buf, &len)) <= 0) {
+			if (rc < 0) {
+				dtlsEngineClosePeer(eng, peer);
+			}
+			return;
+		}
+	}
+}
+
+/******************************************************************************/
+/*
+	Set up the engine for an already bound UDP socket.  Server sessions are
+	created with eng->options, which the caller may adjust after this.
+*/
+int32 dtlsEngineOpen(dtlsEngine_t *eng, SOCKET fd, sslKeys_t *keys,
+				sslCertCb_t certCb, uint32 maxPeers, uint32 batch)
+{
+	uint32_t	i, buckets;
+	uint32		pmtu;
+
+	memset(eng, 0x0, sizeof(dtlsEngine_t));
+	if (maxPeers == 0 || maxPeers > 0x40000000) {
+		return PS_ARG_FAIL;
+	}
+	eng->fd = fd;
+	eng->keys = keys;
+	eng->certCb = certCb;
+	eng->options.versionFlag = SSL_FLAGS_DTLS;
+	eng->options.truncHmac = -1;
+	eng->useCid = 1;
+	eng->maxPeers = maxPeers;
+	eng->batch = batch ? batch : DTLS_DEFAULT_BATCH;
+#ifndef DTLS_USE_MMSG
+	eng->batch = 1;
+#endif
+	if (matrixCryptoGetPrngData((unsigned char *)&eng->hashSeed,
+			sizeof(eng->hashSeed), NULL) < 0) {
+		return PS_PLATFORM_FAIL;
+	}
+
+	/* About one peer per bucket when full */
+	for (buckets = 16; buckets < maxPeers; buckets <<= 1);
+	eng->bucketMask = buckets - 1;
+	eng->peers = psCalloc(NULL, maxPeers, sizeof(dtlsPeer_t));
+	eng->buckets = psCalloc(NULL, buckets, sizeof(dtlsPeer_t *));
+	if (eng->peers == NULL || eng->buckets == NULL) {
+		dtlsEngineClose(eng);
+		return PS_MEM_FAIL;
+	}
+	for (i = maxPeers; i-- > 0; ) {
+		eng->peers[i].next = eng->freePeers;
+		eng->freePeers = &eng->peers[i];
+	}
+
+	eng->rxBuf = psCalloc(NULL, eng->batch, sizeof(unsigned char *));
+	eng->rxSize = psCalloc(NULL, eng->batch, sizeof(uint32));
+	eng->rxLen = psCalloc(NULL, eng->batch, sizeof(uint32));
+	eng->rxAddr = psCalloc(NULL, eng->batch, sizeof(struct sockaddr_storage));
+	eng->rxAddrLen = psCalloc(NULL, eng->batch, sizeof(socklen_t));
+	eng->txBuf = psCalloc(NULL, eng->batch, sizeof(unsigned char *));
+	eng->txLen = psCalloc(NULL, eng->batch, sizeof(uint32));
+	eng->txAddr = psCalloc(NULL, eng->batch, sizeof(struct sockaddr_storage));
+	eng->txAddrLen = psCalloc(NULL, eng->batch, sizeof(socklen_t));
+#ifdef DTLS_USE_MMSG
+	eng->rxMsg = psCalloc(NULL, eng->batch, sizeof(struct mmsghdr));
+	eng->rxIov = psCalloc(NULL, eng->batch, sizeof(struct iovec));
+	eng->txMsg = psCalloc(NULL, eng->batch, sizeof(struct mmsghdr));
+	eng->txIov = psCalloc(NULL, eng->batch, sizeof(struct iovec));
+	if (eng->rxMsg == NULL || eng->rxIov == NULL || eng->txMsg == NULL ||
+			eng->txIov == NULL) {
+		dtlsEngineClose(eng);
+		return PS_MEM_FAIL;
+	}
+#endif
+	if (eng->rxBuf == NULL || eng->rxSize == NULL || eng->rxLen == NULL ||
+			eng->rxAddr == NULL ||
+			eng->rxAddrLen == NULL || eng->txBuf == NULL ||
+			eng->txLen == NULL || eng->txAddr == NULL ||
+			eng->txAddrLen == NULL) {
+		dtlsEngineClose(eng);
+		return PS_MEM_FAIL;
+	}
+	pmtu = matrixDtlsGetPmtu();
+	for (i = 0; i < eng->batch; i++) {
+		eng->rxBuf[i] = psMalloc(NULL, pmtu);
+		eng->txBuf[i] = psMalloc(NULL, pmtu);
+		if (eng->rxBuf[i] == NULL || eng->txBuf[i] == NULL) {
+			dtlsEngineClose(eng);
+			return PS_MEM_FAIL;
+		}
+		eng->rxSize[i] = pmtu;
+	}
+	udpInitProxy();
+	return PS_SUCCESS;
+}
+
+void dtlsEngineClose(dtlsEngine_t *eng)
+{
+	uint32_t	i;
+
+	if (eng->peers) {
+		/* Free any leftover clients */
+		for (i = 0; i < eng->maxPeers; i++) {
+			if (eng->peers[i].ssl != NULL) {
+				matrixSslDeleteSession(eng->peers[i].ssl);
+			}
+		}
+		psFree(eng->peers, NULL);
+	}
+	if (eng->buckets) {
+		psFree(eng->buckets, NULL);
+	}
+	for (i = 0; i < eng->batch; i++) {
+		if (eng->rxBuf && eng->rxBuf[i]) {
+			psFree(eng->rxBuf[i], NULL);
+		}
+		if (eng->txBuf && eng->txBuf[i]) {
+			psFree(eng->txBuf[i], NULL);
+		}
+	}
+	if (eng->rxBuf) psFree(eng->rxBuf, NULL);
+	if (eng->rxSize) psFree(eng->rxSize, NULL);
+	if (eng->rxLen) psFree(eng->rxLen, NULL);
+	if (eng->rxAddr) psFree(eng->rxAddr, NULL);
+	if (eng->rxAddrLen) psFree(eng->rxAddrLen, NULL);
+	if (eng->txBuf) psFree(eng->txBuf, NULL);
+	if (eng->txLen) psFree(eng->txLen, NULL);
+	if (eng->txAddr) psFree(eng->txAddr, NULL);
+	if (eng->txAddrLen) psFree(eng->txAddrLen, NULL);
+#ifdef DTLS_USE_MMSG
+	if (eng->rxMsg) psFree(eng->rxMsg, NULL);
+	if (eng->rxIov) psFree(eng->rxIov, NULL);
+	if (eng->txMsg) psFree(eng->txMsg, NULL);
+	if (eng->txIov) psFree(eng->txIov, NULL);
+#endif
+	memset(eng, 0x0, sizeof(dtlsEngine_t));
+}
+
+/*
+	Read one batch of datagrams.  Returns how many, 0 if the socket had
+	nothing, or < 0 on a socket error.
+*/
+static int32 readBatch(dtlsEngine_t *eng)
+{
+	int32		n;
+#ifdef DTLS_USE_MMSG
+	uint32_t	i;
+
+	for (i = 0; i < eng->batch; i++) {
+		eng->rxIov[i].iov_base = eng->rxBuf[i];
+		eng->rxIov[i].iov_len = eng->rxSize[i];
+		memset(&eng->rxMsg[i], 0x0, sizeof(struct mmsghdr));
+		eng->rxMsg[i].msg_hdr.msg_name = &eng->rxAddr[i];
+		eng->rxMsg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+		eng->rxMsg[i].msg_hdr.msg_iov = &eng->rxIov[i];
+		eng->rxMsg[i].msg_hdr.msg_iovlen = 1;
+	}
+	n = recvmmsg(eng->fd, eng->rxMsg, eng->batch, MSG_DONTWAIT, NULL);
+	for (i = 0; n > 0 && i < (uint32_t)n; i++) {
+		eng->rxAddrLen[i] = eng->rxMsg[i].msg_hdr.msg_namelen;
+		eng->rxLen[i] = eng->rxMsg[i].msg_len;
+		if (eng->rxMsg[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			/* Larger than the PMTU, can't be a valid DTLS datagram */
+			eng->rxAddrLen[i] = 0;
+		}
+	}
+#else
+	eng->rxAddrLen[0] = sizeof(struct sockaddr_storage);
+	n = (int32)recvfrom(eng->fd, eng->rxBuf[0], eng->rxSize[0], MSG_DONTWAIT,
+		(struct sockaddr *)&eng->rxAddr[0], &eng->rxAddrLen[0]);
+	if (n >= 0) {
+		eng->rxLen[0] = n;
+		n = 1;
+	}
+#endif /* DTLS_USE_MMSG */
+	if (n < 0) {
+#ifdef WIN32
+		if (SOCKET_ERRNO == EWOULDBLOCK || SOCKET_ERRNO == WSAECONNRESET) {
+#else
+		if (SOCKET_ERRNO == EWOULDBLOCK || SOCKET_ERRNO == EAGAIN ||
+				SOCKET_ERRNO == EINTR) {
+#endif
+			return 0;
+		}
+		_psTraceInt("recvfrom error %d\n", SOCKET_ERRNO);
+		return PS_PLATFORM_FAIL;
+	}
+	return n;
+}
+
+/*
+	Drain the socket: read batches until it is empty or DTLS_MAX_READ_BATCHES
+	have been handled, so timeouts still get their turn under load.
+	Returns the number of datagrams handled or < 0 on a socket error.
+*/
+int32 dtlsEngineRead(dtlsEngine_t *eng)
+{
+	dtlsPeer_t			*peer;
+	struct sockaddr		*addr;
+	int32				n, total, b;
+	uint32_t			i;
+	uint32				len;
+
+	total = 0;
+	for (b = 0; b < DTLS_MAX_READ_BATCHES; b++) {
+		if ((n = readBatch(eng)) <= 0) {
+			flushSends(eng);
+			return n < 0 ? n : total;
+		}
+		for (i = 0; i < (uint32_t)n; i++) {
+			if (eng->rxAddrLen[i] == 0) {
+				continue;
+			}
+			len = eng->rxLen[i];
+			addr = (struct sockaddr *)&eng->rxAddr[i];
+			/* Locate the SSL context of this receive and create a new
+			session if not found and the client returned our cookie */
+			if ((peer = findPeerByCid(eng, eng->rxBuf[i], len)) == NULL &&
+					(peer = dtlsEngineFindPeer(eng, addr, eng->rxAddrLen[i]))
+					== NULL) {
+				if (cookieExchange(eng, addr, eng->rxAddrLen[i],
+						eng->rxBuf[i], len) != PS_SUCCESS) {
+					continue;
+				}
+				if ((peer = newPeer(eng, addr, eng->rxAddrLen[i])) == NULL) {
+					/* Client list is full.  Just have to ignore */
+					psTraceDtls("Peer table full.  Dropping datagram\n");
+					continue;
+				}
+			}
+			psTraceIntDtls("Read %d bytes\n", len);
+			deliver(eng, peer, i, len);
+		}
+		total += n;
+		flushSends(eng);
+		if ((uint32_t)n < eng->batch) {
+			break;
+		}
+	}
+	return total;
+}
+
+/******************************************************************************/
+/*
+	Work through the peer table when the earliest retransmit timer is due,
+	or after a second for the idle check.  Sessions keep their own RFC 6347
+	timers; any flights they reload here go out in one send batch.  Returns
+	the number of active peers.
+*/
+int32 dtlsEngineTimeouts(dtlsEngine_t *eng)
+{
+	dtlsPeer_t	*peer;
+	psTime_t	now;
+	uint32_t	i;
+	int32		rc, next;
+
+	psGetTime(&now, NULL);
+	if (psDiffMsecs(eng->lastSweep, now, NULL) < eng->sweepMsecs) {
+		return eng->numPeers;
+	}
+	eng->lastSweep = now;
+	next = 1000;
+	for (i = 0; i < eng->maxPeers; i++) {
+		peer = &eng->peers[i];
+		if (peer->ssl == NULL) {
+			continue;
+		}
+		/* Haven't heard from this client in too long */
+		if (psDiffMsecs(peer->lastRecvTime, now, NULL) / 1000 > MAX_WAIT_SECS) {
+			dtlsEngineClosePeer(eng, peer);
+			continue;
+		}
+		rc = matrixDtlsHandleTimeout(peer->ssl, &now);
+		if (rc == MATRIXSSL_REQUEST_SEND) {
+			peer->timeout *= 2;
+			if (sendFlight(eng, peer, peer->timeout / 2) < 0) {
+				continue;
+			}
+		} else if (rc < 0) {
+			psTraceIntDtls("Giving up on peer: %d\n", rc);
+			dtlsEngineClosePeer(eng, peer);
+			continue;
+		}
+		rc = matrixDtlsGetTimeout(peer->ssl, &now);
+		if (rc >= 0 && rc < next) {
+			next = rc;
+		}
+	}
+	flushSends(eng);
+	eng->sweepMsecs = next;
+	return eng->numPeers;
+}
+
+/*
+	Milliseconds until dtlsEngineTimeouts has work, for the select timeout
+*/
+int32 dtlsEngineNextTimeout(dtlsEngine_t *eng)
+{
+	psTime_t	now;
+	int32		elapsed;
+
+	psGetTime(&now, NULL);
+	elapsed = psDiffMsecs(eng->lastSweep, now, NULL);
+	if (elapsed < 0 || elapsed >= eng->sweepMsecs) {
+		return 0;
+	}
+	return eng->sweepMsecs - elapsed;
+}
+
+#endif /* USE_DTLS && USE_SERVER_SIDE_SSL */
+
+/******************************************************************************/
@@ -0,0 +1,144 @@
+/**
+ *	@file    dtlsEngine.h
+ *	@version ee35b93 (HEAD -> master)
+ *
+ *	Reusable DTLS server engine: one UDP socket, many peers.
+ */
+/*
+ *	Copyright (c) 2014-2016 INSIDE Secure Corporation
+ *	Copyright (c) PeerSec Networks, 2002-2011
+ *	All Rights Reserved
+ *
+ *	The latest version of this code is available at http://www.matrixssl.org
+ *
+ *	This software is open source; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This General Public License does NOT permit incorporating this software
+ *	into proprietary programs.  If you are unable to comply with the GPL, a
+ *	commercial license for this software may be purchased from INSIDE at
+ *	http://www.insidesecure.com/
+ *
+ *	This program is distributed in WITHOUT ANY WARRANTY; without even the
+ *	implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *	See the GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *	http://www.gnu.org/copyleft/gpl.html
+ */
+
+#ifndef _h_DTLSENGINE
+#define _h_DTLSENGINE
+
+#include "dtlsCommon.h"
+
+#if defined(USE_DTLS) && defined(USE_SERVER_SIDE_SSL)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+	recvmmsg/sendmmsg move a batch of datagrams per system call.  Elsewhere
+	the engine falls back to one recvfrom/sendto per datagram.
+*/
+#if defined(LINUX) && defined(MSG_WAITFORONE)
+#define DTLS_USE_MMSG
+#endif
+
+#define DTLS_DEFAULT_BATCH		32	/* Datagrams per receive or send call */
+#define DTLS_MAX_READ_BATCHES	8	/* Per dtlsEngineRead, then timeouts run */
+
+#define	RESUMED_HANDSHAKE_COMPLETE 1
+
+/*
+	Connection ID handed to each client: the peer's slot in the table
+	followed by a random tag, so a record that arrives from a new address
+	after a NAT rebinding still finds its session in O(1).
+*/
+#define DTLS_ENGINE_CID_LEN		8
+
+/*
+	One remote address and its session.  Peers are preallocated in a single
+	array and chained into buckets keyed by a seeded hash of the address,
+	so lookups stay O(1) at any table size.
+*/
+typedef struct dtlsPeer {
+	struct sockaddr_storage	addr;
+	socklen_t				addrLen;
+	uint32_t				hash;
+	struct dtlsPeer			*next;		/* Bucket chain, or free list */
+	psTime_t				lastRecvTime;
+	uint32					timeout;	/* in seconds, for loss testing */
+	uint32					connStatus;
+	ssl_t					*ssl;
+	void					*userPtr;
+	unsigned char			cid[DTLS_ENGINE_CID_LEN];
+} dtlsPeer_t;
+
+struct dtlsEngine;
+
+/* Decrypted application data from a peer.  < 0 closes the peer. */
+typedef int32 (*dtlsAppDataCb_t)(struct dtlsEngine *eng, dtlsPeer_t *peer,
+					unsigned char *buf, uint32 len);
+
+typedef struct dtlsEngine {
+	SOCKET				fd;
+	sslKeys_t			*keys;
+	sslCertCb_t			certCb;
+	sslSessOpts_t		options;	/* For each new server session */
+	dtlsAppDataCb_t		appDataCb;
+	int					packetLossProb;
+	psTime_t			lastSweep;
+	int32				sweepMsecs;	/* Next dtlsEngineTimeouts pass */
+	/* Peer table */
+	dtlsPeer_t			*peers;
+	dtlsPeer_t			**buckets;
+	dtlsPeer_t			*freePeers;
+	uint32_t			bucketMask;
+	uint32_t			maxPeers;
+	uint32_t			numPeers;
+	uint32_t			hashSeed;
+	int32				useCid;		/* Offer DTLS_ENGINE_CID_LEN CIDs */
+	/* Datagram batches, each buffer matrixDtlsGetPmtu() or larger */
+	uint32_t			batch;
+	unsigned char		**rxBuf;
+	uint32				*rxSize;
+	uint32				*rxLen;
+	struct sockaddr_storage	*rxAddr;
+	socklen_t			*rxAddrLen;
+	unsigned char		**txBuf;
+	uint32				*txLen;
+	struct sockaddr_storage	*txAddr;
+	socklen_t			*txAddrLen;
+	uint32_t			txCount;
+#ifdef DTLS_USE_MMSG
+	struct mmsghdr		*rxMsg;
+	struct iovec		*rxIov;
+	struct mmsghdr		*txMsg;
+	struct iovec		*txIov;
+#endif
+} dtlsEngine_t;
+
+extern int32 dtlsEngineOpen(dtlsEngine_t *eng, SOCKET fd, sslKeys_t *keys,
+					sslCertCb_t certCb, uint32 maxPeers, uint32 batch);
+extern void dtlsEngineClose(dtlsEngine_t *eng);
+extern int32 dtlsEngineRead(dtlsEngine_t *eng);
+extern int32 dtlsEngineTimeouts(dtlsEngine_t *eng);
+extern int32 dtlsEngineNextTimeout(dtlsEngine_t *eng);
+extern dtlsPeer_t *dtlsEngineFindPeer(dtlsEngine_t *eng,
+					const struct sockaddr *addr, socklen_t addrLen);
+extern void dtlsEngineClosePeer(dtlsEngine_t *eng, dtlsPeer_t *peer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USE_DTLS && USE_SERVER_SIDE_SSL */
+#endif /* _h_DTLSENGINE */
+
+/******************************************************************************/
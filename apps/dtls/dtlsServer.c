@@ -38,9 +38,9 @@
 #define MSG_NOSIGNAL 0
 #endif
 
-#include "dtlsCommon.h"
+#include "dtlsEngine.h"
 
-#ifdef USE_DTLS
+#if defined(USE_DTLS) && defined(USE_SERVER_SIDE_SSL)
 
 #include "../../crypto/cryptoApi.h"
 
@@ -52,30 +52,11 @@ static int packet_loss_prob = 0; /* Reciprocal of packet loss probability
 /*
 	Client management
 */
-#define	MAX_CLIENTS	16
-
-typedef struct {
-	psTime_t			lastRecvTime;
-	uint32				timeout; /* in seconds */
-	uint32				connStatus;
-	SOCKET				fd;
-	struct sockaddr_in	addr;
-	ssl_t				*ssl;
-} serverDtls_t;
-
-static serverDtls_t		*clientTable;
-static uint16			tableSize;
-
-#define	RESUMED_HANDSHAKE_COMPLETE 1
+#define	DEFAULT_MAX_CLIENTS	1024
 
 /* Static Prototypes */
-static int32 initClientList(uint16 maxPeers);
-static int32 handleResends(SOCKET sock);
-static serverDtls_t *findClient(struct sockaddr_in addr);
-static serverDtls_t *registerClient(struct sockaddr_in addr, SOCKET sock,
-						ssl_t *ssl);
-static void clearClient(serverDtls_t *dtls);
-static void closeClientList();
+static int32 appDataReceived(dtlsEngine_t *eng, dtlsPeer_t *peer,
+						unsigned char *buf, uint32 len);
 static SOCKET newUdpSocket(char *ip, short port, int *err);
 static int sigsetup(void);
 static void sigsegv_handler(int);
@@ -324,6 +305,7 @@ static uint32_t g_rsaKeySize;
 static uint32_t g_eccKeySize;
 static uint32_t g_ecdhKeySize;
 static int g_port;
+static uint32_t g_maxClients;
 
 #ifdef USE_CERT_VALIDATOR
 /******************************************************************************/
@@ -371,6 +353,7 @@ static void usage(void)
 		   "                          (for packet loss simulation tests)\n"
 #endif /* DTLS_PACKET_LOSS_TEST */
 		   "-p <value>              - Port number to use\n"
+		   "-n <value>              - Maximum simultaneous clients\n"
 		);
 }
 
@@ -383,9 +366,10 @@ static int32 process_cmd_options(int32 argc, char **argv)
 	// Set some default options:
 	g_rsaKeySize = 2048;
 	g_eccKeySize = g_ecdhKeySize = 256;
+	g_maxClients = DEFAULT_MAX_CLIENTS;
 
 	opterr = 0;
-	while ((optionChar = getopt(argc, argv, "hr:e:d:l:p:")) != -1)
+	while ((optionChar = getopt(argc, argv, "hr:e:d:l:p:n:")) != -1)
 	{
 		switch (optionChar) {
 		case '?':
@@ -440,6 +424,15 @@ static int32 process_cmd_options(int32 argc, char **argv)
 				printf("invalid -p option\n");
 				return -1;
 			}
+			break;
+
+		case 'n':
+			if (atoi(optarg) <= 0) {
+				printf("invalid -n option\n");
+				return -1;
+			}
+			g_maxClients = atoi(optarg);
+			break;
 		}
 	}
 
@@ -452,25 +445,17 @@ static int32 process_cmd_options(int32 argc, char **argv)
 */
 int main(int argc, char ** argv)
 {
-	struct sockaddr_in	inaddr;
-	socklen_t		inaddrlen;
+	dtlsEngine_t	eng;
 	struct timeval	timeout;
-	ssl_t			*ssl;
-	serverDtls_t	*dtlsCtx;
 	SOCKET			sock;
 	fd_set			readfd;
-	unsigned char	*sslBuf, *recvfromBuf, *CAstream;
-#ifdef USE_DTLS_DEBUG_TRACE	
-	unsigned char   *addrstr;
-#endif
+	unsigned char	*CAstream;
 #if !defined(ID_PSK) && !defined(ID_DHE_PSK)
 	unsigned char   *keyValue, *certValue;
 	int32           keyLen, certLen;
 #endif	
 	sslKeys_t		*keys;
-	int32			freeBufLen, rc, val, recvLen, err, CAstreamLen;
-	int32			sslBufLen, rcr, rcs, sendLen, recvfromBufLen;
-	sslSessOpts_t	options;
+	int32			rc, val, err, CAstreamLen;
 
 #ifdef WIN32
 	WSADATA         wsaData;
@@ -478,9 +463,8 @@ int main(int argc, char ** argv)
 #endif
 
 	rc = 0;
-	ssl = NULL;
-	dtlsCtx = NULL;
 	CAstream = NULL;
+	memset(&eng, 0x0, sizeof(dtlsEngine_t));
 	sock = INVALID_SOCKET;
 
 	if (0 != process_cmd_options(argc, argv)) {
@@ -500,10 +484,6 @@ int main(int argc, char ** argv)
 		matrixSslClose();
 		return DTLS_FATAL;
 	}
-	if ((rc = initClientList(MAX_CLIENTS)) < 0) {
-		_psTrace("Init error opening client list\n");
-		goto MATRIX_EXIT;
-	}
 
 #ifdef USE_HEADER_KEYS
 /*
@@ -753,178 +733,39 @@ int main(int argc, char ** argv)
     }
 #endif /* PSK */
 
-	recvfromBufLen = matrixDtlsGetPmtu();
-	if ((recvfromBuf = psMalloc(MATRIX_NO_POOL, recvfromBufLen)) == NULL) {
-		rc = PS_MEM_FAIL;
-		_psTrace("Init error allocating receive buffer\n");
-		goto CLIENT_EXIT;
-	}
-
 	if ((sock = newUdpSocket(NULL, g_port, &err)) == INVALID_SOCKET) {
 		_psTrace("Error creating UDP socket\n");
-		goto DTLS_EXIT;
+		goto CLIENT_EXIT;
 	}
+	if ((rc = dtlsEngineOpen(&eng, sock, keys, certValidator, g_maxClients,
+			DTLS_DEFAULT_BATCH)) < 0) {
+		_psTrace("Init error opening client list\n");
+		goto CLIENT_EXIT;
+	}
+	eng.appDataCb = appDataReceived;
+	eng.packetLossProb = packet_loss_prob;
 	_psTraceInt("DTLS server running on port %d\n", g_port);
 
 	/* Server loop */
 	for (exitFlag = 0; exitFlag == 0;) {
-		timeout.tv_sec = 1;
-		timeout.tv_usec = 0;
+		val = dtlsEngineNextTimeout(&eng);
+		timeout.tv_sec = val / 1000;
+		timeout.tv_usec = (val % 1000) * 1000;
 		FD_ZERO(&readfd);
 		FD_SET(sock, &readfd);
 /*
-		Always just wait a second for any incoming data.  The primary loop
-		mechanism reads data from one source and replies with handshake data
-		if needed (that reply may be a resend if reading a repeat message).
-		Individual client timeouts are then handled
+		Wait for incoming data until the next client retransmit timer is due
+		(a second at most).  The engine drains what the socket has queued,
+		replying with handshake data if needed (that reply may be a resend if
+		reading a repeat message).  Individual client timeouts are then handled
 */
 		val = select(sock+1, &readfd, NULL, NULL, &timeout);
 
 		if (val > 0 && FD_ISSET(sock, &readfd)) {
 			psTraceIntDtls("Select woke %d\n", val);
-			/* recvfrom data must always go into generic buffer becuase we
-			don't yet know who it is from */
-			inaddrlen = sizeof(struct sockaddr_in);
-			if ((recvLen = (int32)recvfrom(sock, recvfromBuf, recvfromBufLen, 0,
-										   (struct sockaddr *)&inaddr, &inaddrlen)) < 0) {
-#ifdef WIN32
-				if (SOCKET_ERRNO != EWOULDBLOCK &&
-						SOCKET_ERRNO != WSAECONNRESET) {
-#else
-				if (SOCKET_ERRNO != EWOULDBLOCK) {
-#endif
-					_psTraceInt("recvfrom error %d.  Exiting\n", SOCKET_ERRNO);
-					goto DTLS_EXIT;
-				}
-				continue;
-				}
-#ifdef USE_DTLS_DEBUG_TRACE
-			/* nice for debugging */
-			{
-				const char *addrstr;
-				addrstr = getaddrstring((struct sockaddr *)&inaddr, 1);
-				psTraceIntDtls("Read %d bytes ", recvLen);
-				psTraceStrDtls("from %s\n", (char*)addrstr);
-				psFree(addrstr, NULL);
-			}
-#endif
-
-			/* Locate the SSL context of this receive and create a new session
-			if not found */
-			if ((dtlsCtx = findClient(inaddr)) == NULL) {
-				memset(&options, 0x0, sizeof(sslSessOpts_t));
-				options.versionFlag = SSL_FLAGS_DTLS;
-				options.truncHmac = -1;
-
-				if (matrixSslNewServerSession(&ssl, keys,
-						certValidator, &options) < 0) {
-					rc = DTLS_FATAL; goto DTLS_EXIT;
-				}
-				if ((dtlsCtx = registerClient(inaddr, sock, ssl)) == NULL) {
-					/* Client list is full.  Just have to ignore */
-					matrixSslDeleteSession(ssl);
-					continue;
-				}
-			}
-
-			ssl = dtlsCtx->ssl;
-			/*  Move socket data into internal buffer */
-			freeBufLen = matrixSslGetReadbuf(ssl, &sslBuf);
-			psAssert(freeBufLen >= recvLen);
-			psAssert(freeBufLen == matrixDtlsGetPmtu());
-			memcpy(sslBuf, recvfromBuf, recvLen);
-
-			/*	Notify SSL state machine that we've received more data into the
-			ssl buffer retreived with matrixSslGetReadbuf. */
-			if ((rcr = matrixSslReceivedData(ssl, recvLen, &sslBuf,
-					(uint32*)&freeBufLen)) < 0) {
-				clearClient(dtlsCtx);
-				continue;	/* Next connection */
-			}
-			/* Update last activity time and reset timeout*/
-			psGetTime(&dtlsCtx->lastRecvTime, NULL);
-			dtlsCtx->timeout = MIN_WAIT_SECS;
-
-PROCESS_MORE_FROM_BUFFER:
-			/* Process any incoming plaintext application data */
-			switch (rcr) {
-				case MATRIXSSL_HANDSHAKE_COMPLETE:
-					/* This is a resumed handshake case which means we are
-					the last to receive handshake flights and we know the
-					handshake is complete.  However, the internal workings
-					will not flag us officially complete until we receive
-					application data from the peer so we need a local flag
-					to handle this case so we are not resending our final
-					flight */
-					dtlsCtx->connStatus = RESUMED_HANDSHAKE_COMPLETE;
-					psTraceDtls("Got HANDSHAKE_COMPLETE out of ReceivedData\n");
-					break;
-				case MATRIXSSL_APP_DATA:
-					/* Now safe to clear the connStatus flag that was keeping
-					track of the state between receiving the final flight of
-					a resumed handshake and receiving application data.  The
-					reciept of app data has now internally disabled flight
-					resends */
-					dtlsCtx->connStatus = 0;
-					_psTrace("Client connected.  Received...\n");
-					_psTraceStr("%s\n", (char*)sslBuf);
-					break;
-				case MATRIXSSL_REQUEST_SEND:
-					/* Still handshaking with this particular client */
-					while ((sslBufLen = matrixDtlsGetOutdata(ssl,
-							&sslBuf)) > 0) {
-						if ((sendLen = udpSend(dtlsCtx->fd, sslBuf, sslBufLen,
-											   (struct sockaddr*)&inaddr,
-											   sizeof(struct sockaddr_in),
-											   dtlsCtx->timeout,
-											   packet_loss_prob,
-											   NULL)) < 0) {
-							psTraceDtls("udpSend error.  Ignoring\n");
-						}
-						/* Always indicate the entire datagram was sent as
-						there is no way for DTLS to handle partial records.
-						Resends and timeouts will handle any problems */
-						rcs = matrixDtlsSentData(ssl, sslBufLen);
-
-						if (rcs == MATRIXSSL_REQUEST_CLOSE) {
-							psTraceDtls("Got REQUEST_CLOSE out of SentData\n");
-							clearClient(dtlsCtx);
-							break;
-						}
-						if (rcs == MATRIXSSL_HANDSHAKE_COMPLETE) {
-							/* This is the standard handshake case */
-							_psTrace("Got HANDSHAKE_COMPLETE from SentData\n");
-							break;
-						}
-						/* SSL_REQUEST_SEND is handled by loop logic */
-					}
-					break;
-				case MATRIXSSL_REQUEST_RECV:
-					psTraceDtls("Got REQUEST_RECV from ReceivedData\n");
-					break;
-				case MATRIXSSL_RECEIVED_ALERT:
-					/* The first byte of the buffer is the level */
-					/* The second byte is the description */
-					if (*sslBuf == SSL_ALERT_LEVEL_FATAL) {
-						psTraceIntDtls("Fatal alert: %d, closing connection.\n",
-									*(sslBuf + 1));
-						clearClient(dtlsCtx);
-						continue; /* Next connection */
-					}
-					/* Closure alert is normal (and best) way to close */
-					if (*(sslBuf + 1) == SSL_ALERT_CLOSE_NOTIFY) {
-						clearClient(dtlsCtx);
-						continue; /* Next connection */
-					}
-					psTraceIntDtls("Warning alert: %d\n", *(sslBuf + 1));
-					if ((rcr = matrixSslProcessedData(ssl, &sslBuf,
-							(uint32*)&freeBufLen)) == 0) {
-						continue;
-					}
-					goto PROCESS_MORE_FROM_BUFFER;
-
-				default:
-					continue; /* Next connection */
+			if ((rc = dtlsEngineRead(&eng)) < 0) {
+				_psTrace("Exiting on socket error\n");
+				break;
 			}
 		} else if (val < 0) {
 			if (SOCKET_ERRNO != EINTR) {
@@ -932,21 +773,17 @@ PROCESS_MORE_FROM_BUFFER:
 			}
 		}
 /*
-		Have either timed out waiting for a read or have processed a single
-		recv.  Now check to see if any timeout resends are required
+		Have either timed out waiting for a read or have processed what was
+		queued.  Now check to see if any timeout resends are required
 */
-		rc = handleResends(sock);
+		rc = dtlsEngineTimeouts(&eng);
 	}	/* Main Select Loop */
 
-
-DTLS_EXIT:
-	psFree(recvfromBuf, NULL);
+	dtlsEngineClose(&eng);
 CLIENT_EXIT:
 	if (CAstream) {
 		psFree(CAstream, NULL);
 	}
-	closeClientList();
-MATRIX_EXIT:
 	matrixSslDeleteKeys(keys);
 	matrixSslClose();
 	if (sock != INVALID_SOCKET) close(sock);
@@ -955,84 +792,13 @@ MATRIX_EXIT:
 
 /******************************************************************************/
 /*
-	Work through client list and resend handshake flight if haven't heard
-	from them in a while
+	Application data from a connected client
 */
-static int32 handleResends(SOCKET sock)
+static int32 appDataReceived(dtlsEngine_t *eng, dtlsPeer_t *peer,
+				unsigned char *buf, uint32 len)
 {
-	serverDtls_t	*dtlsCtx;
-	ssl_t			*ssl;
-	psTime_t		now;
-	unsigned char	*sslBuf;
-	int16_t			i;
-	int32_t			sendLen, sslBufLen, rc;
-	uint32_t			timeout, clientCount;
-
-	clientCount = 0; /* return code is number of active clients or < 0 on error */
-	psGetTime(&now, NULL);
-	for (i = 0; i < tableSize; i++) {
-		dtlsCtx = &clientTable[i];
-		if (dtlsCtx->ssl != NULL) {
-			clientCount++;
-			timeout = psDiffMsecs(dtlsCtx->lastRecvTime, now, NULL) / 1000;
-			/* Haven't heard from this client in a while.  Might need resend */
-			if (timeout > dtlsCtx->timeout) {
-				/* if timeout is too great. clear conn */
-				if (dtlsCtx->timeout >= MAX_WAIT_SECS) {
-					clearClient(dtlsCtx);
-					clientCount--;
-					break;
-				}
-				/* Increase the timeout for next pass */
-				dtlsCtx->timeout *= 2;
-
-				/* If we are in a RESUMED_HANDSHAKE_COMPLETE state that means
-				we are positive the handshake is complete so we don't want to
-				resend no matter what.  This is an interim state before the
-				internal mechaism sees an application data record and flags
-				us as complete officially */
-				if (dtlsCtx->connStatus == RESUMED_HANDSHAKE_COMPLETE) {
-					psTraceDtls("Connected but awaiting data\n");
-					continue;
-				}
-				ssl = dtlsCtx->ssl;
-				while ((sslBufLen = matrixDtlsGetOutdata(ssl,
-						&sslBuf)) > 0) {
-					if ((sendLen = udpSend(dtlsCtx->fd, sslBuf, sslBufLen,
-										   (struct sockaddr*)&dtlsCtx->addr,
-										   sizeof(struct sockaddr_in),
-										   dtlsCtx->timeout / 2,
-										   packet_loss_prob,
-										   NULL)) < 0) {
-						psTraceDtls("udpSend error.  Ignoring\n");
-					}
-					/* Always indicate the entire datagram was sent as
-					there is no way for DTLS to handle partial records.
-					Resends and timeouts will handle any problems */
-					if ((rc = matrixDtlsSentData(ssl, sslBufLen)) < 0) {
-						psTraceDtls("internal error\n");
-						clearClient(dtlsCtx);
-						clientCount--;
-						break;
-					}
-					if (rc == MATRIXSSL_REQUEST_CLOSE) {
-						psTraceDtls("Got REQUEST_CLOSE out of SentData\n");
-						clearClient(dtlsCtx);
-						clientCount--;
-						break;
-					}
-					if (rc == MATRIXSSL_HANDSHAKE_COMPLETE) {
-						/* This is the standard handshake case */
-						psTraceDtls("Got HANDSHAKE_COMPLETE out of SentData\n");
-						break;
-					}
-					/* SSL_REQUEST_SEND is handled by loop logic */
-				}
-
-			}
-		}
-	}
-	return clientCount;
+	_psTraceInt("Client connected.  Received %d bytes\n", len);
+	return PS_SUCCESS;
 }
 
 /******************************************************************************/
@@ -1058,11 +824,36 @@ static int32_t setSocketOptions(SOCKET fd)
 }
 
 
+/*
+	Prefer one dual-stack IPv6 socket so IPv4 clients arrive as mapped
+	addresses on the same socket, and fall back to plain IPv4.
+*/
 static SOCKET newUdpSocket(char *ip, short port, int *err)
 {
 	struct sockaddr_in	addr = { 0 };
+#ifdef AF_INET6
+	struct sockaddr_in6	addr6;
+	int					off = 0;
+#endif
 	SOCKET				fd;
 
+#ifdef AF_INET6
+	if (ip == NULL &&
+			(fd = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP)) != INVALID_SOCKET) {
+		memset(&addr6, 0x0, sizeof(addr6));
+		addr6.sin6_family = AF_INET6;
+		addr6.sin6_port = htons(port);
+		addr6.sin6_addr = in6addr_any;
+		if (setSocketOptions(fd) == PS_SUCCESS &&
+				setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&off,
+					sizeof(off)) == 0 &&
+				bind(fd, (struct sockaddr *)&addr6, sizeof(addr6)) == 0) {
+			return fd;
+		}
+		close(fd);
+	}
+#endif /* AF_INET6 */
+
 	if ((fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
 		_psTraceInt("Error creating socket %d\n", SOCKET_ERRNO);
 		*err = SOCKET_ERRNO;
@@ -1171,111 +962,6 @@ static unsigned char * getaddrstring(struct sockaddr *addr,
 }
 #endif /* USE_DTLS_DEBUG_TRACE */
 
-/******************************************************************************/
-/*
-	Client management
-*/
-/******************************************************************************/
-static int32 initClientList(uint16 maxPeers)
-{
-	clientTable = psCalloc(NULL, maxPeers, sizeof(serverDtls_t));
-	if (clientTable == NULL) {
-		return PS_MEM_FAIL;
-	}
-	tableSize = maxPeers;
-
-	udpInitProxy();
-	return PS_SUCCESS;
-}
-
-/******************************************************************************/
-/*
-	Associates a new sockaddr with an existing ssl context and returns context
- */
-serverDtls_t *registerClient(struct sockaddr_in addr, SOCKET sock,
-					ssl_t *ssl)
-{
-	int16			i;
-	serverDtls_t	*dtlsCtx;
-
-	for (i = 0; i < tableSize && clientTable[i].ssl != NULL &&
-		 (clientTable[i].addr.sin_addr.s_addr != addr.sin_addr.s_addr ||
-		  clientTable[i].addr.sin_port != addr.sin_port); i++);
-	if (i >= tableSize) {
-		/* no available slots */
-		return NULL;
-	}
-
-	dtlsCtx = &clientTable[i];
-
-	dtlsCtx->addr = addr;
-	dtlsCtx->fd = sock;
-	dtlsCtx->timeout = MIN_WAIT_SECS;
-	dtlsCtx->connStatus = 0;
-	psGetTime(&dtlsCtx->lastRecvTime, NULL);
-	dtlsCtx->ssl = ssl;
-	return dtlsCtx;
-}
-
-static void clearClient(serverDtls_t *dtls)
-{
-	ssl_t           *ssl;
-	unsigned char   *buf;
-	int32           len;
-
-	ssl = dtls->ssl;
-
-	/* Quick attempt to send a closure alert, don't worry about failure */
-	if (matrixSslEncodeClosureAlert(ssl) >= 0) {
-		if ((len = matrixDtlsGetOutdata(ssl, &buf)) > 0) {
-			if (sendto(dtls->fd, buf, len, 0, (struct sockaddr*)&dtls->addr,
-					sizeof(struct sockaddr_in)) >= 0) {
-				matrixDtlsSentData(ssl, len);
-			}
-		}
-	}
-	matrixSslDeleteSession(ssl);
-
-/*
-	Free up the entry in the client table
-*/
-	dtls->ssl = NULL;
-	dtls->connStatus = 0;
-	dtls->fd = 0;
-	memset(&dtls->addr, 0x0, sizeof(struct sockaddr_in));
-	return;
-}
-
-/******************************************************************************/
-/*
-	Return the ssl_t given the sockaddr or NULL if doesn't exist
-*/
-serverDtls_t *findClient(struct sockaddr_in addr)
-{
-	int		i;
-
-	for (i = 0; i < tableSize; i++) {
-		if (clientTable[i].ssl != NULL) {
-			if (clientTable[i].addr.sin_addr.s_addr == addr.sin_addr.s_addr &&
-					clientTable[i].addr.sin_port == addr.sin_port) {
-				return &clientTable[i];
-			}
-		}
-	}
-	return NULL;
-}
-
-static void closeClientList()
-{
-	int		i;
-	/* Free any leftover clients */
-	for (i = 0; i < tableSize && clientTable[i].ssl != NULL; i++) {
-		matrixSslDeleteSession(clientTable[i].ssl);
-	}
-	psFree(clientTable, NULL);
-	tableSize = 0;
-}
-
 #else
 
 /******************************************************************************/
@@ -1284,10 +970,10 @@ static void closeClientList()
 */
 int32 main(int32 argc, char **argv)
 {
-    printf("USE_DTLS must be enabled in " \
+    printf("USE_DTLS and USE_SERVER_SIDE_SSL must be enabled in " \
             "matrixsslConfig.h at build time to run this application\n");
     return -1;
 }
-#endif /* USE_DTLS */
+#endif /* USE_DTLS && USE_SERVER_SIDE_SSL */
 
 /******************************************************************************/
@@ -0,0 +1,1014 @@
+/**
+ *	@file    epollServer.c
+ *	@version ee35b93 (HEAD -> master)
+ *
+ *	Multi-core non-blocking MatrixSSL server for Linux.
+ *	One worker thread per core, each with its own SO_REUSEPORT listener and
+ *	edge triggered epoll loop.  A connection stays on the worker that
+ *	accepted it, so sessions are never shared between threads.
+ */
+/*
+ *	Copyright (c) 2013-2016 INSIDE Secure Corporation
+ *	Copyright (c) PeerSec Networks, 2002-2011
+ *	All Rights Reserved
+ *
+ *	The latest version of this code is available at http://www.matrixssl.org
+ *
+ *	This software is open source; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This General Public License does NOT permit incorporating this software
+ *	into proprietary programs.  If you are unable to comply with the GPL, a
+ *	commercial license for this software may be purchased from INSIDE at
+ *	http://www.insidesecure.com/
+ *
+ *	This program is distributed in WITHOUT ANY WARRANTY; without even the
+ *	implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *	See the GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *	http://www.gnu.org/copyleft/gpl.html
+ */
+/******************************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* pthread_setaffinity_np */
+#endif
+
+#include "app.h"
+#include "matrixssl/matrixsslApi.h"
+
+#if defined(USE_SERVER_SIDE_SSL) && defined(MATRIX_USE_FILE_SYSTEM) && \
+	defined(LINUX) && defined(USE_MULTITHREADING)
+
+#include <signal.h>			/* Defines SIGTERM, etc. */
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+
+#warning "DO NOT USE THESE DEFAULT KEYS IN PRODUCTION ENVIRONMENTS."
+
+/* Default keys if nothing provided on command line */
+#define KEY_DIR		"../../"
+
+const static char g_defaultCertFile[] = "testkeys/RSA/2048_RSA.pem";
+const static char g_defaultPrivkeyFile[] = "testkeys/RSA/2048_RSA_KEY.pem";
+const static char g_defaultCAFile[] = "testkeys/RSA/2048_RSA_CA.pem";
+
+#ifdef REQUIRE_DH_PARAMS
+const static char g_defaultDHParamFile[] = "testkeys/DH/1024_DH_PARAMS.pem";
+#endif
+
+/********************************** Defines ***********************************/
+
+#define SSL_TIMEOUT			45000	/* In milliseconds */
+#define EPOLL_TIME			1000	/* In milliseconds */
+#define EPOLL_EVENTS		256		/* Events per epoll_wait */
+#define MAX_WORKERS			256
+#define RESPONSE_REC_LEN	SSL_MAX_PLAINTEXT_LEN
+/*
+	Records encoded ahead of the socket for a /bytes? response.  Enough to
+	keep the send buffer full without holding the whole response in outbuf.
+*/
+#define RESPONSE_RECS		4
+
+/*
+	Per worker state.  Counters are only written by the owning thread and
+	summed by the main thread for display, so the struct is padded to keep
+	workers off each other's cache lines.
+*/
+typedef struct {
+	pthread_t		thread;
+	int				id;
+	SOCKET			lfd;
+	int				efd;
+	DLListEntry		conns;		/* Least recently active first */
+	uint32_t		numConns;
+	uint64_t		handshakes;
+	uint64_t		bytesIn;
+	uint64_t		bytesOut;
+	unsigned char	pad[64];
+} worker_t;
+
+/********************************** Globals ***********************************/
+
+static volatile int32	g_exitFlag;
+static int				g_port;
+static int				g_workers;
+static int				g_pin;
+static int				g_disabledCiphers;
+static uint16_t			g_disabledCipher[SSL_MAX_DISABLED_CIPHERS];
+static sslKeys_t		*g_keys;
+static worker_t			*g_worker;
+
+#define MAX_KEYFILE_PATH	256
+#define MAX_PASSWORD_LEN	MAX_KEYFILE_PATH
+static char				g_keyfilePath[MAX_KEYFILE_PATH];
+static char				g_privkeyFile[MAX_KEYFILE_PATH];
+static char				g_identityCert[MAX_KEYFILE_PATH];
+static char				g_dhParamFile[MAX_KEYFILE_PATH];
+static char				g_caFile[MAX_KEYFILE_PATH];
+static char				g_password[MAX_PASSWORD_LEN];
+
+static unsigned char	g_httpResponseHdr[] = "HTTP/1.0 200 OK\r\n"
+	"Server: MatrixSSL/" MATRIXSSL_VERSION "\r\n"
+	"Pragma: no-cache\r\n"
+	"Cache-Control: no-cache\r\n"
+	"Content-type: text/plain\r\n"
+	"Content-length: 9\r\n"
+	"\r\n"
+	"MatrixSSL";
+
+#ifdef USE_STATELESS_SESSION_TICKETS
+static int32 sessTicketCb(void *keys, unsigned char name[16], short found);
+static unsigned char sessTicketSymKey[32] = { 0 };
+static unsigned char sessTicketMacKey[32] = { 0 };
+#endif
+
+/****************************** Local Functions *******************************/
+
+static int setSocketOptions(SOCKET fd);
+static SOCKET lsocketListen(short port, int32 *err);
+static void closeConn(worker_t *w, httpConn_t *cp, int32 reason);
+static void sigintterm_handler(int i);
+static int32 sighandlers(void);
+
+/************************ Handshake Callback Functions ************************/
+
+#ifdef USE_STATELESS_SESSION_TICKETS
+int32 sessTicketCb(void *keys, unsigned char name[16], short found)
+{
+	if (found) {
+		/* Was already cached */
+		return PS_SUCCESS;
+	}
+	return matrixSslLoadSessionTicketKeys((sslKeys_t*)keys, name,
+		sessTicketSymKey, sizeof(sessTicketSymKey),
+		sessTicketMacKey, sizeof(sessTicketMacKey));
+}
+#endif
+
+/******************************************************************************/
+/**
+	Display handshakes per second and throughput summed over all workers,
+	at most once per second.
+*/
+static void displayStats(void)
+{
+	static uint64_t s_handshakes = 0, s_bytes = 0;	/* last values displayed */
+	static time_t	s_t = (time_t)0;				/* last time displayed */
+	uint64_t		handshakes, bytes;
+	uint32_t		conns;
+	time_t			t;
+	int				i;
+
+	handshakes = bytes = 0;
+	conns = 0;
+	for (i = 0; i < g_workers; i++) {
+		handshakes += g_worker[i].handshakes;
+		bytes += g_worker[i].bytesIn + g_worker[i].bytesOut;
+		conns += g_worker[i].numConns;
+	}
+	t = time(NULL);
+	if (s_t != 0 && t > s_t && (handshakes > s_handshakes || bytes > s_bytes)) {
+		printf("%u CPS, %.1f Mbps, %u connections\n",
+			(uint32_t)((handshakes - s_handshakes) / (uint64_t)(t - s_t)),
+			(double)(bytes - s_bytes) * 8 / 1000000 / (double)(t - s_t),
+			conns);
+	}
+	if (t > s_t) {
+		s_handshakes = handshakes;
+		s_bytes = bytes;
+		s_t = t;
+	}
+}
+
+/******************************************************************************/
+/*
+	Encode the next part of the response.  A plain request gets the fixed
+	header; "GET /bytes?<n>" gets n bytes, a few records at a time so a
+	large response streams out as the socket drains.
+*/
+static int32 encodeResponse(httpConn_t *cp)
+{
+	unsigned char	*buf;
+	uint32			hdrLen;
+	int32			len, rc, recs;
+
+	hdrLen = (uint32)strlen((char *)g_httpResponseHdr);
+	for (recs = 0; recs < RESPONSE_RECS &&
+			cp->bytes_sent < cp->bytes_requested; recs++) {
+		len = cp->bytes_requested - cp->bytes_sent;
+		if (len > RESPONSE_REC_LEN) {
+			len = RESPONSE_REC_LEN;
+		}
+		if ((rc = matrixSslGetWritebuf(cp->ssl, &buf, len)) < 1) {
+			return PS_MEM_FAIL;
+		}
+		if (rc < len) {
+			len = rc; /* could have been shortened due to max_frag */
+		}
+		memset(buf, 'J', len);
+		if (cp->bytes_sent < hdrLen) {
+			/* The header goes first, and is always in the first record */
+			memcpy(buf, g_httpResponseHdr + cp->bytes_sent,
+				min(hdrLen - cp->bytes_sent, (uint32)len));
+		}
+		if ((rc = matrixSslEncodeWritebuf(cp->ssl, len)) < 0) {
+			return rc;
+		}
+		cp->bytes_sent += len;
+	}
+	return PS_SUCCESS;
+}
+
+/*
+	Start the response to a request.  Returns < 0 to close the connection.
+*/
+static int32 handleRequest(httpConn_t *cp, unsigned char *buf, uint32 len)
+{
+	uint32	hdrLen, n;
+	int32	rc;
+
+	hdrLen = (uint32)strlen((char *)g_httpResponseHdr);
+	if (cp->bytes_requested > 0) {
+		return PS_SUCCESS;	/* Already answering, HTTP/1.0 has one request */
+	}
+	/* Shutdown the server */
+	if (len >= 15 && strncmp((char *)buf, "MATRIX_SHUTDOWN", 15) == 0) {
+		_psTrace("Got MATRIX_SHUTDOWN.  Exiting\n");
+		g_exitFlag = 1;
+		return PS_SUCCESS;
+	}
+	/* "GET /bytes?<byteCount>", or "ET /bytes?" with the TLS 1.0 BEAST
+		workaround's one byte first record */
+	n = 0;
+	if (len > 11 && strncmp((char *)buf, "GET /bytes?", 11) == 0) {
+		n = atoi((char *)buf + 11);
+	} else if (len > 10 && strncmp((char *)buf, "ET /bytes?", 10) == 0) {
+		n = atoi((char *)buf + 10);
+	} else {
+		if ((rc = httpBasicParse(cp, buf, len, 0)) < 0) {
+			_psTrace("Couldn't parse HTTP data.  Closing...\n");
+			return rc;
+		}
+		if (rc != HTTPS_COMPLETE) {
+			return PS_SUCCESS;	/* Partial request */
+		}
+	}
+	if (n < hdrLen || n > 1073741824) {
+		n = hdrLen;
+	}
+	cp->bytes_requested = n;
+	cp->bytes_sent = 0;
+	return encodeResponse(cp);
+}
+
+/*
+	Work through the records matrixSslReceivedData decoded
+*/
+static int32 processRecords(worker_t *w, httpConn_t *cp, int32 rc,
+				unsigned char *buf, uint32 len)
+{
+	for (;;) {
+		switch (rc) {
+		case MATRIXSSL_HANDSHAKE_COMPLETE:
+			/* Resumed handshake, where the client speaks last */
+			w->handshakes++;
+			return PS_SUCCESS;
+		case MATRIXSSL_APP_DATA:
+		case MATRIXSSL_APP_DATA_COMPRESSED:
+			if ((rc = handleRequest(cp, buf, len)) < 0) {
+				return rc;
+			}
+			break;
+		case MATRIXSSL_RECEIVED_ALERT:
+			/* The first byte of the buffer is the level */
+			/* The second byte is the description */
+			if (*buf == SSL_ALERT_LEVEL_FATAL) {
+				psTraceIntInfo("Fatal alert: %d, closing connection.\n",
+							*(buf + 1));
+				return PS_PROTOCOL_FAIL;
+			}
+			/* Closure alert is normal (and best) way to close */
+			if (*(buf + 1) == SSL_ALERT_CLOSE_NOTIFY) {
+				return MATRIXSSL_REQUEST_CLOSE;
+			}
+			psTraceIntInfo("Warning alert: %d\n", *(buf + 1));
+			break;
+		case PS_SUCCESS:
+		case MATRIXSSL_REQUEST_SEND:
+		case MATRIXSSL_REQUEST_RECV:
+			/* The caller sends and reads until the socket would block */
+			return PS_SUCCESS;
+		default:
+			return rc < 0 ? rc : PS_PROTOCOL_FAIL;
+		}
+		if ((rc = matrixSslProcessedData(cp->ssl, &buf, &len)) < 0) {
+			return rc;
+		}
+	}
+}
+
+/*
+	Send queued records until done or the socket is full.  PS_PENDING if
+	the rest has to wait for EPOLLOUT.
+*/
+static int32 flushOut(worker_t *w, httpConn_t *cp)
+{
+	unsigned char	*buf;
+	uint32			ptLen;
+	int32			len, sent, rc;
+
+	while ((len = matrixSslGetOutdata(cp->ssl, &buf)) > 0) {
+		if ((sent = (int32)send(cp->fd, buf, len, MSG_NOSIGNAL)) < 0) {
+			if (SOCKET_ERRNO == EINTR) {
+				continue;
+			}
+			if (SOCKET_ERRNO == EWOULDBLOCK || SOCKET_ERRNO == EAGAIN) {
+				return PS_PENDING;
+			}
+			return PS_PLATFORM_FAIL;
+		}
+		w->bytesOut += sent;
+		if ((rc = matrixSslSentData(cp->ssl, sent)) < 0 ||
+				rc == MATRIXSSL_REQUEST_CLOSE) {
+			return rc;
+		}
+		if (rc == MATRIXSSL_HANDSHAKE_COMPLETE) {
+			w->handshakes++;
+			/* A false start client may already have sent its request */
+			if ((rc = matrixSslReceivedData(cp->ssl, 0, &buf, &ptLen)) > 0 &&
+					(rc = processRecords(w, cp, rc, buf, ptLen)) != 0) {
+				return rc;
+			}
+			if (rc < 0) {
+				return rc;
+			}
+		}
+	}
+	return len < 0 ? PS_ARG_FAIL : PS_SUCCESS;
+}
+
+/*
+	Move a connection as far as it can go without blocking.  With edge
+	triggered events both directions are worked until the socket would
+	block, so nothing is left behind for a wakeup that won't come.
+	Returns PS_PENDING to wait for the next event, anything else closes.
+*/
+static int32 serviceConn(worker_t *w, httpConn_t *cp)
+{
+	unsigned char	*buf;
+	uint32			ptLen;
+	int32			len, rc;
+	ssize_t			n;
+
+	for (;;) {
+		if ((rc = flushOut(w, cp)) < 0 && rc != PS_PENDING) {
+			return rc;
+		}
+		if (rc == MATRIXSSL_REQUEST_CLOSE) {
+			return rc;
+		}
+		if (rc == PS_SUCCESS && cp->bytes_requested > 0) {
+			if (cp->bytes_sent == cp->bytes_requested) {
+				/* HTTP/1.0, so done once the whole response is out */
+				return MATRIXSSL_REQUEST_CLOSE;
+			}
+			if ((rc = encodeResponse(cp)) < 0) {
+				return rc;
+			}
+			continue;
+		}
+		if (g_exitFlag && rc == PS_SUCCESS) {
+			return MATRIXSSL_REQUEST_CLOSE;
+		}
+
+		/* Get the ssl buffer and how much data it can accept */
+		/* Note 0 is a return failure, unlike with matrixSslGetOutdata */
+		if ((len = matrixSslGetReadbuf(cp->ssl, &buf)) <= 0) {
+			return PS_ARG_FAIL;
+		}
+		if ((n = recv(cp->fd, buf, len, 0)) < 0) {
+			if (SOCKET_ERRNO == EINTR) {
+				continue;
+			}
+			if (SOCKET_ERRNO == EWOULDBLOCK || SOCKET_ERRNO == EAGAIN) {
+				return PS_PENDING;
+			}
+			return PS_PLATFORM_FAIL;
+		}
+		/* If EOF, remote socket closed. This is semi-normal closure.
+		   Officially, we should close on closure alert. */
+		if (n == 0) {
+			return PS_SUCCESS;
+		}
+		w->bytesIn += n;
+		if ((rc = matrixSslReceivedData(cp->ssl, (int32)n, &buf,
+				&ptLen)) < 0) {
+			return rc;
+		}
+		if ((rc = processRecords(w, cp, rc, buf, ptLen)) != PS_SUCCESS) {
+			return rc;
+		}
+	}
+}
+
+/* Mark a connection active, which keeps the list in timeout order */
+static void touchConn(worker_t *w, httpConn_t *cp)
+{
+	psGetTime(&cp->time, NULL);
+	DLListRemove(&cp->List);
+	DLListInsertTail(&w->conns, &cp->List);
+}
+
+/*
+	Accept everything queued on this worker's listener.  The kernel spreads
+	connections over the SO_REUSEPORT listeners, so there is no shared
+	accept lock and each connection lives on one core.
+*/
+static void acceptConns(worker_t *w)
+{
+	struct epoll_event	ev;
+	sslSessOpts_t		options;
+	httpConn_t			*cp;
+	SOCKET				fd;
+
+	while ((fd = accept4(w->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))
+			!= INVALID_SOCKET) {
+		if (setSocketOptions(fd) < 0 ||
+				(cp = malloc(sizeof(httpConn_t))) == NULL) {
+			close(fd);
+			continue;
+		}
+		memset(cp, 0x0, sizeof(httpConn_t));
+		memset(&options, 0x0, sizeof(sslSessOpts_t));
+		options.userPtr = g_keys;
+		if (matrixSslNewServerSession(&cp->ssl, g_keys, NULL, &options) < 0) {
+			free(cp);
+			close(fd);
+			continue;
+		}
+		cp->fd = fd;
+		cp->timeout = SSL_TIMEOUT;
+		psGetTime(&cp->time, NULL);
+		DLListInsertTail(&w->conns, &cp->List);
+		w->numConns++;
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = cp;
+		if (epoll_ctl(w->efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			closeConn(w, cp, PS_PLATFORM_FAIL);
+			continue;
+		}
+		/* The ClientHello is often here already; no need to wait for it */
+		if (serviceConn(w, cp) != PS_PENDING) {
+			closeConn(w, cp, PS_SUCCESS);
+		}
+	}
+}
+
+/* Close connections idle past their timeout, oldest first */
+static void checkTimeouts(worker_t *w)
+{
+	httpConn_t		*cp;
+	psTime_t		now;
+
+	psGetTime(&now, NULL);
+	while (!DLListIsEmpty(&w->conns)) {
+		cp = DLListGetContainer(w->conns.pNext, httpConn_t, List);
+		if (psDiffMsecs(cp->time, now, NULL) <= (int32)cp->timeout) {
+			break;
+		}
+		closeConn(w, cp, PS_TIMEOUT_FAIL);
+	}
+}
+
+/******************************************************************************/
+/*
+	Worker event loop.  Listener and connections share one epoll set; the
+	listener is registered with a NULL pointer to tell it apart.
+*/
+static void *workerLoop(void *arg)
+{
+	worker_t			*w = arg;
+	struct epoll_event	ev[EPOLL_EVENTS];
+	httpConn_t			*cp;
+	cpu_set_t			cpus;
+	psTime_t			lastSweep, now;
+	int					n, i;
+	int32				rc;
+
+	if (g_pin) {
+		CPU_ZERO(&cpus);
+		CPU_SET(w->id % CPU_SETSIZE, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+	psGetTime(&lastSweep, NULL);
+	while (!g_exitFlag) {
+		if ((n = epoll_wait(w->efd, ev, EPOLL_EVENTS, EPOLL_TIME)) < 0) {
+			if (SOCKET_ERRNO == EINTR) {
+				continue;
+			}
+			_psTraceInt("epoll_wait failed on worker %d\n", w->id);
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if ((cp = ev[i].data.ptr) == NULL) {
+				acceptConns(w);
+				continue;
+			}
+			if ((rc = serviceConn(w, cp)) == PS_PENDING) {
+				touchConn(w, cp);
+				continue;
+			}
+			closeConn(w, cp, rc);
+		}
+		psGetTime(&now, NULL);
+		if (psDiffMsecs(lastSweep, now, NULL) >= EPOLL_TIME) {
+			checkTimeouts(w);
+			lastSweep = now;
+		}
+	}
+	/* Close any active connections */
+	while (!DLListIsEmpty(&w->conns)) {
+		cp = DLListGetContainer(w->conns.pNext, httpConn_t, List);
+		closeConn(w, cp, PS_SUCCESS);
+	}
+	return NULL;
+}
+
+static int32 startWorker(worker_t *w, int id)
+{
+	struct epoll_event	ev;
+	int32				err;
+
+	memset(w, 0x0, sizeof(worker_t));
+	w->id = id;
+	w->efd = -1;
+	DLListInit(&w->conns);
+	if ((w->lfd = lsocketListen(g_port, &err)) == INVALID_SOCKET) {
+		_psTraceInt("Can't listen on port %d\n", g_port);
+		return PS_PLATFORM_FAIL;
+	}
+	if ((w->efd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		return PS_PLATFORM_FAIL;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(w->efd, EPOLL_CTL_ADD, w->lfd, &ev) < 0) {
+		return PS_PLATFORM_FAIL;
+	}
+	if (pthread_create(&w->thread, NULL, workerLoop, w) != 0) {
+		return PS_PLATFORM_FAIL;
+	}
+	return PS_SUCCESS;
+}
+
+static void stopWorker(worker_t *w)
+{
+	if (w->thread) {
+		pthread_join(w->thread, NULL);
+	}
+	if (w->efd >= 0) {
+		close(w->efd);
+	}
+	if (w->lfd != INVALID_SOCKET) {
+		close(w->lfd);
+	}
+}
+
+/******************************************************************************/
+
+static void usage(void)
+{
+	printf(
+		"\nusage: epollServer { options }\n"
+		"\n"
+		"Options can be one or more of the following:\n"
+		"\n"
+		"-c <file>           - Server certificate file\n"
+		"-k <file>           - Server private key file of certificate\n"
+		"-a <file>           - CA certificate file\n"
+		"-p <pass>           - Private key password\n"
+		"-d <file>           - Diffie-Hellman parameters file\n"
+		"-D <dir>            - Directory path to certificate, private key, \n"
+		"                       and Diffie-Hellman parameter files\n"
+		"-P <port>           - Port number\n"
+		"-t <threads>        - Worker threads (default one per core)\n"
+		"-n                  - Don't pin workers to cores\n"
+		"-h                  - Help, print usage and exit\n"
+		"-x <ciphers>        - Cipher suites to disable\n"
+		"                      Example cipher numbers:\n"
+		"                        - '53' TLS_RSA_WITH_AES_256_CBC_SHA\n"
+		"                        - '47' TLS_RSA_WITH_AES_128_CBC_SHA\n"
+		"\n");
+}
+
+/* Returns number of cipher numbers found, or -1 if an error. */
+#include <ctype.h>
+static int32_t parse_cipher_list(char  *cipherListString,
+				uint16_t cipher_array[], uint8_t size_of_cipher_array)
+{
+	uint32 numCiphers, cipher;
+	char *endPtr;
+
+	/* Convert the cipherListString into an array of cipher numbers. */
+	numCiphers = 0;
+	while (cipherListString != NULL) {
+		cipher = strtol(cipherListString, &endPtr, 10);
+		if (endPtr == cipherListString) {
+			printf("The remaining cipherList has no cipher numbers - '%s'\n",
+				   cipherListString);
+			return -1;
+		} else if (size_of_cipher_array <= numCiphers) {
+			printf("Too many cipher numbers supplied.  limit is %d\n",
+				   size_of_cipher_array);
+			return -1;
+		}
+		cipher_array[numCiphers++] = cipher;
+		while (*endPtr != '\0' && !isdigit(*endPtr)) {
+			endPtr++;
+		}
+		cipherListString = endPtr;
+		if (*endPtr == '\0') {
+			break;
+		}
+	}
+
+	return numCiphers;
+}
+
+/* Copy an option argument into a fixed size path buffer */
+static int32 optPath(char *dst, const char *src)
+{
+	if (strlen(src) > MAX_KEYFILE_PATH - 1) {
+		return -1;
+	}
+	strncpy(dst, src, MAX_KEYFILE_PATH - 1);
+	return 0;
+}
+
+/* Return 0 on good set of cmd options, return -1 if a bad cmd option is
+   encountered OR a request for help is seen (i.e. '-h' option). */
+static int32 process_cmd_options(int32 argc, char **argv)
+{
+	int   optionChar, numCiphers;
+
+	/* Start with all options zeroized. */
+	memset(g_keyfilePath, 0, MAX_KEYFILE_PATH);
+	memset(g_privkeyFile, 0, MAX_KEYFILE_PATH);
+	memset(g_identityCert, 0, MAX_KEYFILE_PATH);
+	memset(g_dhParamFile, 0, MAX_KEYFILE_PATH);
+	memset(g_caFile, 0, MAX_KEYFILE_PATH);
+	memset(g_password, 0, MAX_PASSWORD_LEN);
+
+	g_port				= HTTPS_PORT;
+	g_workers			= (int)sysconf(_SC_NPROCESSORS_ONLN);
+	g_pin				= 1;
+	g_disabledCiphers	= 0;
+
+	opterr = 0;
+	while ((optionChar = getopt(argc, argv, "c:d:a:D:hk:np:P:t:x:")) != -1)
+	{
+		switch (optionChar)
+		{
+		case 'h':
+			return -1;
+
+		case 'x':
+			// Ciphers to DISABLE!
+			numCiphers = parse_cipher_list(optarg, g_disabledCipher,
+				SSL_MAX_DISABLED_CIPHERS);
+			if (numCiphers <= 0) {
+				return -1;
+			}
+			g_disabledCiphers = numCiphers;
+			break;
+
+		case 'D':
+			if (optPath(g_keyfilePath, optarg) < 0) {
+				return -1;
+			}
+			break;
+
+		case 'c':
+			if (optPath(g_identityCert, optarg) < 0) {
+				return -1;
+			}
+			break;
+
+		case 'a':
+			if (optPath(g_caFile, optarg) < 0) {
+				return -1;
+			}
+			break;
+
+		case 'd':
+			if (optPath(g_dhParamFile, optarg) < 0) {
+				return -1;
+			}
+			break;
+
+		case 'k':
+			if (optPath(g_privkeyFile, optarg) < 0) {
+				return -1;
+			}
+			break;
+
+		case 'p':
+			if (optPath(g_password, optarg) < 0) {
+				return -1;
+			}
+			break;
+
+		case 'P':
+			g_port = atoi(optarg);
+			break;
+
+		case 't':
+			g_workers = atoi(optarg);
+			break;
+
+		case 'n':
+			g_pin = 0;
+			break;
+		}
+	}
+	if (g_workers < 1) {
+		g_workers = 1;
+	}
+	if (g_workers > MAX_WORKERS) {
+		g_workers = MAX_WORKERS;
+	}
+	return 0;
+}
+
+/* Key file path from the -D directory and a user or default file name */
+static void keyPath(char *out, const char *file, const char *defaultFile)
+{
+	if (file[0] == 0) {
+		snprintf(out, FILENAME_MAX - 1, "%s/%s", KEY_DIR, defaultFile);
+	} else if (g_keyfilePath[0] != 0) {
+		snprintf(out, FILENAME_MAX - 1, "%s/%s", g_keyfilePath, file);
+	} else {
+		snprintf(out, FILENAME_MAX - 1, "%s", file);
+	}
+}
+
+/******************************************************************************/
+/*
+	Main multi-core SSL server
+	Load keys once, shared read-only by every worker, then start one event
+	loop per core and report their combined rates until told to exit.
+ */
+int32 main(int32 argc, char **argv)
+{
+#ifdef USE_STATELESS_SESSION_TICKETS
+	unsigned char	sessTicketName[16];
+#endif
+	char			certpath[FILENAME_MAX];
+	char			keypath[FILENAME_MAX];
+	char			capath[FILENAME_MAX];
+	int32			rc;
+	int				i, started;
+
+	g_exitFlag = 0;
+	if (sighandlers() < 0) {
+		return PS_PLATFORM_FAIL;
+	}
+
+	if ((rc = matrixSslOpen()) < 0) {
+		_psTrace("MatrixSSL library init failure.  Exiting\n");
+		return rc;
+	}
+
+	if (matrixSslNewKeys(&g_keys, NULL) < 0) {
+		return -1;
+	}
+
+	if (0 != process_cmd_options(argc, argv)) {
+		usage();
+		return 0;
+	}
+
+#ifdef USE_STATELESS_SESSION_TICKETS
+	if (matrixCryptoGetPrngData(sessTicketSymKey, sizeof(sessTicketSymKey), NULL) < 0
+			|| matrixCryptoGetPrngData(sessTicketMacKey, sizeof(sessTicketMacKey), NULL) < 0
+			|| matrixCryptoGetPrngData(sessTicketName, sizeof(sessTicketName), NULL) < 0) {
+		_psTrace("Error generating session ticket encryption key\n");
+		return EXIT_FAILURE;
+	}
+	if (matrixSslLoadSessionTicketKeys(g_keys, sessTicketName,
+			sessTicketSymKey, sizeof(sessTicketSymKey),
+			sessTicketMacKey, sizeof(sessTicketMacKey)) < 0) {
+		_psTrace("Error loading session ticket encryption key\n");
+		return EXIT_FAILURE;
+	}
+	matrixSslSetSessionTicketCallback(g_keys, sessTicketCb);
+#endif
+
+	if (g_identityCert[0] == 0 || g_privkeyFile[0] == 0) {
+		_psTrace("WARNING: Do not use sample key material in production\n");
+	}
+	keyPath(certpath, g_identityCert, g_defaultCertFile);
+	keyPath(keypath, g_privkeyFile, g_defaultPrivkeyFile);
+	keyPath(capath, g_caFile, g_defaultCAFile);
+
+	/* Still don't have a generic key loading function.  Try RSA first and
+		then ECC if that doesn't load */
+#ifdef USE_RSA
+	if ((rc = matrixSslLoadRsaKeys(g_keys, certpath, keypath, g_password,
+			capath)) < 0) {
+#endif /* USE_RSA */
+#ifdef USE_ECC_CIPHER_SUITE
+		if ((rc = matrixSslLoadEcKeys(g_keys, certpath, keypath, g_password,
+				capath)) < 0) {
+			_psTrace("Unable to load key material.  Exiting\n");
+			return rc;
+		}
+#else
+		_psTrace("Unable to load key material. Please enable RSA or ECC from config.\n");
+		return rc;
+#endif /* USE_ECC_CIPHER_SUITE */
+#ifdef USE_RSA
+	}
+#endif /* USE_RSA */
+
+#ifdef REQUIRE_DH_PARAMS
+	keyPath(certpath, g_dhParamFile, g_defaultDHParamFile);
+	if ((rc = matrixSslLoadDhParams(g_keys, certpath)) < 0) {
+		_psTrace("Unable to load static key material.  Exiting\n");
+		return rc;
+	}
+#endif
+
+	/* Were any cipher suites disabled? */
+	for (i = 0; i < g_disabledCiphers; i++) {
+		matrixSslSetCipherSuiteEnabledStatus(NULL, g_disabledCipher[i],
+			PS_FALSE);
+	}
+
+	if ((g_worker = calloc(g_workers, sizeof(worker_t))) == NULL) {
+		return PS_MEM_FAIL;
+	}
+	for (started = 0; started < g_workers; started++) {
+		if (startWorker(&g_worker[started], started) < 0) {
+			g_exitFlag = 1;
+			started++;	/* Its sockets still need closing */
+			break;
+		}
+	}
+	if (!g_exitFlag) {
+		printf("Listening on port %d with %d workers\n", g_port, g_workers);
+	}
+	while (!g_exitFlag) {
+		sleep(1);
+		displayStats();
+	}
+	for (i = 0; i < started; i++) {
+		stopWorker(&g_worker[i]);
+	}
+	free(g_worker);
+	matrixSslDeleteKeys(g_keys);
+	matrixSslClose();
+	return 0;
+}
+
+/******************************************************************************/
+/*
+	Close a socket and free associated SSL context and buffers
+ */
+static void closeConn(worker_t *w, httpConn_t *cp, int32 reason)
+{
+	unsigned char	*buf;
+	int32			len;
+
+	DLListRemove(&cp->List);
+	w->numConns--;
+	/* Quick attempt to send a closure alert, don't worry about failure */
+	if (matrixSslEncodeClosureAlert(cp->ssl) >= 0) {
+		if ((len = matrixSslGetOutdata(cp->ssl, &buf)) > 0) {
+			if ((len = (int32)send(cp->fd, buf, len, MSG_NOSIGNAL)) > 0) {
+				matrixSslSentData(cp->ssl, len);
+			}
+		}
+	}
+	if (cp->parsebuf != NULL) {
+		free(cp->parsebuf);
+	}
+	matrixSslDeleteSession(cp->ssl);
+	/* Closing the descriptor also takes it out of the epoll set */
+	close(cp->fd);
+	if (reason < 0 && reason != PS_TIMEOUT_FAIL) {
+		psTraceIntInfo("=== Closing Client on Error %d ===\n", reason);
+	}
+	free(cp);
+}
+
+/******************************************************************************/
+/*
+	Listening socket for one worker.  SO_REUSEPORT lets every worker bind
+	the same port and have the kernel balance new connections across them.
+ */
+static SOCKET lsocketListen(short port, int32 *err)
+{
+	struct sockaddr_in	addr = { 0 };
+	SOCKET				fd;
+	int					on = 1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+		_psTrace("Error creating listen socket\n");
+		*err = SOCKET_ERRNO;
+		return INVALID_SOCKET;
+	}
+	if (setSocketOptions(fd) < 0 ||
+			setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		*err = SOCKET_ERRNO;
+		close(fd);
+		return INVALID_SOCKET;
+	}
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		_psTrace("Can't bind socket. Port in use or insufficient privilege\n");
+		*err = SOCKET_ERRNO;
+		return INVALID_SOCKET;
+	}
+	if (listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		_psTrace("Error listening on socket\n");
+		*err = SOCKET_ERRNO;
+		return INVALID_SOCKET;
+	}
+	return fd;
+}
+
+/******************************************************************************/
+/*
+	Make sure the socket is not inherited by exec'd processes
+	Then we set REUSEADDR, NODELAY and NONBLOCK on the socket
+*/
+static int setSocketOptions(SOCKET fd)
+{
+	int rc;
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+		return PS_PLATFORM_FAIL;
+	}
+	rc = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&rc, sizeof(rc)) < 0) {
+		return PS_PLATFORM_FAIL;
+	}
+	rc = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&rc, sizeof(rc)) < 0) {
+		return PS_PLATFORM_FAIL;
+	}
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		return PS_PLATFORM_FAIL;
+	}
+	return PS_SUCCESS;
+}
+
+/******************************************************************************/
+/*
+	Lets ctrl-c do a clean exit of the server.  Workers see the flag within
+	EPOLL_TIME.
+ */
+static int32 sighandlers(void)
+{
+	if (signal(SIGINT, sigintterm_handler) == SIG_ERR ||
+			signal(SIGTERM, sigintterm_handler) == SIG_ERR ||
+			signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+		return PS_PLATFORM_FAIL;
+	}
+	return 0;
+}
+
+/* catch ctrl-c or sigterm */
+static void sigintterm_handler(int unused)
+{
+	g_exitFlag = 1; /* Rudimentary exit flagging */
+}
+
+#else
+
+/******************************************************************************/
+/*
+	Stub main for compiling without the needed features
+*/
+int32 main(int32 argc, char **argv)
+{
+	printf("epollServer needs Linux with USE_SERVER_SIDE_SSL, " \
+			"MATRIX_USE_FILE_SYSTEM and USE_MULTITHREADING\n");
+	return -1;
+}
+#endif
+
+/******************************************************************************/
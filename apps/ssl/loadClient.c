@@ -0,0 +1,1039 @@
+/**
+ *	@file    loadClient.c
+ *	@version ee35b93 (HEAD -> master)
+ *
+ *	Multi-threaded MatrixSSL load generator for Linux.
+ *	Keeps many non-blocking client sessions in flight against one server,
+ *	mixing full handshakes with session id and session ticket resumptions,
+ *	and reports handshakes per second, throughput and latency percentiles
+ *	for each cipher suite.
+ */
+/*
+ *	Copyright (c) 2013-2016 INSIDE Secure Corporation
+ *	Copyright (c) PeerSec Networks, 2002-2011
+ *	All Rights Reserved
+ *
+ *	The latest version of this code is available at http://www.matrixssl.org
+ *
+ *	This software is open source; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This General Public License does NOT permit incorporating this software
+ *	into proprietary programs.  If you are unable to comply with the GPL, a
+ *	commercial license for this software may be purchased from INSIDE at
+ *	http://www.insidesecure.com/
+ *
+ *	This program is distributed in WITHOUT ANY WARRANTY; without even the
+ *	implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *	See the GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *	http://www.gnu.org/copyleft/gpl.html
+ */
+/******************************************************************************/
+
+#include "app.h"
+#include "matrixssl/matrixsslApi.h"
+
+#if defined(USE_CLIENT_SIDE_SSL) && defined(LINUX) && \
+	defined(USE_MULTITHREADING)
+
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+/*
+	A client only offers suites it holds a CA of the matching key type for,
+	so the test CAs are built in.  -a loads a CA file instead.
+*/
+#ifdef USE_RSA_CIPHER_SUITE
+#include "testkeys/RSA/ALL_RSA_CAS.h"
+#ifdef USE_ECC_CIPHER_SUITE
+#include "testkeys/ECDH_RSA/ALL_ECDH-RSA_CAS.h"
+#endif
+#endif
+#if defined(USE_ECC_CIPHER_SUITE) && defined(USE_SECP192R1) && \
+	defined(USE_SECP224R1) && defined(USE_SECP521R1)
+#include "testkeys/EC/ALL_EC_CAS.h"
+#define LOAD_EC_CAS
+#endif
+
+/********************************** Defines ***********************************/
+
+#define MAX_THREADS			256
+#define MAX_SESSIONS		65536	/* Per thread */
+#define EPOLL_EVENTS		256
+#define CONNECT_TIMEOUT		10000	/* In milliseconds, per connection */
+
+/* Connection kinds in the mix, and how a handshake actually went */
+enum {
+	KIND_FULL = 0,
+	KIND_SESSION_ID,
+	KIND_TICKET,
+	KIND_COUNT
+};
+
+/*
+	Log-linear latency histogram in microseconds: 16 buckets per power of
+	two, so any percentile is within about 6% of the true value at a fixed
+	1K entries per kind per thread.
+*/
+#define HIST_SUB_BITS		4
+#define HIST_SUB			(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		(64 * HIST_SUB)
+
+typedef struct {
+	uint64_t	count;
+	uint64_t	sum;
+	uint32_t	bucket[HIST_BUCKETS];
+} latHist_t;
+
+typedef struct {
+	uint64_t	handshakes[KIND_COUNT];
+	uint64_t	bytesIn;
+	uint64_t	bytesOut;
+	uint64_t	errors;
+	latHist_t	hsLat[KIND_COUNT];	/* Connect to handshake complete */
+	latHist_t	reqLat;				/* Request to last response byte */
+} loadStats_t;
+
+struct loadThread;
+
+/*
+	One concurrent session.  A slot runs its connections back to back and
+	keeps the session id and ticket it was last given for resumption.
+*/
+typedef struct {
+	struct loadThread	*thread;
+	SOCKET			fd;
+	ssl_t			*ssl;
+	int				kind;
+	int				ticketOffered;
+	psTime_t		start;		/* Connect */
+	psTime_t		reqStart;	/* Request sent */
+	uint32			received;
+	sslSessionId_t	*sid;		/* For session id resumption */
+	sslSessionId_t	*ticket;	/* For ticket resumption */
+} loadSlot_t;
+
+typedef struct loadThread {
+	pthread_t		thread;
+	int				efd;
+	uint32_t		numSlots;
+	loadSlot_t		*slots;
+	uint32_t		active;
+	uint64_t		started;	/* Connections started */
+	uint64_t		quota;		/* 0 for no limit */
+	int				mixCredit[KIND_COUNT];
+	loadStats_t		stats;
+} loadThread_t;
+
+/********************************** Globals ***********************************/
+
+static volatile int32	g_exitFlag;
+static char				g_ip[64];
+static int				g_port;
+static int				g_threads;
+static int				g_sessions;		/* Per thread */
+static int				g_seconds;
+static uint64_t			g_connections;	/* Instead of g_seconds, if set */
+static uint32			g_bytes;		/* Requested per connection */
+static int				g_version;
+static int				g_mix[KIND_COUNT];
+static uint16_t			g_cipher[SSL_MAX_DISABLED_CIPHERS];
+static int				g_ciphers;
+static uint16_t			g_phaseCipher;	/* Cipher suite of this phase */
+static char				g_caFile[256];
+static int				g_anyCert;		/* -k, accept any server chain */
+static volatile int32	g_certRejected;	/* Reported once */
+static psTime_t			g_deadline;
+static sslKeys_t		*g_keys;
+static struct sockaddr_in	g_addr;
+
+static const char		*g_kindName[KIND_COUNT] = {
+	"full", "session id", "ticket"
+};
+
+/****************************** Local Functions *******************************/
+
+static void startConn(loadSlot_t *slot);
+static void sigintterm_handler(int i);
+
+/******************************************************************************/
+/*
+	Latency histogram
+*/
+static uint32_t histIndex(uint64_t v)
+{
+	uint32_t	msb;
+
+	if (v < HIST_SUB) {
+		return (uint32_t)v;
+	}
+	for (msb = HIST_SUB_BITS; (v >> (msb + 1)) != 0; msb++);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+		(uint32_t)((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Smallest value that falls in bucket i */
+static uint64_t histValue(uint32_t i)
+{
+	if (i < HIST_SUB) {
+		return i;
+	}
+	return (uint64_t)(HIST_SUB | (i & (HIST_SUB - 1))) <<
+		((i >> HIST_SUB_BITS) - 1);
+}
+
+static void histAdd(latHist_t *h, uint64_t usecs)
+{
+	h->bucket[histIndex(usecs)]++;
+	h->count++;
+	h->sum += usecs;
+}
+
+static void histMerge(latHist_t *to, const latHist_t *from)
+{
+	uint32_t	i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		to->bucket[i] += from->bucket[i];
+	}
+	to->count += from->count;
+	to->sum += from->sum;
+}
+
+/* Value at or below which pct percent of the samples fall */
+static uint64_t histPercentile(const latHist_t *h, double pct)
+{
+	uint64_t	want, seen;
+	uint32_t	i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+	want = (uint64_t)(h->count * pct / 100);
+	if (want >= h->count) {
+		want = h->count - 1;
+	}
+	for (i = 0, seen = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen > want) {
+			return histValue(i);
+		}
+	}
+	return histValue(HIST_BUCKETS - 1);
+}
+
+static uint64_t usecsSince(psTime_t then)
+{
+	psTime_t	now;
+
+	psGetTime(&now, NULL);
+#ifdef USE_HIGHRES_TIME
+	return (uint64_t)psDiffUsecs(then, now);
+#else
+	return (uint64_t)psDiffMsecs(then, now, NULL) * 1000;
+#endif
+}
+
+/******************************************************************************/
+/*
+	Server chains must validate against loadCAs() unless -k asked for any
+	chain to be accepted.  Rejections show up in the error count, and the
+	first one is reported.
+*/
+static int32 certCb(ssl_t *ssl, psX509Cert_t *cert, int32 alert)
+{
+	if (g_anyCert || alert == 0) {
+		return 0;
+	}
+	if (!g_certRejected) {
+		g_certRejected = 1;
+		_psTraceInt("Server certificate rejected with alert %d.  "
+			"See -a and -k\n", alert);
+	}
+	return alert;
+}
+
+/* The built in test CAs, or g_caFile if given */
+static int32 loadCAs(sslKeys_t *keys)
+{
+	unsigned char	*CAstream;
+	int32			CAstreamLen, rc;
+
+	if (g_caFile[0] != 0) {
+#ifdef USE_RSA
+		return matrixSslLoadRsaKeys(keys, NULL, NULL, NULL, g_caFile);
+#elif defined(USE_ECC)
+		return matrixSslLoadEcKeys(keys, NULL, NULL, NULL, g_caFile);
+#else
+		return PS_UNSUPPORTED_FAIL;
+#endif
+	}
+	CAstreamLen = 0;
+#ifdef USE_RSA_CIPHER_SUITE
+	CAstreamLen += sizeof(RSACAS);
+#ifdef USE_ECC_CIPHER_SUITE
+	CAstreamLen += sizeof(ECDHRSACAS);
+#endif
+#endif
+#ifdef LOAD_EC_CAS
+	CAstreamLen += sizeof(ECCAS);
+#endif
+	if (CAstreamLen == 0) {
+		return PS_SUCCESS;	/* PSK suites only */
+	}
+	if ((CAstream = psMalloc(NULL, CAstreamLen)) == NULL) {
+		return PS_MEM_FAIL;
+	}
+	CAstreamLen = 0;
+#ifdef USE_RSA_CIPHER_SUITE
+	memcpy(CAstream, RSACAS, sizeof(RSACAS));
+	CAstreamLen += sizeof(RSACAS);
+#ifdef USE_ECC_CIPHER_SUITE
+	memcpy(CAstream + CAstreamLen, ECDHRSACAS, sizeof(ECDHRSACAS));
+	CAstreamLen += sizeof(ECDHRSACAS);
+#endif
+#endif
+#ifdef LOAD_EC_CAS
+	memcpy(CAstream + CAstreamLen, ECCAS, sizeof(ECCAS));
+	CAstreamLen += sizeof(ECCAS);
+#endif
+#ifdef USE_RSA
+	rc = matrixSslLoadRsaKeysMem(keys, NULL, 0, NULL, 0, CAstream,
+		CAstreamLen);
+#else
+	rc = matrixSslLoadEcKeysMem(keys, NULL, 0, NULL, 0, CAstream,
+		CAstreamLen);
+#endif
+	psFree(CAstream, NULL);
+	return rc;
+}
+
+/*
+	Pick the next connection kind.  Smooth weighted round robin, so the
+	kinds are interleaved and the mix holds over any run length.
+*/
+static int nextKind(loadThread_t *t)
+{
+	int		k, best;
+
+	best = 0;
+	for (k = 0; k < KIND_COUNT; k++) {
+		t->mixCredit[k] += g_mix[k];
+		if (t->mixCredit[k] > t->mixCredit[best]) {
+			best = k;
+		}
+	}
+	t->mixCredit[best] -= 100;
+	return best;
+}
+
+static int32 phaseOver(loadThread_t *t)
+{
+	psTime_t	now;
+
+	if (g_exitFlag) {
+		return 1;
+	}
+	if (t->quota) {
+		return t->started >= t->quota;
+	}
+	psGetTime(&now, NULL);
+	return psDiffMsecs(g_deadline, now, NULL) >= 0;
+}
+
+/*
+	End the slot's connection and start its next one.  A failed connection
+	loses the slot's resumption state so it can't fail again the same way.
+*/
+static void endConn(loadSlot_t *slot, int32 ok)
+{
+	loadThread_t	*t = slot->thread;
+	unsigned char	*buf;
+	int32			len;
+
+	if (ok) {
+		/* Be polite so the server can keep resuming our sessions */
+		if (matrixSslEncodeClosureAlert(slot->ssl) >= 0 &&
+				(len = matrixSslGetOutdata(slot->ssl, &buf)) > 0 &&
+				(len = (int32)send(slot->fd, buf, len, MSG_NOSIGNAL)) > 0) {
+			matrixSslSentData(slot->ssl, len);
+		}
+	} else {
+		t->stats.errors++;
+		matrixSslClearSessionId(slot->sid);
+		matrixSslClearSessionId(slot->ticket);
+	}
+	matrixSslDeleteSession(slot->ssl);
+	slot->ssl = NULL;
+	close(slot->fd);	/* Also takes it out of the epoll set */
+	slot->fd = INVALID_SOCKET;
+	t->active--;
+	if (!phaseOver(t)) {
+		startConn(slot);
+	}
+}
+
+/*
+	Connect and queue the ClientHello.  A session id slot with nothing
+	cached yet does a full handshake that fills it in, and likewise for
+	tickets, so every slot warms up on its own.
+*/
+static void startConn(loadSlot_t *slot)
+{
+	loadThread_t		*t = slot->thread;
+	struct epoll_event	ev;
+	sslSessOpts_t		options;
+	sslSessionId_t		*sid;
+	int32				rc;
+
+	slot->kind = nextKind(t);
+	slot->ticketOffered = 0;
+	slot->received = 0;
+	memset(&options, 0x0, sizeof(sslSessOpts_t));
+	switch (g_version) {
+	case 1:
+		options.versionFlag = SSL_FLAGS_TLS_1_0;
+		break;
+	case 2:
+		options.versionFlag = SSL_FLAGS_TLS_1_1;
+		break;
+	default:
+		options.versionFlag = SSL_FLAGS_TLS_1_2;
+		break;
+	}
+	sid = NULL;
+	if (slot->kind == KIND_SESSION_ID) {
+		sid = slot->sid;
+	} else if (slot->kind == KIND_TICKET) {
+		sid = slot->ticket;
+		options.ticketResumption = 1;
+#ifdef USE_STATELESS_SESSION_TICKETS
+		slot->ticketOffered = slot->ticket->sessionTicketLen > 0;
+#endif
+	}
+
+	t->started++;
+	t->active++;
+	psGetTime(&slot->start, NULL);
+	slot->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (slot->fd == INVALID_SOCKET) {
+		goto L_FAIL;
+	}
+	rc = 1;
+	setsockopt(slot->fd, IPPROTO_TCP, TCP_NODELAY, (char *)&rc, sizeof(rc));
+	if (connect(slot->fd, (struct sockaddr *)&g_addr, sizeof(g_addr)) < 0 &&
+			SOCKET_ERRNO != EINPROGRESS) {
+		goto L_FAIL;
+	}
+	if (matrixSslNewClientSession(&slot->ssl, g_keys, sid, &g_phaseCipher,
+			1, certCb, NULL, NULL, NULL, &options) < 0) {
+		slot->ssl = NULL;
+		goto L_FAIL;
+	}
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = slot;
+	if (epoll_ctl(t->efd, EPOLL_CTL_ADD, slot->fd, &ev) < 0) {
+		goto L_FAIL;
+	}
+	return;
+
+L_FAIL:
+	/* Out of descriptors or ports.  Leave the slot idle for this phase */
+	t->stats.errors++;
+	if (slot->ssl) {
+		matrixSslDeleteSession(slot->ssl);
+		slot->ssl = NULL;
+	}
+	if (slot->fd != INVALID_SOCKET) {
+		close(slot->fd);
+		slot->fd = INVALID_SOCKET;
+	}
+	t->active--;
+}
+
+/* Handshake done: record how it went, then send the request if any */
+static int32 handshakeDone(loadSlot_t *slot)
+{
+	loadThread_t	*t = slot->thread;
+	unsigned char	*buf;
+	int32			len, kind;
+	char			req[64];
+
+	if (!(slot->ssl->flags & SSL_FLAGS_RESUMED)) {
+		kind = KIND_FULL;
+	} else if (slot->ticketOffered) {
+		kind = KIND_TICKET;
+	} else {
+		kind = KIND_SESSION_ID;
+	}
+	t->stats.handshakes[kind]++;
+	histAdd(&t->stats.hsLat[kind], usecsSince(slot->start));
+	if (g_bytes == 0) {
+		return MATRIXSSL_REQUEST_CLOSE;
+	}
+	len = snprintf(req, sizeof(req), "GET /bytes?%u HTTP/1.0\r\n\r\n",
+		g_bytes);
+	if (matrixSslGetWritebuf(slot->ssl, &buf, len) < len) {
+		return PS_MEM_FAIL;
+	}
+	memcpy(buf, req, len);
+	if (matrixSslEncodeWritebuf(slot->ssl, len) < 0) {
+		return PS_MEM_FAIL;
+	}
+	psGetTime(&slot->reqStart, NULL);
+	return PS_SUCCESS;
+}
+
+/*
+	Work through the records matrixSslReceivedData decoded.  Returns
+	PS_SUCCESS to keep going, MATRIXSSL_REQUEST_CLOSE when the connection
+	has done its job, < 0 on failure.
+*/
+static int32 processRecords(loadSlot_t *slot, int32 rc, unsigned char *buf,
+				uint32 len)
+{
+	loadThread_t	*t = slot->thread;
+
+	for (;;) {
+		switch (rc) {
+		case MATRIXSSL_HANDSHAKE_COMPLETE:
+			/* Resumed handshake, where the client speaks last */
+			if ((rc = handshakeDone(slot)) != PS_SUCCESS) {
+				return rc;
+			}
+			break;
+		case MATRIXSSL_APP_DATA:
+		case MATRIXSSL_APP_DATA_COMPRESSED:
+			slot->received += len;
+			if (slot->received >= g_bytes) {
+				histAdd(&t->stats.reqLat, usecsSince(slot->reqStart));
+				return MATRIXSSL_REQUEST_CLOSE;
+			}
+			break;
+		case MATRIXSSL_RECEIVED_ALERT:
+			if (*buf == SSL_ALERT_LEVEL_FATAL) {
+				return PS_PROTOCOL_FAIL;
+			}
+			if (*(buf + 1) == SSL_ALERT_CLOSE_NOTIFY) {
+				/* Closed before the full response, or never got one */
+				return PS_PROTOCOL_FAIL;
+			}
+			break;
+		case PS_SUCCESS:
+		case MATRIXSSL_REQUEST_SEND:
+		case MATRIXSSL_REQUEST_RECV:
+			return PS_SUCCESS;
+		default:
+			return rc < 0 ? rc : PS_PROTOCOL_FAIL;
+		}
+		if ((rc = matrixSslProcessedData(slot->ssl, &buf, &len)) < 0) {
+			return rc;
+		}
+	}
+}
+
+/*
+	Move a connection as far as it can go without blocking, in both
+	directions, as events are edge triggered.  PS_PENDING to wait.
+*/
+static int32 serviceSlot(loadSlot_t *slot)
+{
+	loadThread_t	*t = slot->thread;
+	unsigned char	*buf;
+	uint32			ptLen;
+	int32			len, rc;
+	ssize_t			n;
+
+	for (;;) {
+		while ((len = matrixSslGetOutdata(slot->ssl, &buf)) > 0) {
+			if ((n = send(slot->fd, buf, len, MSG_NOSIGNAL)) < 0) {
+				if (SOCKET_ERRNO == EINTR) {
+					continue;
+				}
+				if (SOCKET_ERRNO == EWOULDBLOCK || SOCKET_ERRNO == EAGAIN) {
+					break;	/* EPOLLOUT will bring us back */
+				}
+				return PS_PLATFORM_FAIL;
+			}
+			t->stats.bytesOut += n;
+			if ((rc = matrixSslSentData(slot->ssl, (uint32)n)) < 0) {
+				return rc;
+			}
+			if (rc == MATRIXSSL_HANDSHAKE_COMPLETE &&
+					(rc = handshakeDone(slot)) != PS_SUCCESS) {
+				return rc;
+			}
+		}
+		if (len < 0) {
+			return PS_ARG_FAIL;
+		}
+
+		if ((len = matrixSslGetReadbuf(slot->ssl, &buf)) <= 0) {
+			return PS_ARG_FAIL;
+		}
+		if ((n = recv(slot->fd, buf, len, 0)) < 0) {
+			if (SOCKET_ERRNO == EINTR) {
+				continue;
+			}
+			if (SOCKET_ERRNO == EWOULDBLOCK || SOCKET_ERRNO == EAGAIN ||
+					SOCKET_ERRNO == ENOTCONN) {
+				/* Still connecting, or nothing more for now */
+				return PS_PENDING;
+			}
+			return PS_PLATFORM_FAIL;
+		}
+		if (n == 0) {
+			return PS_PROTOCOL_FAIL;	/* Server hung up early */
+		}
+		t->stats.bytesIn += n;
+		if ((rc = matrixSslReceivedData(slot->ssl, (int32)n, &buf,
+				&ptLen)) < 0) {
+			return rc;
+		}
+		if ((rc = processRecords(slot, rc, buf, ptLen)) != PS_SUCCESS) {
+			return rc;
+		}
+	}
+}
+
+/******************************************************************************/
+/*
+	One load thread: its slots all run from a single epoll set.
+*/
+static void *loadLoop(void *arg)
+{
+	loadThread_t		*t = arg;
+	struct epoll_event	ev[EPOLL_EVENTS];
+	loadSlot_t			*slot;
+	psTime_t			lastScan;
+	uint32_t			i;
+	int					n, j;
+	int32				rc;
+
+	for (i = 0; i < t->numSlots && !phaseOver(t); i++) {
+		startConn(&t->slots[i]);
+	}
+	psGetTime(&lastScan, NULL);
+	while (t->active > 0) {
+		if ((n = epoll_wait(t->efd, ev, EPOLL_EVENTS, 100)) < 0) {
+			if (SOCKET_ERRNO == EINTR) {
+				continue;
+			}
+			break;
+		}
+		for (j = 0; j < n; j++) {
+			slot = ev[j].data.ptr;
+			if ((rc = serviceSlot(slot)) != PS_PENDING) {
+				endConn(slot, rc == MATRIXSSL_REQUEST_CLOSE);
+			}
+		}
+		/* Give up on connections stuck past CONNECT_TIMEOUT, and on all
+			of them once told to stop */
+		if (!g_exitFlag && usecsSince(lastScan) < 100000) {
+			continue;
+		}
+		psGetTime(&lastScan, NULL);
+		for (i = 0; i < t->numSlots; i++) {
+			slot = &t->slots[i];
+			if (slot->ssl != NULL && (g_exitFlag ||
+					usecsSince(slot->start) / 1000 > CONNECT_TIMEOUT)) {
+				endConn(slot, 0);
+			}
+		}
+	}
+	return NULL;
+}
+
+/******************************************************************************/
+/*
+	Run every thread against one cipher suite and print what they saw
+*/
+static void reportLine(const char *name, uint64_t count, const latHist_t *h,
+				double secs)
+{
+	printf("  %-11s %10llu %10.1f %9llu %9llu %9llu %9llu %9llu\n", name,
+		(unsigned long long)count, count / secs,
+		(unsigned long long)(h->count ? h->sum / h->count : 0),
+		(unsigned long long)histPercentile(h, 50),
+		(unsigned long long)histPercentile(h, 90),
+		(unsigned long long)histPercentile(h, 99),
+		(unsigned long long)histPercentile(h, 99.9));
+}
+
+static int32 runPhase(loadThread_t *threads)
+{
+	loadStats_t		*total;
+	latHist_t		all;
+	psTime_t		start;
+	uint64_t		handshakes, usecs;
+	double			secs;
+	int				i, k;
+	uint32_t		j;
+
+	if ((total = calloc(1, sizeof(loadStats_t))) == NULL) {
+		return PS_MEM_FAIL;
+	}
+	psGetTime(&start, NULL);
+	g_deadline = start;
+	g_deadline.tv_sec += g_seconds;
+	for (i = 0; i < g_threads; i++) {
+		threads[i].active = 0;
+		threads[i].started = 0;
+		threads[i].quota = 0;
+		memset(threads[i].mixCredit, 0x0, sizeof(threads[i].mixCredit));
+		if (g_connections) {
+			threads[i].quota = g_connections / g_threads +
+				((uint64_t)i < g_connections % g_threads ? 1 : 0);
+		}
+		memset(&threads[i].stats, 0x0, sizeof(loadStats_t));
+		if (pthread_create(&threads[i].thread, NULL, loadLoop,
+				&threads[i]) != 0) {
+			g_exitFlag = 1;
+			g_threads = i;
+			break;
+		}
+	}
+	for (i = 0; i < g_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		for (k = 0; k < KIND_COUNT; k++) {
+			total->handshakes[k] += threads[i].stats.handshakes[k];
+			histMerge(&total->hsLat[k], &threads[i].stats.hsLat[k]);
+		}
+		histMerge(&total->reqLat, &threads[i].stats.reqLat);
+		total->bytesIn += threads[i].stats.bytesIn;
+		total->bytesOut += threads[i].stats.bytesOut;
+		total->errors += threads[i].stats.errors;
+		for (j = 0; j < threads[i].numSlots; j++) {
+			/* Start the next cipher suite cold */
+			matrixSslClearSessionId(threads[i].slots[j].sid);
+			matrixSslClearSessionId(threads[i].slots[j].ticket);
+		}
+	}
+	usecs = usecsSince(start);
+	secs = usecs ? usecs / 1000000.0 : 1;
+
+	printf("Cipher suite %u: %d threads x %d sessions, %.2f seconds\n",
+		g_phaseCipher, g_threads, g_sessions, secs);
+	printf("  %-11s %10s %10s %9s %9s %9s %9s %9s\n", "latency us", "count",
+		"per sec", "mean", "p50", "p90", "p99", "p99.9");
+	memset(&all, 0x0, sizeof(latHist_t));
+	handshakes = 0;
+	for (k = 0; k < KIND_COUNT; k++) {
+		reportLine(g_kindName[k], total->handshakes[k], &total->hsLat[k],
+			secs);
+		histMerge(&all, &total->hsLat[k]);
+		handshakes += total->handshakes[k];
+	}
+	reportLine("handshakes", handshakes, &all, secs);
+	if (g_bytes > 0) {
+		reportLine("requests", total->reqLat.count, &total->reqLat, secs);
+	}
+	printf("  %.2f MB/s in, %.2f MB/s out, %llu errors\n\n",
+		total->bytesIn / secs / 1000000, total->bytesOut / secs / 1000000,
+		(unsigned long long)total->errors);
+	free(total);
+	return PS_SUCCESS;
+}
+
+/******************************************************************************/
+
+static void usage(void)
+{
+	printf(
+		"\nusage: loadClient { options }\n"
+		"\n"
+		"Options can be one or more of the following:\n"
+		"\n"
+		"-s <serverIpAddress>    - IP address of server machine/interface\n"
+		"                        - Default 127.0.0.1 (localhost)\n"
+		"-p <serverPortNum>      - Port number for SSL/TLS server\n"
+		"                        - Default 4433\n"
+		"-t <threads>            - Load threads (default one per core)\n"
+		"-S <sessions>           - Concurrent sessions per thread, default 16\n"
+		"-d <seconds>            - Run time per cipher suite, default 5\n"
+		"-n <connections>        - Connections per cipher suite instead of -d\n"
+		"-b <numBytesPerRequest> - Request '/bytes?<n>' after each handshake\n"
+		"                          Default 0, close after the handshake\n"
+		"-m <full,id,ticket>     - Percentages of full handshakes, session id\n"
+		"                          and ticket resumptions, default 50,25,25\n"
+		"-c <cipherList>         - Comma separated list of cipher numbers,\n"
+		"                          each run in turn, default 47\n"
+		"-a <CAfile>             - CA certificates, default the built in\n"
+		"                          test CAs\n"
+		"-k                      - Accept any server certificate chain\n"
+		"-V <tlsVersion>         - '1' TLS 1.0, '2' TLS 1.1, '3' TLS 1.2\n"
+		"                          (default)\n"
+		"-h                      - Help, print usage and exit\n"
+		"\n");
+}
+
+/* Returns number of numbers found, or -1 if an error. */
+#include <ctype.h>
+static int32_t parse_number_list(char *listString, uint16_t array[],
+				uint8_t size_of_array)
+{
+	uint32 count, value;
+	char *endPtr;
+
+	count = 0;
+	while (listString != NULL) {
+		value = strtol(listString, &endPtr, 10);
+		if (endPtr == listString) {
+			printf("The remaining list has no numbers - '%s'\n", listString);
+			return -1;
+		} else if (size_of_array <= count) {
+			printf("Too many numbers supplied.  limit is %d\n",
+				size_of_array);
+			return -1;
+		}
+		array[count++] = value;
+		while (*endPtr != '\0' && !isdigit(*endPtr)) {
+			endPtr++;
+		}
+		listString = endPtr;
+		if (*endPtr == '\0') {
+			break;
+		}
+	}
+	return count;
+}
+
+/* Return 0 on good set of cmd options, return -1 if a bad cmd option is
+   encountered OR a request for help is seen (i.e. '-h' option). */
+static int32 process_cmd_options(int32 argc, char **argv)
+{
+	uint16_t	mix[KIND_COUNT];
+	int			optionChar, n;
+
+	strncpy(g_ip, "127.0.0.1", sizeof(g_ip) - 1);
+	g_port			= HTTPS_PORT;
+	g_threads		= (int)sysconf(_SC_NPROCESSORS_ONLN);
+	g_sessions		= 16;
+	g_seconds		= 5;
+	g_connections	= 0;
+	g_bytes			= 0;
+	g_version		= 3;
+	g_mix[KIND_FULL] = 50;
+	g_mix[KIND_SESSION_ID] = 25;
+	g_mix[KIND_TICKET] = 25;
+	g_cipher[0]		= 47;	/* TLS_RSA_WITH_AES_128_CBC_SHA */
+	g_ciphers		= 1;
+	g_anyCert		= 0;
+
+	opterr = 0;
+	while ((optionChar = getopt(argc, argv, "a:b:c:d:hkm:n:p:s:S:t:V:")) != -1)
+	{
+		switch (optionChar)
+		{
+		case 'h':
+			return -1;
+
+		case 'a':
+			if (strlen(optarg) >= sizeof(g_caFile)) {
+				return -1;
+			}
+			strcpy(g_caFile, optarg);
+			break;
+
+		case 'b':
+			g_bytes = (uint32)strtoul(optarg, NULL, 10);
+			break;
+
+		case 'c':
+			if ((g_ciphers = parse_number_list(optarg, g_cipher,
+					SSL_MAX_DISABLED_CIPHERS)) <= 0) {
+				return -1;
+			}
+			break;
+
+		case 'd':
+			g_seconds = atoi(optarg);
+			break;
+
+		case 'k':
+			g_anyCert = 1;
+			break;
+
+		case 'm':
+			if (parse_number_list(optarg, mix, KIND_COUNT) != KIND_COUNT ||
+					mix[0] + mix[1] + mix[2] != 100) {
+				printf("The mix must be three percentages adding to 100\n");
+				return -1;
+			}
+			for (n = 0; n < KIND_COUNT; n++) {
+				g_mix[n] = mix[n];
+			}
+			break;
+
+		case 'n':
+			g_connections = strtoull(optarg, NULL, 10);
+			break;
+
+		case 'p':
+			g_port = atoi(optarg);
+			break;
+
+		case 's':
+			strncpy(g_ip, optarg, sizeof(g_ip) - 1);
+			break;
+
+		case 'S':
+			g_sessions = atoi(optarg);
+			break;
+
+		case 't':
+			g_threads = atoi(optarg);
+			break;
+
+		case 'V':
+			g_version = atoi(optarg);
+			if (g_version < 1 || g_version > 3) {
+				printf("Invalid version: %d\n", g_version);
+				return -1;
+			}
+			break;
+
+		default:
+			return -1;
+		}
+	}
+	if (g_threads < 1 || g_threads > MAX_THREADS ||
+			g_sessions < 1 || g_sessions > MAX_SESSIONS ||
+			(g_seconds < 1 && g_connections == 0)) {
+		printf("Thread, session or run length out of range\n");
+		return -1;
+	}
+	return 0;
+}
+
+/******************************************************************************/
+/*
+	Main load generator
+	One phase per cipher suite; within a phase every thread keeps its
+	sessions busy until the time or connection count runs out.
+ */
+int32 main(int32 argc, char **argv)
+{
+	loadThread_t	*threads;
+	int32			rc;
+	int				i, c;
+	uint32_t		j;
+
+	g_exitFlag = 0;
+	if (signal(SIGINT, sigintterm_handler) == SIG_ERR ||
+			signal(SIGTERM, sigintterm_handler) == SIG_ERR ||
+			signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+		return PS_PLATFORM_FAIL;
+	}
+	if (0 != process_cmd_options(argc, argv)) {
+		usage();
+		return 0;
+	}
+	memset(&g_addr, 0x0, sizeof(g_addr));
+	g_addr.sin_family = AF_INET;
+	g_addr.sin_port = htons((short)g_port);
+	if (inet_pton(AF_INET, g_ip, &g_addr.sin_addr) != 1) {
+		printf("Invalid server address %s\n", g_ip);
+		return -1;
+	}
+
+	if ((rc = matrixSslOpen()) < 0) {
+		_psTrace("MatrixSSL library init failure.  Exiting\n");
+		return rc;
+	}
+	if (matrixSslNewKeys(&g_keys, NULL) < 0) {
+		return -1;
+	}
+	if ((rc = loadCAs(g_keys)) < 0) {
+		_psTraceInt("Unable to load CA certificates: %d.  Exiting\n", rc);
+		matrixSslDeleteKeys(g_keys);
+		matrixSslClose();
+		return rc;
+	}
+
+	if ((threads = calloc(g_threads, sizeof(loadThread_t))) == NULL) {
+		return PS_MEM_FAIL;
+	}
+	rc = PS_SUCCESS;
+	for (i = 0; i < g_threads && rc == PS_SUCCESS; i++) {
+		threads[i].numSlots = g_sessions;
+		if ((threads[i].efd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+				(threads[i].slots = calloc(g_sessions,
+				sizeof(loadSlot_t))) == NULL) {
+			rc = PS_PLATFORM_FAIL;
+			break;
+		}
+		for (j = 0; j < threads[i].numSlots; j++) {
+			threads[i].slots[j].thread = &threads[i];
+			threads[i].slots[j].fd = INVALID_SOCKET;
+			if (matrixSslNewSessionId(&threads[i].slots[j].sid, NULL) < 0 ||
+					matrixSslNewSessionId(&threads[i].slots[j].ticket,
+					NULL) < 0) {
+				rc = PS_MEM_FAIL;
+				break;
+			}
+		}
+	}
+
+	if (rc == PS_SUCCESS) {
+		printf("Loading %s:%d, %d%% full, %d%% session id, %d%% ticket, "
+			"%u bytes per connection\n\n", g_ip, g_port, g_mix[KIND_FULL],
+			g_mix[KIND_SESSION_ID], g_mix[KIND_TICKET], g_bytes);
+		for (c = 0; c < g_ciphers && !g_exitFlag; c++) {
+			g_phaseCipher = g_cipher[c];
+			if ((rc = runPhase(threads)) < 0) {
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i < g_threads; i++) {
+		if (threads[i].slots) {
+			for (j = 0; j < threads[i].numSlots; j++) {
+				if (threads[i].slots[j].sid) {
+					matrixSslDeleteSessionId(threads[i].slots[j].sid);
+				}
+				if (threads[i].slots[j].ticket) {
+					matrixSslDeleteSessionId(threads[i].slots[j].ticket);
+				}
+			}
+			free(threads[i].slots);
+		}
+		if (threads[i].efd > 0) {
+			close(threads[i].efd);
+		}
+	}
+	free(threads);
+	matrixSslDeleteKeys(g_keys);
+	matrixSslClose();
+	return rc < 0 ? rc : 0;
+}
+
+/* catch ctrl-c or sigterm */
+static void sigintterm_handler(int unused)
+{
+	g_exitFlag = 1; /* Rudimentary exit flagging */
+}
+
+#else
+
+/******************************************************************************/
+/*
+	Stub main for compiling without the needed features
+*/
+int32 main(int32 argc, char **argv)
+{
+	printf("loadClient needs Linux with USE_CLIENT_SIDE_SSL and " \
+			"USE_MULTITHREADING\n");
+	return -1;
+}
+#endif
+
+/******************************************************************************/
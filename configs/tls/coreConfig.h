@@ -70,6 +70,14 @@
 #define USE_MULTITHREADING
 #endif /* NO_MULTITHREADING */
 
+/**
+	Route psMalloc through an instrumented allocator that tracks current and
+	peak usage globally, per accounting pool and per call site. Adds a small
+	header to every allocation; intended for capacity planning and test
+	builds. Set MAX_MEMORY_USAGE to also cap the total allocated bytes.
+*/
+//#define USE_MEMORY_ACCOUNTING
+
 /**
 	Include the psNetwork family of APIs
 
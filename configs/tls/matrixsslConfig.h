@@ -289,6 +289,24 @@ extern "C" {
 #define SSL_SESSION_ENTRY_LIFE (86400*1000)/* one day, in milliseconds */
 #endif
 
+/******************************************************************************/
+/**
+	If CLIENT or CLIENT_AUTH you may cache the result of validating a peer
+	certificate chain.  A later handshake presenting the same chain, checked
+	against the same trusted CAs and expected name, then skips the signature
+	verifications.  CRL revocation status is still determined on every
+	handshake.  Call matrixSslFlushChainCache() after changing trust in any
+	other way, for example on an OCSP update.
+
+	SSL_CHAIN_CACHE_SIZE minimum value is 1
+	SSL_CHAIN_CACHE_LIFE is in milliseconds
+*/
+#if defined(USE_CLIENT_SIDE_SSL) || defined(USE_CLIENT_AUTH)
+//#define USE_CERT_CHAIN_CACHE
+#define SSL_CHAIN_CACHE_SIZE 32
+#define SSL_CHAIN_CACHE_LIFE (3600*1000)/* one hour, in milliseconds */
+#endif
+
 /******************************************************************************/
 /**
 	Use RFC 5077 session resumption mechanism. The SSL_SESSION_ENTRY_LIFE
@@ -298,6 +316,36 @@ extern "C" {
 #define USE_STATELESS_SESSION_TICKETS
 #define SSL_SESSION_TICKET_LIST_LEN 32
 
+/******************************************************************************/
+/**
+	Dynamic record sizing. Sessions that turn it on with the
+	dynamicRecordSize session option send application data in records that
+	fit a single TCP segment, so the peer can decrypt the first bytes as soon
+	as they arrive. After SSL_DRS_BOOST_BYTES have been sent, full size
+	records are used. Small records are used again once the connection has
+	been idle for SSL_DRS_IDLE_MSEC. Each value can be overridden per session.
+
+	SSL_DRS_RECORD_LEN	encoded size of the small records, in bytes
+*/
+#define USE_DYNAMIC_RECORD_SIZING
+#define SSL_DRS_RECORD_LEN		1400
+#define SSL_DRS_BOOST_BYTES		(1024 * 1024)
+#define SSL_DRS_IDLE_MSEC		1000
+
+/******************************************************************************/
+/**
+	Per session statistics. Enables matrixSslRegisterStatCallback() event
+	reporting and the counters returned by matrixSslGetStats(): records and
+	bytes in each direction, time spent in record protection, handshake
+	parsing and writing, key exchange and signature operations, and buffer
+	management.  The counters are updated without locking, and the timers
+	add a clock read around each record, handshake message and public key
+	operation.  On x86_64 Linux a timer pair costs about 100ns per record,
+	under 4% of a 64 byte AES-128-CBC/HMAC-SHA1 record and under 0.1% of a
+	full 16KB one.
+*/
+#define USE_MATRIXSSL_STATS
+
 /******************************************************************************/
 /**
 	The initial buffer sizes for send and receive buffers in each ssl_t session.
@@ -325,6 +373,14 @@ extern "C" {
 #define SSL_DEFAULT_OUT_BUF_SIZE	DTLS_PMTU  /* See PMTU comments above */
 
 //#define DTLS_SEND_RECORDS_INDIVIDUALLY /* Max one record per datagram */
+
+/**
+	Number of records tracked behind the newest one for replay detection.
+	Records further behind are dropped, so links that reorder heavily at
+	high packet rates need a wider window.  Power of two, at least 64.
+	Costs DTLS_REPLAY_WINDOW / 8 bytes per session.
+*/
+#define DTLS_REPLAY_WINDOW	1024
 #endif
 
 #ifdef __cplusplus
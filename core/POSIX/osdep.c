@@ -160,6 +160,11 @@ int64_t psDiffUsecs(psTime_t then, psTime_t now)
 	return (int64_t)(((now - then) * hiresFreq.numer) / (hiresFreq.denom * 1000));
 }
 
+int64_t psDiffNsecs(psTime_t then, psTime_t now)
+{
+	return (int64_t)(((now - then) * hiresFreq.numer) / hiresFreq.denom);
+}
+
 int32 psCompareTime(psTime_t a, psTime_t b, void *userPtr)
 {
 	return a <= b ? 1 : 0;
@@ -209,6 +214,16 @@ int64_t psDiffUsecs(psTime_t then, psTime_t now)
 		((now.tv_nsec - then.tv_nsec)/ 1000);
 }
 
+int64_t psDiffNsecs(psTime_t then, psTime_t now)
+{
+	if (now.tv_nsec < then.tv_nsec) {
+		now.tv_sec--;
+		now.tv_nsec += 1000000000L; /* borrow 1 second worth of nsec */
+	}
+	return ((int64_t)(now.tv_sec - then.tv_sec) * 1000000000L) +
+		(now.tv_nsec - then.tv_nsec);
+}
+
 int32 psCompareTime(psTime_t a, psTime_t b, void *userPtr)
 {
 	/* Time comparison.  1 if 'a' is less than or equal.  0 if 'a' is greater */
@@ -306,16 +321,27 @@ void psDestroyMutex(psMutex_t *mutex)
 
 static int32 urandfd = -1;
 static int32 randfd = -1;
+#ifdef USE_MULTITHREADING
+static psMutex_t entropyLock;	/* Reopening randfd and urandfd */
+#endif
 /*
 	Module open and close
 */
 int osdepEntropyOpen(void)
 {
+#ifdef USE_MULTITHREADING
+	if (psCreateMutex(&entropyLock, 0) < 0) {
+		return PS_PLATFORM_FAIL;
+	}
+#endif
 /*
 	Open /dev/random access non-blocking.
 */
 	if ((urandfd = open("/dev/urandom", O_RDONLY)) < 0) {
 		psErrorInt("open of urandom failed %d\n", urandfd);
+#ifdef USE_MULTITHREADING
+		psDestroyMutex(&entropyLock);
+#endif
 		return PS_PLATFORM_FAIL;
 	}
 /*
@@ -333,6 +359,34 @@ void osdepEntropyClose(void)
 		close(randfd);
 	}
 	close(urandfd);
+#ifdef USE_MULTITHREADING
+	psDestroyMutex(&entropyLock);
+#endif
+}
+
+/*
+	Reopen *fd after a read found 'stale' closed under us.  Threads that
+	hit it together open it once, and 'stale' isn't closed again since its
+	number may already have been reused.
+*/
+static int32 entropyReopen(int32 *fd, int32 stale, const char *path,
+				int flags)
+{
+	int32	rc = PS_SUCCESS;
+
+#ifdef USE_MULTITHREADING
+	psLockMutex(&entropyLock);
+#endif
+	if (*fd == stale) {
+		*fd = open(path, flags);
+	}
+	if (*fd < 0) {
+		rc = PS_PLATFORM_FAIL;
+	}
+#ifdef USE_MULTITHREADING
+	psUnlockMutex(&entropyLock);
+#endif
+	return rc;
 }
 
 /*
@@ -344,13 +398,14 @@ int32 psGetEntropy(unsigned char *bytes, uint32 size, void *userPtr)
 	Read from /dev/random non-blocking first, then from urandom if it would
 	block.  Also, handle file closure case and re-open.
 */
-	int32			rc, sanity, retry, readBytes;
+	int32			rc, sanity, retry, readBytes, fd;
 	unsigned char 	*where = bytes;
 
 	sanity = retry = rc = readBytes = 0;
 
 	while (size) {
-		if ((rc = read(randfd, where, size)) < 0 || sanity > MAX_RAND_READS) {
+		fd = randfd;
+		if ((rc = read(fd, where, size)) < 0 || sanity > MAX_RAND_READS) {
 			if (errno == EINTR) {
 				if (sanity > MAX_RAND_READS) {
 					psTraceCore("psGetEntropy failed randfd sanity\n");
@@ -361,8 +416,8 @@ int32 psGetEntropy(unsigned char *bytes, uint32 size, void *userPtr)
 			} else if (errno == EAGAIN) {
 				break;
 			} else if (errno == EBADF && retry == 0) {
-				close(randfd);
-				if ((randfd = open("/dev/random", O_RDONLY | O_NONBLOCK)) < 0) {
+				if (entropyReopen(&randfd, fd, "/dev/random",
+						O_RDONLY | O_NONBLOCK) < 0) {
 					break;
 				}
 				retry++;
@@ -378,7 +433,8 @@ int32 psGetEntropy(unsigned char *bytes, uint32 size, void *userPtr)
 
 	sanity = retry = 0;
 	while (size) {
-		if ((rc = read(urandfd, where, size)) < 0 || sanity > MAX_RAND_READS) {
+		fd = urandfd;
+		if ((rc = read(fd, where, size)) < 0 || sanity > MAX_RAND_READS) {
 			if (errno == EINTR) {
 				if (sanity > MAX_RAND_READS) {
 					psTraceCore("psGetEntropy failed urandfd sanity\n");
@@ -387,9 +443,8 @@ int32 psGetEntropy(unsigned char *bytes, uint32 size, void *userPtr)
 				sanity++;
 				continue;
 			} else if (errno == EBADF && retry == 0) {
-				close(urandfd);
-				if ((urandfd =
-						open("/dev/urandom", O_RDONLY | O_NONBLOCK)) < 0) {
+				if (entropyReopen(&urandfd, fd, "/dev/urandom",
+						O_RDONLY | O_NONBLOCK) < 0) {
 					psTraceCore("psGetEntropy failed urandom open\n");
 					return PS_PLATFORM_FAIL;
 				}
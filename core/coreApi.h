@@ -179,7 +179,11 @@ extern psPool_t * const psStaticAllocationsPool;
 #else
  #define FILESYSTEM_CONFIG_STR "N"
 #endif
+#ifdef USE_MEMORY_ACCOUNTING
+ #define PSMALLOC_CONFIG_STR "Y"
+#else
  #define PSMALLOC_CONFIG_STR "N"
+#endif
 #ifdef USE_MULTITHREADING
  #define MULTITHREAD_CONFIG_STR "Y"
 #else
@@ -88,6 +88,17 @@ int32 psCoreOpen(const char *config)
 	}
 #endif /* USE_MULTITHREADING */
 
+	if (psOpenMalloc() < 0) {
+		psTraceCore("psOpenMalloc failed\n");
+#ifdef USE_MULTITHREADING
+		psDestroyMutex(&corelibMutex);
+		osdepMutexClose();
+#endif /* USE_MULTITHREADING */
+		osdepEntropyClose();
+		osdepTimeClose();
+		return PS_FAILURE;
+	}
+
 	return PS_SUCCESS;
 }
 
@@ -97,6 +108,8 @@ void psCoreClose(void)
 	if (*g_config == 'Y') {
 		*g_config = 'N';
 
+		psCloseMalloc();
+
 #ifdef USE_MULTITHREADING
 		psDestroyMutex(&corelibMutex);
 		osdepMutexClose();
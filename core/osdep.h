@@ -318,6 +318,7 @@ extern errno_t memset_s(void *s, rsize_t smax, int c, rsize_t n);
    typedef struct timespec psTime_t;
   #endif
   extern int64_t psDiffUsecs(psTime_t then, psTime_t now);
+  extern int64_t psDiffNsecs(psTime_t then, psTime_t now);
  #endif
 #elif defined(WIN32)
  typedef LARGE_INTEGER psTime_t;
@@ -0,0 +1,422 @@
+/**
+ *	@file    psmalloc.c
+ *	@version ee35b93 (HEAD -> master)
+ *
+ *	Instrumented psMalloc implementation for memory accounting.
+ */
+/*
+ *	Copyright (c) 2013-2016 INSIDE Secure Corporation
+ *	Copyright (c) PeerSec Networks, 2002-2011
+ *	All Rights Reserved
+ *
+ *	The latest version of this code is available at http://www.matrixssl.org
+ *
+ *	This software is open source; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This General Public License does NOT permit incorporating this software
+ *	into proprietary programs.  If you are unable to comply with the GPL, a
+ *	commercial license for this software may be purchased from INSIDE at
+ *	http://www.insidesecure.com/
+ *
+ *	This program is distributed in WITHOUT ANY WARRANTY; without even the
+ *	implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *	See the GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *	http://www.gnu.org/copyleft/gpl.html
+ */
+/******************************************************************************/
+
+#include "coreApi.h"
+
+#ifdef USE_MEMORY_ACCOUNTING
+
+/* Number of distinct allocation sites tracked. Allocations from sites that
+   do not fit in the table are charged to entry 0. */
+#define PS_MEM_SITES		1024
+
+#define PS_MEM_POOL_MAGIC	0x4D504F4FU	/* 'MPOO' */
+#define PS_MEM_BLOCK_MAGIC	0x4D424C4BU	/* 'MBLK' */
+
+typedef struct {
+	const char		*file;
+	int				line;
+	psMemStats_t	stats;
+} psMemSite_t;
+
+typedef struct {
+	psPool_t		*pool;
+	size_t			size;
+	uint32_t		site;
+	uint32_t		magic;
+} psMemHdr_t;
+
+/* Keep the user pointer aligned as malloc() would */
+#define PS_MEM_HDR_LEN	((sizeof(psMemHdr_t) + 15) & ~(size_t)15)
+
+static psMemStats_t	g_memStats;
+static size_t		g_memReserved;	/* Past the limit check, not yet charged */
+static psMemSite_t	g_memSites[PS_MEM_SITES];
+
+#ifdef USE_MULTITHREADING
+static psMutex_t	g_memLock;
+static int			g_memLockReady = 0;
+#define MEM_LOCK()		do { if (g_memLockReady) psLockMutex(&g_memLock); } while(0)
+#define MEM_UNLOCK()	do { if (g_memLockReady) psUnlockMutex(&g_memLock); } while(0)
+#else
+#define MEM_LOCK()		do { } while(0)
+#define MEM_UNLOCK()	do { } while(0)
+#endif /* USE_MULTITHREADING */
+
+/******************************************************************************/
+/*
+	Only pools created by psMemPoolOpen() are charged. The static allocations
+	pool marker and NULL are valid pool values that only hit global counters.
+	The marker is only pointer sized, so magic must stay the first member.
+*/
+static int isAccountingPool(const psPool_t *pool)
+{
+	if (pool == NULL || pool == psStaticAllocationsPool) {
+		return 0;
+	}
+	return pool->magic == PS_MEM_POOL_MAGIC;
+}
+
+static uint32_t siteIndex(const char *file, int line)
+{
+	uint32_t	h, i, n;
+
+	h = (uint32_t)(((uintptr_t)file >> 3) * 31 + (uint32_t)line);
+	for (n = 0; n < PS_MEM_SITES - 1; n++) {
+		i = 1 + (h + n) % (PS_MEM_SITES - 1);
+		if (g_memSites[i].file == file && g_memSites[i].line == line) {
+			return i;
+		}
+		if (g_memSites[i].file == NULL) {
+			g_memSites[i].file = file;
+			g_memSites[i].line = line;
+			return i;
+		}
+	}
+	return 0;
+}
+
+static void statAdd(psMemStats_t *s, size_t size)
+{
+	s->current += size;
+	s->total += size;
+	if (s->current > s->peak) {
+		s->peak = s->current;
+	}
+}
+
+static void statAlloc(psMemStats_t *s, size_t size)
+{
+	statAdd(s, size);
+	s->allocs++;
+	s->live++;
+}
+
+static void statFree(psMemStats_t *s, size_t size)
+{
+	s->current -= size;
+	s->frees++;
+	s->live--;
+}
+
+/* Caller holds the lock */
+static void chargeAlloc(psMemHdr_t *hdr)
+{
+	statAlloc(&g_memStats, hdr->size);
+	statAlloc(&g_memSites[hdr->site].stats, hdr->size);
+	if (hdr->pool) {
+		statAlloc(&hdr->pool->stats, hdr->size);
+	}
+}
+
+/* Caller holds the lock. Returns a closed pool that has become empty. */
+static psPool_t *chargeFree(psMemHdr_t *hdr)
+{
+	psPool_t	*pool = hdr->pool;
+
+	statFree(&g_memStats, hdr->size);
+	statFree(&g_memSites[hdr->site].stats, hdr->size);
+	if (pool) {
+		statFree(&pool->stats, hdr->size);
+		if (pool->closed && pool->stats.live == 0) {
+			return pool;
+		}
+	}
+	return NULL;
+}
+
+/*
+	Caller holds the lock.  Bytes that pass the limit are held in
+	g_memReserved until the allocation is charged or fails, so concurrent
+	callers that release the lock around malloc can't all pass together.
+*/
+static int32 reserve(size_t size)
+{
+#if MAX_MEMORY_USAGE > 0
+	if (g_memStats.current + g_memReserved + size >
+			(size_t)MAX_MEMORY_USAGE) {
+		g_memStats.failed++;
+		return PS_MEM_FAIL;
+	}
+#endif
+	g_memReserved += size;
+	return PS_SUCCESS;
+}
+
+/* Caller holds the lock */
+static void unreserve(size_t size)
+{
+	g_memReserved -= size;
+}
+
+/******************************************************************************/
+/*
+	Called from psCoreOpen()
+*/
+int32 psOpenMalloc(void)
+{
+#ifdef USE_MULTITHREADING
+	if (!g_memLockReady) {
+		if (psCreateMutex(&g_memLock, 0) < 0) {
+			return PS_PLATFORM_FAIL;
+		}
+		g_memLockReady = 1;
+	}
+#endif /* USE_MULTITHREADING */
+	return PS_SUCCESS;
+}
+
+void psCloseMalloc(void)
+{
+#ifdef USE_MULTITHREADING
+	if (g_memLockReady) {
+		g_memLockReady = 0;
+		psDestroyMutex(&g_memLock);
+	}
+#endif /* USE_MULTITHREADING */
+}
+
+/******************************************************************************/
+
+void *psMallocAccounted(psPool_t *pool, size_t size, const char *file, int line)
+{
+	psMemHdr_t	*hdr;
+
+	MEM_LOCK();
+	if (reserve(size) < 0) {
+		MEM_UNLOCK();
+		return NULL;
+	}
+	MEM_UNLOCK();
+	hdr = malloc(PS_MEM_HDR_LEN + size);
+	MEM_LOCK();
+	unreserve(size);
+	if (hdr == NULL) {
+		g_memStats.failed++;
+		MEM_UNLOCK();
+		return NULL;
+	}
+	hdr->pool = isAccountingPool(pool) ? pool : NULL;
+	hdr->size = size;
+	hdr->magic = PS_MEM_BLOCK_MAGIC;
+	hdr->site = siteIndex(file, line);
+	chargeAlloc(hdr);
+	MEM_UNLOCK();
+	return (unsigned char *)hdr + PS_MEM_HDR_LEN;
+}
+
+void *psCallocAccounted(psPool_t *pool, size_t n, size_t size,
+				const char *file, int line)
+{
+	void	*p;
+
+	if (size != 0 && n > ((size_t)-1 - PS_MEM_HDR_LEN) / size) {
+		return NULL;
+	}
+	if ((p = psMallocAccounted(pool, n * size, file, line)) != NULL) {
+		memset(p, 0x0, n * size);
+	}
+	return p;
+}
+
+void *psReallocAccounted(void *ptr, size_t size, psPool_t *pool,
+				const char *file, int line)
+{
+	psMemHdr_t	*hdr, *nhdr;
+	psPool_t	*empty;
+	size_t		grow;
+
+	if (ptr == NULL) {
+		return psMallocAccounted(pool, size, file, line);
+	}
+	hdr = (psMemHdr_t *)((unsigned char *)ptr - PS_MEM_HDR_LEN);
+	psAssert(hdr->magic == PS_MEM_BLOCK_MAGIC);
+	grow = size > hdr->size ? size - hdr->size : 0;
+	MEM_LOCK();
+	if (reserve(grow) < 0) {
+		MEM_UNLOCK();
+		return NULL;
+	}
+	MEM_UNLOCK();
+	nhdr = realloc(hdr, PS_MEM_HDR_LEN + size);
+	MEM_LOCK();
+	unreserve(grow);
+	if (nhdr == NULL) {
+		g_memStats.failed++;
+		MEM_UNLOCK();
+		return NULL;
+	}
+	/* Recharge the block to the reallocating call site */
+	empty = chargeFree(nhdr);
+	nhdr->size = size;
+	nhdr->site = siteIndex(file, line);
+	if (empty) {
+		nhdr->pool = NULL;
+	}
+	chargeAlloc(nhdr);
+	MEM_UNLOCK();
+	if (empty) {
+		memset(empty, 0x0, sizeof(psPool_t));
+		free(empty);
+	}
+	return (unsigned char *)nhdr + PS_MEM_HDR_LEN;
+}
+
+void psFreeAccounted(void *ptr)
+{
+	psMemHdr_t	*hdr;
+	psPool_t	*empty;
+
+	if (ptr == NULL) {
+		return;
+	}
+	hdr = (psMemHdr_t *)((unsigned char *)ptr - PS_MEM_HDR_LEN);
+	psAssert(hdr->magic == PS_MEM_BLOCK_MAGIC);
+	MEM_LOCK();
+	empty = chargeFree(hdr);
+	MEM_UNLOCK();
+	hdr->magic = 0;
+	free(hdr);
+	if (empty) {
+		memset(empty, 0x0, sizeof(psPool_t));
+		free(empty);
+	}
+}
+
+/******************************************************************************/
+/*
+	Create an accounting pool. Allocations made with the returned pool are
+	charged to it in addition to the global counters. The pool itself is not
+	charged.
+*/
+psPool_t *psMemPoolOpen(const char *name)
+{
+	psPool_t	*pool;
+
+	if ((pool = malloc(sizeof(psPool_t))) == NULL) {
+		return NULL;
+	}
+	memset(pool, 0x0, sizeof(psPool_t));
+	pool->magic = PS_MEM_POOL_MAGIC;
+	pool->name = name;
+	return pool;
+}
+
+/*
+	Close an accounting pool. Blocks still outstanding keep the pool alive
+	until the last of them is freed, so closing never invalidates them.
+*/
+void psMemPoolClose(psPool_t *pool)
+{
+	if (!isAccountingPool(pool)) {
+		return;
+	}
+	MEM_LOCK();
+	pool->closed = 1;
+	if (pool->stats.live != 0) {
+		pool = NULL;
+	}
+	MEM_UNLOCK();
+	if (pool) {
+		memset(pool, 0x0, sizeof(psPool_t));
+		free(pool);
+	}
+}
+
+/*
+	Snapshot the counters of a pool, or the global counters if pool is NULL.
+*/
+int32 psMemGetStats(const psPool_t *pool, psMemStats_t *stats)
+{
+	if (stats == NULL) {
+		return PS_ARG_FAIL;
+	}
+	if (pool == NULL) {
+		MEM_LOCK();
+		*stats = g_memStats;
+		MEM_UNLOCK();
+		return PS_SUCCESS;
+	}
+	if (!isAccountingPool(pool)) {
+		memset(stats, 0x0, sizeof(psMemStats_t));
+		return PS_ARG_FAIL;
+	}
+	MEM_LOCK();
+	*stats = pool->stats;
+	MEM_UNLOCK();
+	return PS_SUCCESS;
+}
+
+/*
+	Restart high water tracking from the current usage of a pool, or of the
+	global and per-site counters if pool is NULL.
+*/
+void psMemResetPeak(psPool_t *pool)
+{
+	uint32_t	i;
+
+	MEM_LOCK();
+	if (pool == NULL) {
+		g_memStats.peak = g_memStats.current;
+		for (i = 0; i < PS_MEM_SITES; i++) {
+			g_memSites[i].stats.peak = g_memSites[i].stats.current;
+		}
+	} else if (isAccountingPool(pool)) {
+		pool->stats.peak = pool->stats.current;
+	}
+	MEM_UNLOCK();
+}
+
+/*
+	Report every call site that has allocated memory. A reallocation charges
+	the block to the call site that resized it.
+*/
+void psMemWalkSites(psMemSiteCb_t cb, void *arg)
+{
+	uint32_t		i;
+	psMemSite_t		site;
+
+	for (i = 0; i < PS_MEM_SITES; i++) {
+		MEM_LOCK();
+		site = g_memSites[i];
+		MEM_UNLOCK();
+		if (site.stats.allocs == 0) {
+			continue;
+		}
+		cb(site.file ? site.file : "<other>", site.line, &site.stats, arg);
+	}
+}
+
+#endif /* USE_MEMORY_ACCOUNTING */
+
+/******************************************************************************/
@@ -60,7 +60,16 @@
 */
 #include <stdlib.h> 		/* malloc, free, etc... */
 
+/*
+	Upper bound in bytes for all memory allocated through psMalloc.
+	Only enforced by the instrumented allocator (USE_MEMORY_ACCOUNTING),
+	0 means unlimited.
+*/
+#ifndef MAX_MEMORY_USAGE
 #define MAX_MEMORY_USAGE	0
+#endif
+
+#ifndef USE_MEMORY_ACCOUNTING
 #define psOpenMalloc()		0
 #define psCloseMalloc()
 #define psDefineHeap(A, B)
@@ -72,9 +81,71 @@
 #define psFree(A, B)		free(A)
 #define psMemset			memset
 #define psMemcpy			memcpy
+#define psMemPoolOpen(A)	NULL
+#define psMemPoolClose(A)
 
 typedef int32 psPool_t;
 
+#else /* USE_MEMORY_ACCOUNTING */
+/******************************************************************************/
+/*
+	Instrumented memory routines
+	Every block carries a small header recording its size, the accounting
+	pool it was charged to and the call site that allocated it, so current
+	and peak usage can be reported globally, per pool and per call site.
+	Pools are created with psMemPoolOpen(). Any other pool pointer
+	(including NULL) charges the global counters only.
+*/
+typedef struct {
+	size_t		current;	/**< Bytes currently allocated */
+	size_t		peak;		/**< High water of current */
+	size_t		total;		/**< Cumulative bytes allocated */
+	uint32_t	allocs;		/**< Number of allocations */
+	uint32_t	frees;		/**< Number of frees */
+	uint32_t	live;		/**< Allocations not yet freed */
+	uint32_t	failed;		/**< Allocations refused or failed */
+} psMemStats_t;
+
+/* Accounting pool. Treat as opaque, use psMemGetStats() for the counters. */
+typedef struct psPool {
+	uint32_t		magic;
+	uint32_t		closed;
+	const char		*name;
+	psMemStats_t	stats;
+} psPool_t;
+
+/** Callback for psMemWalkSites(). */
+typedef void (*psMemSiteCb_t)(const char *file, int line,
+					const psMemStats_t *stats, void *arg);
+
+extern int32	psOpenMalloc(void);
+extern void		psCloseMalloc(void);
+extern void		*psMallocAccounted(psPool_t *pool, size_t size,
+					const char *file, int line);
+extern void		*psCallocAccounted(psPool_t *pool, size_t n, size_t size,
+					const char *file, int line);
+extern void		*psReallocAccounted(void *ptr, size_t size, psPool_t *pool,
+					const char *file, int line);
+extern void		psFreeAccounted(void *ptr);
+
+PSPUBLIC psPool_t	*psMemPoolOpen(const char *name);
+PSPUBLIC void		psMemPoolClose(psPool_t *pool);
+PSPUBLIC int32		psMemGetStats(const psPool_t *pool, psMemStats_t *stats);
+PSPUBLIC void		psMemResetPeak(psPool_t *pool);
+PSPUBLIC void		psMemWalkSites(psMemSiteCb_t cb, void *arg);
+
+#define psDefineHeap(A, B)
+#define psAddPoolCache(A, B)
+#define psMalloc(A, B)		psMallocAccounted(A, B, __FILE__, __LINE__)
+#define psCalloc(A, B, C)	psCallocAccounted(A, B, C, __FILE__, __LINE__)
+#define psMallocNoPool(B)	psMallocAccounted(NULL, B, __FILE__, __LINE__)
+#define psRealloc(A, B, C)	psReallocAccounted(A, B, C, __FILE__, __LINE__)
+#define psFree(A, B)		psFreeAccounted(A)
+#define psMemset			memset
+#define psMemcpy			memcpy
+
+#endif /* USE_MEMORY_ACCOUNTING */
+
 /******************************************************************************/
 
 #endif /* !PS_UNSUPPORTED_OS */
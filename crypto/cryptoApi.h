@@ -396,6 +396,12 @@ PSPUBLIC void psHmacUpdate(psHmac_t *ctx,
 				const unsigned char *buf, uint32_t len);
 PSPUBLIC void psHmacFinal(psHmac_t *ctx,
 				unsigned char hash[MAX_HASHLEN]);
+/* An initialized context may be copied before Update to reuse its key
+   without recomputing the ipad/opad hash states. */
+static __inline void psHmacCpy(psHmac_t *d, const psHmac_t *s)
+{
+	memcpy(d, s, sizeof(psHmac_t));
+}
 
 #ifdef USE_HMAC_MD5
 /******************************************************************************/
@@ -409,6 +415,10 @@ PSPUBLIC void psHmacMd5Update(psHmacMd5_t *ctx,
 				const unsigned char *buf, uint32_t len);
 PSPUBLIC void psHmacMd5Final(psHmacMd5_t *ctx,
 				unsigned char hash[MD5_HASHLEN]);
+static __inline void psHmacMd5Cpy(psHmacMd5_t *d, const psHmacMd5_t *s)
+{
+	memcpy(d, s, sizeof(psHmacMd5_t));
+}
 #endif
 
 #ifdef USE_HMAC_SHA1
@@ -430,6 +440,10 @@ PSPUBLIC void psHmacSha1Update(psHmacSha1_t *ctx,
 				const unsigned char *buf, uint32_t len);
 PSPUBLIC void psHmacSha1Final(psHmacSha1_t *ctx,
 				unsigned char hash[SHA1_HASHLEN]);
+static __inline void psHmacSha1Cpy(psHmacSha1_t *d, const psHmacSha1_t *s)
+{
+	memcpy(d, s, sizeof(psHmacSha1_t));
+}
 #endif
 
 #ifdef USE_HMAC_SHA256
@@ -452,6 +466,10 @@ PSPUBLIC void psHmacSha256Update(psHmacSha256_t *ctx,
 				const unsigned char *buf, uint32_t len);
 PSPUBLIC void psHmacSha256Final(psHmacSha256_t *ctx,
 				unsigned char hash[SHA256_HASHLEN]);
+static __inline void psHmacSha256Cpy(psHmacSha256_t *d, const psHmacSha256_t *s)
+{
+	memcpy(d, s, sizeof(psHmacSha256_t));
+}
 #endif
 #ifdef USE_HMAC_SHA384
 /******************************************************************************/
@@ -465,6 +483,10 @@ PSPUBLIC void psHmacSha384Update(psHmacSha384_t *ctx,
 				const unsigned char *buf, uint32_t len);
 PSPUBLIC void psHmacSha384Final(psHmacSha384_t *ctx,
 				unsigned char hash[SHA384_HASHLEN]);
+static __inline void psHmacSha384Cpy(psHmacSha384_t *d, const psHmacSha384_t *s)
+{
+	memcpy(d, s, sizeof(psHmacSha384_t));
+}
 #endif
 
 /******************************************************************************/
@@ -687,6 +709,12 @@ PSPUBLIC int32 psX509GetCertPublicKeyDer(psX509Cert_t *cert,
 PSPUBLIC int32 psX509AuthenticateCert(psPool_t *pool, psX509Cert_t *subjectCert,
 					psX509Cert_t *issuerCert, psX509Cert_t **foundIssuer,
 					void *hwCtx, void *poolUserPtr);
+PSPUBLIC int32_t psX509DecodeExtensions(psX509Cert_t *cert);
+PSPUBLIC int32 psX509IndexCerts(psPool_t *pool, psX509Cert_t *certs,
+					psX509CertIndex_t *idx);
+PSPUBLIC void psX509FreeCertIndex(psX509CertIndex_t *idx);
+PSPUBLIC psX509Cert_t *psX509FindIssuer(const psX509CertIndex_t *idx,
+					const psX509Cert_t *subject, uint32_t *pos);
 #endif
 #ifdef USE_CRL
 #define CRL_CHECK_EXPECTED	5 /* cert had a dist point but not fetched yet */
@@ -705,6 +733,24 @@ PSPUBLIC int32_t psX509GetCRLdistURL(psX509Cert_t *cert, char **url,
 					uint32_t *urlLen);
 PSPUBLIC int32_t psX509AuthenticateCRL(psX509Cert_t *CA, psX509Crl_t *CRL,
 					void *poolUserPtr);
+PSPUBLIC int32_t psX509CrlStreamInit(psPool_t *pool, psX509CrlStream_t *ctx);
+PSPUBLIC int32_t psX509CrlStreamUpdate(psX509CrlStream_t *ctx,
+					const unsigned char *in, uint32_t inLen);
+PSPUBLIC int32_t psX509CrlStreamFinal(psX509CrlStream_t *ctx,
+					psX509Crl_t **crl);
+PSPUBLIC void	 psX509CrlStreamFree(psX509CrlStream_t *ctx);
+#ifdef MATRIX_USE_FILE_SYSTEM
+PSPUBLIC int32_t psX509ParseCRLFile(psPool_t *pool, const char *fileName,
+					psX509Crl_t **crl);
+#ifdef USE_HMAC_SHA256
+PSPUBLIC int32_t psX509WriteCRLIndex(const psX509Crl_t *crl,
+					const char *fileName,
+					const unsigned char *key, uint16_t keyLen);
+PSPUBLIC int32_t psX509LoadCRLIndex(psPool_t *pool, const char *fileName,
+					const unsigned char *key, uint16_t keyLen,
+					psX509Crl_t **crl);
+#endif
+#endif /* MATRIX_USE_FILE_SYSTEM */
 
 /* CRL global cache management */
 PSPUBLIC int psCRL_Update(psX509Crl_t *crl, int deleteExisting);
@@ -716,6 +762,9 @@ PSPUBLIC void psCRL_DeleteAll();
 PSPUBLIC psX509Crl_t* psCRL_GetCRLForCert(psX509Cert_t *cert);
 PSPUBLIC int32_t psCRL_isRevoked(psX509Cert_t *cert, psX509Crl_t *CRL);
 PSPUBLIC int32_t psCRL_determineRevokedStatus(psX509Cert_t *cert);
+#ifdef USE_MEMORY_ACCOUNTING
+PSPUBLIC int32_t psCRL_GetMemStats(psMemStats_t *stats);
+#endif
 
 #endif /* USE_CRL */
 #endif /* USE_X509 */
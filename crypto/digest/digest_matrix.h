@@ -120,32 +120,36 @@ typedef struct {
 #endif
 
 /******************************************************************************/
-
+/*
+	HMAC contexts hold both keyed hash states so that an initialized context
+	can be copied (psHmac*Cpy) to MAC further messages under the same key
+	without hashing the ipad and opad blocks again.
+*/
 #ifdef USE_MATRIX_HMAC_MD5
 typedef struct {
-	unsigned char		pad[64];
-	psMd5_t				md5;
+	psMd5_t				md5;	/* Inner hash, keyed with key ^ ipad */
+	psMd5_t				outer;	/* Outer hash, keyed with key ^ opad */
 } psHmacMd5_t;
 #endif
 
 #ifdef USE_MATRIX_HMAC_SHA1
 typedef struct {
-	unsigned char		pad[64];
-	psSha1_t			sha1;
+	psSha1_t			sha1;	/* Inner hash, keyed with key ^ ipad */
+	psSha1_t			outer;	/* Outer hash, keyed with key ^ opad */
 } psHmacSha1_t;
 #endif
 
 #ifdef USE_MATRIX_HMAC_SHA256
 typedef struct {
-	unsigned char		pad[64];
-	psSha256_t			sha256;
+	psSha256_t			sha256;	/* Inner hash, keyed with key ^ ipad */
+	psSha256_t			outer;	/* Outer hash, keyed with key ^ opad */
 } psHmacSha256_t;
 #endif
 
 #ifdef USE_MATRIX_HMAC_SHA384
 typedef struct {
-	unsigned char		pad[128];
-	psSha384_t			sha384;
+	psSha384_t			sha384;	/* Inner hash, keyed with key ^ ipad */
+	psSha384_t			outer;	/* Outer hash, keyed with key ^ opad */
 } psHmacSha384_t;
 #endif
 
@@ -180,28 +180,36 @@ int32_t psHmacMd5(const unsigned char *key, uint16_t keyLen,
 int32_t psHmacMd5Init(psHmacMd5_t *ctx,
 				const unsigned char *key, uint16_t keyLen)
 {
-	int32_t		rc, i;
+	unsigned char	pad[64];
+	int32_t			rc, i;
 
 #ifdef CRYPTO_ASSERT
 	psAssert(keyLen <= 64);
 #endif
 	for (i = 0; (uint32)i < keyLen; i++) {
-		ctx->pad[i] = key[i] ^ 0x36;
+		pad[i] = key[i] ^ 0x36;
 	}
 	for (i = keyLen; i < 64; i++) {
-		ctx->pad[i] = 0x36;
+		pad[i] = 0x36;
 	}
 	if ((rc = psMd5Init(&ctx->md5)) < 0) {
-		return rc;
+		goto L_RETURN;
 	}
-	psMd5Update(&ctx->md5, ctx->pad, 64);
+	psMd5Update(&ctx->md5, pad, 64);
 	for (i = 0; (uint32)i < keyLen; i++) {
-		ctx->pad[i] = key[i] ^ 0x5c;
+		pad[i] = key[i] ^ 0x5c;
 	}
 	for (i = keyLen; i < 64; i++) {
-		ctx->pad[i] = 0x5c;
+		pad[i] = 0x5c;
 	}
-	return PS_SUCCESS;
+	if ((rc = psMd5Init(&ctx->outer)) < 0) {
+		goto L_RETURN;
+	}
+	psMd5Update(&ctx->outer, pad, 64);
+	rc = PS_SUCCESS;
+L_RETURN:
+	memzero_s(pad, sizeof(pad));
+	return rc;
 }
 
 void psHmacMd5Update(psHmacMd5_t *ctx,
@@ -215,7 +223,6 @@ void psHmacMd5Update(psHmacMd5_t *ctx,
 
 void psHmacMd5Final(psHmacMd5_t *ctx, unsigned char hash[MD5_HASHLEN])
 {
-	int32_t		rc;
 #ifdef CRYPTO_ASSERT
 	psAssert(ctx != NULL);
 	if (hash == NULL) {
@@ -224,18 +231,10 @@ void psHmacMd5Final(psHmacMd5_t *ctx, unsigned char hash[MD5_HASHLEN])
 	}
 #endif
 	psMd5Final(&ctx->md5, hash);
-
-	/* This Init should succeed, even if it allocates memory since an 
-		psMd5_t was just Finalized the line above */
-	if ((rc = psMd5Init(&ctx->md5)) < 0) {
-		psAssert(rc >= 0);
-		return;
-	}
-	psMd5Update(&ctx->md5, ctx->pad, 64);
-	psMd5Update(&ctx->md5, hash, MD5_HASHLEN);
-	psMd5Final(&ctx->md5, hash);
-
-	memset(ctx->pad, 0x0, sizeof(ctx->pad));
+	psMd5Update(&ctx->outer, hash, MD5_HASHLEN);
+	psMd5Final(&ctx->outer, hash);
+	/* Both keyed states are spent; don't leave them in this copy */
+	memzero_s(ctx, sizeof(psHmacMd5_t));
 }
 
 #endif /* USE_MATRIX_HMAC_MD5 */
@@ -291,27 +290,36 @@ int32_t psHmacSha1(const unsigned char *key, uint16_t keyLen,
 int32_t psHmacSha1Init(psHmacSha1_t *ctx,
 				const unsigned char *key, uint16_t keyLen)
 {
-	int32_t		rc, i;
+	unsigned char	pad[64];
+	int32_t			rc, i;
+
 #ifdef CRYPTO_ASSERT
 	psAssert(keyLen <= 64);
 #endif
 	for (i = 0; (uint32)i < keyLen; i++) {
-		ctx->pad[i] = key[i] ^ 0x36;
+		pad[i] = key[i] ^ 0x36;
 	}
-	for (i = keyLen; (uint32)i < 64; i++) {
-		ctx->pad[i] = 0x36;
+	for (i = keyLen; i < 64; i++) {
+		pad[i] = 0x36;
 	}
 	if ((rc = psSha1Init(&ctx->sha1)) < 0) {
-		return rc;
+		goto L_RETURN;
 	}
-	psSha1Update(&ctx->sha1, ctx->pad, 64);
+	psSha1Update(&ctx->sha1, pad, 64);
 	for (i = 0; (uint32)i < keyLen; i++) {
-		ctx->pad[i] = key[i] ^ 0x5c;
+		pad[i] = key[i] ^ 0x5c;
 	}
 	for (i = keyLen; i < 64; i++) {
-		ctx->pad[i] = 0x5c;
+		pad[i] = 0x5c;
 	}
-	return PS_SUCCESS;
+	if ((rc = psSha1Init(&ctx->outer)) < 0) {
+		goto L_RETURN;
+	}
+	psSha1Update(&ctx->outer, pad, 64);
+	rc = PS_SUCCESS;
+L_RETURN:
+	memzero_s(pad, sizeof(pad));
+	return rc;
 }
 
 void psHmacSha1Update(psHmacSha1_t *ctx,
@@ -325,7 +333,6 @@ void psHmacSha1Update(psHmacSha1_t *ctx,
 
 void psHmacSha1Final(psHmacSha1_t *ctx, unsigned char hash[SHA1_HASHLEN])
 {
-	int32_t		rc;
 #ifdef CRYPTO_ASSERT
 	psAssert(ctx != NULL);
 	if (hash == NULL) {
@@ -334,16 +341,10 @@ void psHmacSha1Final(psHmacSha1_t *ctx, unsigned char hash[SHA1_HASHLEN])
 	}
 #endif
 	psSha1Final(&ctx->sha1, hash);
-
-	if ((rc = psSha1Init(&ctx->sha1)) < 0) {
-		psAssert(rc >= 0);
-		return;
-	}
-	psSha1Update(&ctx->sha1, ctx->pad, 64);
-	psSha1Update(&ctx->sha1, hash, SHA1_HASHLEN);
-	psSha1Final(&ctx->sha1, hash);
-
-	memset(ctx->pad, 0x0, sizeof(ctx->pad));
+	psSha1Update(&ctx->outer, hash, SHA1_HASHLEN);
+	psSha1Final(&ctx->outer, hash);
+	/* Both keyed states are spent; don't leave them in this copy */
+	memzero_s(ctx, sizeof(psHmacSha1_t));
 }
 
 #endif /* USE_MATRIX_HMAC_SHA1 */
@@ -397,28 +398,36 @@ int32_t psHmacSha256(const unsigned char *key, uint16_t keyLen,
 int32_t psHmacSha256Init(psHmacSha256_t *ctx,
 				const unsigned char *key, uint16_t keyLen)
 {
-	int32_t		rc, i, padLen = 64;
+	unsigned char	pad[64];
+	int32_t			rc, i;
 
 #ifdef CRYPTO_ASSERT
-	psAssert(keyLen <= (uint32)padLen);
+	psAssert(keyLen <= 64);
 #endif
 	for (i = 0; (uint32)i < keyLen; i++) {
-		ctx->pad[i] = key[i] ^ 0x36;
+		pad[i] = key[i] ^ 0x36;
 	}
-	for (i = keyLen; i < padLen; i++) {
-		ctx->pad[i] = 0x36;
+	for (i = keyLen; i < 64; i++) {
+		pad[i] = 0x36;
 	}
 	if ((rc = psSha256Init(&ctx->sha256)) < 0) {
-		return rc;
+		goto L_RETURN;
 	}
-	psSha256Update(&ctx->sha256, ctx->pad, padLen);
+	psSha256Update(&ctx->sha256, pad, 64);
 	for (i = 0; (uint32)i < keyLen; i++) {
-		ctx->pad[i] = key[i] ^ 0x5c;
+		pad[i] = key[i] ^ 0x5c;
 	}
-	for (i = keyLen; i < padLen; i++) {
-		ctx->pad[i] = 0x5c;
+	for (i = keyLen; i < 64; i++) {
+		pad[i] = 0x5c;
 	}
-	return PS_SUCCESS;
+	if ((rc = psSha256Init(&ctx->outer)) < 0) {
+		goto L_RETURN;
+	}
+	psSha256Update(&ctx->outer, pad, 64);
+	rc = PS_SUCCESS;
+L_RETURN:
+	memzero_s(pad, sizeof(pad));
+	return rc;
 }
 
 void psHmacSha256Update(psHmacSha256_t *ctx,
@@ -433,7 +442,6 @@ void psHmacSha256Update(psHmacSha256_t *ctx,
 void psHmacSha256Final(psHmacSha256_t *ctx,
 				unsigned char hash[SHA256_HASHLEN])
 {
-	int32_t		rc;
 #ifdef CRYPTO_ASSERT
 	psAssert(ctx != NULL);
 	if (hash == NULL) {
@@ -443,15 +451,10 @@ void psHmacSha256Final(psHmacSha256_t *ctx,
 #endif
 
 	psSha256Final(&ctx->sha256, hash);
-
-	if ((rc = psSha256Init(&ctx->sha256)) < 0) {
-		psAssert(rc >= 0);
-		return;
-	}
-	psSha256Update(&ctx->sha256, ctx->pad, 64);
-	psSha256Update(&ctx->sha256, hash, SHA256_HASHLEN);
-	psSha256Final(&ctx->sha256, hash);
-	memset(ctx->pad, 0x0, sizeof(ctx->pad));
+	psSha256Update(&ctx->outer, hash, SHA256_HASHLEN);
+	psSha256Final(&ctx->outer, hash);
+	/* Both keyed states are spent; don't leave them in this copy */
+	memzero_s(ctx, sizeof(psHmacSha256_t));
 }
 #endif /* USE_MATRIX_HMAC_SHA256 */
 
@@ -504,31 +507,36 @@ int32_t psHmacSha384(const unsigned char *key, uint16_t keyLen,
 int32_t psHmacSha384Init(psHmacSha384_t *ctx,
 				const unsigned char *key, uint16_t keyLen)
 {
-	int32_t		rc, i, padLen;
-
-	padLen = 128;
+	unsigned char	pad[128];
+	int32_t			rc, i;
 
 #ifdef CRYPTO_ASSERT
-	psAssert(keyLen <= (uint32)padLen);
+	psAssert(keyLen <= 128);
 #endif
 	for (i = 0; (uint32)i < keyLen; i++) {
-		ctx->pad[i] = key[i] ^ 0x36;
+		pad[i] = key[i] ^ 0x36;
 	}
-	for (i = keyLen; i < padLen; i++) {
-		ctx->pad[i] = 0x36;
+	for (i = keyLen; i < 128; i++) {
+		pad[i] = 0x36;
 	}
 	if ((rc = psSha384Init(&ctx->sha384)) < 0) {
-		return rc;
+		goto L_RETURN;
 	}
-	psSha384Update(&ctx->sha384, ctx->pad, padLen);
-
+	psSha384Update(&ctx->sha384, pad, 128);
 	for (i = 0; (uint32)i < keyLen; i++) {
-		ctx->pad[i] = key[i] ^ 0x5c;
+		pad[i] = key[i] ^ 0x5c;
 	}
-	for (i = keyLen; i < padLen; i++) {
-		ctx->pad[i] = 0x5c;
+	for (i = keyLen; i < 128; i++) {
+		pad[i] = 0x5c;
 	}
-	return PS_SUCCESS;
+	if ((rc = psSha384Init(&ctx->outer)) < 0) {
+		goto L_RETURN;
+	}
+	psSha384Update(&ctx->outer, pad, 128);
+	rc = PS_SUCCESS;
+L_RETURN:
+	memzero_s(pad, sizeof(pad));
+	return rc;
 }
 
 void psHmacSha384Update(psHmacSha384_t *ctx,
@@ -543,7 +551,6 @@ void psHmacSha384Update(psHmacSha384_t *ctx,
 void psHmacSha384Final(psHmacSha384_t *ctx,
 				unsigned char hash[SHA384_HASHLEN])
 {
-	int32_t		rc;
 #ifdef CRYPTO_ASSERT
 	psAssert(ctx != NULL);
 	if (hash == NULL) {
@@ -553,16 +560,10 @@ void psHmacSha384Final(psHmacSha384_t *ctx,
 #endif
 
 	psSha384Final(&ctx->sha384, hash);
-
-	if ((rc = psSha384Init(&ctx->sha384)) < 0) {
-		psAssert(rc >= 0);
-		return;
-	}
-	psSha384Update(&ctx->sha384, ctx->pad, 128);
-	psSha384Update(&ctx->sha384, hash, SHA384_HASHLEN);
-	psSha384Final(&ctx->sha384, hash);
-
-	memset(ctx->pad, 0x0, sizeof(ctx->pad));
+	psSha384Update(&ctx->outer, hash, SHA384_HASHLEN);
+	psSha384Final(&ctx->outer, hash);
+	/* Both keyed states are spent; don't leave them in this copy */
+	memzero_s(ctx, sizeof(psHmacSha384_t));
 }
 #endif /* USE_MATRIX_HMAC_SHA384 */
 
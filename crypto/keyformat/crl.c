@@ -36,6 +36,14 @@
 #ifdef USE_CRL
 #ifdef USE_CERT_PARSE
 
+#if defined(MATRIX_USE_FILE_SYSTEM) && defined(POSIX)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define CRL_INDEX_MMAP	/* Map index files instead of reading them */
+#endif
+
 #ifdef USE_MULTITHREADING
 static psMutex_t	g_crlTableLock;
 #endif
@@ -71,6 +79,40 @@ void psCrlClose()
 #endif
 }
 
+#ifdef USE_MEMORY_ACCOUNTING
+/* Memory held by the global CRL cache.  Only CRLs parsed into accounting
+	pools are counted, and peak is the sum of the per-CRL peaks. */
+int32_t psCRL_GetMemStats(psMemStats_t *stats)
+{
+	psX509Crl_t		*curr;
+	psMemStats_t	s;
+
+	if (stats == NULL) {
+		return PS_ARG_FAIL;
+	}
+	memset(stats, 0x0, sizeof(psMemStats_t));
+#ifdef USE_MULTITHREADING
+	psLockMutex(&g_crlTableLock);
+#endif /* USE_MULTITHREADING */
+	for (curr = g_CRL; curr != NULL; curr = curr->next) {
+		if (psMemGetStats(curr->pool, &s) < 0) {
+			continue;
+		}
+		stats->current += s.current;
+		stats->peak += s.peak;
+		stats->total += s.total;
+		stats->allocs += s.allocs;
+		stats->frees += s.frees;
+		stats->live += s.live;
+		stats->failed += s.failed;
+	}
+#ifdef USE_MULTITHREADING
+	psUnlockMutex(&g_crlTableLock);
+#endif /* USE_MULTITHREADING */
+	return PS_SUCCESS;
+}
+#endif /* USE_MEMORY_ACCOUNTING */
+
 /* Helper for CRL insert */
 static int internalCRLInsert(psX509Crl_t *crl)
 {
@@ -303,6 +345,172 @@ int psCRL_Update(psX509Crl_t *crl, int deleteExisting)
 	return rc;
 }
 
+/******************************************************************************/
+/*
+	Revoked serial index.  Slots compare with memcmp, see x509revoked_t.
+*/
+static void swapSerialSlots(unsigned char *a, unsigned char *b, uint16_t w,
+				unsigned char *tmp)
+{
+	memcpy(tmp, a, w);
+	memcpy(a, b, w);
+	memcpy(b, tmp, w);
+}
+
+static void siftSerialSlot(unsigned char *s, uint16_t w, size_t root, size_t n,
+				unsigned char *tmp)
+{
+	size_t	child;
+
+	while ((child = 2 * root + 1) < n) {
+		if (child + 1 < n && memcmp(s + child * w, s + (child + 1) * w, w) < 0) {
+			child++;
+		}
+		if (memcmp(s + root * w, s + child * w, w) >= 0) {
+			return;
+		}
+		swapSerialSlots(s + root * w, s + child * w, w, tmp);
+		root = child;
+	}
+}
+
+/* Heapsort, so neither recursion nor memory grows with the CRL */
+static void sortRevokedSerials(x509revoked_t *rev)
+{
+	unsigned char	tmp[CRL_MAX_SERIAL_SLOT];
+	size_t			i;
+
+	for (i = rev->count / 2; i-- > 0; ) {
+		siftSerialSlot(rev->serials, rev->slotLen, i, rev->count, tmp);
+	}
+	for (i = rev->count; i-- > 1; ) {
+		swapSerialSlots(rev->serials, rev->serials + i * rev->slotLen,
+			rev->slotLen, tmp);
+		siftSerialSlot(rev->serials, rev->slotLen, 0, i, tmp);
+	}
+}
+
+/* 1 if the serial number is in the index, 0 if not */
+static int32_t findRevokedSerial(const x509revoked_t *rev,
+				const unsigned char *sn, uint16_t snLen)
+{
+	const unsigned char	*slot;
+	size_t				lo, hi, mid;
+	int					cmp;
+
+	if (rev->count == 0 || snLen >= rev->slotLen) {
+		return 0;
+	}
+	lo = 0;
+	hi = rev->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		slot = rev->serials + mid * rev->slotLen;
+		if (slot[0] != snLen) {
+			cmp = slot[0] < snLen ? -1 : 1;
+		} else {
+			cmp = memcmp(slot + 1, sn, snLen);
+		}
+		if (cmp == 0) {
+			return 1; /* REVOKED! */
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return 0;
+}
+
+/*
+	Step over one revokedCertificates entry, returning where its serial
+	number is.  Nothing is allocated.
+		SEQUENCE {
+			userCertificate         CertificateSerialNumber,
+			revocationDate          Time,
+			crlEntryExtensions      Extensions OPTIONAL }
+*/
+static int32_t getRevokedEntry(const unsigned char **pp,
+				const unsigned char *end, const unsigned char **sn,
+				uint16_t *snLen)
+{
+	const unsigned char	*p = *pp, *start;
+	uint32_t			ilen;
+	uint16_t			vlen;
+
+	if (getAsnSequence32(&p, (uint32)(end - p), &ilen, 0) < 0) {
+		psTraceCrypto("Deep revokedCert error in psX509ParseCRL\n");
+		return PS_PARSE_FAIL;
+	}
+	start = p;
+	if (ilen < 2 || (*p != ASN_INTEGER &&
+			*p != (ASN_CONTEXT_SPECIFIC | ASN_PRIMITIVE | 2))) {
+		psTraceCrypto("ASN serial number parse error\n");
+		return PS_PARSE_FAIL;
+	}
+	p++;
+	if (getAsnLength(&p, ilen - 1, &vlen) < 0 ||
+			(uint32)(p - start) + vlen > ilen) {
+		psTraceCrypto("ASN serial number parse error\n");
+		return PS_PARSE_FAIL;
+	}
+	*sn = p;
+	*snLen = vlen;
+	/* skipping time and crlEntryExtensions */
+	*pp = start + ilen;
+	return PS_SUCCESS;
+}
+
+/*
+	Build the sorted serial index from the contents of revokedCertificates.
+	One pass sizes the slots, a second fills them.
+*/
+static int32_t indexRevokedSerials(psPool_t *pool, const unsigned char *p,
+				uint32_t len, x509revoked_t *rev)
+{
+	const unsigned char	*c, *end, *sn;
+	unsigned char		*slot;
+	uint32_t			count, i;
+	uint16_t			snLen, maxLen;
+	int32_t				rc;
+
+	memset(rev, 0x0, sizeof(x509revoked_t));
+	end = p + len;
+	count = maxLen = 0;
+	for (c = p; c < end; count++) {
+		if ((rc = getRevokedEntry(&c, end, &sn, &snLen)) < 0) {
+			return rc;
+		}
+		if (snLen > maxLen) {
+			maxLen = snLen;
+		}
+	}
+	if (count == 0) {
+		return PS_SUCCESS;
+	}
+	if (maxLen + 1 > CRL_MAX_SERIAL_SLOT) {
+		psTraceCrypto("CRL serial number too long to index\n");
+		return PS_LIMIT_FAIL;
+	}
+	rev->slotLen = maxLen + 1;
+	rev->baseLen = (size_t)count * rev->slotLen;
+	if ((rev->base = psMalloc(pool, rev->baseLen)) == NULL) {
+		return PS_MEM_FAIL;
+	}
+	memset(rev->base, 0x0, rev->baseLen);
+	rev->serials = rev->base;
+	for (c = p, i = 0; i < count; i++) {
+		getRevokedEntry(&c, end, &sn, &snLen);
+		slot = rev->serials + (size_t)i * rev->slotLen;
+		slot[0] = (unsigned char)snLen;
+		memcpy(slot + 1, sn, snLen);
+	}
+	rev->count = count;
+	sortRevokedSerials(rev);
+	return PS_SUCCESS;
+}
+
 /* Helper to see if we have a matching CRL for the given subject cert.  So
 	this means we are looking at the issuer/authority fields of the cert */
 static int32 internalMatchSubject(psX509Cert_t *cert, psX509Crl_t *CRL)
@@ -416,7 +624,6 @@ psX509Crl_t* psCRL_GetCRLForCert(psX509Cert_t *cert)
 int32_t internalCrlIsRevoked(psX509Cert_t *cert, psX509Crl_t *CRL)
 {
 	psX509Crl_t		*crl;
-	x509revoked_t	*entry;
 
 	if (cert == NULL) {
 		return -1;
@@ -429,19 +636,9 @@ int32_t internalCrlIsRevoked(psX509Cert_t *cert, psX509Crl_t *CRL)
 			return -1;
 		}
 	}
-	if (crl->revoked == NULL) {
-		/* It is totally reasonable to have a CRL with no revoked certs */
-		return 0;
-	}
-	for (entry = crl->revoked; entry != NULL; entry = entry->next) {
-		if (cert->serialNumberLen == entry->serialLen) {
-			if (memcmpct(cert->serialNumber, entry->serial, entry->serialLen)
-					== 0) {
-				return 1; /* REVOKED! */
-			}
-		}
-	}
-	return 0; /* never found it.  good to go */
+	/* It is totally reasonable to have a CRL with no revoked certs */
+	return findRevokedSerial(&crl->revoked, cert->serialNumber,
+		cert->serialNumberLen);
 }
 
 /* 
@@ -556,17 +753,17 @@ int32_t psCRL_determineRevokedStatus(psX509Cert_t *cert)
 
 
 /******************************************************************************/
-static void x509FreeRevoked(x509revoked_t **revoked, psPool_t *pool)
+static void x509FreeRevoked(x509revoked_t *revoked, psPool_t *pool)
 {
-	x509revoked_t		*next, *curr = *revoked;
-
-	while (curr) {
-		next = curr->next;
-		psFree(curr->serial, pool);
-		psFree(curr, pool);
-		curr = next;
+	if (revoked->base) {
+#ifdef CRL_INDEX_MMAP
+		if (revoked->mapped) {
+			munmap(revoked->base, revoked->baseLen);
+		} else
+#endif
+		psFree(revoked->base, pool);
 	}
-	*revoked = NULL;
+	memset(revoked, 0x0, sizeof(x509revoked_t));
 }
 
 static void internalFreeCRL(psX509Crl_t *crl)
@@ -654,6 +851,7 @@ int32_t psX509AuthenticateCRL(psX509Cert_t *CA,	psX509Crl_t *CRL,
 {
 	int32				rc, sigType;
 	unsigned char		sigOut[SHA512_HASH_SIZE];
+	unsigned char		*tempSig;
 	psPool_t			*pkiPool = MATRIX_NO_POOL;
 	
 	if (CA == NULL || CRL == NULL) {
@@ -664,6 +862,12 @@ int32_t psX509AuthenticateCRL(psX509Cert_t *CA,	psX509Crl_t *CRL,
 		psTraceCrypto("WARNING: this CRL has already been authenticated\n");
 	}
 	CRL->authenticated = 0;
+
+	/* Loaded from an index, nothing binds the serials to a signature */
+	if (CRL->sig == NULL) {
+		psTraceCrypto("CRL has no signature to authenticate\n");
+		return PS_CERT_AUTH_FAIL_SIG;
+	}
 	
 	/* A few tests to see if this CA is the true issuer of the CRL */
 	if ((rc = internalMatchIssuer(CA, CRL)) < 0) {
@@ -725,8 +929,15 @@ int32_t psX509AuthenticateCRL(psX509Cert_t *CA,	psX509Crl_t *CRL,
 	/* Perform the signature verification. */
 
 	if (sigType == PS_RSA) {
+		/* psRsaDecryptPub destroys its input.  Keep CRL->sig intact so the
+			CRL can be authenticated again or written to an index. */
+		if ((tempSig = psMalloc(pkiPool, CRL->sigLen)) == NULL) {
+			return PS_MEM_FAIL;
+		}
+		memcpy(tempSig, CRL->sig, CRL->sigLen);
 		rc = pubRsaDecryptSignedElement(pkiPool, &CA->publicKey.key.rsa,
-				CRL->sig, CRL->sigLen, sigOut, CRL->sigHashLen, NULL);
+				tempSig, CRL->sigLen, sigOut, CRL->sigHashLen, NULL);
+		psFree(tempSig, pkiPool);
 		if (rc < 0) {
 			psTraceCrypto("Unable to RSA decrypt CRL signature\n");
 			return rc;
@@ -756,18 +967,183 @@ int32_t psX509AuthenticateCRL(psX509Cert_t *CA,	psX509Crl_t *CRL,
 }
 
 
+static psX509Crl_t *allocCRL(psPool_t *pool)
+{
+	psX509Crl_t		*crl;
+
+	if (pool == NULL) {
+		/* Give each CRL its own accounting pool.  A closed pool lives on
+			until its last block, the psX509Crl_t itself, is freed. */
+		pool = psMemPoolOpen("psX509Crl_t");
+		crl = psMalloc(pool, sizeof(psX509Crl_t));
+		psMemPoolClose(pool);
+	} else {
+		crl = psMalloc(pool, sizeof(psX509Crl_t));
+	}
+	if (crl == NULL) {
+		return NULL;
+	}
+	memset(crl, 0, sizeof(psX509Crl_t));
+	crl->pool = pool;
+	crl->extensions.pool = pool;
+	return crl;
+}
+
+/*
+	Digest of the TBSCertList for the given signature algorithm.  Split in
+	steps so the streaming parser can hash as it goes.
+*/
+static int32_t crlDigestLen(int32_t sigAlg)
+{
+	switch (sigAlg) {
+#ifdef ENABLE_MD5_SIGNED_CERTS
+	case OID_MD5_RSA_SIG:
+		return MD5_HASH_SIZE;
+#endif
+#ifdef ENABLE_SHA1_SIGNED_CERTS
+	case OID_SHA1_RSA_SIG:
+#ifdef USE_ECC
+	case OID_SHA1_ECDSA_SIG:
+#endif /* USE_ECC */
+		return SHA1_HASH_SIZE;
+#endif /* ENABLE_SHA1_SIGNED_CERTS */
+#ifdef USE_SHA256
+	case OID_SHA256_RSA_SIG:
+#ifdef USE_ECC
+	case OID_SHA256_ECDSA_SIG:
+#endif /* USE_ECC */
+		return SHA256_HASH_SIZE;
+#endif /* USE_SHA256 */
+#ifdef USE_SHA384
+	case OID_SHA384_RSA_SIG:
+#ifdef USE_ECC
+	case OID_SHA384_ECDSA_SIG:
+#endif /* USE_ECC */
+		return SHA384_HASH_SIZE;
+#endif /* USE_SHA384 */
+#ifdef USE_SHA512
+	case OID_SHA512_RSA_SIG:
+#ifdef USE_ECC
+	case OID_SHA512_ECDSA_SIG:
+#endif /* USE_ECC */
+		return SHA512_HASH_SIZE;
+#endif /* USE_SHA512 */
+	default:
+		psTraceCrypto("Need more signature alg support for CRL\n");
+		return PS_UNSUPPORTED_FAIL;
+	}
+}
+
+static void crlDigestInit(psDigestContext_t *ctx, int32_t hashLen)
+{
+	switch (hashLen) {
+#ifdef ENABLE_MD5_SIGNED_CERTS
+	case MD5_HASH_SIZE:
+		psMd5Init(&ctx->md5);
+		break;
+#endif /* ENABLE_MD5_SIGNED_CERTS */
+#ifdef ENABLE_SHA1_SIGNED_CERTS
+	case SHA1_HASH_SIZE:
+		psSha1PreInit(&ctx->sha1);
+		psSha1Init(&ctx->sha1);
+		break;
+#endif /* ENABLE_SHA1_SIGNED_CERTS */
+#ifdef USE_SHA256
+	case SHA256_HASH_SIZE:
+		psSha256PreInit(&ctx->sha256);
+		psSha256Init(&ctx->sha256);
+		break;
+#endif /* USE_SHA256 */
+#ifdef USE_SHA384
+	case SHA384_HASH_SIZE:
+		psSha384PreInit(&ctx->sha384);
+		psSha384Init(&ctx->sha384);
+		break;
+#endif /* USE_SHA384 */
+#ifdef USE_SHA512
+	case SHA512_HASH_SIZE:
+		psSha512PreInit(&ctx->sha512);
+		psSha512Init(&ctx->sha512);
+		break;
+#endif /* USE_SHA512 */
+	}
+}
+
+static void crlDigestUpdate(psDigestContext_t *ctx, int32_t hashLen,
+				const unsigned char *p, uint32_t len)
+{
+	switch (hashLen) {
+#ifdef ENABLE_MD5_SIGNED_CERTS
+	case MD5_HASH_SIZE:
+		psMd5Update(&ctx->md5, p, len);
+		break;
+#endif /* ENABLE_MD5_SIGNED_CERTS */
+#ifdef ENABLE_SHA1_SIGNED_CERTS
+	case SHA1_HASH_SIZE:
+		psSha1Update(&ctx->sha1, p, len);
+		break;
+#endif /* ENABLE_SHA1_SIGNED_CERTS */
+#ifdef USE_SHA256
+	case SHA256_HASH_SIZE:
+		psSha256Update(&ctx->sha256, p, len);
+		break;
+#endif /* USE_SHA256 */
+#ifdef USE_SHA384
+	case SHA384_HASH_SIZE:
+		psSha384Update(&ctx->sha384, p, len);
+		break;
+#endif /* USE_SHA384 */
+#ifdef USE_SHA512
+	case SHA512_HASH_SIZE:
+		psSha512Update(&ctx->sha512, p, len);
+		break;
+#endif /* USE_SHA512 */
+	}
+}
+
+static void crlDigestFinal(psDigestContext_t *ctx, int32_t hashLen,
+				unsigned char *out)
+{
+	switch (hashLen) {
+#ifdef ENABLE_MD5_SIGNED_CERTS
+	case MD5_HASH_SIZE:
+		psMd5Final(&ctx->md5, out);
+		break;
+#endif /* ENABLE_MD5_SIGNED_CERTS */
+#ifdef ENABLE_SHA1_SIGNED_CERTS
+	case SHA1_HASH_SIZE:
+		psSha1Final(&ctx->sha1, out);
+		break;
+#endif /* ENABLE_SHA1_SIGNED_CERTS */
+#ifdef USE_SHA256
+	case SHA256_HASH_SIZE:
+		psSha256Final(&ctx->sha256, out);
+		break;
+#endif /* USE_SHA256 */
+#ifdef USE_SHA384
+	case SHA384_HASH_SIZE:
+		psSha384Final(&ctx->sha384, out);
+		break;
+#endif /* USE_SHA384 */
+#ifdef USE_SHA512
+	case SHA512_HASH_SIZE:
+		psSha512Final(&ctx->sha512, out);
+		break;
+#endif /* USE_SHA512 */
+	}
+}
+
 /*
 	Parse a CRL.
 */
 int32 psX509ParseCRL(psPool_t *pool, psX509Crl_t **crl, unsigned char *crlBin,
 			int32 crlBinLen)
 {
-	const unsigned char	*end, *start, *sigStart, *sigEnd, *revStart, *p = crlBin;
+	const unsigned char	*end, *start, *sigStart, *sigEnd, *p = crlBin;
 	int32				oi, version, rc;
-	x509revoked_t		*curr, *next;
 	psDigestContext_t	hashCtx;
 	psX509Crl_t			*lcrl;
-	uint32_t			glen, ilen, tbsCertLen;
+	uint32_t			glen, tbsCertLen;
 	uint16_t			timelen, plen;
 
 	if (crlBin == NULL || crlBinLen <= 0) {
@@ -820,11 +1196,10 @@ int32 psX509ParseCRL(psPool_t *pool, psX509Crl_t **crl, unsigned char *crlBin,
 	}
 	
 	/* looking correct.  Allocate the psX509Crl_t */
-	if ((lcrl = psMalloc(pool, sizeof(psX509Crl_t))) == NULL) {
+	if ((lcrl = allocCRL(pool)) == NULL) {
 		return PS_MEM_FAIL;
 	}
-	memset(lcrl, 0, sizeof(psX509Crl_t));
-	lcrl->pool = pool;
+	pool = lcrl->pool;
 	
 	/* signature */
 	if (getAsnAlgorithmIdentifier(&p, (int32)(end - p), &lcrl->sigAlg, &plen)
@@ -907,47 +1282,11 @@ int32 psX509ParseCRL(psPool_t *pool, psX509Crl_t **crl, unsigned char *crlBin,
 				psX509FreeCRL(lcrl);
 				return PS_PARSE_FAIL;
 			}
-
-			lcrl->revoked = curr = psMalloc(pool, sizeof(x509revoked_t));
-			if (curr == NULL) {
+			if ((rc = indexRevokedSerials(pool, p, glen, &lcrl->revoked)) < 0) {
 				psX509FreeCRL(lcrl);
-				return PS_MEM_FAIL;
-			}
-			memset(curr, 0x0, sizeof(x509revoked_t));
-			while (glen > 0) {
-				revStart = p;
-				if (getAsnSequence32(&p, (uint32)(end - p), &ilen, 0) < 0) {
-					psTraceCrypto("Deep revokedCert error in psX509ParseCRL\n");
-					psX509FreeCRL(lcrl);
-					return PS_PARSE_FAIL;
-				}
-				start = p; /* reusing start */
-				if ((rc = getSerialNum(pool, &p, ilen, &curr->serial,
-						&curr->serialLen)) < 0) {
-					psTraceCrypto("ASN serial number parse error\n");
-					psX509FreeCRL(lcrl);
-					return rc;
-				}
-				/* skipping time and crlEntryExtensions */
-				p += ilen - (uint32)(p - start);
-				if (glen < (uint32)(p - revStart)) {
-					psTraceCrypto("Deeper revokedCert err in psX509ParseCRL\n");
-					psX509FreeCRL(lcrl);
-					return PS_PARSE_FAIL;
-				}
-				glen -= (uint32)(p - revStart);
-
-				// psTraceBytes("revoked", curr->serial, curr->serialLen);
-				if (glen > 0) {
-					if ((next = psMalloc(pool, sizeof(x509revoked_t))) == NULL){
-						psX509FreeCRL(lcrl);
-						return PS_MEM_FAIL;
-					}
-					memset(next, 0x0, sizeof(x509revoked_t));
-					curr->next = next;
-					curr = next;
-				}
+				return rc;
 			}
+			p += glen;
 		}
 		/* Always treated as OPTIONAL */
 		if (getExplicitExtensions(pool, &p, (uint32)(end - p), 0,
@@ -982,108 +1321,854 @@ int32 psX509ParseCRL(psPool_t *pool, psX509Crl_t **crl, unsigned char *crlBin,
 	}
 	
 	/* Perform the hashing for later auth */
-		switch (lcrl->sigAlg) {
-#ifdef ENABLE_MD5_SIGNED_CERTS
-	case OID_MD5_RSA_SIG:
-		lcrl->sigHashLen = MD5_HASH_SIZE;
-		break;
-#endif
-#ifdef ENABLE_SHA1_SIGNED_CERTS
-	case OID_SHA1_RSA_SIG:
-		lcrl->sigHashLen = SHA1_HASH_SIZE;
-		break;
-#ifdef USE_ECC
-	case OID_SHA1_ECDSA_SIG:
-		lcrl->sigHashLen = SHA1_HASH_SIZE;
-		break;
-#endif /* USE_ECC */
-#endif /* ENABLE_SHA1_SIGNED_CERTS */
-#ifdef USE_SHA256
-	case OID_SHA256_RSA_SIG:
-		lcrl->sigHashLen = SHA256_HASH_SIZE;
-		break;
-#ifdef USE_ECC
-	case OID_SHA256_ECDSA_SIG:
-		lcrl->sigHashLen = SHA256_HASH_SIZE;
-		break;
-#endif /* USE_ECC */
-#endif /* USE_SHA256 */
-#ifdef USE_SHA384
-	case OID_SHA384_RSA_SIG:
-		lcrl->sigHashLen = SHA384_HASH_SIZE;
-		break;
-#ifdef USE_ECC
-	case OID_SHA384_ECDSA_SIG:
-		lcrl->sigHashLen = SHA384_HASH_SIZE;
-		break;
-#endif /* USE_ECC */
-#endif /* USE_SHA384 */
-#ifdef USE_SHA512
-	case OID_SHA512_RSA_SIG:
-		lcrl->sigHashLen = SHA512_HASH_SIZE;
-		break;
-#ifdef USE_ECC
-	case OID_SHA512_ECDSA_SIG:
-		lcrl->sigHashLen = SHA512_HASH_SIZE;
-		break;
-#endif /* USE_ECC */
-#endif /* USE_SHA512 */
-	default:
+	if ((rc = crlDigestLen(lcrl->sigAlg)) < 0) {
 		psX509FreeCRL(lcrl);
-		psTraceCrypto("Need more signature alg support for CRL\n");
-		return PS_UNSUPPORTED_FAIL;
+		return rc;
 	}
+	lcrl->sigHashLen = rc;
+	crlDigestInit(&hashCtx, lcrl->sigHashLen);
+	crlDigestUpdate(&hashCtx, lcrl->sigHashLen, sigStart,
+		(uint32)(sigEnd - sigStart));
+	crlDigestFinal(&hashCtx, lcrl->sigHashLen, lcrl->sigHash);
 
-	switch(lcrl->sigHashLen) {
-#ifdef ENABLE_MD5_SIGNED_CERTS
-	case MD5_HASH_SIZE:
-		psMd5Init(&hashCtx.md5);
-		psMd5Update(&hashCtx.md5, sigStart, (uint32)(sigEnd - sigStart));
-		psMd5Final(&hashCtx.md5, lcrl->sigHash);
-		break;
-#endif /* ENABLE_MD5_SIGNED_CERTS */
-#ifdef ENABLE_SHA1_SIGNED_CERTS
-	case SHA1_HASH_SIZE:
-		psSha1PreInit(&hashCtx.sha1);
-		psSha1Init(&hashCtx.sha1);
-		psSha1Update(&hashCtx.sha1, sigStart, (uint32)(sigEnd - sigStart));
-		psSha1Final(&hashCtx.sha1, lcrl->sigHash);
+	*crl = lcrl;
+	
+	return PS_SUCCESS;
+}
+
+/******************************************************************************/
+/*
+	Streaming CRL parse.  The same structure as psX509ParseCRL, but the
+	input arrives in chunks of any size.  Each complete DER element is
+	handled as it is seen: the CertificateList, TBSCertList and
+	revokedCertificates SEQUENCEs are entered by their headers alone, the
+	TBSCertList is hashed on the way through, and revoked serials go
+	straight into the slot index.  Memory beyond the index is one element.
+*/
+#define CRL_STREAM_LIST				0
+#define CRL_STREAM_TBS				1
+#define CRL_STREAM_VERSION			2
+#define CRL_STREAM_SIGALG			3
+#define CRL_STREAM_ISSUER			4
+#define CRL_STREAM_THIS_UPDATE		5
+#define CRL_STREAM_NEXT_UPDATE		6
+#define CRL_STREAM_REVOKED_LIST		7
+#define CRL_STREAM_REVOKED			8
+#define CRL_STREAM_EXTENSIONS		9
+#define CRL_STREAM_OUTER_SIGALG		10
+#define CRL_STREAM_SIGNATURE		11
+#define CRL_STREAM_DONE				12
+
+#define CRL_STREAM_MORE			1	/* Element not complete in the input */
+#define CRL_STREAM_SLOTS		64	/* Initial revoked serial slots */
+#define CRL_STREAM_SLOT_LEN		21	/* Fits a 20 byte RFC 5280 serial */
+
+#define IS_CRL_TIME(c) ((c) == ASN_UTCTIME || (c) == ASN_GENERALIZEDTIME)
+
+int32_t psX509CrlStreamInit(psPool_t *pool, psX509CrlStream_t *ctx)
+{
+	if (ctx == NULL) {
+		return PS_ARG_FAIL;
+	}
+	memset(ctx, 0x0, sizeof(psX509CrlStream_t));
+	if ((ctx->crl = allocCRL(pool)) == NULL) {
+		return PS_MEM_FAIL;
+	}
+	ctx->pool = pool;
+	ctx->state = CRL_STREAM_LIST;
+	return PS_SUCCESS;
+}
+
+void psX509CrlStreamFree(psX509CrlStream_t *ctx)
+{
+	if (ctx == NULL) {
+		return;
+	}
+	if (ctx->crl) {
+		psX509FreeCRL(ctx->crl);
+	}
+	if (ctx->buf) {
+		psFree(ctx->buf, ctx->pool);
+	}
+	memset(ctx, 0x0, sizeof(psX509CrlStream_t));
+}
+
+/* Tag and length octets at p, CRL_STREAM_MORE if they are not all there */
+static int32_t crlStreamHeader(const unsigned char *p, uint32_t avail,
+				uint32_t *hdrLen, uint32_t *valLen)
+{
+	uint32_t	n, i;
+
+	if (avail < 2) {
+		return CRL_STREAM_MORE;
+	}
+	if (p[1] < 0x80) {
+		*hdrLen = 2;
+		*valLen = p[1];
+		return PS_SUCCESS;
+	}
+	n = p[1] & 0x7F;
+	if (n == 0 || n > 4) {
+		psTraceCrypto("Unsupported length encoding in CRL\n");
+		return PS_PARSE_FAIL;
+	}
+	if (avail < 2 + n) {
+		return CRL_STREAM_MORE;
+	}
+	*valLen = 0;
+	for (i = 0; i < n; i++) {
+		*valLen = (*valLen << 8) | p[2 + i];
+	}
+	*hdrLen = 2 + n;
+	return PS_SUCCESS;
+}
+
+/* Bytes left in the innermost SEQUENCE being parsed */
+static uint32_t crlStreamRoom(const psX509CrlStream_t *ctx)
+{
+	switch (ctx->state) {
+	case CRL_STREAM_LIST:
+		return 0xFFFFFFFF;
+	case CRL_STREAM_TBS:
+	case CRL_STREAM_OUTER_SIGALG:
+	case CRL_STREAM_SIGNATURE:
+		return ctx->listLeft;
+	case CRL_STREAM_REVOKED:
+		return ctx->revokedLeft;
+	default:
+		return ctx->tbsLeft;
+	}
+}
+
+/* Account for n consumed bytes and hash those that are in TBSCertList */
+static int32_t crlStreamEat(psX509CrlStream_t *ctx, const unsigned char *p,
+				uint32_t n)
+{
+	ctx->listLeft -= n;
+	if (ctx->state == CRL_STREAM_REVOKED) {
+		ctx->revokedLeft -= n;
+	}
+	if (ctx->state < CRL_STREAM_TBS || ctx->state > CRL_STREAM_EXTENSIONS) {
+		return PS_SUCCESS;
+	}
+	if (ctx->state != CRL_STREAM_TBS) {
+		ctx->tbsLeft -= n;
+	}
+	if (ctx->crl->sigHashLen == 0) {
+		/* Digest isn't known until the signature AlgorithmIdentifier */
+		if (n > sizeof(ctx->pre) - ctx->preLen) {
+			psTraceCrypto("CRL TBS header too large\n");
+			return PS_LIMIT_FAIL;
+		}
+		memcpy(ctx->pre + ctx->preLen, p, n);
+		ctx->preLen += n;
+		return PS_SUCCESS;
+	}
+	crlDigestUpdate(&ctx->hashCtx, ctx->crl->sigHashLen, p, n);
+	return PS_SUCCESS;
+}
+
+/* Append a serial to the unsorted index, widening slots if need be */
+static int32_t crlStreamAddSerial(psX509CrlStream_t *ctx,
+				const unsigned char *sn, uint16_t snLen)
+{
+	x509revoked_t	*rev = &ctx->crl->revoked;
+	unsigned char	*s;
+	uint32_t		max, i;
+	uint16_t		w;
+
+	if (snLen + 1 > CRL_MAX_SERIAL_SLOT) {
+		psTraceCrypto("CRL serial number too long to index\n");
+		return PS_LIMIT_FAIL;
+	}
+	w = rev->slotLen;
+	if (w == 0) {
+		w = CRL_STREAM_SLOT_LEN;
+	}
+	if (snLen + 1 > w) {
+		w = snLen + 1;
+	}
+	if (w != rev->slotLen || rev->count == ctx->revokedMax) {
+		max = ctx->revokedMax;
+		if (rev->count == max) {
+			max = max ? max * 2 : CRL_STREAM_SLOTS;
+		}
+		if (max <= rev->count || (size_t)max > (size_t)-1 / w) {
+			return PS_LIMIT_FAIL;
+		}
+		if ((s = psRealloc(rev->base, (size_t)max * w, ctx->crl->pool))
+				== NULL) {
+			return PS_MEM_FAIL;
+		}
+		/* Move existing slots out to the new width, last first */
+		if (w != rev->slotLen) {
+			for (i = rev->count; i-- > 0; ) {
+				memmove(s + (size_t)i * w, s + (size_t)i * rev->slotLen,
+					rev->slotLen);
+				memset(s + (size_t)i * w + rev->slotLen, 0x0,
+					w - rev->slotLen);
+			}
+			rev->slotLen = w;
+		}
+		rev->base = rev->serials = s;
+		rev->baseLen = (size_t)max * w;
+		ctx->revokedMax = max;
+	}
+	s = rev->serials + (size_t)rev->count * w;
+	s[0] = (unsigned char)snLen;
+	memcpy(s + 1, sn, snLen);
+	memset(s + 1 + snLen, 0x0, w - 1 - snLen);
+	rev->count++;
+	return PS_SUCCESS;
+}
+
+/*
+	Handle the element at the start of p.  Sets used to the bytes consumed,
+	which is 0 when an OPTIONAL element is absent or a SEQUENCE has ended
+	and only the state moves on.  CRL_STREAM_MORE with need set to the
+	element size (or 0 if the header is short) asks for more input.
+*/
+static int32_t crlStreamStep(psX509CrlStream_t *ctx, const unsigned char *p,
+				uint32_t avail, uint32_t *used)
+{
+	psX509Crl_t			*crl = ctx->crl;
+	const unsigned char	*c, *sn;
+	uint32_t			hdrLen, valLen, len, room;
+	int32_t				rc, version, oi;
+	uint16_t			plen, snLen;
+
+	*used = 0;
+	ctx->need = 0;
+
+	/* Ends of revokedCertificates and TBSCertList */
+	if (ctx->state == CRL_STREAM_REVOKED && ctx->revokedLeft == 0) {
+		ctx->state = CRL_STREAM_EXTENSIONS;
+		return PS_SUCCESS;
+	}
+	if (ctx->state >= CRL_STREAM_NEXT_UPDATE &&
+			ctx->state <= CRL_STREAM_EXTENSIONS && ctx->tbsLeft == 0) {
+		crlDigestFinal(&ctx->hashCtx, crl->sigHashLen, crl->sigHash);
+		ctx->state = CRL_STREAM_OUTER_SIGALG;
+		return PS_SUCCESS;
+	}
+
+	if ((rc = crlStreamHeader(p, avail, &hdrLen, &valLen)) != PS_SUCCESS) {
+		return rc;
+	}
+	room = crlStreamRoom(ctx);
+	if (valLen > room || hdrLen > room - valLen) {
+		psTraceCrypto("CRL element overruns its SEQUENCE\n");
+		return PS_PARSE_FAIL;
+	}
+	len = hdrLen + valLen;
+
+	/* OPTIONAL elements */
+	if ((ctx->state == CRL_STREAM_VERSION && *p != ASN_INTEGER) ||
+			(ctx->state == CRL_STREAM_NEXT_UPDATE && !IS_CRL_TIME(*p))) {
+		ctx->state++;
+		return PS_SUCCESS;
+	}
+	if (ctx->state == CRL_STREAM_REVOKED_LIST &&
+			*p != (ASN_SEQUENCE | ASN_CONSTRUCTED)) {
+		ctx->state = CRL_STREAM_EXTENSIONS;
+		return PS_SUCCESS;
+	}
+
+	/* SEQUENCEs that are entered rather than buffered */
+	switch (ctx->state) {
+	case CRL_STREAM_LIST:
+	case CRL_STREAM_TBS:
+		if (*p != (ASN_SEQUENCE | ASN_CONSTRUCTED)) {
+			psTraceCrypto("Initial parse error in psX509CrlStream\n");
+			return PS_PARSE_FAIL;
+		}
+		if (ctx->state == CRL_STREAM_LIST) {
+			ctx->listLeft = valLen;
+		} else {
+			if ((rc = crlStreamEat(ctx, p, hdrLen)) < 0) {
+				return rc;
+			}
+			ctx->tbsLeft = valLen;
+		}
+		ctx->state++;
+		*used = hdrLen;
+		return PS_SUCCESS;
+	case CRL_STREAM_REVOKED_LIST:
+		if ((rc = crlStreamEat(ctx, p, hdrLen)) < 0) {
+			return rc;
+		}
+		ctx->revokedLeft = valLen;
+		ctx->state = CRL_STREAM_REVOKED;
+		*used = hdrLen;
+		return PS_SUCCESS;
+	}
+
+	/* Everything else is decoded whole */
+	if (len > CRL_STREAM_MAX_ELEMENT) {
+		psTraceCrypto("CRL element too large to stream\n");
+		return PS_LIMIT_FAIL;
+	}
+	if (avail < len) {
+		ctx->need = len;
+		return CRL_STREAM_MORE;
+	}
+	if ((rc = crlStreamEat(ctx, p, len)) < 0) {
+		return rc;
+	}
+	c = p;
+	switch (ctx->state) {
+	case CRL_STREAM_VERSION:
+		version = 0;
+		if (getAsnInteger(&c, len, &version) < 0 || version != 1) {
+			psTraceIntCrypto("Version parse error in psX509CrlStream %d\n",
+				version);
+			return PS_PARSE_FAIL;
+		}
 		break;
-#endif /* ENABLE_SHA1_SIGNED_CERTS */
-#ifdef USE_SHA256
-	case SHA256_HASH_SIZE:
-		psSha256PreInit(&hashCtx.sha256);
-		psSha256Init(&hashCtx.sha256);
-		psSha256Update(&hashCtx.sha256, sigStart, (uint32)(sigEnd - sigStart));
-		psSha256Final(&hashCtx.sha256, lcrl->sigHash);
+	case CRL_STREAM_SIGALG:
+		if (getAsnAlgorithmIdentifier(&c, len, &crl->sigAlg, &plen) < 0) {
+			psTraceCrypto("Couldn't parse crl sig algorithm identifier\n");
+			return PS_PARSE_FAIL;
+		}
+		if ((rc = crlDigestLen(crl->sigAlg)) < 0) {
+			return rc;
+		}
+		crl->sigHashLen = rc;
+		crlDigestInit(&ctx->hashCtx, crl->sigHashLen);
+		crlDigestUpdate(&ctx->hashCtx, crl->sigHashLen, ctx->pre, ctx->preLen);
 		break;
-#endif /* USE_SHA256 */
-#ifdef USE_SHA384
-	case SHA384_HASH_SIZE:
-		psSha384PreInit(&hashCtx.sha384);
-		psSha384Init(&hashCtx.sha384);
-		psSha384Update(&hashCtx.sha384, sigStart, (uint32)(sigEnd - sigStart));
-		psSha384Final(&hashCtx.sha384, lcrl->sigHash);
+	case CRL_STREAM_ISSUER:
+		if ((rc = psX509GetDNAttributes(crl->pool, &c, (uint16_t)len,
+				&crl->issuer, 0)) < 0) {
+			psTraceCrypto("Couldn't parse crl issuer DN attributes\n");
+			return rc;
+		}
 		break;
-#endif /* USE_SHA384 */
-#ifdef USE_SHA512
-	case SHA512_HASH_SIZE:
-		psSha512PreInit(&hashCtx.sha512);
-		psSha512Init(&hashCtx.sha512);
-		psSha512Update(&hashCtx.sha512, sigStart, (uint32)(sigEnd - sigStart));
-		psSha512Final(&hashCtx.sha512, lcrl->sigHash);
+	case CRL_STREAM_THIS_UPDATE:
+		if (!IS_CRL_TIME(*p)) {
+			psTraceCrypto("Malformed thisUpdate CRL\n");
+			return PS_PARSE_FAIL;
+		}
+		break;
+	case CRL_STREAM_NEXT_UPDATE:
+		crl->nextUpdateType = *p;
+		if ((crl->nextUpdate = psMalloc(crl->pool, valLen + 1)) == NULL) {
+			return PS_MEM_FAIL;
+		}
+		memcpy(crl->nextUpdate, p + hdrLen, valLen);
+		crl->nextUpdate[valLen] = '\0';
+		break;
+	case CRL_STREAM_REVOKED:
+		if ((rc = getRevokedEntry(&c, p + len, &sn, &snLen)) < 0) {
+			return rc;
+		}
+		if ((rc = crlStreamAddSerial(ctx, sn, snLen)) < 0) {
+			return rc;
+		}
+		*used = len;
+		return PS_SUCCESS; /* Until revokedLeft runs out */
+	case CRL_STREAM_EXTENSIONS:
+		if (*p != (ASN_CONTEXT_SPECIFIC | ASN_CONSTRUCTED | 0) ||
+				getExplicitExtensions(crl->pool, &c, (uint16_t)len, 0,
+				&crl->extensions, 0) < 0 || ctx->tbsLeft != 0) {
+			psTraceCrypto("Extension parse error in psX509CrlStream\n");
+			return PS_PARSE_FAIL;
+		}
+		*used = len;
+		return PS_SUCCESS; /* tbsLeft is 0, TBSCertList ends next step */
+	case CRL_STREAM_OUTER_SIGALG:
+		if (getAsnAlgorithmIdentifier(&c, len, &oi, &plen) < 0) {
+			psTraceCrypto("Couldn't parse crl sig algorithm identifier\n");
+			return PS_PARSE_FAIL;
+		}
+		/* must match */
+		if (oi != crl->sigAlg) {
+			psTraceCrypto("Couldn't match crl sig algorithm identifier\n");
+			return PS_PARSE_FAIL;
+		}
+		break;
+	case CRL_STREAM_SIGNATURE:
+		if ((rc = psX509GetSignature(crl->pool, &c, (uint16_t)len, &crl->sig,
+				&crl->sigLen)) < 0) {
+			psTraceCrypto("Couldn't parse signature\n");
+			return rc;
+		}
+		if (ctx->listLeft != 0) {
+			psTraceCrypto("Trailing data in CRL\n");
+			return PS_PARSE_FAIL;
+		}
 		break;
-#endif /* USE_SHA512 */
 	default:
-		psX509FreeCRL(lcrl);
-		psTraceCrypto("Unsupported digest algorithm in CRL\n");
-		return PS_UNSUPPORTED_FAIL;
+		return PS_PARSE_FAIL;
+	}
+	ctx->state++;
+	*used = len;
+	return PS_SUCCESS;
+}
+
+/* Make room for at least size bytes of partial element */
+static int32_t crlStreamReserve(psX509CrlStream_t *ctx, uint32_t size)
+{
+	unsigned char	*p;
+	uint32_t		n;
+
+	if (size <= ctx->bufSize) {
+		return PS_SUCCESS;
+	}
+	for (n = ctx->bufSize ? ctx->bufSize : 256; n < size; n *= 2);
+	if (n > CRL_STREAM_MAX_ELEMENT) {
+		n = CRL_STREAM_MAX_ELEMENT;
+	}
+	if ((p = psRealloc(ctx->buf, n, ctx->pool)) == NULL) {
+		return PS_MEM_FAIL;
+	}
+	ctx->buf = p;
+	ctx->bufSize = n;
+	return PS_SUCCESS;
+}
+
+/*
+	Feed the next inLen bytes of a DER CRL.  Elements complete in the input
+	are parsed in place; the tail of an element split across calls is
+	copied aside until the rest arrives.  On error the context must still
+	be released with psX509CrlStreamFree.
+*/
+int32_t psX509CrlStreamUpdate(psX509CrlStream_t *ctx, const unsigned char *in,
+				uint32_t inLen)
+{
+	const unsigned char	*p;
+	uint32_t			avail, used, take;
+	int32_t				rc;
+
+	if (ctx == NULL || ctx->crl == NULL || (in == NULL && inLen > 0)) {
+		return PS_ARG_FAIL;
+	}
+	while (inLen > 0) {
+		if (ctx->state == CRL_STREAM_DONE) {
+			psTraceCrypto("Trailing data after CRL\n");
+			return PS_PARSE_FAIL;
+		}
+		if (ctx->bufLen > 0) {
+			/* Top up the partial element, or its header if size unknown */
+			take = ctx->need > ctx->bufLen ? ctx->need - ctx->bufLen : 6;
+			if (take > inLen) {
+				take = inLen;
+			}
+			if ((rc = crlStreamReserve(ctx, ctx->bufLen + take)) < 0) {
+				return rc;
+			}
+			memcpy(ctx->buf + ctx->bufLen, in, take);
+			ctx->bufLen += take;
+			in += take;
+			inLen -= take;
+			p = ctx->buf;
+			avail = ctx->bufLen;
+		} else {
+			p = in;
+			avail = inLen;
+			in += inLen;
+			inLen = 0;
+		}
+		rc = PS_SUCCESS;
+		while (avail > 0 && ctx->state != CRL_STREAM_DONE) {
+			if ((rc = crlStreamStep(ctx, p, avail, &used)) != PS_SUCCESS) {
+				break;
+			}
+			p += used;
+			avail -= used;
+		}
+		if (rc < 0) {
+			return rc;
+		}
+		/* Keep what is left of an incomplete element */
+		if (p != ctx->buf || avail == 0) {
+			if (avail > 0 && ctx->state == CRL_STREAM_DONE) {
+				psTraceCrypto("Trailing data after CRL\n");
+				return PS_PARSE_FAIL;
+			}
+			if ((rc = crlStreamReserve(ctx, avail)) < 0) {
+				return rc;
+			}
+			if (avail > 0) {
+				memmove(ctx->buf, p, avail);
+			}
+			ctx->bufLen = avail;
+		}
+	}
+	return PS_SUCCESS;
+}
+
+/*
+	Finish a streamed CRL.  The context is released whether or not the
+	CRL was complete.  As with psX509ParseCRL the result still has to be
+	authenticated.
+*/
+int32_t psX509CrlStreamFinal(psX509CrlStream_t *ctx, psX509Crl_t **crl)
+{
+	x509revoked_t	*rev;
+	unsigned char	*s;
+	uint32_t		used, i;
+	uint16_t		w;
+
+	if (ctx == NULL || crl == NULL) {
+		return PS_ARG_FAIL;
+	}
+	*crl = NULL;
+	if (ctx->crl == NULL) {
+		return PS_ARG_FAIL;
+	}
+	/* The end of TBSCertList may not have been stepped over yet */
+	while (ctx->state != CRL_STREAM_DONE && ctx->bufLen == 0 &&
+			crlStreamStep(ctx, NULL, 0, &used) == PS_SUCCESS);
+	if (ctx->state != CRL_STREAM_DONE) {
+		psTraceCrypto("Incomplete CRL in psX509CrlStreamFinal\n");
+		psX509CrlStreamFree(ctx);
+		return PS_PARSE_FAIL;
+	}
+	rev = &ctx->crl->revoked;
+	/* Narrow the slots to the longest serial seen, then trim */
+	for (i = 0, w = 1; i < rev->count; i++) {
+		if (rev->serials[(size_t)i * rev->slotLen] + 1 > w) {
+			w = rev->serials[(size_t)i * rev->slotLen] + 1;
+		}
 	}
+	if (rev->count > 0 && w < rev->slotLen) {
+		for (i = 0; i < rev->count; i++) {
+			memmove(rev->serials + (size_t)i * w,
+				rev->serials + (size_t)i * rev->slotLen, w);
+		}
+		rev->slotLen = w;
+	}
+	if ((size_t)rev->count * rev->slotLen < rev->baseLen) {
+		if (rev->count == 0) {
+			psFree(rev->base, ctx->crl->pool);
+			memset(rev, 0x0, sizeof(x509revoked_t));
+		} else if ((s = psRealloc(rev->base,
+				(size_t)rev->count * rev->slotLen, ctx->crl->pool)) != NULL) {
+			rev->base = rev->serials = s;
+			rev->baseLen = (size_t)rev->count * rev->slotLen;
+		}
+	}
+	sortRevokedSerials(rev);
+	*crl = ctx->crl;
+	ctx->crl = NULL;
+	psX509CrlStreamFree(ctx);
+	return PS_SUCCESS;
+}
+
+#ifdef MATRIX_USE_FILE_SYSTEM
+#define CRL_FILE_CHUNK	16384
 
+/*
+	Parse a DER CRL file through the streaming parser, so the file is never
+	read into memory whole however large it is.
+*/
+int32_t psX509ParseCRLFile(psPool_t *pool, const char *fileName,
+				psX509Crl_t **crl)
+{
+	psX509CrlStream_t	ctx;
+	FILE				*fp;
+	unsigned char		*buf;
+	size_t				n;
+	int32_t				rc;
+
+	if (fileName == NULL || crl == NULL) {
+		return PS_ARG_FAIL;
+	}
+	*crl = NULL;
+	if ((fp = fopen(fileName, "rb")) == NULL) {
+		psTraceStrCrypto("Unable to open %s\n", (char *)fileName);
+		return PS_PLATFORM_FAIL;
+	}
+	if ((buf = psMalloc(pool, CRL_FILE_CHUNK)) == NULL) {
+		fclose(fp);
+		return PS_MEM_FAIL;
+	}
+	if ((rc = psX509CrlStreamInit(pool, &ctx)) == PS_SUCCESS) {
+		while ((n = fread(buf, 1, CRL_FILE_CHUNK, fp)) > 0) {
+			if ((rc = psX509CrlStreamUpdate(&ctx, buf, (uint32_t)n)) < 0) {
+				break;
+			}
+		}
+		if (rc == PS_SUCCESS && ferror(fp)) {
+			rc = PS_PLATFORM_FAIL;
+		}
+		if (rc == PS_SUCCESS) {
+			rc = psX509CrlStreamFinal(&ctx, crl);
+		} else {
+			psX509CrlStreamFree(&ctx);
+		}
+	}
+	psFree(buf, pool);
+	fclose(fp);
+	return rc;
+}
+
+#ifdef USE_HMAC_SHA256
+/******************************************************************************/
+/*
+	CRL index files hold what the g_CRL cache needs from a parsed CRL so it
+	can be reloaded without psX509ParseCRL.  All integers are big endian.
+		"MCRL" 3
+		nextUpdateType(1) nextUpdateLen(1) nextUpdate
+		issuer DN hash (SHA1_HASH_SIZE)
+		authKeyIdLen(2) authKeyId
+		count(4) slotLen(2) serial slots, sorted
+		HMAC-SHA256 of everything above
+	Nothing in the file ties the slots to the issuer signature; checking
+	that would mean rebuilding them from the TBSCertList, which is the parse
+	the index exists to skip.  Instead only an authenticated CRL may be
+	written, under a key held by the caller, and a file whose MAC verifies
+	under that key loads as authenticated.  Without the key an index is
+	worth nothing, so the key is required both ways.
+*/
+#define CRL_INDEX_MAGIC		"MCRL"
+#define CRL_INDEX_VERSION	3
+#define CRL_INDEX_MAC_LEN	SHA256_HASH_SIZE
+
+static unsigned char *putIndexInt(unsigned char *c, uint32_t v, int32 len)
+{
+	while (len-- > 0) {
+		*c++ = (unsigned char)(v >> (8 * len));
+	}
+	return c;
+}
+
+static int32_t getIndexInt(const unsigned char **pp, const unsigned char *end,
+				int32 len, uint32_t *v)
+{
+	const unsigned char	*p = *pp;
+
+	if (end - p < len) {
+		return PS_PARSE_FAIL;
+	}
+	*v = 0;
+	while (len-- > 0) {
+		*v = (*v << 8) | *p++;
+	}
+	*pp = p;
+	return PS_SUCCESS;
+}
+
+int32_t psX509WriteCRLIndex(const psX509Crl_t *crl, const char *fileName,
+				const unsigned char *key, uint16_t keyLen)
+{
+	FILE			*fp;
+	psHmacSha256_t	hmac;
+	unsigned char	*hdr, *c;
+	unsigned char	mac[CRL_INDEX_MAC_LEN];
+	uint32_t		hdrLen, nuLen;
+	size_t			slotsLen;
+	int32_t			rc;
+
+	if (crl == NULL || fileName == NULL || key == NULL || keyLen == 0) {
+		return PS_ARG_FAIL;
+	}
+	if (crl->authenticated != PS_TRUE) {
+		psTraceCrypto("Only an authenticated CRL can be indexed\n");
+		return PS_CERT_AUTH_FAIL;
+	}
+	nuLen = crl->nextUpdate ? (uint32_t)strlen(crl->nextUpdate) : 0;
+	if (nuLen > 0xFF) {
+		return PS_LIMIT_FAIL;
+	}
+	hdrLen = 5 + 2 + nuLen + SHA1_HASH_SIZE + 2 + crl->extensions.ak.keyLen +
+		4 + 2;
+	if ((hdr = psMalloc(crl->pool, hdrLen)) == NULL) {
+		return PS_MEM_FAIL;
+	}
+	c = hdr;
+	memcpy(c, CRL_INDEX_MAGIC, 4); c += 4;
+	*c++ = CRL_INDEX_VERSION;
+	*c++ = (unsigned char)crl->nextUpdateType;
+	*c++ = (unsigned char)nuLen;
+	memcpy(c, crl->nextUpdate, nuLen); c += nuLen;
+	memcpy(c, crl->issuer.hash, SHA1_HASH_SIZE); c += SHA1_HASH_SIZE;
+	c = putIndexInt(c, crl->extensions.ak.keyLen, 2);
+	memcpy(c, crl->extensions.ak.keyId, crl->extensions.ak.keyLen);
+	c += crl->extensions.ak.keyLen;
+	c = putIndexInt(c, crl->revoked.count, 4);
+	c = putIndexInt(c, crl->revoked.slotLen, 2);
+	psAssert((uint32_t)(c - hdr) == hdrLen);
+
+	slotsLen = (size_t)crl->revoked.count * crl->revoked.slotLen;
+	if ((rc = psHmacSha256Init(&hmac, key, keyLen)) < 0) {
+		psFree(hdr, crl->pool);
+		return rc;
+	}
+	psHmacSha256Update(&hmac, hdr, hdrLen);
+	if (slotsLen > 0) {
+		psHmacSha256Update(&hmac, crl->revoked.serials, (uint32_t)slotsLen);
+	}
+	psHmacSha256Final(&hmac, mac);
+
+	rc = PS_SUCCESS;
+	if ((fp = fopen(fileName, "wb")) == NULL) {
+		psTraceStrCrypto("Unable to open %s\n", (char *)fileName);
+		psFree(hdr, crl->pool);
+		return PS_PLATFORM_FAIL;
+	}
+	if (fwrite(hdr, 1, hdrLen, fp) != hdrLen ||
+			(slotsLen > 0 &&
+			fwrite(crl->revoked.serials, slotsLen, 1, fp) != 1) ||
+			fwrite(mac, sizeof(mac), 1, fp) != 1) {
+		rc = PS_PLATFORM_FAIL;
+	}
+	if (fclose(fp) != 0) {
+		rc = PS_PLATFORM_FAIL;
+	}
+	psFree(hdr, crl->pool);
+	return rc;
+}
+
+/* Check the trailing MAC of an index file, see above */
+static int32_t checkCRLIndexMac(const unsigned char *buf, size_t bufLen,
+				const unsigned char *key, uint16_t keyLen)
+{
+	psHmacSha256_t	hmac;
+	unsigned char	mac[CRL_INDEX_MAC_LEN];
+	size_t			len;
+	int32_t			rc;
+
+	if (bufLen < CRL_INDEX_MAC_LEN) {
+		return PS_PARSE_FAIL;
+	}
+	len = bufLen - CRL_INDEX_MAC_LEN;
+	if ((rc = psHmacSha256Init(&hmac, key, keyLen)) < 0) {
+		return rc;
+	}
+	psHmacSha256Update(&hmac, buf, (uint32_t)len);
+	psHmacSha256Final(&hmac, mac);
+	if (memcmpct(mac, buf + len, CRL_INDEX_MAC_LEN) != 0) {
+		psTraceCrypto("CRL index MAC does not verify\n");
+		return PS_AUTH_FAIL;
+	}
+	return PS_SUCCESS;
+}
+
+/* Fill in a CRL from the header of an index file, see above */
+static int32_t parseCRLIndex(psX509Crl_t *crl, const unsigned char *buf,
+				size_t bufLen)
+{
+	const unsigned char	*p = buf, *end = buf + bufLen, *prev;
+	uint32_t			v, nuLen;
+	size_t				i;
+
+	if (bufLen < 7 || memcmp(p, CRL_INDEX_MAGIC, 4) != 0 ||
+			p[4] != CRL_INDEX_VERSION) {
+		psTraceCrypto("Not a CRL index file\n");
+		return PS_PARSE_FAIL;
+	}
+	p += 5;
+	crl->nextUpdateType = *p++;
+	nuLen = *p++;
+	if ((uint32_t)(end - p) < nuLen + SHA1_HASH_SIZE) {
+		return PS_PARSE_FAIL;
+	}
+	if (nuLen > 0) {
+		if ((crl->nextUpdate = psMalloc(crl->pool, nuLen + 1)) == NULL) {
+			return PS_MEM_FAIL;
+		}
+		memcpy(crl->nextUpdate, p, nuLen);
+		crl->nextUpdate[nuLen] = '\0';
+		p += nuLen;
+	}
+	memcpy(crl->issuer.hash, p, SHA1_HASH_SIZE);
+	p += SHA1_HASH_SIZE;
+	if (getIndexInt(&p, end, 2, &v) < 0 || (uint32_t)(end - p) < v) {
+		return PS_PARSE_FAIL;
+	}
+	if ((crl->extensions.ak.keyLen = (uint16_t)v) > 0) {
+		if ((crl->extensions.ak.keyId = psMalloc(crl->pool, v)) == NULL) {
+			return PS_MEM_FAIL;
+		}
+		memcpy(crl->extensions.ak.keyId, p, v);
+		p += v;
+	}
+	if (getIndexInt(&p, end, 4, &crl->revoked.count) < 0 ||
+			getIndexInt(&p, end, 2, &v) < 0 || v > CRL_MAX_SERIAL_SLOT ||
+			(crl->revoked.count > 0 && v == 0) ||
+			(size_t)(end - p) != (size_t)crl->revoked.count * v) {
+		return PS_PARSE_FAIL;
+	}
+	crl->revoked.slotLen = (uint16_t)v;
+	crl->revoked.serials = (unsigned char *)p;
+	/* Binary search relies on the order, so check it once here */
+	for (i = 1, prev = p; i < crl->revoked.count; i++, prev += v) {
+		if (prev[0] >= v || memcmp(prev, prev + v, v) > 0) {
+			psTraceCrypto("CRL index serials not sorted\n");
+			return PS_PARSE_FAIL;
+		}
+	}
+	return PS_SUCCESS;
+}
+
+/*
+	Load a CRL index written by psX509WriteCRLIndex with the same key.  On
+	POSIX the serial slots stay in a read-only mapping of the file, so even
+	a very large CRL loads in the time it takes to check its MAC and slot
+	order.  The result is authenticated, see the file format above.
+*/
+int32_t psX509LoadCRLIndex(psPool_t *pool, const char *fileName,
+				const unsigned char *key, uint16_t keyLen, psX509Crl_t **crl)
+{
+	psX509Crl_t		*lcrl;
+	int32_t			rc;
+#ifdef CRL_INDEX_MMAP
+	struct stat		st;
+	int				fd;
+	void			*map;
+#else
+	int32			len;
+#endif
+
+	if (fileName == NULL || crl == NULL || key == NULL || keyLen == 0) {
+		return PS_ARG_FAIL;
+	}
+	*crl = NULL;
+	if ((lcrl = allocCRL(pool)) == NULL) {
+		return PS_MEM_FAIL;
+	}
+	/* The CRL owns the file contents, freeing it releases them */
+#ifdef CRL_INDEX_MMAP
+	rc = PS_PLATFORM_FAIL;
+	if ((fd = open(fileName, O_RDONLY)) >= 0) {
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map != MAP_FAILED) {
+				lcrl->revoked.base = map;
+				lcrl->revoked.baseLen = (size_t)st.st_size;
+				lcrl->revoked.mapped = 1;
+				rc = PS_SUCCESS;
+			}
+		}
+		close(fd);
+	}
+#else
+	if ((rc = psGetFileBuf(lcrl->pool, fileName, &lcrl->revoked.base,
+			&len)) == PS_SUCCESS) {
+		lcrl->revoked.baseLen = (size_t)len;
+	}
+#endif
+	if (rc == PS_SUCCESS) {
+		rc = checkCRLIndexMac(lcrl->revoked.base, lcrl->revoked.baseLen,
+			key, keyLen);
+	}
+	if (rc == PS_SUCCESS) {
+		rc = parseCRLIndex(lcrl, lcrl->revoked.base,
+			lcrl->revoked.baseLen - CRL_INDEX_MAC_LEN);
+	}
+	if (rc < 0) {
+		psTraceStrCrypto("Error loading CRL index %s\n", (char *)fileName);
+		psX509FreeCRL(lcrl);
+		return rc;
+	}
+	lcrl->authenticated = PS_TRUE;
 	*crl = lcrl;
-	
 	return PS_SUCCESS;
 }
+#endif /* USE_HMAC_SHA256 */
+#endif /* MATRIX_USE_FILE_SYSTEM */
 
 /*
 	If the provided cert has a URL based CRL Distribution point, return
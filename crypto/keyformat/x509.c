@@ -150,6 +150,9 @@ static const struct {
 /*
 	Hybrid ASN.1/X.509 cert parsing helpers
 */
+static int32_t parseCertExtensions(psPool_t *pool, const unsigned char **pp,
+				uint16_t len, psX509Cert_t *cert, int32_t flags,
+				const unsigned char *certStart);
 static int32_t getExplicitVersion(const unsigned char **pp, uint16_t len,
 				int32_t expVal, int32_t *val);
 static int32_t getTimeValidity(psPool_t *pool, const unsigned char **pp,
@@ -868,8 +871,8 @@ int32 psX509ParseCert(psPool_t *pool, const unsigned char *pp, uint32 size,
 					getImplicitBitString(pool, &p, (uint32)(end - p),
 						IMPLICIT_SUBJECT_ID, &cert->uniqueSubjectId,
 						&cert->uniqueSubjectIdLen) < 0 ||
-					getExplicitExtensions(pool, &p, (uint32)(end - p),
-						EXPLICIT_EXTENSION, &cert->extensions, 0) < 0) {
+					parseCertExtensions(pool, &p, (uint32)(end - p), cert,
+						flags, certStart) < 0) {
 				psTraceCrypto("There was an error parsing a certificate\n");
 				psTraceCrypto("extension.  This is likely caused by an\n");
 				psTraceCrypto("extension format that is not currently\n");
@@ -1194,6 +1197,9 @@ void x509FreeExtensions(x509v3extensions_t *extensions)
 #endif /* CRL */
 
 #ifdef USE_FULL_CERT_PARSE
+	if (extensions->deferredCopy) {
+		psFree((unsigned char *)extensions->deferred, extensions->pool);
+	}
 	if (extensions->nameConstraints.excluded) {
 		active = extensions->nameConstraints.excluded;
 		while (active != NULL) {
@@ -2448,6 +2454,69 @@ int32_t parseAuthorityInfoAccess(psPool_t *pool,
 }
 #endif /* USE_FULL_CERT_PARSE */
 
+#ifdef USE_FULL_CERT_PARSE
+/* Values of x509v3extensions_t.lazy */
+#define X509_EXT_ALL		0	/* Decode every extension */
+#define X509_EXT_LAZY		1	/* Keep deferrable extensions as DER */
+#define X509_EXT_DEFERRED	2	/* Decode only the deferrable extensions */
+
+/*
+	Extensions a TLS peer chain doesn't need to be validated.  Only parsed
+	here, they can wait until the application asks for them.  The other
+	decoded extensions (basicConstraints, key usages, subjectAltName, key
+	identifiers and CRL distribution points) are read by chain validation,
+	name matching or CRL lookup on every handshake.
+*/
+static int32_t isDeferredExt(oid_e noid)
+{
+	switch (noid) {
+	case OID_ENUM(id_ce_certificatePolicies):
+	case OID_ENUM(id_ce_policyConstraints):
+	case OID_ENUM(id_ce_policyMappings):
+	case OID_ENUM(id_ce_issuerAltName):
+	case OID_ENUM(id_ce_nameConstraints):
+	case OID_ENUM(id_pe_authorityInfoAccess):
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+#define X509_MAX_DER_DEPTH	16
+
+/*
+	Structural check for an extension value that isn't decoded yet.  Every
+	TLV must be complete and constructed ones must be filled exactly by
+	their contents, so a malformed value is refused at parse time rather
+	than by psX509DecodeExtensions.
+*/
+static int32_t checkDerStructure(const unsigned char *p, uint32_t len,
+				int32_t depth)
+{
+	const unsigned char	*end = p + len;
+	uint32_t			vlen;
+	unsigned char		tag;
+
+	if (depth > X509_MAX_DER_DEPTH) {
+		return PS_PARSE_FAIL;
+	}
+	while (p < end) {
+		tag = *p++;
+		/* Multi-byte tag numbers don't occur in these extensions */
+		if ((tag & 0x1F) == 0x1F ||
+				getAsnLength32(&p, (uint32_t)(end - p), &vlen, 0) < 0) {
+			return PS_PARSE_FAIL;
+		}
+		if ((tag & ASN_CONSTRUCTED) &&
+				checkDerStructure(p, vlen, depth + 1) < 0) {
+			return PS_PARSE_FAIL;
+		}
+		p += vlen;
+	}
+	return PS_SUCCESS;
+}
+#endif /* USE_FULL_CERT_PARSE */
+
 int32_t getExplicitExtensions(psPool_t *pool, const unsigned char **pp,
 								 uint16_t inlen, int32_t expVal,
 								 x509v3extensions_t *extensions, uint8_t known)
@@ -2465,6 +2534,8 @@ int32_t getExplicitExtensions(psPool_t *pool, const unsigned char **pp,
 	int32_t				nc = 0;
 	x509PolicyInformation_t *pPolicy;
 	const unsigned char *policiesEnd;
+	const unsigned char	*deferStart;
+	int32_t				haveDeferred = 0;
 #endif /* USE_FULL_CERT_PARSE */
 
 	end = p + inlen;
@@ -2472,6 +2543,9 @@ int32_t getExplicitExtensions(psPool_t *pool, const unsigned char **pp,
 		return PS_ARG_FAIL;
 	}
 	extensions->pool = pool;
+#ifdef USE_FULL_CERT_PARSE
+	if (extensions->lazy != X509_EXT_DEFERRED)
+#endif
 	extensions->bc.cA = CA_UNDEFINED;
 
 	if (known) {
@@ -2490,6 +2564,9 @@ int32_t getExplicitExtensions(psPool_t *pool, const unsigned char **pp,
 		return PS_PARSE_FAIL;
 	}
 KNOWN_EXT:
+#ifdef USE_FULL_CERT_PARSE
+	deferStart = p;
+#endif
 /*
 	Extensions  ::=  SEQUENCE SIZE (1..MAX) OF Extension
 
@@ -2568,6 +2645,28 @@ KNOWN_EXT:
 		if (critical) {
 			extensions->critFlags |= EXT_CRIT_FLAG(noid);
 		}
+#ifdef USE_FULL_CERT_PARSE
+		if (extensions->lazy == X509_EXT_LAZY && isDeferredExt(noid)) {
+			if (critical && noid == OID_ENUM(id_ce_nameConstraints)) {
+				psTraceCrypto("ERROR: critical nameConstraints unsupported\n");
+				return PS_PARSE_FAIL;
+			}
+			/* Each deferred extension value is a single SEQUENCE */
+			if (len < 2 || *p != (ASN_SEQUENCE | ASN_CONSTRUCTED) ||
+					p + len != extStart + fullExtLen ||
+					checkDerStructure(p, len, 0) < 0) {
+				psTraceCrypto("Malformed deferred extension\n");
+				return PS_PARSE_FAIL;
+			}
+			haveDeferred = 1;
+			p = extStart + fullExtLen;
+			continue;
+		}
+		if (extensions->lazy == X509_EXT_DEFERRED && !isDeferredExt(noid)) {
+			p = extStart + fullExtLen;
+			continue;
+		}
+#endif /* USE_FULL_CERT_PARSE */
 
 		switch (noid) {
 /*
@@ -3131,10 +3230,104 @@ KNOWN_EXT:
 				break;
 		}
 	}
+#ifdef USE_FULL_CERT_PARSE
+	/* The Extensions DER stands in for everything deferred.  It points
+		into the caller's buffer until parseCertExtensions places it */
+	if (haveDeferred) {
+		extensions->deferred = deferStart;
+		extensions->deferredLen = (uint16_t)(extEnd - deferStart);
+	}
+#endif /* USE_FULL_CERT_PARSE */
 	*pp = p;
 	return 0;
 }
 
+/*
+	Certificate extensions, deferring the ones psX509DecodeExtensions can
+	fill in later if the caller asked for CERT_LAZY_EXTENSIONS.  The
+	deferred DER is referenced in cert->unparsedBin when the cert keeps
+	one (CERT_STORE_UNPARSED_BUFFER), otherwise it is copied since the
+	parse buffer, a TLS record for instance, goes away.
+*/
+static int32_t parseCertExtensions(psPool_t *pool, const unsigned char **pp,
+				uint16_t len, psX509Cert_t *cert, int32_t flags,
+				const unsigned char *certStart)
+{
+	int32_t		rc;
+#ifdef USE_FULL_CERT_PARSE
+	x509v3extensions_t	*ext = &cert->extensions;
+	unsigned char		*copy;
+
+	ext->lazy = (flags & CERT_LAZY_EXTENSIONS) ?
+		X509_EXT_LAZY : X509_EXT_ALL;
+#endif
+	rc = getExplicitExtensions(pool, pp, len, EXPLICIT_EXTENSION,
+		&cert->extensions, 0);
+#ifdef USE_FULL_CERT_PARSE
+	ext->lazy = X509_EXT_ALL;
+	if (rc < 0 || ext->deferred == NULL) {
+		return rc;
+	}
+	if (cert->unparsedBin) {
+		ext->deferred = cert->unparsedBin + (ext->deferred - certStart);
+	} else {
+		if ((copy = psMalloc(pool, ext->deferredLen)) == NULL) {
+			ext->deferred = NULL;
+			return PS_MEM_FAIL;
+		}
+		memcpy(copy, ext->deferred, ext->deferredLen);
+		ext->deferred = copy;
+		ext->deferredCopy = 1;
+	}
+#else
+	PS_VARIABLE_SET_BUT_UNUSED(certStart);
+#endif
+	return rc;
+}
+
+/******************************************************************************/
+/*
+	Decode the extensions left undecoded by CERT_LAZY_EXTENSIONS parsing.
+	Must be called before reading the certificatePolicy, policyConstraints,
+	policyMappings, issuerAltName, nameConstraints or authorityInfoAccess
+	members of such a cert.  Does nothing if there is nothing to decode.
+*/
+int32_t psX509DecodeExtensions(psX509Cert_t *cert)
+{
+#ifdef USE_FULL_CERT_PARSE
+	x509v3extensions_t	*ext;
+	const unsigned char	*p;
+	int32_t				rc;
+
+	if (cert == NULL) {
+		return PS_ARG_FAIL;
+	}
+	ext = &cert->extensions;
+	if (ext->deferred == NULL) {
+		return PS_SUCCESS;
+	}
+	p = ext->deferred;
+	ext->lazy = X509_EXT_DEFERRED;
+	rc = getExplicitExtensions(cert->pool, &p, ext->deferredLen, 0, ext, 1);
+	ext->lazy = X509_EXT_ALL;
+	if (ext->deferredCopy) {
+		psFree((unsigned char *)ext->deferred, cert->pool);
+		ext->deferredCopy = 0;
+	}
+	ext->deferred = NULL;
+	ext->deferredLen = 0;
+	if (rc < 0) {
+		psTraceCrypto("Error decoding deferred certificate extensions\n");
+		return rc;
+	}
+#else
+	if (cert == NULL) {
+		return PS_ARG_FAIL;
+	}
+#endif /* USE_FULL_CERT_PARSE */
+	return PS_SUCCESS;
+}
+
 /******************************************************************************/
 /*
 	Although a certificate serial number is encoded as an integer type, that
@@ -4376,6 +4569,162 @@ int32 psX509AuthenticateCert(psPool_t *pool, psX509Cert_t *subjectCert,
 	return PS_SUCCESS;
 }
 
+/******************************************************************************/
+/*
+	Trusted CA lookup tables.  Two open addressed tables of cert pointers
+	share one allocation: one keyed by the SHA1 subject DN hash computed at
+	parse time and one keyed by the subjectKeyIdentifier.  Both are kept at
+	most half full so every probe sequence ends on an empty slot.
+*/
+#define INDEX_MIN_SIZE	16
+#define INDEX_BY_DN		0x40000000	/* psX509FindIssuer is in the DN table */
+#define INDEX_DONE		0x80000000	/* psX509FindIssuer has no more */
+
+static uint32_t dnIndexHash(const char *hash)
+{
+	const unsigned char	*h = (const unsigned char *)hash;
+
+	/* Already a digest, any four bytes will do */
+	return ((uint32_t)h[0] << 24) | ((uint32_t)h[1] << 16) |
+		((uint32_t)h[2] << 8) | (uint32_t)h[3];
+}
+
+static uint32_t keyIdIndexHash(const unsigned char *id, uint16_t len)
+{
+	uint32_t	h = 2166136261U;
+
+	while (len-- > 0) {
+		h = (h ^ *id++) * 16777619U;
+	}
+	return h;
+}
+
+static int32_t sameKeyId(const psX509Cert_t *ic, const psX509Cert_t *sc)
+{
+	return ic->extensions.sk.len > 0 &&
+		ic->extensions.sk.len == sc->extensions.ak.keyLen &&
+		memcmp(ic->extensions.sk.id, sc->extensions.ak.keyId,
+			ic->extensions.sk.len) == 0;
+}
+
+static void indexInsert(psX509Cert_t **table, uint32_t mask, uint32_t h,
+				psX509Cert_t *cert)
+{
+	while (table[h & mask] != NULL) {
+		h++;
+	}
+	table[h & mask] = cert;
+}
+
+/*
+	Build the lookup tables for a list of trusted certs.  The certs are
+	referenced, not copied, so the index must be freed with
+	psX509FreeCertIndex before the list is freed.
+*/
+int32 psX509IndexCerts(psPool_t *pool, psX509Cert_t *certs,
+				psX509CertIndex_t *idx)
+{
+	psX509Cert_t	*cert;
+	uint32_t		count, size, mask;
+
+	if (idx == NULL) {
+		return PS_ARG_FAIL;
+	}
+	memset(idx, 0x0, sizeof(psX509CertIndex_t));
+	for (count = 0, cert = certs; cert != NULL; cert = cert->next) {
+		count++;
+	}
+	if (count == 0) {
+		return PS_SUCCESS;
+	}
+	for (size = INDEX_MIN_SIZE; size < 2 * count; size <<= 1);
+	if (size >= INDEX_BY_DN) {
+		return PS_LIMIT_FAIL;
+	}
+	idx->byDN = psMalloc(pool, 2 * size * sizeof(psX509Cert_t *));
+	if (idx->byDN == NULL) {
+		return PS_MEM_FAIL;
+	}
+	memset(idx->byDN, 0x0, 2 * size * sizeof(psX509Cert_t *));
+	idx->byKeyId = idx->byDN + size;
+	idx->pool = pool;
+	idx->size = size;
+	mask = size - 1;
+	for (cert = certs; cert != NULL; cert = cert->next) {
+		indexInsert(idx->byDN, mask, dnIndexHash(cert->subject.hash), cert);
+		if (cert->extensions.sk.len > 0) {
+			indexInsert(idx->byKeyId, mask,
+				keyIdIndexHash(cert->extensions.sk.id,
+				cert->extensions.sk.len), cert);
+		}
+	}
+	return PS_SUCCESS;
+}
+
+void psX509FreeCertIndex(psX509CertIndex_t *idx)
+{
+	if (idx == NULL) {
+		return;
+	}
+	if (idx->byDN) {
+		psFree(idx->byDN, idx->pool);
+	}
+	memset(idx, 0x0, sizeof(psX509CertIndex_t));
+}
+
+/*
+	Return the next indexed cert that may have issued subject, or NULL when
+	there are no more.  *pos must be 0 on the first call and is passed back
+	unchanged on the following ones.  Certs whose subjectKeyIdentifier
+	matches the authorityKeyIdentifier of subject come first, then any
+	other cert with a matching DN.  A DN match is required either way since
+	psX509AuthenticateCert would reject the pair otherwise.
+*/
+psX509Cert_t *psX509FindIssuer(const psX509CertIndex_t *idx,
+				const psX509Cert_t *subject, uint32_t *pos)
+{
+	const x509extAuthKeyId_t	*ak;
+	psX509Cert_t				*ic;
+	uint32_t					h, i, mask;
+
+	if (idx == NULL || idx->size == 0 || subject == NULL ||
+			(*pos & INDEX_DONE)) {
+		return NULL;
+	}
+	mask = idx->size - 1;
+	ak = &subject->extensions.ak;
+	if (!(*pos & INDEX_BY_DN)) {
+		if (ak->keyLen > 0) {
+			h = keyIdIndexHash(ak->keyId, ak->keyLen);
+			for (i = *pos; i <= mask; i++) {
+				if ((ic = idx->byKeyId[(h + i) & mask]) == NULL) {
+					break;
+				}
+				if (sameKeyId(ic, subject) && memcmp(ic->subject.hash,
+						subject->issuer.hash, SHA1_HASH_SIZE) == 0) {
+					*pos = i + 1;
+					return ic;
+				}
+			}
+		}
+		*pos = INDEX_BY_DN;
+	}
+	h = dnIndexHash(subject->issuer.hash);
+	for (i = *pos & ~INDEX_BY_DN; i <= mask; i++) {
+		if ((ic = idx->byDN[(h + i) & mask]) == NULL) {
+			break;
+		}
+		if (memcmp(ic->subject.hash, subject->issuer.hash,
+				SHA1_HASH_SIZE) == 0 &&
+				!(ak->keyLen > 0 && sameKeyId(ic, subject))) {
+			*pos = INDEX_BY_DN | (i + 1);
+			return ic;
+		}
+	}
+	*pos = INDEX_DONE;
+	return NULL;
+}
+
 #ifdef USE_RSA
 /******************************************************************************/
 /*
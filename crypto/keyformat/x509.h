@@ -63,6 +63,9 @@ enum {
 /* Parsing flags */
 #define	CERT_STORE_UNPARSED_BUFFER	0x1
 #define	CERT_STORE_DN_BUFFER		0x2
+/* Leave policy, policy mapping/constraint, issuerAltName, nameConstraints
+	and authorityInfoAccess extensions for psX509DecodeExtensions */
+#define	CERT_LAZY_EXTENSIONS		0x4
 
 #ifdef USE_CERT_PARSE
 
@@ -512,15 +515,33 @@ typedef struct {
 	unsigned char				*crlNum;
 	int32						crlNumLen;
 #endif /* USE_CRL */
+#ifdef USE_FULL_CERT_PARSE
+	const unsigned char			*deferred; /* Undecoded Extensions DER */
+	uint16_t					deferredLen;
+	uint8_t						deferredCopy; /* deferred is our own */
+	uint8_t						lazy; /* Which extensions to decode */
+#endif /* USE_FULL_CERT_PARSE */
 } x509v3extensions_t;
 
 #endif /* USE_CERT_PARSE */
 
 #ifdef USE_CRL
-typedef struct x509revoked {
-	unsigned char		*serial;
-	uint16_t			serialLen;
-	struct x509revoked	*next;
+/*
+	Revoked serial numbers of a CRL, sorted for binary search.  Each of the
+	count slots is slotLen bytes: the serial length, then the serial
+	zero padded, so slots order by length and then value under memcmp.
+	The slots live in base, which is either allocated from the CRL pool
+	or a read-only mapping of an index file.
+*/
+#define CRL_MAX_SERIAL_SLOT	256	/* Length byte and a 255 byte serial */
+
+typedef struct {
+	unsigned char		*serials;
+	uint32_t			count;
+	uint16_t			slotLen;
+	uint8_t				mapped;
+	unsigned char		*base;
+	size_t				baseLen;
 } x509revoked_t;
 
 typedef struct psCRL {
@@ -536,9 +557,34 @@ typedef struct psCRL {
 	uint16_t			expired;
 	x509DNattributes_t	issuer;
 	x509v3extensions_t	extensions;
-	x509revoked_t		*revoked;
+	x509revoked_t		revoked;
 	struct psCRL		*next;
 } psX509Crl_t;
+
+/*
+	State of an incremental CRL parse, see psX509CrlStreamInit.  Only a DER
+	element split across input chunks is buffered, and no element may be
+	larger than CRL_STREAM_MAX_ELEMENT.
+*/
+#define CRL_STREAM_MAX_ELEMENT	0xFFFF
+#define CRL_STREAM_PRE_LEN		128	/* TBS bytes ahead of its signature alg */
+
+typedef struct {
+	psPool_t			*pool;
+	psX509Crl_t			*crl;		/* Being filled in */
+	int32_t				state;
+	unsigned char		*buf;		/* Partial element */
+	uint32_t			bufLen;
+	uint32_t			bufSize;
+	uint32_t			need;		/* Size of that element, 0 if unknown */
+	uint32_t			listLeft;	/* Unparsed bytes of CertificateList */
+	uint32_t			tbsLeft;	/* ... of TBSCertList */
+	uint32_t			revokedLeft; /* ... of revokedCertificates */
+	uint32_t			revokedMax;	/* Slots allocated in crl->revoked */
+	psDigestContext_t	hashCtx;	/* Over TBSCertList */
+	unsigned char		pre[CRL_STREAM_PRE_LEN];
+	uint16_t			preLen;
+} psX509CrlStream_t;
 #endif
 
 
@@ -593,6 +639,16 @@ typedef struct psCert {
 	struct psCert		*next;
 } psX509Cert_t;
 
+#ifdef USE_CERT_PARSE
+/* Issuer lookup tables over a list of trusted certs, see psX509IndexCerts */
+typedef struct {
+	psPool_t			*pool;
+	psX509Cert_t		**byDN;		/* Keyed by subject DN hash */
+	psX509Cert_t		**byKeyId;	/* Keyed by subjectKeyIdentifier */
+	uint32_t			size;		/* Slots per table, a power of two */
+} psX509CertIndex_t;
+#endif /* USE_CERT_PARSE */
+
 
 extern int32_t psX509GetSignature(psPool_t *pool, const unsigned char **pp,
 				uint16_t len, unsigned char **sig, uint16_t *sigLen);
@@ -38,22 +38,102 @@
 
 #ifdef USE_MULTITHREADING
 static psMutex_t			prngLock;
+/*
+	With thread local storage each thread reads from its own context and
+	random fetches don't serialize on prngLock.  Otherwise all threads share
+	gMatrixPrng under the lock.
+*/
+#if defined(__GNUC__) || defined(__clang__)
+#define PRNG_THREAD_LOCAL	__thread
+#elif defined(_MSC_VER)
+#define PRNG_THREAD_LOCAL	__declspec(thread)
 #endif
+#endif /* USE_MULTITHREADING */
 
 static psRandom_t gMatrixPrng;
 static short	gPrngInit = 0;
 
+/*
+	Bumped by psOpenPrng and in the child after a fork.  A context seeded
+	in an older generation is seeded again before its next read, so a
+	forked child never repeats its parent's output.  0 is never current.
+*/
+static volatile uint32	gPrngGeneration = 0;
+static uint32			gMatrixPrngGeneration = 0;
+
+#ifdef PRNG_THREAD_LOCAL
+static PRNG_THREAD_LOCAL psRandom_t	tPrng;
+static PRNG_THREAD_LOCAL uint32		tPrngGeneration;
+#endif
+
+static void prngNewGeneration(void)
+{
+	if (++gPrngGeneration == 0) {
+		gPrngGeneration = 1;
+	}
+}
+
+#if defined(USE_MULTITHREADING) && defined(POSIX)
+/*
+	prngLock is held across fork() so the child can't inherit it locked by
+	a thread that doesn't exist there
+*/
+static void prngForkPrepare(void)
+{
+	if (gPrngInit) {
+		psLockMutex(&prngLock);
+	}
+}
+
+static void prngForkParent(void)
+{
+	if (gPrngInit) {
+		psUnlockMutex(&prngLock);
+	}
+}
+
+static void prngForkChild(void)
+{
+	if (gPrngInit) {
+		psUnlockMutex(&prngLock);
+	}
+	prngNewGeneration();
+}
+#endif
+
+#ifdef PRNG_THREAD_LOCAL
+/* Whether reading size bytes from ctx first reseeds it from the source */
+static int32 prngReseedDue(psRandom_t *ctx, uint16_t size)
+{
+#ifdef USE_YARROW
+	return ctx->bytecount + size >= RANDOM_BYTES_BEFORE_ENTROPY;
+#else
+	return 0;
+#endif
+}
+#endif
+
 /******************************************************************************/
 /* One-time global prng lock creation and prng context */
 void psOpenPrng(void)
 {
+#if defined(USE_MULTITHREADING) && defined(POSIX)
+	static short	atforkDone = 0;
+
+	if (atforkDone == 0) {
+		pthread_atfork(prngForkPrepare, prngForkParent, prngForkChild);
+		atforkDone = 1;
+	}
+#endif
 #ifdef USE_MULTITHREADING
 	psCreateMutex(&prngLock, 0);
 #endif
+	prngNewGeneration();
 	/* NOTE: if a PRNG is enabled, the low level psGetEntropy call can't
 		have a useful userPtr context becuase there will be no session
 		context at this early stage */
 	psInitPrng(&gMatrixPrng, NULL);
+	gMatrixPrngGeneration = gPrngGeneration;
 	gPrngInit = 1;
 	return;
 }
@@ -62,6 +142,7 @@ void psOpenPrng(void)
 /* One-time global prng lock destruction */
 void psClosePrng(void)
 {
+	gPrngInit = 0;
 #ifdef USE_MULTITHREADING
 	psDestroyMutex(&prngLock);
 #endif
@@ -70,8 +151,10 @@ void psClosePrng(void)
 
 /******************************************************************************/
 /*
-	Main PRNG retrieval API for Matrix based apps to lock all PRNG and entropy
-	fetches
+	Main PRNG retrieval API for Matrix based apps.  Reads from the calling
+	thread's context, seeded from the entropy source on first use, or from
+	the shared context under prngLock.  A thread's context is only seeded
+	and reseeded under the lock
 */
 int32_t matrixCryptoGetPrngData(unsigned char *bytes, uint16_t size, void *userPtr)
 {
@@ -80,14 +163,40 @@ int32_t matrixCryptoGetPrngData(unsigned char *bytes, uint16_t size, void *userP
 	if (gPrngInit == 0) {
 		return PS_FAILURE;
 	}
+#ifdef PRNG_THREAD_LOCAL
+	if (tPrngGeneration == gPrngGeneration && !prngReseedDue(&tPrng, size)) {
+		return psGetPrng(&tPrng, bytes, size, userPtr);
+	}
+	psLockMutex(&prngLock);
+	rc = PS_SUCCESS;
+	if (tPrngGeneration != gPrngGeneration) {
+		if ((rc = psInitPrng(&tPrng, userPtr)) >= 0) {
+			tPrngGeneration = gPrngGeneration;
+		}
+	}
+	if (rc >= 0) {
+		rc = psGetPrng(&tPrng, bytes, size, userPtr);
+	}
+	psUnlockMutex(&prngLock);
+	return rc;
+#else
 #ifdef USE_MULTITHREADING
 	psLockMutex(&prngLock);
 #endif /* USE_MULTITHREADING */
-	rc = psGetPrng(&gMatrixPrng, bytes, size, userPtr);
+	rc = PS_SUCCESS;
+	if (gMatrixPrngGeneration != gPrngGeneration) {
+		if ((rc = psInitPrng(&gMatrixPrng, userPtr)) >= 0) {
+			gMatrixPrngGeneration = gPrngGeneration;
+		}
+	}
+	if (rc >= 0) {
+		rc = psGetPrng(&gMatrixPrng, bytes, size, userPtr);
+	}
 #ifdef USE_MULTITHREADING
 	psUnlockMutex(&prngLock);
 #endif /* USE_MULTITHREADING */
 	return rc;
+#endif /* PRNG_THREAD_LOCAL */
 }
 
 /******************************************************************************/
@@ -86,6 +86,107 @@ static int32 psPrngTests(void)
 	return res < 0 ? res : PS_SUCCESS;
 }
 
+#if defined(USE_MULTITHREADING) && defined(POSIX)
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define PRNG_TEST_THREADS	4
+#define PRNG_TEST_FORKS		32
+#define PRNG_TEST_DRAW		32
+
+static volatile int	prngTestStop;
+
+/* Read in chunks that reseed the thread's context every few reads */
+static void *prngThreadDraw(void *arg)
+{
+	unsigned char	buf[RANDOM_BYTES_BEFORE_ENTROPY / 4 + 1];
+	int32			*rc = arg;
+
+	while (!prngTestStop) {
+		if (matrixCryptoGetPrngData(buf, sizeof(buf), NULL) != sizeof(buf)) {
+			*rc = PS_FAILURE;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* One fork: the child's first draw must arrive, and differ from ours */
+static int32 prngForkOnce(void)
+{
+	unsigned char	mine[PRNG_TEST_DRAW], theirs[PRNG_TEST_DRAW];
+	struct pollfd	pfd;
+	int				fds[2], status;
+	pid_t			pid;
+	int32			res = PS_FAILURE;
+
+	if (pipe(fds) < 0) {
+		return PS_PLATFORM_FAIL;
+	}
+	if ((pid = fork()) == 0) {
+		close(fds[0]);
+		if (matrixCryptoGetPrngData(theirs, sizeof(theirs), NULL) !=
+				sizeof(theirs) ||
+				write(fds[1], theirs, sizeof(theirs)) != sizeof(theirs)) {
+			_exit(1);
+		}
+		_exit(0);
+	}
+	if (pid > 0) {
+		pfd.fd = fds[0];
+		pfd.events = POLLIN;
+		if (matrixCryptoGetPrngData(mine, sizeof(mine), NULL) ==
+				sizeof(mine) && poll(&pfd, 1, 5000) == 1 &&
+				read(fds[0], theirs, sizeof(theirs)) == sizeof(theirs) &&
+				memcmp(mine, theirs, sizeof(mine)) != 0) {
+			res = PS_SUCCESS;
+		}
+		kill(pid, SIGKILL);
+		waitpid(pid, &status, 0);
+	}
+	close(fds[0]);
+	close(fds[1]);
+	return res;
+}
+
+/*
+	Fork repeatedly while other threads reseed.  A child must not block on
+	a lock held in the parent, and must not draw what the parent draws.
+*/
+static int32 psPrngForkTest(void)
+{
+	pthread_t		tid[PRNG_TEST_THREADS];
+	int32			rc[PRNG_TEST_THREADS];
+	int				started, i;
+	int32			res;
+
+	_psTrace("	PRNG reseeds in threads across fork... ");
+	prngTestStop = 0;
+	for (started = 0; started < PRNG_TEST_THREADS; started++) {
+		rc[started] = PS_SUCCESS;
+		if (pthread_create(&tid[started], NULL, prngThreadDraw,
+				&rc[started]) != 0) {
+			break;
+		}
+	}
+	res = started == PRNG_TEST_THREADS ? PS_SUCCESS : PS_FAILURE;
+	for (i = 0; i < PRNG_TEST_FORKS && res == PS_SUCCESS; i++) {
+		res = prngForkOnce();
+	}
+	prngTestStop = 1;
+	for (i = 0; i < started; i++) {
+		pthread_join(tid[i], NULL);
+		if (rc[i] < 0) {
+			res = PS_FAILURE;
+		}
+	}
+	_psTrace(res == PS_SUCCESS ? "PASSED\n" : "FAILED\n");
+	return res;
+}
+#endif /* USE_MULTITHREADING && POSIX */
+
 /******************************************************************************/
 #ifdef USE_AES
 #define AES_ITER	1000	/* For AES Block mode test */
@@ -4881,6 +4982,843 @@ static int32_t psEccTest(void)
 }
 #endif /* USE_ECC */
 
+#if defined(USE_FULL_CERT_PARSE) && defined(USE_ECC)
+/******************************************************************************/
+/*
+	Self-signed P-256 cert carrying every extension CERT_LAZY_EXTENSIONS
+	defers: issuerAltName, certificatePolicies (CPS and userNotice),
+	policyConstraints, policyMappings, nameConstraints and
+	authorityInfoAccess.
+*/
+static const unsigned char lazyExtCert[] = {
+	0x30, 0x82, 0x02, 0xF8, 0x30, 0x82, 0x02, 0x9D, 0xA0, 0x03, 0x02, 0x01,
+	0x02, 0x02, 0x01, 0x07, 0x30, 0x0A, 0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE,
+	0x3D, 0x04, 0x03, 0x02, 0x30, 0x1F, 0x31, 0x1D, 0x30, 0x1B, 0x06, 0x03,
+	0x55, 0x04, 0x03, 0x0C, 0x14, 0x4C, 0x61, 0x7A, 0x79, 0x20, 0x45, 0x78,
+	0x74, 0x65, 0x6E, 0x73, 0x69, 0x6F, 0x6E, 0x73, 0x20, 0x54, 0x65, 0x73,
+	0x74, 0x30, 0x1E, 0x17, 0x0D, 0x32, 0x36, 0x31, 0x30, 0x31, 0x36, 0x32,
+	0x32, 0x33, 0x31, 0x33, 0x38, 0x5A, 0x17, 0x0D, 0x33, 0x36, 0x31, 0x30,
+	0x31, 0x33, 0x32, 0x32, 0x33, 0x31, 0x33, 0x38, 0x5A, 0x30, 0x1F, 0x31,
+	0x1D, 0x30, 0x1B, 0x06, 0x03, 0x55, 0x04, 0x03, 0x0C, 0x14, 0x4C, 0x61,
+	0x7A, 0x79, 0x20, 0x45, 0x78, 0x74, 0x65, 0x6E, 0x73, 0x69, 0x6F, 0x6E,
+	0x73, 0x20, 0x54, 0x65, 0x73, 0x74, 0x30, 0x59, 0x30, 0x13, 0x06, 0x07,
+	0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x02, 0x01, 0x06, 0x08, 0x2A, 0x86, 0x48,
+	0xCE, 0x3D, 0x03, 0x01, 0x07, 0x03, 0x42, 0x00, 0x04, 0x54, 0x92, 0x59,
+	0xC0, 0xF4, 0x85, 0xD9, 0x1D, 0xDC, 0xF0, 0x31, 0x68, 0x63, 0xEB, 0x7D,
+	0xD9, 0x46, 0x37, 0x75, 0x04, 0xC3, 0x05, 0xA4, 0x5B, 0x88, 0x9F, 0x59,
+	0x98, 0x78, 0x13, 0x42, 0x3C, 0x6C, 0x15, 0x9D, 0x76, 0xEE, 0xE0, 0xAB,
+	0x6B, 0x5B, 0x28, 0xF0, 0x40, 0xDB, 0xC0, 0x4B, 0xA8, 0x29, 0xF0, 0x09,
+	0x0C, 0xE6, 0x22, 0x71, 0x11, 0x4E, 0x0B, 0xF2, 0xE7, 0xF4, 0x0B, 0x90,
+	0xCF, 0xA3, 0x82, 0x01, 0xC8, 0x30, 0x82, 0x01, 0xC4, 0x30, 0x0F, 0x06,
+	0x03, 0x55, 0x1D, 0x13, 0x01, 0x01, 0xFF, 0x04, 0x05, 0x30, 0x03, 0x01,
+	0x01, 0xFF, 0x30, 0x0E, 0x06, 0x03, 0x55, 0x1D, 0x0F, 0x01, 0x01, 0xFF,
+	0x04, 0x04, 0x03, 0x02, 0x01, 0x06, 0x30, 0x1D, 0x06, 0x03, 0x55, 0x1D,
+	0x0E, 0x04, 0x16, 0x04, 0x14, 0xBB, 0x9B, 0xE8, 0x24, 0x7F, 0x54, 0x99,
+	0xBD, 0x18, 0x7B, 0x1B, 0x5F, 0x66, 0x89, 0xC0, 0xE3, 0x0C, 0x22, 0xB9,
+	0x2C, 0x30, 0x1B, 0x06, 0x03, 0x55, 0x1D, 0x11, 0x04, 0x14, 0x30, 0x12,
+	0x82, 0x10, 0x6C, 0x61, 0x7A, 0x79, 0x2E, 0x65, 0x78, 0x61, 0x6D, 0x70,
+	0x6C, 0x65, 0x2E, 0x63, 0x6F, 0x6D, 0x30, 0x39, 0x06, 0x03, 0x55, 0x1D,
+	0x12, 0x04, 0x32, 0x30, 0x30, 0x82, 0x12, 0x69, 0x73, 0x73, 0x75, 0x65,
+	0x72, 0x2E, 0x65, 0x78, 0x61, 0x6D, 0x70, 0x6C, 0x65, 0x2E, 0x63, 0x6F,
+	0x6D, 0x86, 0x1A, 0x68, 0x74, 0x74, 0x70, 0x3A, 0x2F, 0x2F, 0x69, 0x73,
+	0x73, 0x75, 0x65, 0x72, 0x2E, 0x65, 0x78, 0x61, 0x6D, 0x70, 0x6C, 0x65,
+	0x2E, 0x63, 0x6F, 0x6D, 0x2F, 0x30, 0x70, 0x06, 0x03, 0x55, 0x1D, 0x20,
+	0x04, 0x69, 0x30, 0x67, 0x30, 0x5E, 0x06, 0x03, 0x2A, 0x03, 0x04, 0x30,
+	0x57, 0x30, 0x23, 0x06, 0x08, 0x2B, 0x06, 0x01, 0x05, 0x05, 0x07, 0x02,
+	0x01, 0x16, 0x17, 0x68, 0x74, 0x74, 0x70, 0x3A, 0x2F, 0x2F, 0x63, 0x70,
+	0x73, 0x2E, 0x65, 0x78, 0x61, 0x6D, 0x70, 0x6C, 0x65, 0x2E, 0x63, 0x6F,
+	0x6D, 0x2F, 0x30, 0x30, 0x06, 0x08, 0x2B, 0x06, 0x01, 0x05, 0x05, 0x07,
+	0x02, 0x02, 0x30, 0x24, 0x30, 0x15, 0x1A, 0x0B, 0x45, 0x78, 0x61, 0x6D,
+	0x70, 0x6C, 0x65, 0x20, 0x4F, 0x72, 0x67, 0x30, 0x06, 0x02, 0x01, 0x01,
+	0x02, 0x01, 0x02, 0x1A, 0x0B, 0x54, 0x65, 0x73, 0x74, 0x20, 0x6E, 0x6F,
+	0x74, 0x69, 0x63, 0x65, 0x30, 0x05, 0x06, 0x03, 0x2A, 0x03, 0x05, 0x30,
+	0x0F, 0x06, 0x03, 0x55, 0x1D, 0x24, 0x04, 0x08, 0x30, 0x06, 0x80, 0x01,
+	0x01, 0x81, 0x01, 0x02, 0x30, 0x15, 0x06, 0x03, 0x55, 0x1D, 0x21, 0x04,
+	0x0E, 0x30, 0x0C, 0x30, 0x0A, 0x06, 0x03, 0x2A, 0x03, 0x04, 0x06, 0x03,
+	0x2A, 0x03, 0x09, 0x30, 0x30, 0x06, 0x03, 0x55, 0x1D, 0x1E, 0x04, 0x29,
+	0x30, 0x27, 0xA0, 0x10, 0x30, 0x0E, 0x82, 0x0C, 0x2E, 0x65, 0x78, 0x61,
+	0x6D, 0x70, 0x6C, 0x65, 0x2E, 0x63, 0x6F, 0x6D, 0xA1, 0x13, 0x30, 0x11,
+	0x82, 0x0F, 0x62, 0x61, 0x64, 0x2E, 0x65, 0x78, 0x61, 0x6D, 0x70, 0x6C,
+	0x65, 0x2E, 0x63, 0x6F, 0x6D, 0x30, 0x5E, 0x06, 0x08, 0x2B, 0x06, 0x01,
+	0x05, 0x05, 0x07, 0x01, 0x01, 0x04, 0x52, 0x30, 0x50, 0x30, 0x24, 0x06,
+	0x08, 0x2B, 0x06, 0x01, 0x05, 0x05, 0x07, 0x30, 0x01, 0x86, 0x18, 0x68,
+	0x74, 0x74, 0x70, 0x3A, 0x2F, 0x2F, 0x6F, 0x63, 0x73, 0x70, 0x2E, 0x65,
+	0x78, 0x61, 0x6D, 0x70, 0x6C, 0x65, 0x2E, 0x63, 0x6F, 0x6D, 0x2F, 0x30,
+	0x28, 0x06, 0x08, 0x2B, 0x06, 0x01, 0x05, 0x05, 0x07, 0x30, 0x02, 0x86,
+	0x1C, 0x68, 0x74, 0x74, 0x70, 0x3A, 0x2F, 0x2F, 0x63, 0x61, 0x2E, 0x65,
+	0x78, 0x61, 0x6D, 0x70, 0x6C, 0x65, 0x2E, 0x63, 0x6F, 0x6D, 0x2F, 0x63,
+	0x61, 0x2E, 0x63, 0x72, 0x74, 0x30, 0x0A, 0x06, 0x08, 0x2A, 0x86, 0x48,
+	0xCE, 0x3D, 0x04, 0x03, 0x02, 0x03, 0x49, 0x00, 0x30, 0x46, 0x02, 0x21,
+	0x00, 0xC9, 0xFF, 0x48, 0x6B, 0xE3, 0x7C, 0xF5, 0x61, 0x9D, 0x17, 0x0C,
+	0xF5, 0xB6, 0xE3, 0x99, 0x7D, 0x1D, 0x79, 0x52, 0x99, 0x9A, 0x2C, 0x6C,
+	0xDE, 0xA2, 0x66, 0xC8, 0x65, 0xF6, 0x7E, 0x08, 0x48, 0x02, 0x21, 0x00,
+	0xDD, 0xB3, 0x3B, 0xE2, 0x23, 0x6A, 0x25, 0x53, 0x63, 0x02, 0x48, 0xAD,
+	0x93, 0x31, 0x79, 0xD0, 0x7A, 0x13, 0x9D, 0x90, 0x5E, 0x9F, 0xF9, 0xEB,
+	0xB7, 0x70, 0x6B, 0xA6, 0x8B, 0x58, 0xD8, 0x6B
+};
+
+static int32 sameBytes(const void *a, uint16_t aLen, const void *b,
+				uint16_t bLen)
+{
+	if (aLen != bLen) {
+		return 0;
+	}
+	return aLen == 0 || memcmp(a, b, aLen) == 0;
+}
+
+static int32 sameGeneralNames(const x509GeneralName_t *a,
+				const x509GeneralName_t *b)
+{
+	for (; a && b; a = a->next, b = b->next) {
+		if (a->id != b->id || !sameBytes(a->data, a->dataLen, b->data,
+				b->dataLen)) {
+			return 0;
+		}
+	}
+	return a == b;
+}
+
+/* The members psX509DecodeExtensions fills in must match an eager parse */
+static int32 sameDeferredExtensions(const x509v3extensions_t *a,
+				const x509v3extensions_t *b)
+{
+	const x509PolicyInformation_t	*pa, *pb;
+	const x509PolicyQualifierInfo_t	*qa, *qb;
+	const x509policyMappings_t		*ma, *mb;
+	const x509authorityInfoAccess_t	*aa, *ab;
+
+	if (!sameGeneralNames(a->issuerAltName, b->issuerAltName) ||
+			!sameGeneralNames(a->nameConstraints.permitted,
+				b->nameConstraints.permitted) ||
+			!sameGeneralNames(a->nameConstraints.excluded,
+				b->nameConstraints.excluded) ||
+			a->policyConstraints.requireExplicitPolicy !=
+				b->policyConstraints.requireExplicitPolicy ||
+			a->policyConstraints.inhibitPolicyMappings !=
+				b->policyConstraints.inhibitPolicyMappings ||
+			a->critFlags != b->critFlags) {
+		return 0;
+	}
+	for (pa = a->certificatePolicy.policy, pb = b->certificatePolicy.policy;
+			pa && pb; pa = pa->next, pb = pb->next) {
+		if (!sameBytes(pa->policyOid, pa->policyOidLen * sizeof(uint32_t),
+				pb->policyOid, pb->policyOidLen * sizeof(uint32_t))) {
+			return 0;
+		}
+		for (qa = pa->qualifiers, qb = pb->qualifiers; qa && qb;
+				qa = qa->next, qb = qb->next) {
+			if (!sameBytes(qa->cps, qa->cpsLen, qb->cps, qb->cpsLen) ||
+					!sameBytes(qa->unoticeOrganization,
+						qa->unoticeOrganizationLen, qb->unoticeOrganization,
+						qb->unoticeOrganizationLen) ||
+					!sameBytes(qa->unoticeExplicitText,
+						qa->unoticeExplicitTextLen, qb->unoticeExplicitText,
+						qb->unoticeExplicitTextLen) ||
+					!sameBytes(qa->unoticeNumbers, qa->unoticeNumbersLen *
+						sizeof(int32_t), qb->unoticeNumbers,
+						qb->unoticeNumbersLen * sizeof(int32_t))) {
+				return 0;
+			}
+		}
+		if (qa != qb) {
+			return 0;
+		}
+	}
+	if (pa != pb) {
+		return 0;
+	}
+	for (ma = a->policyMappings, mb = b->policyMappings; ma && mb;
+			ma = ma->next, mb = mb->next) {
+		if (!sameBytes(ma->issuerDomainPolicy, ma->issuerDomainPolicyLen *
+				sizeof(uint32_t), mb->issuerDomainPolicy,
+				mb->issuerDomainPolicyLen * sizeof(uint32_t)) ||
+				!sameBytes(ma->subjectDomainPolicy,
+				ma->subjectDomainPolicyLen * sizeof(uint32_t),
+				mb->subjectDomainPolicy,
+				mb->subjectDomainPolicyLen * sizeof(uint32_t))) {
+			return 0;
+		}
+	}
+	if (ma != mb) {
+		return 0;
+	}
+	for (aa = a->authorityInfoAccess, ab = b->authorityInfoAccess; aa && ab;
+			aa = aa->next, ab = ab->next) {
+		if (!sameBytes(aa->ocsp, aa->ocspLen, ab->ocsp, ab->ocspLen) ||
+				!sameBytes(aa->caIssuers, aa->caIssuersLen, ab->caIssuers,
+				ab->caIssuersLen)) {
+			return 0;
+		}
+	}
+	return aa == ab;
+}
+
+/*
+	A CERT_LAZY_EXTENSIONS parse followed by psX509DecodeExtensions must give
+	the same result as an eager parse, with or without the DER kept in the
+	cert.  A malformed deferred extension must fail the parse itself.
+*/
+static int32 psX509LazyExtTest(void)
+{
+	psPool_t		*pool = NULL;
+	psX509Cert_t	*eager = NULL, *lazy = NULL;
+	unsigned char	bad[sizeof(lazyExtCert)];
+	const char		*ocsp = "http://ocsp.example.com/";
+	int32			i, flags, rc = PS_FAILURE;
+
+	if (psX509ParseCert(pool, lazyExtCert, sizeof(lazyExtCert), &eager, 0)
+			< 0) {
+		_psTrace("Eager parse failed\n");
+		goto L_FAIL;
+	}
+	if (eager->extensions.certificatePolicy.policy == NULL ||
+			eager->extensions.authorityInfoAccess == NULL ||
+			eager->extensions.policyMappings == NULL ||
+			eager->extensions.issuerAltName == NULL ||
+			eager->extensions.nameConstraints.excluded == NULL ||
+			eager->extensions.policyConstraints.inhibitPolicyMappings != 2) {
+		_psTrace("Eager parse missed an extension\n");
+		goto L_FAIL;
+	}
+	for (i = 0; i < 2; i++) {
+		flags = CERT_LAZY_EXTENSIONS | (i ? CERT_STORE_UNPARSED_BUFFER : 0);
+		if (psX509ParseCert(pool, lazyExtCert, sizeof(lazyExtCert), &lazy,
+				flags) < 0) {
+			_psTrace("Lazy parse failed\n");
+			goto L_FAIL;
+		}
+		/* Only the deferred members are missing, and the DER is shared
+			with unparsedBin when the cert keeps one */
+		if (lazy->extensions.deferred == NULL ||
+				lazy->extensions.deferredCopy != (i ? 0 : 1) ||
+				lazy->extensions.certificatePolicy.policy != NULL ||
+				lazy->extensions.authorityInfoAccess != NULL ||
+				lazy->extensions.san == NULL ||
+				lazy->extensions.bc.cA != eager->extensions.bc.cA ||
+				lazy->extensions.keyUsageFlags !=
+					eager->extensions.keyUsageFlags) {
+			_psTrace("Lazy parse decoded the wrong extensions\n");
+			goto L_FAIL;
+		}
+		if (psX509DecodeExtensions(lazy) < 0 ||
+				lazy->extensions.deferred != NULL ||
+				!sameDeferredExtensions(&lazy->extensions,
+					&eager->extensions)) {
+			_psTrace("Lazy and eager extensions differ\n");
+			goto L_FAIL;
+		}
+		/* Nothing left to decode */
+		if (psX509DecodeExtensions(lazy) != PS_SUCCESS ||
+				!sameDeferredExtensions(&lazy->extensions,
+					&eager->extensions)) {
+			_psTrace("Second decode changed the extensions\n");
+			goto L_FAIL;
+		}
+		psX509FreeCert(lazy);
+		lazy = NULL;
+	}
+
+	/* Lengthen the OCSP URI inside authorityInfoAccess past its parent */
+	memcpy(bad, lazyExtCert, sizeof(bad));
+	for (i = 1; i + strlen(ocsp) <= sizeof(bad); i++) {
+		if (memcmp(bad + i, ocsp, strlen(ocsp)) == 0) {
+			break;
+		}
+	}
+	if (i + strlen(ocsp) > sizeof(bad) || bad[i - 1] != strlen(ocsp)) {
+		_psTrace("Test cert has no OCSP URI\n");
+		goto L_FAIL;
+	}
+	bad[i - 1] = 0x7F;
+	if (psX509ParseCert(pool, bad, sizeof(bad), &lazy,
+			CERT_LAZY_EXTENSIONS) >= 0) {
+		_psTrace("Malformed deferred extension was accepted\n");
+		goto L_FAIL;
+	}
+	psX509FreeCert(lazy);
+	lazy = NULL;
+
+	_psTrace("	PASSED\n");
+	rc = PS_SUCCESS;
+L_FAIL:
+	psX509FreeCert(lazy);
+	psX509FreeCert(eager);
+	return rc;
+}
+#endif /* USE_FULL_CERT_PARSE && USE_ECC */
+
+#ifdef USE_CERT_PARSE
+/******************************************************************************/
+/*
+	Issuer lookups over an index of synthetic CA entries.  Only the fields
+	psX509IndexCerts and psX509FindIssuer read are filled in: subject and
+	issuer DN hashes, subjectKeyIdentifier and authorityKeyIdentifier.
+*/
+#define CA_INDEX_FILLER		20
+
+static void caIndexEntry(psX509Cert_t *cert, unsigned char dn0,
+				unsigned char dn4, unsigned char *ski, uint16_t skiLen)
+{
+	memset(cert, 0x0, sizeof(psX509Cert_t));
+	memset(cert->subject.hash, dn0, SHA1_HASH_SIZE);
+	cert->subject.hash[4] = dn4;
+	cert->extensions.sk.id = ski;
+	cert->extensions.sk.len = skiLen;
+}
+
+static void caIndexSubject(psX509Cert_t *cert, const psX509Cert_t *issuer,
+				unsigned char *aki, uint16_t akiLen)
+{
+	memset(cert, 0x0, sizeof(psX509Cert_t));
+	memcpy(cert->issuer.hash, issuer->subject.hash, SHA1_HASH_SIZE);
+	cert->extensions.ak.keyId = aki;
+	cert->extensions.ak.keyLen = akiLen;
+}
+
+/* Every candidate for subject, in lookup order, NULL terminated */
+static int32 caIndexFind(const psX509CertIndex_t *idx,
+				const psX509Cert_t *subject, psX509Cert_t **found, int32 max)
+{
+	uint32_t	pos = 0;
+	int32		n;
+
+	for (n = 0; n < max; n++) {
+		if ((found[n] = psX509FindIssuer(idx, subject, &pos)) == NULL) {
+			return n;
+		}
+	}
+	return -1;
+}
+
+static int32 psX509CaIndexTest(void)
+{
+	psX509Cert_t		filler[CA_INDEX_FILLER], collide[2], twin[2];
+	psX509Cert_t		subject, *found[4], *list;
+	psX509CertIndex_t	idx;
+	unsigned char		fillerSki[CA_INDEX_FILLER][2];
+	unsigned char		skiA[] = { 0x01, 0x02, 0x03, 0x04 };
+	unsigned char		skiB[] = { 0x05, 0x06, 0x07, 0x08 };
+	unsigned char		skiStale[] = { 0x09, 0x0A, 0x0B, 0x0C };
+	int32				i, rc = PS_FAILURE;
+
+	memset(&idx, 0x0, sizeof(idx));
+	for (i = 0; i < CA_INDEX_FILLER; i++) {
+		fillerSki[i][0] = 0xA0;
+		fillerSki[i][1] = (unsigned char)i;
+		caIndexEntry(&filler[i], (unsigned char)(0x10 + i), 0,
+			fillerSki[i], sizeof(fillerSki[i]));
+	}
+	/* Different DNs whose hashes share the four bytes used as the key */
+	caIndexEntry(&collide[0], 0xEE, 0x01, NULL, 0);
+	caIndexEntry(&collide[1], 0xEE, 0x02, NULL, 0);
+	/* Same DN, two keys, as after a CA rekey */
+	caIndexEntry(&twin[0], 0xCC, 0x00, skiA, sizeof(skiA));
+	caIndexEntry(&twin[1], 0xCC, 0x00, skiB, sizeof(skiB));
+
+	list = &collide[0];
+	collide[0].next = &collide[1];
+	collide[1].next = &twin[0];
+	twin[0].next = &twin[1];
+	twin[1].next = &filler[0];
+	for (i = 0; i < CA_INDEX_FILLER - 1; i++) {
+		filler[i].next = &filler[i + 1];
+	}
+	if (psX509IndexCerts(NULL, list, &idx) < 0) {
+		_psTrace("Index build failed\n");
+		goto L_FAIL;
+	}
+
+	_psTrace("	DN hash collision...");
+	for (i = 0; i < 2; i++) {
+		caIndexSubject(&subject, &collide[i], NULL, 0);
+		if (caIndexFind(&idx, &subject, found, 4) != 1 ||
+				found[0] != &collide[i]) {
+			_psTraceInt("wrong issuer for collision %d\n", i);
+			goto L_FAIL;
+		}
+	}
+	_psTrace("	PASSED\n");
+
+	_psTrace("	Same subject, different key identifiers...");
+	caIndexSubject(&subject, &twin[0], skiB, sizeof(skiB));
+	if (caIndexFind(&idx, &subject, found, 4) != 2 ||
+			found[0] != &twin[1] || found[1] != &twin[0]) {
+		_psTrace("AKI did not select the matching key\n");
+		goto L_FAIL;
+	}
+	caIndexSubject(&subject, &twin[0], skiA, sizeof(skiA));
+	if (caIndexFind(&idx, &subject, found, 4) != 2 ||
+			found[0] != &twin[0] || found[1] != &twin[1]) {
+		_psTrace("AKI did not select the matching key\n");
+		goto L_FAIL;
+	}
+	/* A matching key identifier does not override a different DN */
+	caIndexSubject(&subject, &collide[0], skiA, sizeof(skiA));
+	if (caIndexFind(&idx, &subject, found, 4) != 1 ||
+			found[0] != &collide[0]) {
+		_psTrace("Key identifier matched across DNs\n");
+		goto L_FAIL;
+	}
+	_psTrace("	PASSED\n");
+
+	_psTrace("	Missing or unknown authority key identifier...");
+	caIndexSubject(&subject, &twin[0], NULL, 0);
+	if (caIndexFind(&idx, &subject, found, 4) != 2 ||
+			!((found[0] == &twin[0] && found[1] == &twin[1]) ||
+			(found[0] == &twin[1] && found[1] == &twin[0]))) {
+		_psTrace("DN fallback without AKI failed\n");
+		goto L_FAIL;
+	}
+	caIndexSubject(&subject, &twin[0], skiStale, sizeof(skiStale));
+	if (caIndexFind(&idx, &subject, found, 4) != 2 ||
+			!((found[0] == &twin[0] && found[1] == &twin[1]) ||
+			(found[0] == &twin[1] && found[1] == &twin[0]))) {
+		_psTrace("DN fallback with unknown AKI failed\n");
+		goto L_FAIL;
+	}
+	for (i = 0; i < CA_INDEX_FILLER; i++) {
+		caIndexSubject(&subject, &filler[i], NULL, 0);
+		if (caIndexFind(&idx, &subject, found, 4) != 1 ||
+				found[0] != &filler[i]) {
+			_psTraceInt("wrong issuer for CA %d\n", i);
+			goto L_FAIL;
+		}
+	}
+	_psTrace("	PASSED\n");
+	rc = PS_SUCCESS;
+
+L_FAIL:
+	psX509FreeCertIndex(&idx);
+	return rc;
+}
+#endif /* USE_CERT_PARSE */
+
+#if defined(USE_CRL) && defined(USE_ECC) && defined(USE_SHA256)
+/******************************************************************************/
+/*
+	P-256 CA and a CRL it signed revoking serials 05, 3A, 00FF, 0102,
+	7F112233445566778899 and 1234567890ABCDEF1234567890ABCDEF
+*/
+static const unsigned char crlTestCA[] = {
+	0x30, 0x82, 0x01, 0xA1, 0x30, 0x82, 0x01, 0x47, 0xA0, 0x03, 0x02, 0x01,
+	0x02, 0x02, 0x14, 0x5E, 0x82, 0x2D, 0x94, 0x02, 0x70, 0xA1, 0x68, 0x44,
+	0x0A, 0x72, 0xF5, 0x6B, 0xB3, 0xE2, 0x38, 0x5C, 0x75, 0x60, 0xF3, 0x30,
+	0x0A, 0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x04, 0x03, 0x02, 0x30,
+	0x1D, 0x31, 0x1B, 0x30, 0x19, 0x06, 0x03, 0x55, 0x04, 0x03, 0x0C, 0x12,
+	0x4D, 0x61, 0x74, 0x72, 0x69, 0x78, 0x20, 0x43, 0x52, 0x4C, 0x20, 0x54,
+	0x65, 0x73, 0x74, 0x20, 0x43, 0x41, 0x30, 0x20, 0x17, 0x0D, 0x32, 0x36,
+	0x31, 0x30, 0x31, 0x36, 0x32, 0x32, 0x33, 0x39, 0x34, 0x34, 0x5A, 0x18,
+	0x0F, 0x32, 0x31, 0x32, 0x36, 0x30, 0x39, 0x32, 0x32, 0x32, 0x32, 0x33,
+	0x39, 0x34, 0x34, 0x5A, 0x30, 0x1D, 0x31, 0x1B, 0x30, 0x19, 0x06, 0x03,
+	0x55, 0x04, 0x03, 0x0C, 0x12, 0x4D, 0x61, 0x74, 0x72, 0x69, 0x78, 0x20,
+	0x43, 0x52, 0x4C, 0x20, 0x54, 0x65, 0x73, 0x74, 0x20, 0x43, 0x41, 0x30,
+	0x59, 0x30, 0x13, 0x06, 0x07, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x02, 0x01,
+	0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07, 0x03, 0x42,
+	0x00, 0x04, 0x95, 0xD4, 0x40, 0xE1, 0x73, 0x96, 0x77, 0x5A, 0x84, 0x14,
+	0xA3, 0x94, 0x03, 0x5A, 0x75, 0x80, 0x54, 0x00, 0x09, 0x88, 0xB0, 0x1B,
+	0x4E, 0xD0, 0x7B, 0xFF, 0x5C, 0xE9, 0x42, 0x4C, 0xC1, 0x9E, 0xA9, 0x57,
+	0x5A, 0x1F, 0x3A, 0x46, 0x09, 0x59, 0x73, 0x84, 0x07, 0xC9, 0xBD, 0xE6,
+	0x1E, 0x85, 0xAC, 0xEE, 0x8F, 0x63, 0xD5, 0xB3, 0xC2, 0xD3, 0xEA, 0x6A,
+	0x05, 0xDE, 0x17, 0x3A, 0x03, 0xD1, 0xA3, 0x63, 0x30, 0x61, 0x30, 0x1D,
+	0x06, 0x03, 0x55, 0x1D, 0x0E, 0x04, 0x16, 0x04, 0x14, 0x6F, 0x3D, 0x21,
+	0x22, 0x17, 0x34, 0x52, 0x48, 0x4C, 0x62, 0x57, 0xE7, 0x69, 0x7C, 0xF3,
+	0xBF, 0xCC, 0xF6, 0x29, 0x61, 0x30, 0x1F, 0x06, 0x03, 0x55, 0x1D, 0x23,
+	0x04, 0x18, 0x30, 0x16, 0x80, 0x14, 0x6F, 0x3D, 0x21, 0x22, 0x17, 0x34,
+	0x52, 0x48, 0x4C, 0x62, 0x57, 0xE7, 0x69, 0x7C, 0xF3, 0xBF, 0xCC, 0xF6,
+	0x29, 0x61, 0x30, 0x0E, 0x06, 0x03, 0x55, 0x1D, 0x0F, 0x01, 0x01, 0xFF,
+	0x04, 0x04, 0x03, 0x02, 0x01, 0x06, 0x30, 0x0F, 0x06, 0x03, 0x55, 0x1D,
+	0x13, 0x01, 0x01, 0xFF, 0x04, 0x05, 0x30, 0x03, 0x01, 0x01, 0xFF, 0x30,
+	0x0A, 0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x04, 0x03, 0x02, 0x03,
+	0x48, 0x00, 0x30, 0x45, 0x02, 0x20, 0x3B, 0x0B, 0x79, 0x01, 0xC2, 0x71,
+	0x59, 0x89, 0x48, 0x6E, 0x30, 0x61, 0xC5, 0x25, 0x8F, 0x5C, 0x3A, 0x73,
+	0xE4, 0x82, 0x63, 0x46, 0x1B, 0x8A, 0xF0, 0xA4, 0xE4, 0x8D, 0x5B, 0x9D,
+	0x8C, 0x9E, 0x02, 0x21, 0x00, 0x8D, 0x6C, 0x91, 0x05, 0x35, 0x68, 0x27,
+	0x0A, 0x70, 0xBF, 0x65, 0x9A, 0x3B, 0x24, 0x40, 0x1F, 0xB0, 0xF9, 0x55,
+	0x27, 0x1E, 0x31, 0xDD, 0x1D, 0xD3, 0x6C, 0x10, 0x2B, 0xD5, 0x62, 0xBB,
+	0x11
+};
+
+static const unsigned char crlTestCRL[] = {
+	0x30, 0x82, 0x01, 0x6E, 0x30, 0x82, 0x01, 0x14, 0x02, 0x01, 0x01, 0x30,
+	0x0A, 0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x04, 0x03, 0x02, 0x30,
+	0x1D, 0x31, 0x1B, 0x30, 0x19, 0x06, 0x03, 0x55, 0x04, 0x03, 0x0C, 0x12,
+	0x4D, 0x61, 0x74, 0x72, 0x69, 0x78, 0x20, 0x43, 0x52, 0x4C, 0x20, 0x54,
+	0x65, 0x73, 0x74, 0x20, 0x43, 0x41, 0x17, 0x0D, 0x32, 0x36, 0x31, 0x30,
+	0x31, 0x36, 0x32, 0x32, 0x33, 0x39, 0x34, 0x34, 0x5A, 0x18, 0x0F, 0x32,
+	0x31, 0x32, 0x36, 0x30, 0x39, 0x32, 0x32, 0x32, 0x32, 0x33, 0x39, 0x34,
+	0x34, 0x5A, 0x30, 0x81, 0x92, 0x30, 0x12, 0x02, 0x01, 0x05, 0x17, 0x0D,
+	0x32, 0x34, 0x30, 0x31, 0x30, 0x31, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30,
+	0x5A, 0x30, 0x12, 0x02, 0x01, 0x3A, 0x17, 0x0D, 0x32, 0x34, 0x30, 0x31,
+	0x30, 0x31, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x5A, 0x30, 0x13, 0x02,
+	0x02, 0x00, 0xFF, 0x17, 0x0D, 0x32, 0x34, 0x30, 0x31, 0x30, 0x31, 0x30,
+	0x30, 0x30, 0x30, 0x30, 0x30, 0x5A, 0x30, 0x13, 0x02, 0x02, 0x01, 0x02,
+	0x17, 0x0D, 0x32, 0x34, 0x30, 0x31, 0x30, 0x31, 0x30, 0x30, 0x30, 0x30,
+	0x30, 0x30, 0x5A, 0x30, 0x1B, 0x02, 0x0A, 0x7F, 0x11, 0x22, 0x33, 0x44,
+	0x55, 0x66, 0x77, 0x88, 0x99, 0x17, 0x0D, 0x32, 0x34, 0x30, 0x31, 0x30,
+	0x31, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x5A, 0x30, 0x21, 0x02, 0x10,
+	0x12, 0x34, 0x56, 0x78, 0x90, 0xAB, 0xCD, 0xEF, 0x12, 0x34, 0x56, 0x78,
+	0x90, 0xAB, 0xCD, 0xEF, 0x17, 0x0D, 0x32, 0x34, 0x30, 0x31, 0x30, 0x31,
+	0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x5A, 0xA0, 0x2F, 0x30, 0x2D, 0x30,
+	0x1F, 0x06, 0x03, 0x55, 0x1D, 0x23, 0x04, 0x18, 0x30, 0x16, 0x80, 0x14,
+	0x6F, 0x3D, 0x21, 0x22, 0x17, 0x34, 0x52, 0x48, 0x4C, 0x62, 0x57, 0xE7,
+	0x69, 0x7C, 0xF3, 0xBF, 0xCC, 0xF6, 0x29, 0x61, 0x30, 0x0A, 0x06, 0x03,
+	0x55, 0x1D, 0x14, 0x04, 0x03, 0x02, 0x01, 0x01, 0x30, 0x0A, 0x06, 0x08,
+	0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x04, 0x03, 0x02, 0x03, 0x48, 0x00, 0x30,
+	0x45, 0x02, 0x21, 0x00, 0xDE, 0x92, 0x0E, 0xAF, 0xE6, 0x5B, 0xD0, 0x32,
+	0x31, 0xCD, 0x27, 0x02, 0x51, 0x73, 0x74, 0x88, 0x35, 0x0B, 0x8C, 0x12,
+	0x00, 0xBC, 0x9F, 0xEA, 0xE0, 0xBE, 0x8A, 0x43, 0x23, 0xEB, 0x04, 0xA8,
+	0x02, 0x20, 0x18, 0xF1, 0x60, 0xFD, 0x2A, 0x53, 0x1E, 0x36, 0x33, 0x21,
+	0x2D, 0x47, 0xE8, 0xEB, 0x1F, 0xC9, 0x9F, 0x41, 0x18, 0x9F, 0xC5, 0x1A,
+	0xF9, 0x60, 0xCC, 0x1B, 0x40, 0x1E, 0x83, 0xFF, 0xB4, 0xC6
+};
+
+static const unsigned char *crlTestRevoked[] = {
+	(const unsigned char *)"\x01\x05",
+	(const unsigned char *)"\x01\x3A",
+	(const unsigned char *)"\x02\x00\xFF",
+	(const unsigned char *)"\x02\x01\x02",
+	(const unsigned char *)"\x0A\x7F\x11\x22\x33\x44\x55\x66\x77\x88\x99",
+	(const unsigned char *)"\x10\x12\x34\x56\x78\x90\xAB\xCD\xEF"
+		"\x12\x34\x56\x78\x90\xAB\xCD\xEF",
+	NULL
+};
+
+static const unsigned char *crlTestValid[] = {
+	(const unsigned char *)"\x01\x06",
+	(const unsigned char *)"\x02\x00\xFE",
+	(const unsigned char *)"\x02\x05\x00",
+	(const unsigned char *)"\x0A\x7F\x11\x22\x33\x44\x55\x66\x77\x88\x98",
+	NULL
+};
+
+/* Serials are given as a length byte followed by the serial */
+static int32 crlRevokesOnly(psX509Crl_t *crl, const unsigned char **serials,
+				int32 revoked)
+{
+	psX509Cert_t	cert;
+
+	for (; *serials != NULL; serials++) {
+		memset(&cert, 0x0, sizeof(psX509Cert_t));
+		cert.serialNumber = (unsigned char *)*serials + 1;
+		cert.serialNumberLen = **serials;
+		if (psCRL_isRevoked(&cert, crl) != revoked) {
+			return PS_FALSE;
+		}
+	}
+	return PS_TRUE;
+}
+
+/* Same serials and issuer, whatever order the slots were built in */
+static int32 sameCrlEntries(psX509Crl_t *a, psX509Crl_t *b)
+{
+	return crlRevokesOnly(a, crlTestRevoked, 1) &&
+		crlRevokesOnly(a, crlTestValid, 0) &&
+		crlRevokesOnly(b, crlTestRevoked, 1) &&
+		crlRevokesOnly(b, crlTestValid, 0) &&
+		a->revoked.count == b->revoked.count &&
+		a->revoked.slotLen == b->revoked.slotLen &&
+		memcmp(a->revoked.serials, b->revoked.serials,
+			(size_t)a->revoked.count * a->revoked.slotLen) == 0 &&
+		memcmp(a->issuer.hash, b->issuer.hash, SHA1_HASH_SIZE) == 0;
+}
+#endif /* USE_CRL && USE_ECC && USE_SHA256 */
+
+#if defined(USE_CRL) && defined(USE_ECC) && defined(USE_SHA256) && \
+	defined(MATRIX_USE_FILE_SYSTEM)
+#define CRL_TEST_INDEX	"crlIndexTest.bin"
+#define CRL_TEST_FILE	"crlTest.der"
+
+static int32 writeTestFile(const char *name, const unsigned char *buf,
+				size_t len)
+{
+	FILE	*fp;
+	int32	rc = PS_SUCCESS;
+
+	if ((fp = fopen(name, "wb")) == NULL) {
+		return PS_PLATFORM_FAIL;
+	}
+	if (len > 0 && fwrite(buf, len, 1, fp) != 1) {
+		rc = PS_PLATFORM_FAIL;
+	}
+	if (fclose(fp) != 0) {
+		rc = PS_PLATFORM_FAIL;
+	}
+	return rc;
+}
+
+#ifdef USE_HMAC_SHA256
+static const unsigned char crlIndexKey[] = "CRL index test key, 32 bytes.";
+static const unsigned char crlOtherKey[] = "CRL index test key, 32 bytes!";
+
+/* Write an edited index with a MAC that matches, as a key holder could */
+static int32 writeTestIndex(const char *name, unsigned char *buf, size_t len)
+{
+	unsigned char	hmacKey[SHA256_HASH_SIZE];
+	uint16_t		hmacKeyLen;
+
+	if (len < SHA256_HASH_SIZE || psHmacSha256(crlIndexKey,
+			sizeof(crlIndexKey), buf, (uint32_t)(len - SHA256_HASH_SIZE),
+			buf + len - SHA256_HASH_SIZE, hmacKey, &hmacKeyLen) < 0) {
+		return PS_FAILURE;
+	}
+	return writeTestFile(name, buf, len);
+}
+
+/*
+	Only an authenticated CRL can be written to an index, and an index
+	that verifies under the same key reloads the same serials as an
+	authenticated CRL, so a cert it lists is refused.  Any change without
+	the key is refused, and so are unsorted slots even with the key.
+*/
+static int32 psX509CrlIndexTest(void)
+{
+	psPool_t		*pool = NULL;
+	psX509Cert_t	*ca = NULL, cert;
+	psX509Crl_t		*crl = NULL, *loaded = NULL;
+	unsigned char	der[sizeof(crlTestCRL)], *index = NULL, *bad = NULL;
+	int32			indexLen, inserted = 0, rc = PS_FAILURE;
+	size_t			w, slots;
+
+	memcpy(der, crlTestCRL, sizeof(der));
+	if (psX509ParseCert(pool, crlTestCA, sizeof(crlTestCA), &ca, 0) < 0 ||
+			psX509ParseCRL(pool, &crl, der, sizeof(der)) < 0) {
+		_psTrace("Parse of the test CA or CRL failed\n");
+		goto L_FAIL;
+	}
+	if (psX509WriteCRLIndex(crl, CRL_TEST_INDEX, crlIndexKey,
+			sizeof(crlIndexKey)) >= 0) {
+		_psTrace("Unauthenticated CRL was indexed\n");
+		goto L_FAIL;
+	}
+	if (psX509AuthenticateCRL(ca, crl, NULL) != PS_SUCCESS ||
+			crl->authenticated != PS_TRUE) {
+		_psTrace("Parsed CRL did not authenticate\n");
+		goto L_FAIL;
+	}
+	if (psX509WriteCRLIndex(crl, CRL_TEST_INDEX, crlIndexKey,
+			sizeof(crlIndexKey)) != PS_SUCCESS ||
+			psX509LoadCRLIndex(pool, CRL_TEST_INDEX, crlIndexKey,
+			sizeof(crlIndexKey), &loaded) != PS_SUCCESS) {
+		_psTrace("CRL index round trip failed\n");
+		goto L_FAIL;
+	}
+	if (!sameCrlEntries(crl, loaded) || loaded->authenticated != PS_TRUE) {
+		_psTrace("Loaded CRL index differs\n");
+		goto L_FAIL;
+	}
+
+	/* A cert the index lists is refused as revoked, others pass */
+	if (psCRL_Insert(loaded) < 0) {
+		goto L_FAIL;
+	}
+	inserted = 1;
+	memset(&cert, 0x0, sizeof(psX509Cert_t));
+	memcpy(cert.issuer.hash, ca->subject.hash, SHA1_HASH_SIZE);
+	cert.extensions.ak = ca->extensions.ak;
+	cert.serialNumber = (unsigned char *)crlTestRevoked[0] + 1;
+	cert.serialNumberLen = crlTestRevoked[0][0];
+	if (psX509AuthenticateCert(pool, &cert, ca, NULL, NULL, NULL) !=
+			PS_CERT_AUTH_FAIL_REVOKED ||
+			cert.revokedStatus != CRL_CHECK_REVOKED_AND_AUTHENTICATED) {
+		_psTrace("Cert listed in a loaded CRL index was not refused\n");
+		goto L_FAIL;
+	}
+	cert.serialNumber = (unsigned char *)crlTestValid[0] + 1;
+	cert.serialNumberLen = crlTestValid[0][0];
+	if (psCRL_determineRevokedStatus(&cert) !=
+			CRL_CHECK_PASSED_AND_AUTHENTICATED) {
+		_psTrace("Cert missing from a loaded CRL index was refused\n");
+		goto L_FAIL;
+	}
+	psCRL_Remove(loaded);
+	inserted = 0;
+	psX509FreeCRL(loaded);
+	loaded = NULL;
+
+	if (psX509LoadCRLIndex(pool, CRL_TEST_INDEX, crlOtherKey,
+			sizeof(crlOtherKey), &loaded) >= 0) {
+		_psTrace("CRL index loaded under the wrong key\n");
+		goto L_FAIL;
+	}
+	if (psGetFileBuf(pool, CRL_TEST_INDEX, &index, &indexLen) < 0 ||
+			(bad = psMalloc(pool, indexLen)) == NULL) {
+		goto L_FAIL;
+	}
+	w = crl->revoked.slotLen;
+	slots = indexLen - SHA256_HASH_SIZE - crl->revoked.count * w;
+
+	/* A serial changed in place, still sorted, MAC left alone */
+	memcpy(bad, index, indexLen);
+	bad[indexLen - SHA256_HASH_SIZE - 1] ^= 0x01;
+	if (writeTestFile(CRL_TEST_INDEX, bad, indexLen) < 0 ||
+			psX509LoadCRLIndex(pool, CRL_TEST_INDEX, crlIndexKey,
+			sizeof(crlIndexKey), &loaded) >= 0) {
+		_psTrace("Tampered CRL index was accepted\n");
+		goto L_FAIL;
+	}
+	/* Truncated MAC */
+	if (writeTestFile(CRL_TEST_INDEX, index, indexLen - 1) < 0 ||
+			psX509LoadCRLIndex(pool, CRL_TEST_INDEX, crlIndexKey,
+			sizeof(crlIndexKey), &loaded) >= 0) {
+		_psTrace("Truncated CRL index was accepted\n");
+		goto L_FAIL;
+	}
+	/* Last slot moved to the front, with a good MAC */
+	memcpy(bad, index, indexLen);
+	memcpy(bad + slots, index + indexLen - SHA256_HASH_SIZE - w, w);
+	if (writeTestIndex(CRL_TEST_INDEX, bad, indexLen) < 0 ||
+			psX509LoadCRLIndex(pool, CRL_TEST_INDEX, crlIndexKey,
+			sizeof(crlIndexKey), &loaded) >= 0) {
+		_psTrace("Unsorted CRL index was accepted\n");
+		goto L_FAIL;
+	}
+	/* Earlier layouts were never authenticated */
+	memcpy(bad, index, indexLen);
+	bad[4] = 2;
+	if (writeTestIndex(CRL_TEST_INDEX, bad, indexLen) < 0 ||
+			psX509LoadCRLIndex(pool, CRL_TEST_INDEX, crlIndexKey,
+			sizeof(crlIndexKey), &loaded) >= 0) {
+		_psTrace("Version 2 CRL index was accepted\n");
+		goto L_FAIL;
+	}
+
+	_psTrace("	PASSED\n");
+	rc = PS_SUCCESS;
+L_FAIL:
+	remove(CRL_TEST_INDEX);
+	if (bad) {
+		psFree(bad, pool);
+	}
+	if (index) {
+		psFree(index, pool);
+	}
+	if (loaded) {
+		if (inserted) {
+			psCRL_Remove(loaded);
+		}
+		psX509FreeCRL(loaded);
+	}
+	if (crl) {
+		psX509FreeCRL(crl);
+	}
+	psX509FreeCert(ca);
+	return rc;
+}
+#endif /* USE_HMAC_SHA256 */
+#endif /* USE_CRL && USE_ECC && USE_SHA256 && MATRIX_USE_FILE_SYSTEM */
+
+#if defined(USE_CRL) && defined(USE_ECC) && defined(USE_SHA256)
+/* Everything psX509ParseCRL fills in, including what authentication uses */
+static int32 sameCrl(psX509Crl_t *a, psX509Crl_t *b)
+{
+	return sameCrlEntries(a, b) &&
+		a->sigAlg == b->sigAlg &&
+		a->sigHashLen == b->sigHashLen &&
+		memcmp(a->sigHash, b->sigHash, a->sigHashLen) == 0 &&
+		sameBytes(a->sig, a->sigLen, b->sig, b->sigLen) &&
+		a->nextUpdateType == b->nextUpdateType &&
+		a->nextUpdate != NULL && b->nextUpdate != NULL &&
+		strcmp(a->nextUpdate, b->nextUpdate) == 0 &&
+		sameBytes(a->extensions.ak.keyId, a->extensions.ak.keyLen,
+			b->extensions.ak.keyId, b->extensions.ak.keyLen);
+}
+
+static int32 streamTestCrl(uint32_t chunk, psX509Crl_t **crl)
+{
+	psX509CrlStream_t	ctx;
+	uint32_t			off, n;
+	int32				rc;
+
+	if ((rc = psX509CrlStreamInit(NULL, &ctx)) < 0) {
+		return rc;
+	}
+	for (off = 0; off < sizeof(crlTestCRL); off += n) {
+		n = sizeof(crlTestCRL) - off < chunk ?
+			sizeof(crlTestCRL) - off : chunk;
+		if ((rc = psX509CrlStreamUpdate(&ctx, crlTestCRL + off, n)) < 0) {
+			psX509CrlStreamFree(&ctx);
+			return rc;
+		}
+	}
+	return psX509CrlStreamFinal(&ctx, crl);
+}
+
+/*
+	Streaming in chunks of any size, down to a byte at a time, and parsing
+	from a file must give the CRL psX509ParseCRL gives for the whole DER.
+*/
+static int32 psX509CrlStreamTest(void)
+{
+	static const uint32_t	chunks[] = { 1, 2, 3, 7, 16, 64, 100,
+								sizeof(crlTestCRL) };
+	psX509Cert_t	*ca = NULL;
+	psX509Crl_t		*whole = NULL, *crl = NULL;
+	psX509CrlStream_t	ctx;
+	unsigned char	der[sizeof(crlTestCRL)];
+	int32			i, rc = PS_FAILURE;
+
+	memcpy(der, crlTestCRL, sizeof(der));
+	if (psX509ParseCert(NULL, crlTestCA, sizeof(crlTestCA), &ca, 0) < 0 ||
+			psX509ParseCRL(NULL, &whole, der, sizeof(der)) < 0) {
+		_psTrace("Parse of the test CA or CRL failed\n");
+		goto L_FAIL;
+	}
+	for (i = 0; i < (int32)(sizeof(chunks) / sizeof(chunks[0])); i++) {
+		if (streamTestCrl(chunks[i], &crl) < 0) {
+			_psTraceInt("Streamed CRL in %d byte chunks failed\n", chunks[i]);
+			goto L_FAIL;
+		}
+		if (!sameCrl(whole, crl) ||
+				psX509AuthenticateCRL(ca, crl, NULL) != PS_SUCCESS) {
+			_psTraceInt("CRL streamed in %d byte chunks differs\n",
+				chunks[i]);
+			goto L_FAIL;
+		}
+		psX509FreeCRL(crl);
+		crl = NULL;
+	}
+	/* Cut short */
+	if (psX509CrlStreamInit(NULL, &ctx) < 0) {
+		goto L_FAIL;
+	}
+	if (psX509CrlStreamUpdate(&ctx, crlTestCRL, sizeof(crlTestCRL) - 1) < 0) {
+		psX509CrlStreamFree(&ctx);
+		goto L_FAIL;
+	}
+	if (psX509CrlStreamFinal(&ctx, &crl) >= 0 || crl != NULL) {
+		_psTrace("Truncated CRL stream was accepted\n");
+		goto L_FAIL;
+	}
+#ifdef MATRIX_USE_FILE_SYSTEM
+	if (writeTestFile(CRL_TEST_FILE, crlTestCRL, sizeof(crlTestCRL)) < 0 ||
+			psX509ParseCRLFile(NULL, CRL_TEST_FILE, &crl) < 0) {
+		_psTrace("CRL file parse failed\n");
+		goto L_FAIL;
+	}
+	if (!sameCrl(whole, crl) ||
+			psX509AuthenticateCRL(ca, crl, NULL) != PS_SUCCESS) {
+		_psTrace("CRL parsed from a file differs\n");
+		goto L_FAIL;
+	}
+#endif /* MATRIX_USE_FILE_SYSTEM */
+
+	_psTrace("	PASSED\n");
+	rc = PS_SUCCESS;
+L_FAIL:
+#ifdef MATRIX_USE_FILE_SYSTEM
+	remove(CRL_TEST_FILE);
+#endif
+	if (crl) {
+		psX509FreeCRL(crl);
+	}
+	if (whole) {
+		psX509FreeCRL(whole);
+	}
+	psX509FreeCert(ca);
+	return rc;
+}
+#endif /* USE_CRL && USE_ECC && USE_SHA256 */
+
 /******************************************************************************/
 
 /******************************************************************************/
@@ -5016,6 +5954,13 @@ static test_t tests[] = {
 {psPrngTests
 , "***** PRNG TESTS *****"},
 
+#if defined(USE_MULTITHREADING) && defined(POSIX)
+{psPrngForkTest
+#else
+{NULL
+#endif
+, "***** PRNG FORK TESTS *****"},
+
 #if defined(USE_RSA) && defined(USE_PRIVATE_KEY_PARSING)
 {psRsaEncryptTest
 #else
@@ -5051,6 +5996,35 @@ static test_t tests[] = {
 #endif
 , "***** ECC TESTS *****"},
 
+#if defined(USE_FULL_CERT_PARSE) && defined(USE_ECC)
+{psX509LazyExtTest
+#else
+{NULL
+#endif
+, "***** X.509 LAZY EXTENSION TESTS *****"},
+
+#ifdef USE_CERT_PARSE
+{psX509CaIndexTest
+#else
+{NULL
+#endif
+, "***** X.509 CA INDEX TESTS *****"},
+
+#if defined(USE_CRL) && defined(USE_ECC) && defined(USE_SHA256) && \
+	defined(MATRIX_USE_FILE_SYSTEM) && defined(USE_HMAC_SHA256)
+{psX509CrlIndexTest
+#else
+{NULL
+#endif
+, "***** CRL INDEX TESTS *****"},
+
+#if defined(USE_CRL) && defined(USE_ECC) && defined(USE_SHA256)
+{psX509CrlStreamTest
+#else
+{NULL
+#endif
+, "***** CRL STREAM TESTS *****"},
+
 {NULL
 , "***** PRF TESTS *****"},
 
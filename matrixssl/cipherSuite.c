@@ -155,7 +155,12 @@ int32 csAesGcmEncrypt(void *ssl, unsigned char *pt,
 	ssl_t				*lssl = ssl;
 	psAesGcm_t			*ctx;
 	unsigned char		nonce[12];
+#ifdef USE_DTLS
+	unsigned char		aad[DTLS_CID_AAD_LEN(DTLS_MAX_CID_LEN)];
+#else
 	unsigned char		aad[TLS_GCM_AAD_LEN];
+#endif
+	uint16_t			aadLen;
 	int32				i, ptLen, seqNotDone;
 
 	if (len == 0) {
@@ -197,8 +202,15 @@ int32 csAesGcmEncrypt(void *ssl, unsigned char *pt,
 	aad[10] = lssl->minVer;
 	aad[11] = ptLen >> 8 & 0xFF;
 	aad[12] = ptLen & 0xFF;
+	aadLen = TLS_GCM_AAD_LEN;
+#ifdef USE_DTLS
+	if ((lssl->flags & SSL_FLAGS_DTLS) &&
+			lssl->outRecType == SSL_RECORD_TYPE_TLS12_CID) {
+		aadLen = (uint16_t)dtlsCidAdditionalData(lssl, HMAC_CREATE, ptLen, aad);
+	}
+#endif
 
-	psAesReadyGCM(ctx, nonce, aad, TLS_GCM_AAD_LEN);
+	psAesReadyGCM(ctx, nonce, aad, aadLen);
 	psAesEncryptGCM(ctx, pt, ct, ptLen);
 	psAesGetGCMTag(ctx, 16, ct + ptLen);
 
@@ -225,7 +237,12 @@ int32 csAesGcmDecrypt(void *ssl, unsigned char *ct,
 	psAesGcm_t			*ctx;
 	int32				i, ctLen, bytes, seqNotDone;
 	unsigned char		nonce[12];
+#ifdef USE_DTLS
+	unsigned char		aad[DTLS_CID_AAD_LEN(DTLS_MAX_CID_LEN)];
+#else
 	unsigned char		aad[TLS_GCM_AAD_LEN];
+#endif
+	uint16_t			aadLen;
 
 	ctx = &lssl->sec.decryptCtx.aesgcm;
 
@@ -254,8 +271,16 @@ int32 csAesGcmDecrypt(void *ssl, unsigned char *ct,
 	aad[10] = lssl->minVer;
 	aad[11] = ctLen >> 8 & 0xFF;
 	aad[12] = ctLen & 0xFF;
+	aadLen = TLS_GCM_AAD_LEN;
+#ifdef USE_DTLS
+	if ((lssl->flags & SSL_FLAGS_DTLS) &&
+			lssl->rec.type == SSL_RECORD_TYPE_TLS12_CID) {
+		aadLen = (uint16_t)dtlsCidAdditionalData(lssl, HMAC_VERIFY, ctLen,
+			aad);
+	}
+#endif
 
-	psAesReadyGCM(ctx, nonce, aad, TLS_GCM_AAD_LEN);
+	psAesReadyGCM(ctx, nonce, aad, aadLen);
 
 	if ((bytes = psAesDecryptGCM(ctx, ct, len, pt, len - TLS_GCM_TAG_LEN)) < 0){
 		return -1;
@@ -769,7 +794,7 @@ static int32 csMd5VerifyMac(void *sslv, unsigned char type, unsigned char *data,
 
 /* Set of bits corresponding to supported cipher ordinal. If set, it is
 	globally disabled */
-static uint32_t	disabledCipherFlags[8] = { 0 };	/* Supports up to 256 ciphers */
+static uint32_t	disabledCipherFlags[SSL_SUITE_WORDS] = { 0 };	/* Supports up to 256 ciphers */
 
 const static sslCipherSpec_t	supportedCiphers[] = {
 /*
@@ -1642,6 +1667,187 @@ const static sslCipherSpec_t	supportedCiphers[] = {
 		csNullVerifyMac}
 };
 
+/******************************************************************************/
+/*
+	Suite bitmaps have one bit per supportedCiphers[] ordinal, the same
+	numbering disabledCipherFlags uses, so negotiation constraints can be
+	combined a word at a time.  suiteIndex maps a suite id to its ordinal
+	(plus one, zero is empty) with linear probing so ClientHello entries are
+	resolved without walking supportedCiphers.
+*/
+#define SUITE_INDEX_SIZE	512	/* Power of 2, at least twice the suites */
+#define SUITE_NONE			0xFFFF
+#define SUITE_HASH(id)		(((id) ^ ((id) >> 7)) & (SUITE_INDEX_SIZE - 1))
+#define SUITE_ISSET(map, i)	((map)[(i) >> 5] & (1U << ((i) & 31)))
+#define SUITE_SET(map, i)	((map)[(i) >> 5] |= 1U << ((i) & 31))
+#define SUITE_CLR(map, i)	((map)[(i) >> 5] &= ~(1U << ((i) & 31)))
+
+static uint16_t	suiteIndex[SUITE_INDEX_SIZE];
+static uint16_t	suiteCount = 0;	/* Including the NULL suite */
+static uint32_t	suiteBuilt[SSL_SUITE_WORDS];	/* Algorithms compiled in */
+static uint32_t	suiteSha2[SSL_SUITE_WORDS];		/* TLS 1.2 only */
+static uint32_t	suiteMd5[SSL_SUITE_WORDS];		/* Not allowed in TLS 1.2 */
+static uint32_t	suiteHttp2[SSL_SUITE_WORDS];	/* Allowed by RFC 7540 */
+
+/*
+	Called from matrixSslOpen, and on first lookup if it hasn't been.  Only
+	writes values that are fixed by the build, so a repeated run is harmless
+*/
+void sslInitSuiteIndex(void)
+{
+	uint16_t	i, h;
+	uint32_t	flags;
+
+	if (suiteCount != 0) {
+		return;
+	}
+	for (i = 0; ; i++) {
+		h = SUITE_HASH(supportedCiphers[i].ident);
+		while (suiteIndex[h] != 0) {
+			h = (h + 1) & (SUITE_INDEX_SIZE - 1);
+		}
+		suiteIndex[h] = i + 1;
+
+		flags = supportedCiphers[i].flags;
+		SUITE_SET(suiteBuilt, i);
+		/* Double check we support the requested hash and weak algorithms */
+#ifndef USE_MD5
+		if (flags & CRYPTO_FLAGS_MD5) {
+			SUITE_CLR(suiteBuilt, i);
+		}
+#endif
+#ifndef USE_SHA1
+		if (flags & CRYPTO_FLAGS_SHA1) {
+			SUITE_CLR(suiteBuilt, i);
+		}
+#endif
+#if !defined(USE_SHA256) && !defined(USE_SHA384)
+		if (flags & CRYPTO_FLAGS_SHA2) {
+			SUITE_CLR(suiteBuilt, i);
+		}
+#endif
+#ifndef USE_ARC4
+		if (flags & (CRYPTO_FLAGS_ARC4INITE | CRYPTO_FLAGS_ARC4INITD)) {
+			SUITE_CLR(suiteBuilt, i);
+		}
+#endif
+#ifndef USE_3DES
+		if (flags & CRYPTO_FLAGS_3DES) {
+			SUITE_CLR(suiteBuilt, i);
+		}
+#endif
+		if (flags & (CRYPTO_FLAGS_SHA2 | CRYPTO_FLAGS_SHA3)) {
+			SUITE_SET(suiteSha2, i);
+		}
+		if (flags & CRYPTO_FLAGS_MD5) {
+			SUITE_SET(suiteMd5, i);
+		}
+		/* HTTP2 only allows AEAD ciphers with ephemeral key exchange */
+		if (flags & (CRYPTO_FLAGS_GCM | CRYPTO_FLAGS_CHACHA)) {
+			switch (supportedCiphers[i].type) {
+			case CS_DHE_RSA:
+			case CS_ECDHE_ECDSA:
+			case CS_ECDHE_RSA:
+				SUITE_SET(suiteHttp2, i);
+				break;
+			default:
+				break;
+			}
+		}
+		if (supportedCiphers[i].ident == SSL_NULL_WITH_NULL_NULL) {
+			break;
+		}
+	}
+	suiteCount = i + 1;
+}
+
+/* Ordinal of the suite in supportedCiphers or SUITE_NONE */
+static uint16_t findSuite(uint16_t id)
+{
+	uint16_t	h;
+
+	if (suiteCount == 0) {
+		sslInitSuiteIndex();
+	}
+	h = SUITE_HASH(id);
+	while (suiteIndex[h] != 0) {
+		if (supportedCiphers[suiteIndex[h] - 1].ident == id) {
+			return suiteIndex[h] - 1;
+		}
+		h = (h + 1) & (SUITE_INDEX_SIZE - 1);
+	}
+	return SUITE_NONE;
+}
+
+/*
+	Bitmap of the suites this session may negotiate, before key material is
+	taken into account
+*/
+static void sessionSuiteMask(const ssl_t *ssl, uint32_t mask[SSL_SUITE_WORDS])
+{
+	uint16_t	i;
+#ifdef USE_SERVER_SIDE_SSL
+	uint16_t	j;
+#endif
+#ifdef USE_TLS_1_2
+	int32		noSha2, noMd5;
+#endif
+
+	for (i = 0; i < SSL_SUITE_WORDS; i++) {
+		mask[i] = suiteBuilt[i];
+#ifdef USE_SERVER_SIDE_SSL
+		/* Globally disabled */
+		mask[i] &= ~disabledCipherFlags[i];
+#endif
+	}
+#ifdef USE_SERVER_SIDE_SSL
+	/* Disabled for session.  Disabling NULL_WITH_NULL_NULL not possible */
+	for (j = 0; j < SSL_MAX_DISABLED_CIPHERS; j++) {
+		if (ssl->disabledCiphers[j] != 0 &&
+				(i = findSuite(ssl->disabledCiphers[j])) != SUITE_NONE) {
+			SUITE_CLR(mask, i);
+		}
+	}
+#endif
+#ifdef USE_TLS_1_2
+	/* Unusable because protocol doesn't allow? */
+	noSha2 = noMd5 = 0;
+#ifdef USE_DTLS
+	if (ssl->majVer == DTLS_MAJ_VER && ssl->minVer != DTLS_1_2_MIN_VER) {
+		noSha2 = 1;
+	}
+	if (!(ssl->flags & SSL_FLAGS_DTLS)) {
+#endif
+	if (ssl->minVer < TLS_1_2_MIN_VER) {
+		noSha2 = 1;
+	}
+	if (ssl->minVer == TLS_1_2_MIN_VER) {
+		noMd5 = 1;
+	}
+#ifdef USE_DTLS
+	}
+#endif
+	for (i = 0; i < SSL_SUITE_WORDS; i++) {
+		if (noSha2) {
+			mask[i] &= ~suiteSha2[i];
+		}
+		if (noMd5) {
+			mask[i] &= ~suiteMd5[i];
+		}
+	}
+#endif /* USE_TLS_1_2 */
+
+	/** Check restrictions by HTTP2 (set by ALPN extension).
+		This should filter out all ciphersuites specified in:
+			https://tools.ietf.org/html/rfc7540#appendix-A
+	*/
+	if (ssl->flags & SSL_FLAGS_HTTP2) {
+		for (i = 0; i < SSL_SUITE_WORDS; i++) {
+			mask[i] &= suiteHttp2[i];
+		}
+	}
+}
+
 #ifdef USE_SERVER_SIDE_SSL
 /******************************************************************************/
 /*
@@ -1960,30 +2166,9 @@ static int32 haveCorrectSigAlg(psX509Cert_t *cert, int32 sigType)
 }
 #endif /* USE_SERVER_SIDE_SSL */
 
-/******************************************************************************/
-/*
-	Don't report a matching cipher suite if the user hasn't loaded the
-	proper public key material to support it.  We do not check the client
-	auth side of the algorithms because that authentication mechanism is
-	negotiated within the handshake itself
-
-	The annoying #ifdef USE_SERVER_SIDE and CLIENT_SIDE are because the
-	structure members only exist one one side or the other and so are used
-	for compiling.  You can't actually get into the wrong area of the
-	SSL_FLAGS_SERVER test so no #else cases should be needed
- */
-int32_t haveKeyMaterial(const ssl_t *ssl, int32 cipherType, short reallyTest)
+static int32 keysSupportCipherType(const sslKeys_t *keys, int32 server,
+				int32 cipherType)
 {
-
-#ifdef USE_SERVER_SIDE_SSL
-	/* If the user has a ServerNameIndication callback registered we're
-		going to skip the first test because they may not have loaded the
-		final key material yet */
-	if (ssl->sni_cb && reallyTest == 0) {
-		return PS_SUCCESS;
-	}
-#endif
-
 #ifndef USE_ONLY_PSK_CIPHER_SUITE
 
 	/*	To start, capture all the cipherTypes where servers must have an
@@ -1991,15 +2176,15 @@ int32_t haveKeyMaterial(const ssl_t *ssl, int32 cipherType, short reallyTest)
 	if (cipherType == CS_RSA || cipherType == CS_DHE_RSA ||
 			cipherType == CS_ECDHE_RSA || cipherType == CS_ECDH_RSA ||
 			cipherType == CS_ECDHE_ECDSA || cipherType == CS_ECDH_ECDSA) {
-		if (ssl->flags & SSL_FLAGS_SERVER) {
+		if (server) {
 #ifdef USE_SERVER_SIDE_SSL
-			if (ssl->keys == NULL || ssl->keys->cert == NULL) {
+			if (keys == NULL || keys->cert == NULL) {
 				return PS_FAILURE;
 			}
 #endif
 #ifdef USE_CLIENT_SIDE_SSL
 		} else {
-			if (ssl->keys == NULL || ssl->keys->CAcerts == NULL) {
+			if (keys == NULL || keys->CAcerts == NULL) {
 				return PS_FAILURE;
 			}
 #endif
@@ -2008,20 +2193,20 @@ int32_t haveKeyMaterial(const ssl_t *ssl, int32 cipherType, short reallyTest)
 
 	/*	Standard RSA ciphers types - auth and exchange */
 	if (cipherType == CS_RSA) {
-		if (ssl->flags & SSL_FLAGS_SERVER) {
+		if (server) {
 #ifdef USE_SERVER_SIDE_SSL
-			if (haveCorrectKeyAlg(ssl->keys->cert, OID_RSA_KEY_ALG,
+			if (haveCorrectKeyAlg(keys->cert, OID_RSA_KEY_ALG,
 					KEY_ALG_FIRST) < 0) {
 				return PS_FAILURE;
 			}
-			if (haveCorrectSigAlg(ssl->keys->cert, RSA_TYPE_SIG) < 0) {
+			if (haveCorrectSigAlg(keys->cert, RSA_TYPE_SIG) < 0) {
 				return PS_FAILURE;
 			}
 #endif
 #ifdef USE_CLIENT_SIDE_SSL
 		} else { /* Client */
 
-			if (haveCorrectKeyAlg(ssl->keys->CAcerts, OID_RSA_KEY_ALG,
+			if (haveCorrectKeyAlg(keys->CAcerts, OID_RSA_KEY_ALG,
 					KEY_ALG_ANY) < 0) {
 				return PS_FAILURE;
 			}
@@ -2034,21 +2219,21 @@ int32_t haveKeyMaterial(const ssl_t *ssl, int32 cipherType, short reallyTest)
 	DHE_RSA ciphers types
 */
 	if (cipherType == CS_DHE_RSA) {
-		if (ssl->flags & SSL_FLAGS_SERVER) {
+		if (server) {
 #ifdef REQUIRE_DH_PARAMS
-			if (ssl->keys->dhParams.size == 0) {
+			if (keys->dhParams.size == 0) {
 				return PS_FAILURE;
 			}
 #endif
 #ifdef USE_SERVER_SIDE_SSL
-			if (haveCorrectKeyAlg(ssl->keys->cert, OID_RSA_KEY_ALG,
+			if (haveCorrectKeyAlg(keys->cert, OID_RSA_KEY_ALG,
 					KEY_ALG_FIRST) < 0) {
 				return PS_FAILURE;
 			}
 #endif
 #ifdef USE_CLIENT_SIDE_SSL
 		} else {
-			if (haveCorrectKeyAlg(ssl->keys->CAcerts, OID_RSA_KEY_ALG,
+			if (haveCorrectKeyAlg(keys->CAcerts, OID_RSA_KEY_ALG,
 					KEY_ALG_ANY) < 0) {
 				return PS_FAILURE;
 			}
@@ -2061,8 +2246,8 @@ int32_t haveKeyMaterial(const ssl_t *ssl, int32 cipherType, short reallyTest)
 	Anon DH ciphers don't need much
 */
 	if (cipherType == CS_DH_ANON) {
-		if (ssl->flags & SSL_FLAGS_SERVER) {
-			if (ssl->keys == NULL || ssl->keys->dhParams.size == 0) {
+		if (server) {
+			if (keys == NULL || keys->dhParams.size == 0) {
 				return PS_FAILURE;
 			}
 		}
@@ -2072,15 +2257,15 @@ int32_t haveKeyMaterial(const ssl_t *ssl, int32 cipherType, short reallyTest)
 #ifdef USE_PSK_CIPHER_SUITE
 	if (cipherType == CS_DHE_PSK) {
 #ifdef REQUIRE_DH_PARAMS
-		if (ssl->flags & SSL_FLAGS_SERVER) {
-			if (ssl->keys == NULL || ssl->keys->dhParams.size == 0) {
+		if (server) {
+			if (keys == NULL || keys->dhParams.size == 0) {
 				return PS_FAILURE;
 			}
 		}
 #endif
 		/* Only using these for clients at the moment */
-		if (!(ssl->flags & SSL_FLAGS_SERVER)) {
-			if (ssl->keys == NULL || ssl->keys->pskKeys == NULL) {
+		if (!(server)) {
+			if (keys == NULL || keys->pskKeys == NULL) {
 				return PS_FAILURE;
 			}
 		}
@@ -2093,19 +2278,19 @@ int32_t haveKeyMaterial(const ssl_t *ssl, int32 cipherType, short reallyTest)
 	ECDHE_RSA ciphers use RSA keys
 */
 	if (cipherType == CS_ECDHE_RSA) {
-		if (ssl->flags & SSL_FLAGS_SERVER) {
+		if (server) {
 #ifdef USE_SERVER_SIDE_SSL
-			if (haveCorrectKeyAlg(ssl->keys->cert, OID_RSA_KEY_ALG,
+			if (haveCorrectKeyAlg(keys->cert, OID_RSA_KEY_ALG,
 					KEY_ALG_FIRST) < 0) {
 				return PS_FAILURE;
 			}
-			if (haveCorrectSigAlg(ssl->keys->cert, RSA_TYPE_SIG) < 0) {
+			if (haveCorrectSigAlg(keys->cert, RSA_TYPE_SIG) < 0) {
 				return PS_FAILURE;
 			}
 #endif
 #ifdef USE_CLIENT_SIDE_SSL
 		} else {
-			if (haveCorrectKeyAlg(ssl->keys->CAcerts, OID_RSA_KEY_ALG,
+			if (haveCorrectKeyAlg(keys->CAcerts, OID_RSA_KEY_ALG,
 					KEY_ALG_ANY) < 0) {
 				return PS_FAILURE;
 			}
@@ -2117,19 +2302,19 @@ int32_t haveKeyMaterial(const ssl_t *ssl, int32 cipherType, short reallyTest)
 	ECDH_RSA ciphers use ECDSA key exhange and RSA auth.
 */
 	if (cipherType == CS_ECDH_RSA) {
-		if (ssl->flags & SSL_FLAGS_SERVER) {
+		if (server) {
 #ifdef USE_SERVER_SIDE_SSL
-			if (haveCorrectKeyAlg(ssl->keys->cert, OID_ECDSA_KEY_ALG,
+			if (haveCorrectKeyAlg(keys->cert, OID_ECDSA_KEY_ALG,
 					KEY_ALG_FIRST) < 0) {
 				return PS_FAILURE;
 			}
-			if (haveCorrectSigAlg(ssl->keys->cert, RSA_TYPE_SIG) < 0) {
+			if (haveCorrectSigAlg(keys->cert, RSA_TYPE_SIG) < 0) {
 				return PS_FAILURE;
 			}
 #endif
 #ifdef USE_CLIENT_SIDE_SSL
 		} else {
-			if (haveCorrectKeyAlg(ssl->keys->CAcerts, OID_RSA_KEY_ALG,
+			if (haveCorrectKeyAlg(keys->CAcerts, OID_RSA_KEY_ALG,
 					KEY_ALG_ANY) < 0) {
 				return PS_FAILURE;
 			}
@@ -2142,19 +2327,19 @@ int32_t haveKeyMaterial(const ssl_t *ssl, int32 cipherType, short reallyTest)
 	ECDHE_ECDSA and ECDH_ECDSA ciphers must have ECDSA keys
 */
 	if (cipherType == CS_ECDHE_ECDSA || cipherType == CS_ECDH_ECDSA) {
-		if (ssl->flags & SSL_FLAGS_SERVER) {
+		if (server) {
 #ifdef USE_SERVER_SIDE_SSL
-			if (haveCorrectKeyAlg(ssl->keys->cert, OID_ECDSA_KEY_ALG,
+			if (haveCorrectKeyAlg(keys->cert, OID_ECDSA_KEY_ALG,
 					KEY_ALG_FIRST) < 0) {
 				return PS_FAILURE;
 			}
-			if (haveCorrectSigAlg(ssl->keys->cert, ECDSA_TYPE_SIG) < 0) {
+			if (haveCorrectSigAlg(keys->cert, ECDSA_TYPE_SIG) < 0) {
 				return PS_FAILURE;
 			}
 #endif
 #ifdef USE_CLIENT_SIDE_SSL
 		} else {
-			if (haveCorrectKeyAlg(ssl->keys->CAcerts, OID_ECDSA_KEY_ALG,
+			if (haveCorrectKeyAlg(keys->CAcerts, OID_ECDSA_KEY_ALG,
 					KEY_ALG_ANY) < 0) {
 				return PS_FAILURE;
 			}
@@ -2166,7 +2351,7 @@ int32_t haveKeyMaterial(const ssl_t *ssl, int32 cipherType, short reallyTest)
 
 #ifdef USE_PSK_CIPHER_SUITE
 	if (cipherType == CS_PSK) {
-		if (ssl->keys == NULL || ssl->keys->pskKeys == NULL) {
+		if (keys == NULL || keys->pskKeys == NULL) {
 			return PS_FAILURE;
 		}
 	}
@@ -2174,8 +2359,77 @@ int32_t haveKeyMaterial(const ssl_t *ssl, int32 cipherType, short reallyTest)
 
 	return PS_SUCCESS;
 }
+
+/******************************************************************************/
+/*
+	Don't report a matching cipher suite if the user hasn't loaded the
+	proper public key material to support it.  We do not check the client
+	auth side of the algorithms because that authentication mechanism is
+	negotiated within the handshake itself
+
+	The annoying #ifdef USE_SERVER_SIDE and CLIENT_SIDE are because the
+	structure members only exist one one side or the other and so are used
+	for compiling.  You can't actually get into the wrong area of the
+	SSL_FLAGS_SERVER test so no #else cases should be needed
+ */
+int32_t haveKeyMaterial(const ssl_t *ssl, int32 cipherType, short reallyTest)
+{
+	uint16_t	types;
+
+#ifdef USE_SERVER_SIDE_SSL
+	/* If the user has a ServerNameIndication callback registered we're
+		going to skip the first test because they may not have loaded the
+		final key material yet */
+	if (ssl->sni_cb && reallyTest == 0) {
+		return PS_SUCCESS;
+	}
+#endif
+	if (ssl->keys == NULL) {
+		return keysSupportCipherType(NULL, ssl->flags & SSL_FLAGS_SERVER,
+			cipherType);
+	}
+	types = (ssl->flags & SSL_FLAGS_SERVER) ? ssl->keys->serverCipherTypes :
+		ssl->keys->clientCipherTypes;
+	return (types & (1 << cipherType)) ? PS_SUCCESS : PS_FAILURE;
+}
 #endif /* VALIDATE_KEY_MATERIAL */
 
+/******************************************************************************/
+/*
+	Record which cipher types and suites the key material supports so the
+	per-suite checks above are done once per load rather than per handshake.
+	Every function that changes sslKeys_t key material must call this.
+*/
+void updateSuiteCaps(sslKeys_t *keys)
+{
+	uint16_t	i;
+	int32		type;
+
+	keys->serverCipherTypes = keys->clientCipherTypes = 0;
+	for (type = CS_NULL; type <= CS_ECDH_RSA; type++) {
+#ifdef VALIDATE_KEY_MATERIAL
+		if (keysSupportCipherType(keys, 1, type) == PS_SUCCESS) {
+			keys->serverCipherTypes |= 1 << type;
+		}
+		if (keysSupportCipherType(keys, 0, type) == PS_SUCCESS) {
+			keys->clientCipherTypes |= 1 << type;
+		}
+#else
+		keys->serverCipherTypes |= 1 << type;
+		keys->clientCipherTypes |= 1 << type;
+#endif
+	}
+	memset(keys->suiteCaps, 0x0, sizeof(keys->suiteCaps));
+	for (i = 0; ; i++) {
+		if (keys->serverCipherTypes & (1 << supportedCiphers[i].type)) {
+			SUITE_SET(keys->suiteCaps, i);
+		}
+		if (supportedCiphers[i].ident == SSL_NULL_WITH_NULL_NULL) {
+			break;
+		}
+	}
+}
+
 
 /*	0 return is a key was found
 	<0 is no luck
@@ -2190,7 +2444,26 @@ int32 chooseCipherSuite(ssl_t *ssl, unsigned char *listStart, int32 listLen)
 	uint32					cipher;
 	sslPubkeyId_t			wantKey;
 	sslKeys_t				*givenKey = NULL;
+	uint32_t				allowed[SSL_SUITE_WORDS];
+	uint32_t				offered[SSL_SUITE_WORDS];
+	uint16_t				order[SSL_SUITE_WORDS * 32];
+	uint16_t				i, n, count;
+
+	/* Everything the session allows, and in the cases of static server
+		keys (ssl->keys not NULL) what the key material supports */
+	sessionSuiteMask(ssl, allowed);
+#ifdef VALIDATE_KEY_MATERIAL
+	if (ssl->keys != NULL && ssl->sni_cb == NULL) {
+		for (i = 0; i < SSL_SUITE_WORDS; i++) {
+			allowed[i] &= ssl->keys->suiteCaps[i];
+		}
+	}
+#endif
 
+	/* One pass over the client list keeps the usable suites in client
+		preference order, ignoring unknown and repeated ids */
+	memset(offered, 0x0, sizeof(offered));
+	count = 0;
 	end = c + listLen;
 	while (c < end) {
 		
@@ -2198,19 +2471,36 @@ int32 chooseCipherSuite(ssl_t *ssl, unsigned char *listStart, int32 listLen)
 			cipher = *c << 8; c++;
 			cipher += *c; c++;
 		} else {
-			/* Deal with an SSLv2 hello message.  Ciphers are 3 bytes long */
+			/* Deal with an SSLv2 hello message.  Ciphers are 3 bytes long
+				and only those with a zero first byte are SSLv3/TLS suites */
 			cipher = *c << 16; c++;
 			cipher += *c << 8; c++;
 			cipher += *c; c++;
+			if (cipher > 0xFFFF) {
+				continue;
+			}
 		}
-
-		/* Checks if this cipher suite compiled into the library.
-			ALSO, in the cases of static server keys (ssl->keys not NULL)
-			the haveKeyMaterial	function will be run */
-		if ((spec = sslGetCipherSpec(ssl, cipher)) == NULL) {
+		if ((i = findSuite((uint16_t)cipher)) == SUITE_NONE ||
+				!SUITE_ISSET(allowed, i) || SUITE_ISSET(offered, i)) {
 			continue;
 		}
-		
+		SUITE_SET(offered, i);
+		order[count++] = i;
+	}
+
+	if (ssl->serverCipherPref) {
+		/* supportedCiphers is listed in our order of preference */
+		n = 0;
+		for (i = 0; i < suiteCount && n < count; i++) {
+			if (SUITE_ISSET(offered, i)) {
+				order[n++] = i;
+			}
+		}
+	}
+
+	for (n = 0; n < count; n++) {
+		spec = &supportedCiphers[order[n]];
+
 		if (ssl->keys == NULL) {
 			/* Populate the sslPubkeyId_t struct to pass to user callback */
 			wantKey.keyType = getKeyTypeFromCipherType(spec->type,
@@ -2430,14 +2720,12 @@ int32 csCheckCertAgainstCipherSuite(int32 pubKey, int32 cipherType)
 */
 const sslCipherSpec_t *sslGetDefinedCipherSpec(uint16_t id)
 {
-	uint8_t		i;
+	uint16_t	i;
 
-	for (i = 0; supportedCiphers[i].ident != SSL_NULL_WITH_NULL_NULL; i++) {
-		if (supportedCiphers[i].ident == id) {
-			return &supportedCiphers[i];
-		}
+	if (id == SSL_NULL_WITH_NULL_NULL || (i = findSuite(id)) == SUITE_NONE) {
+		return NULL;
 	}
-	return NULL;
+	return &supportedCiphers[i];
 }
 
 /******************************************************************************/
@@ -2452,144 +2740,30 @@ const sslCipherSpec_t *sslGetDefinedCipherSpec(uint16_t id)
 */
 const sslCipherSpec_t *sslGetCipherSpec(const ssl_t *ssl, uint16_t id)
 {
-	uint8_t		i;
-#ifdef USE_SERVER_SIDE_SSL
-	uint8_t		j;
-#endif /* USE_SERVER_SIDE_SSL */
+	uint16_t	i;
+	uint32_t	mask[SSL_SUITE_WORDS];
 
-	i = 0;
-	do {
-		if (supportedCiphers[i].ident != id) {
-			continue;
-		}
-		/* Double check we support the requsted hash algorithm */
-#ifndef USE_MD5
-		if (supportedCiphers[i].flags & CRYPTO_FLAGS_MD5) {
-			return NULL;
-		}
-#endif
-#ifndef USE_SHA1
-		if (supportedCiphers[i].flags & CRYPTO_FLAGS_SHA1) {
-			return NULL;
-		}
-#endif
-#if !defined(USE_SHA256) && !defined(USE_SHA384)
-		if (supportedCiphers[i].flags & CRYPTO_FLAGS_SHA2) {
-			return NULL;
-		}
-#endif
-		/* Double check we support the requsted weak cipher algorithm */
-#ifndef USE_ARC4
-		if (supportedCiphers[i].flags &
-			(CRYPTO_FLAGS_ARC4INITE | CRYPTO_FLAGS_ARC4INITD)) {
-			return NULL;
-		}
-#endif
-#ifndef USE_3DES
-		if (supportedCiphers[i].flags & CRYPTO_FLAGS_3DES) {
-			return NULL;
-		}
-#endif
-#ifdef USE_SERVER_SIDE_SSL
-		/* Globally disabled? */
-		if (disabledCipherFlags[i >> 5] & (1 << (i & 31))) {
-			psTraceIntInfo("Matched cipher suite %d but disabled by user\n",
-				id);
-			return NULL;
-		}
-		/* Disabled for session? */
-		if (id != 0) { /* Disable NULL_WITH_NULL_NULL not possible */
-			for (j = 0; j < SSL_MAX_DISABLED_CIPHERS; j++) {
-				if (ssl->disabledCiphers[j] == id) {
-					psTraceIntInfo("Matched cipher suite %d but disabled by user\n",
-						id);
-					return NULL;
-				}
-			}
-		}
-#endif /* USE_SERVER_SIDE_SSL */
-#ifdef USE_TLS_1_2
-		/* Unusable because protocol doesn't allow? */
-#ifdef USE_DTLS
-		if (ssl->majVer == DTLS_MAJ_VER &&
-				ssl->minVer != DTLS_1_2_MIN_VER) {
-			if (supportedCiphers[i].flags & CRYPTO_FLAGS_SHA3 ||
-					supportedCiphers[i].flags & CRYPTO_FLAGS_SHA2) {
-				psTraceIntInfo(
-					"Matched cipher suite %d but only allowed in DTLS 1.2\n", id);
-				return NULL;
-			}
-		}
-		if (!(ssl->flags & SSL_FLAGS_DTLS)) {
-#endif
-		if (ssl->minVer < TLS_1_2_MIN_VER) {
-			if (supportedCiphers[i].flags & CRYPTO_FLAGS_SHA3 ||
-					supportedCiphers[i].flags & CRYPTO_FLAGS_SHA2) {
-				psTraceIntInfo(
-					"Matched cipher suite %d but only allowed in TLS 1.2\n", id);
-				return NULL;
-			}
-		}
-		if (ssl->minVer == TLS_1_2_MIN_VER) {
-			if (supportedCiphers[i].flags & CRYPTO_FLAGS_MD5) {
-				psTraceIntInfo("Not allowing MD5 suite %d in TLS 1.2\n",
-					id);
-				return NULL;
-			}
-		}
-#ifdef USE_DTLS
-		}
-#endif
-#endif /* TLS_1_2 */
-
-		/** Check restrictions by HTTP2 (set by ALPN extension).
-			This should filter out all ciphersuites specified in:
-				https://tools.ietf.org/html/rfc7540#appendix-A
-		"Note: This list was assembled from the set of registered TLS
-		cipher suites at the time of writing.  This list includes those
-		cipher suites that do not offer an ephemeral key exchange and
-		those that are based on the TLS null, stream, or block cipher type
-		(as defined in Section 6.2.3 of [TLS12]).  Additional cipher
-		suites with these properties could be defined; these would not be
-		explicitly prohibited."
-		*/
-		if (ssl->flags & SSL_FLAGS_HTTP2) {
-			/** Only allow AEAD ciphers. */
-			if (!(supportedCiphers[i].flags & CRYPTO_FLAGS_GCM) &&
-				!(supportedCiphers[i].flags & CRYPTO_FLAGS_CHACHA)) {
-
-				return NULL;
-			}
-			/** Only allow ephemeral key exchange. */
-			switch (supportedCiphers[i].type) {
-			case CS_DHE_RSA:
-			case CS_ECDHE_ECDSA:
-			case CS_ECDHE_RSA:
-				break;
-			default:
-				return NULL;
-			}
-		}
+	if ((i = findSuite(id)) == SUITE_NONE) {
+		return NULL;
+	}
+	sessionSuiteMask(ssl, mask);
+	if (!SUITE_ISSET(mask, i)) {
+		psTraceIntInfo("Matched cipher suite %d but not allowed for session\n",
+			id);
+		return NULL;
+	}
 
-		/*	The suite is available.  Want to reject if current key material
-			does not support? */
+	/*	The suite is available.  Want to reject if current key material
+		does not support? */
 #ifdef VALIDATE_KEY_MATERIAL
-		if (ssl->keys != NULL) {
-			if (haveKeyMaterial(ssl, supportedCiphers[i].type, 0)
-					== PS_SUCCESS) {
-				return &supportedCiphers[i];
-			}
-			psTraceIntInfo("Matched cipher suite %d but no supporting keys\n",
-				id);
-		} else {
-			return &supportedCiphers[i];
-		}
-#else
-		return &supportedCiphers[i];
+	if (ssl->keys != NULL &&
+			haveKeyMaterial(ssl, supportedCiphers[i].type, 0) < 0) {
+		psTraceIntInfo("Matched cipher suite %d but no supporting keys\n",
+			id);
+		return NULL;
+	}
 #endif /* VALIDATE_KEY_MATERIAL */
-	} while (supportedCiphers[i++].ident != SSL_NULL_WITH_NULL_NULL) ;
-
-	return NULL;
+	return &supportedCiphers[i];
 }
 
 
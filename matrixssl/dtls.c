@@ -49,61 +49,277 @@ static int32 globalPmtu;
 #error "DTLS_COOKIE_KEY_SIZE too small (recommended 32 or more)."
 #endif /* DTLS_COOKIE_KEY_SIZE */
 
-/* The cookie key is generated once on startup. */
-static unsigned char cookie_key[DTLS_COOKIE_KEY_SIZE] = { 0 };
+/*
+	Cookie keys.  The current key signs new cookies and a cookie is accepted
+	under the current or the previous key, so matrixDtlsRotateCookieKey
+	expires any cookie after two rotations.  The first key is generated on
+	startup.
+*/
+static unsigned char cookie_key[2][DTLS_COOKIE_KEY_SIZE];
+static uint8_t cookie_cur = 0;
 
-int32 dtlsGenCookieSecret(void)
+static int32 genCookieKey(unsigned char key[DTLS_COOKIE_KEY_SIZE])
 {
 	int i;
 	int32 res;
 
-	/* Check if cookie_key appears ok from first octets.
+	/* Check if key appears ok from first octets.
 	   Retry at most three times if values appear not ok (too many zeroes). */
 	for(i = 0; i < 4; i++) {
-		res = matrixCryptoGetPrngData(cookie_key, DTLS_COOKIE_KEY_SIZE,
-									  NULL);
-		if ((cookie_key[0] | cookie_key[1] | cookie_key[2] |
-			 cookie_key[3]) != 0)
+		res = matrixCryptoGetPrngData(key, DTLS_COOKIE_KEY_SIZE, NULL);
+		if ((key[0] | key[1] | key[2] | key[3]) != 0)
 				return res;
 	}
 	return PS_FAILURE; /* Unable to get cookie_key from RNG. */
 }
 
-int32_t dtlsComputeCookie(ssl_t *ssl, unsigned char *helloBytes, int32 helloLen)
+int32 dtlsGenCookieSecret(void)
 {
-	unsigned char		hmacKey[SHA256_HASHLEN];
-	unsigned char		out[SHA256_HASHLEN];
-	uint16_t			hmacKeyLen;
-	int32_t				rc;
+	int32 res;
 
-	/* Ensure cookie_key has been initialized.
-	   (Initialization at dtlsGenCookieSecret() makes sure one of first
-	   four bytes is non-zero if initialization succeeded. */
-	if ((cookie_key[0] | cookie_key[1] | cookie_key[2] | cookie_key[3]) == 0)
-	{
-		return PS_FAIL;
+	if ((res = genCookieKey(cookie_key[cookie_cur])) < 0) {
+		return res;
 	}
+	/* Nothing was issued under a previous key */
+	memcpy(cookie_key[cookie_cur ^ 1], cookie_key[cookie_cur],
+		DTLS_COOKIE_KEY_SIZE);
+	return res;
+}
+
+/*
+	Start signing cookies with a fresh key.  Cookies already handed out
+	stay valid until the next rotation, so calling this every N seconds
+	bounds a cookie's life to between N and 2N seconds.  Not thread safe
+	against concurrent cookie checks.
+*/
+int32 matrixDtlsRotateCookieKey(void)
+{
+	int32 res;
+
+	if ((res = genCookieKey(cookie_key[cookie_cur ^ 1])) < 0) {
+		return res;
+	}
+	cookie_cur ^= 1;
+	return res;
+}
+
+/*
+	cookie = HMAC(key, peerId || hello) truncated to DTLS_COOKIE_SIZE.
+	hello is the ClientHello body up to the cookie (version, random and
+	session id), peerId is whatever transport identity the caller binds in.
+*/
+static int32 cookieHmac(const unsigned char *key, const unsigned char *peerId,
+				uint16_t peerIdLen, const unsigned char *hello,
+				uint32_t helloLen, unsigned char cookie[DTLS_COOKIE_SIZE])
+{
 #ifdef USE_HMAC_SHA256
+	psHmacSha256_t		ctx;
+	unsigned char		out[SHA256_HASHLEN];
  #if DTLS_COOKIE_SIZE > SHA256_HASHLEN
   #error "DTLS_COOKIE_SIZE too large"
  #endif
-	rc = psHmacSha256(cookie_key, DTLS_COOKIE_KEY_SIZE, helloBytes, helloLen,
-				out, hmacKey, &hmacKeyLen);
 #elif defined (USE_HMAC_SHA1)
+	psHmacSha1_t		ctx;
+	unsigned char		out[SHA1_HASHLEN];
  #if DTLS_COOKIE_SIZE > SHA1_HASHLEN
   #error "DTLS_COOKIE_SIZE too large"
  #endif
-	rc = psHmacSha1(cookie_key, DTLS_COOKIE_KEY_SIZE, helloBytes, helloLen,
-				out, hmacKey, &hmacKeyLen);
 #else
  #error Must define HMAC_SHA256 or HMAC_SHA1 with DTLS
 #endif
-	if (rc >= 0) {
-		/* Truncate hash output if necessary */
-		memcpy(ssl->srvCookie, out, DTLS_COOKIE_SIZE);
+	int32_t				rc;
+
+	/* Ensure cookie_key has been initialized.
+	   (Initialization at dtlsGenCookieSecret() makes sure one of first
+	   four bytes is non-zero if initialization succeeded. */
+	if ((key[0] | key[1] | key[2] | key[3]) == 0) {
+		return PS_FAIL;
 	}
-	memzero_s(out, DTLS_COOKIE_SIZE);
-	return rc;
+#ifdef USE_HMAC_SHA256
+	if ((rc = psHmacSha256Init(&ctx, key, DTLS_COOKIE_KEY_SIZE)) < 0) {
+		return rc;
+	}
+	psHmacSha256Update(&ctx, peerId, peerIdLen);
+	psHmacSha256Update(&ctx, hello, helloLen);
+	psHmacSha256Final(&ctx, out);
+#else
+	if ((rc = psHmacSha1Init(&ctx, key, DTLS_COOKIE_KEY_SIZE)) < 0) {
+		return rc;
+	}
+	psHmacSha1Update(&ctx, peerId, peerIdLen);
+	psHmacSha1Update(&ctx, hello, helloLen);
+	psHmacSha1Final(&ctx, out);
+#endif
+	/* Truncate hash output if necessary */
+	memcpy(cookie, out, DTLS_COOKIE_SIZE);
+	memzero_s(out, sizeof(out));
+	return PS_SUCCESS;
+}
+
+/*
+	Compute the cookie to send in a HELLO_VERIFY_REQUEST into ssl->srvCookie
+*/
+int32_t dtlsComputeCookie(ssl_t *ssl, unsigned char *helloBytes, int32 helloLen)
+{
+	return cookieHmac(cookie_key[cookie_cur], ssl->dtlsPeerId,
+		ssl->dtlsPeerIdLen, helloBytes, helloLen, ssl->srvCookie);
+}
+
+/*
+	Constant time check of a client's cookie against the current and
+	previous keys.  PS_TRUE if it is one we issued.
+*/
+int32 dtlsCheckCookie(const unsigned char *peerId, uint16_t peerIdLen,
+				const unsigned char *helloBytes, uint32_t helloLen,
+				const unsigned char cookie[DTLS_COOKIE_SIZE])
+{
+	unsigned char	expect[DTLS_COOKIE_SIZE];
+	int32			i, match;
+
+	match = 0;
+	for (i = 0; i < 2; i++) {
+		if (cookieHmac(cookie_key[cookie_cur ^ i], peerId, peerIdLen,
+				helloBytes, helloLen, expect) < 0) {
+			return PS_FALSE;
+		}
+		match |= memcmpct(cookie, expect, DTLS_COOKIE_SIZE) == 0;
+	}
+	memzero_s(expect, sizeof(expect));
+	return match ? PS_TRUE : PS_FALSE;
+}
+
+/******************************************************************************/
+/*
+	Stateless cookie exchange for a datagram from a peer that has no session.
+
+	Lets a server answer ClientHellos with a HelloVerifyRequest before it
+	commits any per-peer state, so spoofed floods cost one HMAC each and no
+	memory.  peerId is the client's transport address (or any identity the
+	server can see for every datagram from it).  Create the session only
+	once this returns PS_SUCCESS, passing the same peerId in
+	sslSessOpts_t.dtlsPeerId, and give it the datagram.
+
+	Returns
+		PS_SUCCESS		ClientHello with a valid cookie
+		MATRIXSSL_REQUEST_SEND	A HELLO_VERIFY_REQUEST datagram was written
+						to out and *outLen set.  Send it and drop 'in'
+		PS_PROTOCOL_FAIL	Not an initial ClientHello.  Drop it
+		< 0				Other failure
+*/
+#define DTLS_HVR_LEN (SSL3_HEADER_LEN + DTLS_HEADER_ADD_LEN + \
+		SSL3_HANDSHAKE_HEADER_LEN + DTLS_HEADER_ADD_LEN + 3 + DTLS_COOKIE_SIZE)
+
+int32 matrixDtlsCheckCookie(const unsigned char *in, uint32 inLen,
+				const unsigned char *peerId, uint16 peerIdLen,
+				unsigned char *out, uint32 *outLen)
+{
+	const unsigned char	*c, *end, *hello;
+	unsigned char		*o, cookie[DTLS_COOKIE_SIZE];
+	uint32				recLen, msgLen, fragOff, fragLen, helloLen;
+
+	if (in == NULL || out == NULL || outLen == NULL ||
+			(peerId == NULL && peerIdLen > 0) ||
+			peerIdLen > DTLS_MAX_PEER_ID_LEN) {
+		return PS_ARG_FAIL;
+	}
+	/* Record header: type, version, epoch 0 and a handshake message */
+	if (inLen < SSL3_HEADER_LEN + DTLS_HEADER_ADD_LEN ||
+			in[0] != SSL_RECORD_TYPE_HANDSHAKE || in[1] != DTLS_MAJ_VER ||
+			in[3] != 0 || in[4] != 0) {
+		return PS_PROTOCOL_FAIL;
+	}
+	recLen = (in[11] << 8) | in[12];
+	c = in + SSL3_HEADER_LEN + DTLS_HEADER_ADD_LEN;
+	if (recLen > inLen - (uint32)(c - in) ||
+			recLen < SSL3_HANDSHAKE_HEADER_LEN + DTLS_HEADER_ADD_LEN) {
+		return PS_PROTOCOL_FAIL;
+	}
+	/* The first fragment of a CLIENT_HELLO is enough if it holds the
+		cookie */
+	msgLen = (c[1] << 16) | (c[2] << 8) | c[3];
+	fragOff = (c[6] << 16) | (c[7] << 8) | c[8];
+	fragLen = (c[9] << 16) | (c[10] << 8) | c[11];
+	if (c[0] != SSL_HS_CLIENT_HELLO || fragOff != 0 || fragLen > msgLen ||
+			fragLen > recLen - (SSL3_HANDSHAKE_HEADER_LEN +
+				DTLS_HEADER_ADD_LEN)) {
+		return PS_PROTOCOL_FAIL;
+	}
+	hello = c + SSL3_HANDSHAKE_HEADER_LEN + DTLS_HEADER_ADD_LEN;
+	end = hello + fragLen;
+
+	/* Version, random and session id make up the hashed hello bytes */
+	c = hello + 2 + SSL_HS_RANDOM_SIZE;
+	if (end - c < 1 || *c > SSL_MAX_SESSION_ID_SIZE || end - c < 2 + *c) {
+		return PS_PROTOCOL_FAIL;
+	}
+	c += 1 + *c;
+	helloLen = (uint32)(c - hello);
+	if (*c == DTLS_COOKIE_SIZE && end - c >= 1 + DTLS_COOKIE_SIZE) {
+		if (dtlsCheckCookie(peerId, peerIdLen, hello, helloLen, c + 1)
+				== PS_TRUE) {
+			return PS_SUCCESS;
+		}
+	}
+
+	/* Missing, stale or forged.  Issue a fresh one */
+	if (*outLen < DTLS_HVR_LEN) {
+		*outLen = DTLS_HVR_LEN;
+		return PS_OUTPUT_LENGTH;
+	}
+	if (cookieHmac(cookie_key[cookie_cur], peerId, peerIdLen, hello,
+			helloLen, cookie) < 0) {
+		return PS_FAILURE;
+	}
+	o = out;
+	/* Record header echoes the ClientHello version and sequence number */
+	*o++ = SSL_RECORD_TYPE_HANDSHAKE;
+	*o++ = in[1];
+	*o++ = in[2];
+	memcpy(o, in + 3, 8); o += 8;
+	recLen = DTLS_HVR_LEN - SSL3_HEADER_LEN - DTLS_HEADER_ADD_LEN;
+	*o++ = (recLen >> 8) & 0xFF;
+	*o++ = recLen & 0xFF;
+	/* Handshake header, message_seq 0, unfragmented */
+	msgLen = 3 + DTLS_COOKIE_SIZE;
+	*o++ = SSL_HS_HELLO_VERIFY_REQUEST;
+	*o++ = 0; *o++ = 0; *o++ = msgLen;
+	*o++ = 0; *o++ = 0;
+	*o++ = 0; *o++ = 0; *o++ = 0;
+	*o++ = 0; *o++ = 0; *o++ = msgLen;
+	/* Body is version, cookie length, and cookie itself */
+	*o++ = in[1];
+	*o++ = in[2];
+	*o++ = DTLS_COOKIE_SIZE;
+	memcpy(o, cookie, DTLS_COOKIE_SIZE);
+	o += DTLS_COOKIE_SIZE;
+	*outLen = (uint32)(o - out);
+	return MATRIXSSL_REQUEST_SEND;
+}
+
+/******************************************************************************/
+/*
+	Connection ID of the first record in a datagram, for servers that hand
+	out fixed length IDs (sslSessOpts_t.dtlsCidLen) and find sessions by
+	them rather than by peer address, which can change under NAT.
+
+	Returns
+		PS_SUCCESS		*cid points at the cidLen byte ID within 'in'
+		PS_PROTOCOL_FAIL	Not a tls12_cid record.  Find by address
+*/
+int32 matrixDtlsGetConnectionId(const unsigned char *in, uint32 inLen,
+				uint16 cidLen, const unsigned char **cid)
+{
+	if (in == NULL || cid == NULL || cidLen == 0 ||
+			cidLen > DTLS_MAX_CID_LEN) {
+		return PS_ARG_FAIL;
+	}
+	if (inLen < SSL3_HEADER_LEN + DTLS_HEADER_ADD_LEN + (uint32)cidLen ||
+			in[0] != SSL_RECORD_TYPE_TLS12_CID || in[1] != DTLS_MAJ_VER) {
+		return PS_PROTOCOL_FAIL;
+	}
+	/* type, version, epoch and sequence number come first */
+	*cid = in + 3 + DTLS_HEADER_ADD_LEN;
+	return PS_SUCCESS;
 }
 #endif /* USE_SERVER_SIDE_SSL */
 
@@ -131,61 +347,76 @@ int32 matrixDtlsGetPmtu(void)
 	return globalPmtu;
 }
 
-#ifndef USE_ONLY_PSK_CIPHER_SUITE
-#if defined(USE_SERVER_SIDE_SSL) || defined(USE_CLIENT_AUTH)
-static int32 fragmentHSMessage(ssl_t *ssl, unsigned char *msg, int32 msgLen,
-							int32 hsType, unsigned char *c);
-static int32 postponeEncryptFragRecord(ssl_t *ssl, int32 padLen,
-			int32 fragCount, int32 fragLen,	int32 msgLen, int32 type,
-			int32 hsMsg, unsigned char *encryptStart, unsigned char **c);
-#endif
-/******************************************************************************/
 /*
-	The certificate message spans records
+	Datagram limit for one session, for peers behind a path known to be
+	smaller than the global PMTU.  The global value is the upper bound since
+	buffers are sized by it.  < 0 resets to the global value.
 */
-int32 dtlsWriteCertificate(ssl_t *ssl, int32 certLen, int32 lsize,
-			unsigned char *c)
+int32 matrixDtlsSetSessionPmtu(ssl_t *ssl, int32 pmtu)
 {
-#if defined(USE_SERVER_SIDE_SSL) || defined(USE_CLIENT_AUTH)
-	psX509Cert_t	*cert;
-	unsigned char	*tmp, *tmpStart;
-	int32			tmpLen, wLen;
+	if (!ssl || !(ssl->flags & SSL_FLAGS_DTLS)) {
+		return PS_ARG_FAIL;
+	}
+	if (pmtu < 0 || pmtu > globalPmtu) {
+		pmtu = globalPmtu;
+	}
+	if (pmtu < PS_MIN_PMTU) {
+		pmtu = PS_MIN_PMTU;
+	}
+	ssl->pmtu = pmtu;
+	return pmtu;
+}
+
 /*
-	DTLS fragmented writes are done backwards.  The message info is written
-	to a temp buffer and the hs header and record header are wrapped around
-	that as the fragmentation is done.
+	Current datagram limit of the session, lower than what was set if
+	flight resends have backed it off.  Worth remembering per destination
+	to start the next session there.
 */
-	tmpLen = certLen + lsize;
-	tmpStart = tmp = psMalloc(NULL, tmpLen);
-	if (tmpStart == NULL) {
-		return SSL_MEM_ERROR;
+int32 matrixDtlsGetSessionPmtu(ssl_t *ssl)
+{
+	if (!ssl || !(ssl->flags & SSL_FLAGS_DTLS)) {
+		return PS_ARG_FAIL;
 	}
+	return ssl->pmtu;
+}
 
-	*tmp = (unsigned char)(((certLen + (lsize - 3)) & 0xFF0000) >> 16); tmp++;
-	*tmp = ((certLen + (lsize - 3)) & 0xFF00) >> 8; tmp++;
-	*tmp = ((certLen + (lsize - 3)) & 0xFF); tmp++;
+/*
+	Repeated loss of a flight is often a datagram too large for the path
+	being dropped, so step down to the next common link size.  Stops at 512,
+	below which the larger handshake flights no longer encode.
+*/
+static void dtlsPmtuBackoff(ssl_t *ssl)
+{
+	static const int32 steps[] = { 1400, 1280, 1024, 768, 576, 512 };
+	int32	i;
 
-	if (certLen > 0) {
-		cert = ssl->keys->cert;
-		while (cert) {
-			certLen = cert->binLen;
-			if (certLen > 0) {
-				*tmp = (unsigned char)((certLen & 0xFF0000) >> 16); tmp++;
-				*tmp = (certLen & 0xFF00) >> 8; tmp++;
-				*tmp = (certLen & 0xFF); tmp++;
-				memcpy(tmp, cert->unparsedBin, certLen);
-				tmp += certLen;
-			}
-			cert = cert->next;
+	for (i = 0; i < (int32)(sizeof(steps) / sizeof(steps[0])); i++) {
+		if (steps[i] < ssl->pmtu) {
+			psTraceIntDtls("Backing off PMTU to %d\n", steps[i]);
+			ssl->pmtu = steps[i];
+			return;
 		}
 	}
+}
 
+#ifndef USE_ONLY_PSK_CIPHER_SUITE
+#if defined(USE_SERVER_SIDE_SSL) || defined(USE_CLIENT_AUTH)
+static int32 fragmentHSMessage(ssl_t *ssl, const unsigned char *msg,
+							int32 msgLen, int32 hsType, unsigned char *c);
+static int32 postponeEncryptFragRecord(ssl_t *ssl, int32 padLen,
+			int32 fragCount, int32 fragLen,	int32 msgLen, int32 type,
+			int32 hsMsg, unsigned char *encryptStart, unsigned char **c);
+#endif
+/******************************************************************************/
 /*
-	Fragment it
+	The certificate message spans records.  The message body is pre-encoded
+	on the sslKeys_t so it can be fragmented directly without a temp copy.
 */
-	wLen = fragmentHSMessage(ssl, tmpStart, tmpLen, SSL_HS_CERTIFICATE, c);
-	psFree(tmpStart, NULL);
-	return wLen;
+int32 dtlsWriteCertificate(ssl_t *ssl, const unsigned char *msg, int32 msgLen,
+			unsigned char *c)
+{
+#if defined(USE_SERVER_SIDE_SSL) || defined(USE_CLIENT_AUTH)
+	return fragmentHSMessage(ssl, msg, msgLen, SSL_HS_CERTIFICATE, c);
 #else
 	/* Wrapping in defines here to keep sslEncode a bit more clear.  Need
 		this because 'cert' is not available on straight USE_CLIENT_SIDE
@@ -322,8 +553,8 @@ int32 dtlsWriteCertificateRequest(psPool_t *pool, ssl_t *ssl, int32 certLen,
 	Given the data message and lengths, chunk up the message into a
 	multi-record handshake message
 */
-static int32 fragmentHSMessage(ssl_t *ssl, unsigned char *msg, int32 msgLen,
-							int32 hsType, unsigned char *c)
+static int32 fragmentHSMessage(ssl_t *ssl, const unsigned char *msg,
+							int32 msgLen, int32 hsType, unsigned char *c)
 {
 	unsigned char	*msgStart, *encryptStart;
 	int32			tmpLen, recordLen, fragLen, offset,	fragCount,
@@ -584,65 +815,114 @@ int32 dtlsHsHashFragMsg(ssl_t *ssl)
 /*
  *	Replay detection, per IPSec
  *	http://www.faqs.org/rfcs/rfc2401.html Appendix C
- *	Returns 0 if packet disallowed, 1 if packet permitted
+ *
+ *	The window is a ring of DTLS_REPLAY_WINDOW bits indexed by the low bits
+ *	of the full 48 bit sequence number, so sliding it forward only clears
+ *	the bits being reused rather than shifting the whole bitmap.  Sliding by
+ *	n clears n bits a word at a time, at most DTLS_REPLAY_WINDOW / 64 + 1
+ *	word writes, and a jump of a whole window or more is one memset.
  */
-enum {
-	ReplayWindowSize = 32
-};
-int32 dtlsChkReplayWindow(ssl_t *ssl, unsigned char *seq64)
+#define REPLAY_MASK		(DTLS_REPLAY_WINDOW - 1)
+
+void dtlsResetReplayWindow(ssl_t *ssl)
 {
-	uint32_t diff, seq, lastSeq;
-	unsigned char *ls64;
+	ssl->replayTop = 0;
+	memset(ssl->replayBits, 0x0, sizeof(ssl->replayBits));
+}
 
-/*
-	TODO DTLS - We truncate 48 bit sequence to 32bits to make it simpler here
-*/
-	seq = ((uint32_t)seq64[2] << 24) + ((uint32_t)seq64[3] << 16) +
-		((uint32_t)seq64[4] << 8) + (uint32_t)seq64[5];
-	ls64 = ssl->lastRsn;
-	lastSeq = ((uint32_t)ls64[2] << 24) + ((uint32_t)ls64[3] << 16) +
-		((uint32_t)ls64[4] << 8) + (uint32_t)ls64[5];
-
-	if (seq == 0) {
-		/* Need to differentiate between initial, duplicate, and epoch shift */
-		if (lastSeq == 0 && ssl->rec.epoch[0] == 0 && ssl->rec.epoch[1] == 0) {
-			ssl->dtlsBitmap = 0;
-			return 1; /* initial one */
-		}
-		if (dtlsCompareEpoch(ssl->rec.epoch, ssl->resendEpoch) == 1 &&
-				lastSeq > 0) {
-			ssl->dtlsBitmap = 0;
-			return 1; /* epoch shift */
-		}
-		if (lastSeq == 0xFFFFFFF) {
-			ssl->dtlsBitmap = 0;
-			return 1; /* wrapped */
+static __inline void replayMark(ssl_t *ssl, uint64_t seq)
+{
+	uint32_t	i = (uint32_t)(seq & REPLAY_MASK);
+
+	ssl->replayBits[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
+/* Forget count (< DTLS_REPLAY_WINDOW) slots starting with that of seq */
+static void replayClear(ssl_t *ssl, uint64_t seq, uint64_t count)
+{
+	uint32_t	i = (uint32_t)(seq & REPLAY_MASK), n;
+	uint64_t	m;
+
+	while (count > 0) {
+		n = 64 - (i & 63);
+		if (n > count) {
+			n = (uint32_t)count;
 		}
-		return 0; /* duplicate */
+		m = n == 64 ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1) << (i & 63);
+		ssl->replayBits[i >> 6] &= ~m;
+		count -= n;
+		i = (i + n) & REPLAY_MASK;
 	}
+}
 
-	if (seq > lastSeq) {		/* new larger sequence number */
-		diff = seq - lastSeq;
-		if (diff < ReplayWindowSize) {	/* In window */
-			ssl->dtlsBitmap <<= diff;
-			ssl->dtlsBitmap |= 1;	/* set bit for this packet */
-		} else {
-			ssl->lastRsn[0] = 1;	/* This packet has a "way larger" */
-		}
-		memcpy(ssl->lastRsn, seq64, 6);
-		return 1;					/* larger is good */
+static __inline uint64_t replaySeq(const unsigned char *seq64)
+{
+	return ((uint64_t)seq64[0] << 40) | ((uint64_t)seq64[1] << 32) |
+		((uint64_t)seq64[2] << 24) | ((uint64_t)seq64[3] << 16) |
+		((uint64_t)seq64[4] << 8) | (uint64_t)seq64[5];
+}
+
+/* Record 0 of the first epoch, or of an epoch after the one we resend in */
+static __inline int32 replayRestart(ssl_t *ssl, uint64_t seq)
+{
+	if (seq != 0) {
+		return 0;
 	}
-	diff = lastSeq - seq;
-	if (diff >= ReplayWindowSize) {
-		return 0;					/* too old or wrapped */
+	if (ssl->replayTop == 0 && ssl->rec.epoch[0] == 0 &&
+			ssl->rec.epoch[1] == 0) {
+		return 1; /* initial one */
 	}
-	if (ssl->dtlsBitmap & ((int32)1 << diff)) {
+	return dtlsCompareEpoch(ssl->rec.epoch, ssl->resendEpoch) == 1 &&
+		ssl->replayTop > 0; /* epoch shift */
+}
+
+/*
+	Returns 0 if packet disallowed, 1 if packet permitted.  The window is
+	left alone: a record must not move it until it has been authenticated,
+	see dtlsMarkReplayWindow (RFC 6347 4.1.2.6).
+*/
+int32 dtlsChkReplayWindow(ssl_t *ssl, const unsigned char *seq64)
+{
+	uint64_t	seq;
+	uint32_t	i;
+
+	seq = replaySeq(seq64);
+	if (replayRestart(ssl, seq) || seq > ssl->replayTop) {
+		return 1;					/* new epoch or larger is good */
+	}
+	if (ssl->replayTop - seq >= DTLS_REPLAY_WINDOW) {
+		return 0;					/* too old */
+	}
+	i = (uint32_t)(seq & REPLAY_MASK);
+	if (ssl->replayBits[i >> 6] & ((uint64_t)1 << (i & 63))) {
 		return 0;					/* already seen */
 	}
-	ssl->dtlsBitmap |= ((unsigned long)1 << diff);	/* mark as seen */
 	return 1;						/* out of order but good */
 }
 
+/*
+	Record an authenticated record that dtlsChkReplayWindow permitted
+*/
+void dtlsMarkReplayWindow(ssl_t *ssl, const unsigned char *seq64)
+{
+	uint64_t	seq, diff;
+
+	seq = replaySeq(seq64);
+	if (replayRestart(ssl, seq)) {
+		dtlsResetReplayWindow(ssl);
+	} else if (seq > ssl->replayTop) {
+		diff = seq - ssl->replayTop;
+		if (diff >= DTLS_REPLAY_WINDOW) {
+			memset(ssl->replayBits, 0x0, sizeof(ssl->replayBits));
+		} else {
+			/* Forget the slots that now fall out the back of the window */
+			replayClear(ssl, ssl->replayTop + 1, diff);
+		}
+		ssl->replayTop = seq;
+	}
+	replayMark(ssl, seq);
+}
+
 /******************************************************************************/
 /*
 	Init ssl_t fragment members
@@ -667,8 +947,12 @@ void dtlsInitFrag(ssl_t *ssl)
 /*
 	Return 1 if this fragment has been seen before.  Just reads the
 	fragHeaders member.  Does not update.
+
+	Return 2 if it overlaps one we have without matching it.  The peer has
+	re-fragmented a resend for a smaller PMTU, so the caller starts over.
 */
-int32 dtlsSeenFrag(ssl_t *ssl, int32 fragOffset, int32 *hdrIndex)
+int32 dtlsSeenFrag(ssl_t *ssl, int32 fragOffset, int32 fragLen,
+				int32 *hdrIndex)
 {
 	int32	i;
 
@@ -677,9 +961,15 @@ int32 dtlsSeenFrag(ssl_t *ssl, int32 fragOffset, int32 *hdrIndex)
 			*hdrIndex = i;
 			return 0;
 		}
-		if (ssl->fragHeaders[i].offset == fragOffset) {
+		if (ssl->fragHeaders[i].offset == fragOffset &&
+				ssl->fragHeaders[i].fragLen == fragLen) {
 			return 1;
 		}
+		if (fragOffset < ssl->fragHeaders[i].offset +
+					ssl->fragHeaders[i].fragLen &&
+				ssl->fragHeaders[i].offset < fragOffset + fragLen) {
+			return 2;
+		}
 	}
 /*
 	Max fragments exceeded error
@@ -748,6 +1038,73 @@ void zeroSixByte(unsigned char *c)
 	}
 }
 
+/*
+	RFC 9146 MAC input, also the AEAD additional data, for a tls12_cid
+	record of DTLSInnerPlaintext length 'len'.  Returns bytes written to out,
+	at most DTLS_CID_AAD_LEN(DTLS_MAX_CID_LEN)
+*/
+int32 dtlsCidAdditionalData(ssl_t *ssl, int32 mode, uint32 len,
+				unsigned char *out)
+{
+	unsigned char	*c = out;
+	unsigned char	*cid, *epoch, *rsn;
+	uint8_t			cidLen;
+
+	if (mode == HMAC_CREATE) {
+		cid = ssl->cidOut;
+		cidLen = ssl->cidOutLen;
+		epoch = ssl->epoch;
+		rsn = ssl->rsn;
+	} else {
+		cid = ssl->cidIn;
+		cidLen = ssl->rec.cidLen;
+		epoch = ssl->rec.epoch;
+		rsn = ssl->rec.rsn;
+	}
+	memset(c, 0xFF, 8); c += 8; /* seq_num_placeholder */
+	*c = SSL_RECORD_TYPE_TLS12_CID; c++;
+	*c = cidLen; c++;
+	*c = SSL_RECORD_TYPE_TLS12_CID; c++;
+	*c = ssl->majVer; c++;
+	*c = ssl->minVer; c++;
+	memcpy(c, epoch, 2); c += 2;
+	memcpy(c, rsn, 6); c += 6;
+	memcpy(c, cid, cidLen); c += cidLen;
+	*c = (len & 0xFF00) >> 8; c++;
+	*c = len & 0xFF; c++;
+	return (int32)(c - out);
+}
+
+/*
+	Whether the negotiated record protection can carry a connection ID.
+	The CID has to be authenticated, so only the record MACs and the native
+	AES-GCM that take dtlsCidAdditionalData qualify.  ChaCha20-Poly1305,
+	CCM, HMAC-MD5, the libsodium GCM (fixed size AAD) and zlib compressed
+	records are left without one.
+*/
+int32 dtlsCidCapable(ssl_t *ssl)
+{
+	uint32_t	flags = ssl->cipher->flags;
+
+#ifdef USE_ZLIB_COMPRESSION
+	if (ssl->compression) {
+		return 0;
+	}
+#endif
+	if (flags & (CRYPTO_FLAGS_CHACHA | CRYPTO_FLAGS_CCM | CRYPTO_FLAGS_CCM8)) {
+		return 0;
+	}
+	if (flags & CRYPTO_FLAGS_GCM) {
+#if defined(USE_NATIVE_AES) && !defined(USE_LIBSODIUM_AES_GCM)
+		return 1;
+#else
+		return 0;
+#endif
+	}
+	return (flags & (CRYPTO_FLAGS_SHA1 | CRYPTO_FLAGS_SHA2 |
+		CRYPTO_FLAGS_SHA3)) ? 1 : 0;
+}
+
 int32 dtlsCompareEpoch(unsigned char *incoming, unsigned char *expected)
 {
 	int32 i;
@@ -778,6 +1135,8 @@ static int32 dtlsRevertWriteCipher(ssl_t *ssl)
 	memcpy(ssl->sec.writeIV, ssl->owriteIV, ssl->oenIvSize);
 #ifdef USE_NATIVE_TLS_ALGS
 	memcpy(ssl->sec.writeMAC, ssl->owriteMAC, ssl->oenMacSize);
+	tlsInitRecordHmac(&ssl->sec.writeHmac, ssl->sec.writeMAC,
+		ssl->nativeEnMacSize);
 	memcpy(&ssl->sec.encryptCtx, &ssl->oencryptCtx,
 		   sizeof(psCipherContext_t));
 #endif
@@ -821,6 +1180,155 @@ static int32 dtlsRevertWriteCipher(ssl_t *ssl)
 	return 0;
 }
 
+/******************************************************************************/
+/*
+	And now the ugly part.  If we have been receiving records that
+	are sent individually and we are successfully midway through an
+	incomming flight, we don't want to resend our previous flight.  We
+	are still just waiting for the remainder of the flight from the peer.
+	The only way to figure this out is to test our specific state to
+	make sure we are on a flight boundary.  This gets somewhat complicated
+	simply due to the different types of handshakes (standard, resumed,
+	and client auth) having different flight boundaries.
+
+	The state is always the handshake message you expect to be receiving
+	from the peer.
+*/
+static int16 dtlsSafeToResend(ssl_t *ssl)
+{
+	int16	safeToResend;
+
+	safeToResend = 0;
+
+	if (ssl->flags & SSL_FLAGS_SERVER) {
+		if (ssl->hsState == SSL_HS_CLIENT_HELLO) {
+			safeToResend = 1; /* any handshake type */
+		}
+		if (!(ssl->flags & SSL_FLAGS_RESUMED)) {
+			if (ssl->hsState == SSL_HS_DONE) {
+				safeToResend = 1; /* DONE set on parse of peer FINISHED */
+			}
+		}
+
+#ifdef USE_CLIENT_AUTH
+		/* Different client auth boundary for second flight */
+		if (ssl->flags & SSL_FLAGS_CLIENT_AUTH) {
+			if (ssl->hsState == SSL_HS_CERTIFICATE) {
+				safeToResend = 1;
+			}
+		} else {
+#endif /* USE_CLIENT_AUTH */
+			if (ssl->hsState == SSL_HS_CLIENT_KEY_EXCHANGE) {
+				safeToResend = 1;
+			}
+#ifdef USE_CLIENT_AUTH
+		}
+#endif /* USE_CLIENT_AUTH */
+
+		if (ssl->flags & SSL_FLAGS_RESUMED) {
+			if (ssl->hsState == SSL_HS_FINISHED) {
+				safeToResend = 1;
+			}
+		}
+
+	} else {
+		/* Client tests */
+		if (ssl->hsState == SSL_HS_SERVER_HELLO) {
+			safeToResend = 1;
+		}
+		if (!(ssl->flags & SSL_FLAGS_RESUMED)) {
+			if (ssl->hsState == SSL_HS_FINISHED) {
+				safeToResend = 1;
+			}
+		}
+		if (ssl->hsState == SSL_HS_DONE) {
+			safeToResend = 1; /* Done is set on parse of peer FINISHED */
+		}
+
+	}
+	return safeToResend;
+}
+
+/******************************************************************************/
+/*
+	Keep a copy of a flight just encoded so that timer resends can skip
+	sslEncodeResponse.  Only flights without encrypted records qualify,
+	since the record MAC covers the sequence number that a resend must
+	change.  Everything else is rebuilt by dtlsResendFlight.
+*/
+void dtlsCacheFlight(ssl_t *ssl, unsigned char *start, unsigned char *end)
+{
+	unsigned char	*c;
+	int32			len, recLen;
+
+	len = (int32)(end - start);
+	if (len <= 0 || (ssl->flags & SSL_FLAGS_WRITE_SECURE)) {
+		dtlsFreeFlightCache(ssl);
+		return;
+	}
+	if (len > ssl->flightCacheSize) {
+		dtlsFreeFlightCache(ssl);
+		if ((ssl->flightCache = psMalloc(ssl->bufferPool, len)) == NULL) {
+			return; /* Resends will just re-encode */
+		}
+		ssl->flightCacheSize = len;
+	}
+	memcpy(ssl->flightCache, start, len);
+	ssl->flightCacheLen = len;
+	ssl->flightCacheMaxRec = 0;
+	for (c = start; end - c >= ssl->recordHeadLen; c += recLen) {
+		recLen = ssl->recordHeadLen + (((int32)c[ssl->recordHeadLen - 2] << 8)
+			+ c[ssl->recordHeadLen - 1]);
+		if (recLen > ssl->flightCacheMaxRec) {
+			ssl->flightCacheMaxRec = recLen;
+		}
+	}
+}
+
+void dtlsFreeFlightCache(ssl_t *ssl)
+{
+	if (ssl->flightCache) {
+		psFree(ssl->flightCache, ssl->bufferPool);
+	}
+	ssl->flightCache = NULL;
+	ssl->flightCacheLen = ssl->flightCacheSize = 0;
+}
+
+/*
+	Copy the cached flight into out, giving each record the next sequence
+	number.  The peer's replay window would drop the original numbers.
+*/
+static int32 dtlsResendCachedFlight(ssl_t *ssl, psBuf_t *out)
+{
+	unsigned char	*c, *end;
+	int32			len;
+
+	if ((out->buf + out->size) - out->end < ssl->flightCacheLen) {
+		psFree(out->buf, ssl->bufferPool);
+		if ((out->buf = psMalloc(ssl->bufferPool, ssl->flightCacheLen))
+				== NULL) {
+			out->start = out->end = NULL;
+			out->size = 0;
+			return PS_MEM_FAIL;
+		}
+		out->start = out->end = out->buf;
+		out->size = ssl->flightCacheLen;
+	}
+	c = out->end;
+	memcpy(c, ssl->flightCache, ssl->flightCacheLen);
+	end = c + ssl->flightCacheLen;
+	while (end - c >= ssl->recordHeadLen) {
+		/* type(1) version(2) epoch(2) rsn(6) length(2) */
+		memcpy(c + 5, ssl->rsn, 6);
+		dtlsIncrRsn(ssl);
+		len = ((int32)c[ssl->recordHeadLen - 2] << 8) +
+			c[ssl->recordHeadLen - 1];
+		c += ssl->recordHeadLen + len;
+	}
+	out->end = end;
+	return PS_SUCCESS;
+}
+
 /******************************************************************************/
 /*
 
@@ -829,6 +1337,20 @@ static int32 dtlsResendFlight(ssl_t *ssl, psBuf_t *out)
 {
 	int32		rc;
 	uint32		requiredLen = 0; /* only added so far to get to compile */
+
+#if DTLS_PMTU_BACKOFF_RESENDS > 0
+	if (++ssl->flightResends >= DTLS_PMTU_BACKOFF_RESENDS) {
+		ssl->flightResends = 0;
+		dtlsPmtuBackoff(ssl);
+	}
+#endif
+/*
+	While every cached record still fits the PMTU only the record numbers
+	need to change.  MSN and epoch stay where the flight left them
+*/
+	if (ssl->flightCache && ssl->flightCacheMaxRec <= ssl->pmtu) {
+		return dtlsResendCachedFlight(ssl, out);
+	}
 /*
 	Reset to the MSN and epoch of the first message in the current flight
 */
@@ -880,6 +1402,19 @@ encode:
 	return PS_SUCCESS;
 }
 
+/******************************************************************************/
+/*
+	Header length of an outgoing record.  Ours carry the peer's connection
+	ID once one has been negotiated
+*/
+static int32 dtlsRecordHeadLen(ssl_t *ssl, const unsigned char *rec)
+{
+	if (*rec == SSL_RECORD_TYPE_TLS12_CID) {
+		return ssl->recordHeadLen + ssl->cidOutLen;
+	}
+	return ssl->recordHeadLen;
+}
+
 /******************************************************************************/
 /*
 	Takes a 'flight' of records and returns the length of how many full
@@ -890,7 +1425,7 @@ encode:
 static int32 dtlsGetNextRecordLen(ssl_t *ssl, int32 pmtu, sslBuf_t *out,
 								 int32 *recordLen)
 {
-	int32			tlen, len;
+	int32			tlen, len, hlen;
 	unsigned char	*newend;
 
 	newend = out->start;
@@ -898,10 +1433,11 @@ static int32 dtlsGetNextRecordLen(ssl_t *ssl, int32 pmtu, sslBuf_t *out,
 	If pmtu is <= 0 the user wants a single record regardless
 */
 	if (pmtu <= 0) {
-		newend += ssl->recordHeadLen - 2; /* Find the last two bytes of len */
+		hlen = dtlsRecordHeadLen(ssl, newend);
+		newend += hlen - 2; /* Find the last two bytes of len */
 		len = (int32)(newend[0]) << 8;
 		len += newend[1];
-		len += ssl->recordHeadLen;	/* add record header length to the total */
+		len += hlen;	/* add record header length to the total */
 		*recordLen = len;
 		return 0;
 	}
@@ -920,11 +1456,12 @@ static int32 dtlsGetNextRecordLen(ssl_t *ssl, int32 pmtu, sslBuf_t *out,
 */
 	tlen = len = 0;
 	while (out->end > newend) {
-		newend += ssl->recordHeadLen - 2; /* Find the last two bytes of len */
+		hlen = dtlsRecordHeadLen(ssl, newend);
+		newend += hlen - 2; /* Find the last two bytes of len */
 		len = (int32)*newend << 8; newend++;
 		len += (int32)*newend; newend++;
 		newend += len;
-		len += ssl->recordHeadLen;	/* add record header length to the total */
+		len += hlen;	/* add record header length to the total */
 /*
 		See if more records can fit in this single write.  Just storing
 		current length in temps and reading off the next one.  If it doesn't
@@ -941,6 +1478,41 @@ static int32 dtlsGetNextRecordLen(ssl_t *ssl, int32 pmtu, sslBuf_t *out,
 	return 0;
 }
 
+/******************************************************************************/
+/*
+	Hand the session a datagram already received into *buf, instead of
+	copying it into the buffer from matrixSslGetReadbuf.  The session takes
+	*buf as its read buffer and returns its old one in *buf and *bufSize for
+	the caller's next receive.  Both must be psMalloc'd from the session
+	bufferPool.  Follow with matrixSslReceivedData as usual.
+
+	PS_PENDING if the session still holds unprocessed data, in which case
+	the caller has to append the datagram with matrixSslGetReadbuf.
+*/
+int32 matrixDtlsSwapReadbuf(ssl_t *ssl, unsigned char **buf, uint32 *bufSize)
+{
+	unsigned char	*p;
+	int32			size;
+
+	if (!ssl || !buf || !*buf || !bufSize ||
+			!(ssl->flags & SSL_FLAGS_DTLS)) {
+		return PS_ARG_FAIL;
+	}
+	if (*bufSize < (uint32)matrixDtlsGetPmtu()) {
+		return PS_ARG_FAIL;
+	}
+	if (ssl->inlen > 0) {
+		return PS_PENDING;
+	}
+	p = ssl->inbuf;
+	size = ssl->insize;
+	ssl->inbuf = *buf;
+	ssl->insize = (int32)*bufSize;
+	*buf = p;
+	*bufSize = (uint32)size;
+	return PS_SUCCESS;
+}
+
 /******************************************************************************/
 /*
 	Manages the DTLS flight buffer to make sure each call will return data
@@ -959,7 +1531,6 @@ int32 matrixDtlsGetOutdata(ssl_t *ssl, unsigned char **buf)
 {
 	psBuf_t			tmp;
 	int32			bytesToSend, rc;
-	int16			safeToResend;
 
 	if (!ssl || !buf) {
 		return PS_ARG_FAIL;
@@ -994,81 +1565,21 @@ int32 matrixDtlsGetOutdata(ssl_t *ssl, unsigned char **buf)
 	If ssl->outbuf is empty and not in appDataExch mode this is a flight resend
 */
 	if ((tmp.end == tmp.start) && (ssl->appDataExch == 0)) {
-
-		/* And now the ugly part.  If we have been receiving records that
-		are sent individually and we are successfully midway through an
-		incomming flight, we don't want to resend our previous flight.  We
-		are still just waiting for the remainder of the flight from the peer.
-		The only way to figure this out is to test our specific state to
-		make sure we are on a flight boundary.  This gets somewhat complicated
-		simply due to the different types of handshakes (standard, resumed,
-		and client auth) having different flight boundaries.
-
-		The state is always the handshake message you expect to be receiving
-		from the peer.
-		*/
-		safeToResend = 0;
-
-		if (ssl->flags & SSL_FLAGS_SERVER) {
-			if (ssl->hsState == SSL_HS_CLIENT_HELLO) {
-				safeToResend = 1; /* any handshake type */
-			}
-			if (!(ssl->flags & SSL_FLAGS_RESUMED)) {
-				if (ssl->hsState == SSL_HS_DONE) {
-					safeToResend = 1; /* DONE set on parse of peer FINISHED */
-				}
-			}
-
-#ifdef USE_CLIENT_AUTH
-			/* Different client auth boundary for second flight */
-			if (ssl->flags & SSL_FLAGS_CLIENT_AUTH) {
-				if (ssl->hsState == SSL_HS_CERTIFICATE) {
-					safeToResend = 1;
-				}
-			} else {
-#endif /* USE_CLIENT_AUTH */
-				if (ssl->hsState == SSL_HS_CLIENT_KEY_EXCHANGE) {
-					safeToResend = 1;
-				}
-#ifdef USE_CLIENT_AUTH
-			}
-#endif /* USE_CLIENT_AUTH */
-
-			if (ssl->flags & SSL_FLAGS_RESUMED) {
-				if (ssl->hsState == SSL_HS_FINISHED) {
-					safeToResend = 1;
-				}
-			}
-
-		} else {
-			/* Client tests */
-			if (ssl->hsState == SSL_HS_SERVER_HELLO) {
-				safeToResend = 1;
-			}
-			if (!(ssl->flags & SSL_FLAGS_RESUMED)) {
-				if (ssl->hsState == SSL_HS_FINISHED) {
-					safeToResend = 1;
-				}
-			}
-			if (ssl->hsState == SSL_HS_DONE) {
-				safeToResend = 1; /* Done is set on parse of peer FINISHED */
-			}
-
-		}
-
-		if (safeToResend == 0) {
+		if (dtlsSafeToResend(ssl) == 0) {
 			psTraceIntDtls("Refused a resend due to state %d\n", ssl->hsState);
 			*buf = NULL;
 			return 0;
 		}
 
-		/* A true flight resend is needed */
-		if ((rc = dtlsResendFlight(ssl, &tmp)) < 0) {
-			return rc;
-		}
+		/* A true flight resend is needed.  The buffer may have been
+			replaced even if the encode then failed */
+		rc = dtlsResendFlight(ssl, &tmp);
 		ssl->outbuf = tmp.buf;
 		ssl->outlen = tmp.end - tmp.start;
 		ssl->outsize = tmp.size;
+		if (rc < 0) {
+			return rc;
+		}
 	}
 
 /*
@@ -1079,7 +1590,7 @@ int32 matrixDtlsGetOutdata(ssl_t *ssl, unsigned char **buf)
 #ifdef DTLS_SEND_RECORDS_INDIVIDUALLY
 	dtlsGetNextRecordLen(ssl, 0, &tmp, &bytesToSend);
 #else
-	dtlsGetNextRecordLen(ssl, matrixDtlsGetPmtu(), &tmp, &bytesToSend);
+	dtlsGetNextRecordLen(ssl, ssl->pmtu, &tmp, &bytesToSend);
 #endif
 
 	*buf = ssl->outbuf;
@@ -1110,9 +1621,103 @@ int32 matrixDtlsSentData(ssl_t *ssl, uint32 bytes)
 */
 	if (ssl->outlen == 0 && ssl->appDataExch == 0) {
 		ssl->flightDone = 1;
+/*
+		The whole flight is out, so (re)start the retransmit timer unless
+		this was the last flight of the handshake.  A server never resends
+		HelloVerifyRequest
+*/
+		if (ssl->hsState != SSL_HS_DONE && !((ssl->flags & SSL_FLAGS_SERVER)
+				&& ssl->hsState == SSL_HS_CLIENT_HELLO)) {
+			psGetTime(&ssl->retransStart, ssl->userPtr);
+			ssl->retransArmed = 1;
+		}
 	}
 	return rc;
 }
 
+/******************************************************************************/
+/*
+	Milliseconds until matrixDtlsHandleTimeout will resend the last flight,
+	0 if it is already due.  Applications use this as the poll or select
+	timeout while a handshake is in progress.  now may be NULL to read the
+	clock here.
+
+	PS_FAILURE if no flight is waiting on the peer
+*/
+int32 matrixDtlsGetTimeout(ssl_t *ssl, psTime_t *now)
+{
+	psTime_t	t;
+	int32		elapsed;
+
+	if (!ssl || !(ssl->flags & SSL_FLAGS_DTLS)) {
+		return PS_ARG_FAIL;
+	}
+	if (!ssl->retransArmed || ssl->hsState == SSL_HS_DONE ||
+			ssl->appDataExch) {
+		return PS_FAILURE;
+	}
+	if (now == NULL) {
+		psGetTime(&t, ssl->userPtr);
+		now = &t;
+	}
+	elapsed = psDiffMsecs(ssl->retransStart, *now, ssl->userPtr);
+	if (elapsed < 0 || (uint32)elapsed >= ssl->retransTimeout) {
+		return 0;
+	}
+	return (int32)(ssl->retransTimeout - elapsed);
+}
+
+/******************************************************************************/
+/*
+	RFC 6347 retransmission timer.  If the timer for the last flight has
+	expired, double it (up to DTLS_RETRANSMIT_MAX_MS) and load the flight
+	back into the outgoing buffer.  DTLS 1.2 has no acknowledgements, so the
+	whole flight is resent; the timer is cancelled as soon as the peer's
+	next flight starts to arrive.
+
+	MATRIXSSL_REQUEST_SEND	Flight queued, drain with matrixDtlsGetOutdata
+	PS_SUCCESS				Nothing due
+	PS_TIMEOUT_FAIL			Expired at the maximum timer, give up on the peer
+*/
+int32 matrixDtlsHandleTimeout(ssl_t *ssl, psTime_t *now)
+{
+	psBuf_t		tmp;
+	int32		rc;
+
+	rc = matrixDtlsGetTimeout(ssl, now);
+	if (rc > 0 || rc == PS_FAILURE) {
+		return PS_SUCCESS;
+	}
+	if (rc < 0) {
+		return rc;
+	}
+	ssl->retransArmed = 0;
+	if (dtlsSafeToResend(ssl) == 0) {
+		/* Part of the peer's next flight is in, which acks ours */
+		return PS_SUCCESS;
+	}
+	if (ssl->retransTimeout >= DTLS_RETRANSMIT_MAX_MS) {
+		psTraceDtls("Giving up on flight resends\n");
+		return PS_TIMEOUT_FAIL;
+	}
+	ssl->retransTimeout *= 2;
+	if (ssl->retransTimeout > DTLS_RETRANSMIT_MAX_MS) {
+		ssl->retransTimeout = DTLS_RETRANSMIT_MAX_MS;
+	}
+	if (ssl->outlen > 0) {
+		return MATRIXSSL_REQUEST_SEND; /* Flight was never drained */
+	}
+	tmp.buf = tmp.start = tmp.end = ssl->outbuf;
+	tmp.size = ssl->outsize;
+	rc = dtlsResendFlight(ssl, &tmp);
+	ssl->outbuf = tmp.buf;
+	ssl->outlen = (int32)(tmp.end - tmp.start);
+	ssl->outsize = tmp.size;
+	if (rc < 0) {
+		return rc;
+	}
+	return MATRIXSSL_REQUEST_SEND;
+}
+
 #endif /* USE_DTLS */
 
@@ -73,6 +73,8 @@ int32 parseClientHelloExtensions(ssl_t *ssl, unsigned char **cp, unsigned short
 	ssl->extFlags.session_ticket = 0;
 	ssl->extFlags.extended_master_secret = 0;
 	ssl->extFlags.status_request = 0;
+	ssl->extFlags.record_size_limit = 0;
+	ssl->extFlags.connection_id_ext = 0;
 	
 	/*	There could be extension data to parse here:
 		Two byte length and extension info.
@@ -128,6 +130,15 @@ int32 parseClientHelloExtensions(ssl_t *ssl, unsigned char **cp, unsigned short
 		}
 	}
 	
+	/* record_size_limit replaces max_fragment_length if both were sent.
+		Our own limit goes back in the SERVER_HELLO. */
+	if (ssl->extFlags.record_size_limit) {
+		ssl->maxPtFrag = min(ssl->peerRecLimit, SSL_MAX_PLAINTEXT_LEN);
+		if (ssl->recLimit == 0) {
+			ssl->recLimit = SSL_MAX_PLAINTEXT_LEN;
+		}
+	}
+
 	/* Handle the extensions that were missing or not what we wanted */
 	if (ssl->extFlags.require_extended_master_secret == 1 &&
 			ssl->extFlags.extended_master_secret == 0) {
@@ -275,6 +286,56 @@ static int ClientHelloExt(ssl_t *ssl, unsigned short extType, unsigned short ext
 
 	/**************************************************************************/
 
+	case EXT_RECORD_SIZE_LIMIT:
+		if (extLen != 2) {
+			psTraceInfo("Invalid record size limit ext len\n");
+			ssl->err = SSL_ALERT_DECODE_ERROR;
+			return MATRIXSSL_ERROR;
+		}
+		i = *c << 8; c++;
+		i += *c;
+		if (i < SSL_MIN_RECORD_SIZE_LIMIT) {
+			psTraceInfo("Client sent bad record size limit\n");
+			ssl->err = SSL_ALERT_ILLEGAL_PARAMETER;
+			return MATRIXSSL_ERROR;
+		}
+		/* User could have disabled for this session */
+		if (!ssl->extFlags.deny_record_size_limit) {
+			ssl->peerRecLimit = i;
+			ssl->extFlags.record_size_limit = 1;
+		}
+		break;
+
+#ifdef USE_DTLS
+	/**************************************************************************/
+
+	case EXT_CONNECTION_ID:
+		/* The connection ID the client wants on records we send it */
+		if (extLen < 1 || extLen != *c + 1) {
+			psTraceInfo("Invalid connection id ext len\n");
+			ssl->err = SSL_ALERT_DECODE_ERROR;
+			return MATRIXSSL_ERROR;
+		}
+		if (*c > DTLS_MAX_CID_LEN) {
+			psTraceIntInfo("Client connection id too long: %d\n", *c);
+			ssl->err = SSL_ALERT_ILLEGAL_PARAMETER;
+			return MATRIXSSL_ERROR;
+		}
+		/* Only negotiated if the server session asked for it, and never
+			changed by a rehandshake */
+		if ((ssl->flags & SSL_FLAGS_DTLS) &&
+				ssl->extFlags.offer_connection_id &&
+				!ssl->extFlags.connection_id) {
+			ssl->cidOutLen = *c;
+			memcpy(ssl->cidOut, c + 1, *c);
+			ssl->extFlags.connection_id = 1;
+			ssl->extFlags.connection_id_ext = 1;
+		}
+		break;
+#endif
+
+	/**************************************************************************/
+
 	case EXT_SNI:
 		/* Must hold (2 b len + 1 b zero) + 2 b len */
 		if (extLen < 5) {
@@ -885,6 +946,59 @@ static int ServerHelloExt(ssl_t *ssl, unsigned short extType, unsigned short ext
 
 	/**************************************************************************/
 
+	case EXT_RECORD_SIZE_LIMIT:
+		if (ssl->extFlags.req_record_size_limit) {
+			ssl->extFlags.req_record_size_limit = 0;
+			rc = 0;
+		}
+		if (extLen != 2) {
+			ssl->err = SSL_ALERT_DECODE_ERROR;
+			psTraceInfo("Server sent bad record size limit ext\n");
+			return MATRIXSSL_ERROR;
+		}
+		ssl->peerRecLimit = *c << 8; c++;
+		ssl->peerRecLimit += *c; c++; extLen -= 2;
+		if (ssl->peerRecLimit < SSL_MIN_RECORD_SIZE_LIMIT) {
+			ssl->err = SSL_ALERT_ILLEGAL_PARAMETER;
+			psTraceInfo("Server sent bad record size limit\n");
+			return MATRIXSSL_ERROR;
+		}
+		ssl->extFlags.record_size_limit = 1;
+		break;
+
+#ifdef USE_DTLS
+	/**************************************************************************/
+
+	case EXT_CONNECTION_ID:
+		if (ssl->extFlags.req_connection_id) {
+			ssl->extFlags.req_connection_id = 0;
+			rc = 0;
+		}
+		if (extLen < 1 || extLen != *c + 1) {
+			ssl->err = SSL_ALERT_DECODE_ERROR;
+			psTraceInfo("Server sent bad connection id ext\n");
+			return MATRIXSSL_ERROR;
+		}
+		if (*c > DTLS_MAX_CID_LEN) {
+			ssl->err = SSL_ALERT_ILLEGAL_PARAMETER;
+			psTraceIntInfo("Server connection id too long: %d\n", *c);
+			return MATRIXSSL_ERROR;
+		}
+		if (rc == 0 && !dtlsCidCapable(ssl)) {
+			ssl->err = SSL_ALERT_ILLEGAL_PARAMETER;
+			psTraceIntInfo("Connection id with suite %d\n", ssl->cipher->ident);
+			return MATRIXSSL_ERROR;
+		}
+		if (rc == 0) {
+			ssl->cidOutLen = *c;
+			memcpy(ssl->cidOut, c + 1, *c);
+			ssl->extFlags.connection_id = 1;
+		}
+		break;
+#endif
+
+	/**************************************************************************/
+
 	case EXT_TRUNCATED_HMAC:
 		if (ssl->extFlags.req_truncated_hmac) {
 			ssl->extFlags.req_truncated_hmac = 0;
@@ -246,7 +246,8 @@ int32 parseClientHello(ssl_t *ssl, unsigned char **cp, unsigned char *end)
 		/*	If DTLS is enabled, make sure we received a valid cookie in the
 			CLIENT_HELLO message. */
 		if (ssl->flags & SSL_FLAGS_DTLS) {
-			uint16_t	cookie_len;
+			uint16_t	cookie_len, helloLen;
+			unsigned char	*helloStart;
 			/* Next field is the cookie length */
 			if (end - c < 1) {
 				ssl->err = SSL_ALERT_DECODE_ERROR;
@@ -271,6 +272,8 @@ int32 parseClientHello(ssl_t *ssl, unsigned char **cp, unsigned char *end)
 				psTraceInfo("Invalid cookie length\n");
 				return MATRIXSSL_ERROR;
 			}
+			helloStart = c - cookie_len;
+			helloLen = cookie_len;
 			cookie_len = *c++;
 			if (cookie_len > 0) {
 				if (end - c < cookie_len || cookie_len != DTLS_COOKIE_SIZE) {
@@ -278,7 +281,9 @@ int32 parseClientHello(ssl_t *ssl, unsigned char **cp, unsigned char *end)
 					psTraceInfo("Invalid cookie length\n");
 					return MATRIXSSL_ERROR;
 				}
-				if (memcmpct(c, ssl->srvCookie, DTLS_COOKIE_SIZE) != 0) {
+				/* Accepts cookies from before a key rotation too */
+				if (dtlsCheckCookie(ssl->dtlsPeerId, ssl->dtlsPeerIdLen,
+						helloStart, helloLen, c) != PS_TRUE) {
 					/* Cookie mismatch. Error to avoid possible DOS */
 					ssl->err = SSL_ALERT_ILLEGAL_PARAMETER;
 					psTraceInfo("Cookie mismatch\n");
@@ -555,6 +560,16 @@ SKIP_STANDARD_RESUMPTION:
 			return MATRIXSSL_ERROR;
 		}
 	}
+#ifdef USE_DTLS
+	/* Leave the connection ID out of ServerHello if the chosen suite
+		could not authenticate it */
+	if (ssl->extFlags.connection_id_ext && !dtlsCidCapable(ssl)) {
+		psTraceIntDtls("No connection id for suite %d\n", ssl->cipher->ident);
+		ssl->extFlags.connection_id = 0;
+		ssl->extFlags.connection_id_ext = 0;
+		ssl->cidOutLen = 0;
+	}
+#endif
 		
 	matrixSslSetKexFlags(ssl);
 
@@ -588,6 +603,7 @@ SKIP_STANDARD_RESUMPTION:
 				if (psEccNewKey(ssl->hsPool, &ssl->sec.eccKeyPriv, curve) < 0) {
 					return PS_MEM_FAIL;
 				}
+				SSL_STAT_PKA_BEGIN(ssl);
 #ifdef USE_ECC_EPHEMERAL_KEY_CACHE
 				if ((rc = matrixSslGenEphemeralEcKey(ssl->keys,
 						ssl->sec.eccKeyPriv, curve, pkiData)) < 0) {
@@ -601,6 +617,7 @@ SKIP_STANDARD_RESUMPTION:
 					ssl->err = SSL_ALERT_INTERNAL_ERROR;
 					return rc;
 				}
+				SSL_STAT_PKA_END(ssl);
 			} else {
 #endif /* USE_ECC_CIPHER_SUITE */
 #ifdef REQUIRE_DH_PARAMS
@@ -610,6 +627,7 @@ SKIP_STANDARD_RESUMPTION:
 						sizeof(psDhKey_t))) == NULL) {
 					return MATRIXSSL_ERROR;
 				}
+				SSL_STAT_PKA_BEGIN(ssl);
 				if ((rc = psDhGenKeyInts(ssl->hsPool, ssl->keys->dhParams.size,
 						&ssl->keys->dhParams.p, &ssl->keys->dhParams.g,
 						ssl->sec.dhKeyPriv, pkiData)) < 0) {
@@ -619,6 +637,7 @@ SKIP_STANDARD_RESUMPTION:
 					ssl->err = SSL_ALERT_INTERNAL_ERROR;
 					return MATRIXSSL_ERROR;
 				}
+				SSL_STAT_PKA_END(ssl);
 #endif
 #ifdef USE_ECC_CIPHER_SUITE
 			}
@@ -651,6 +670,9 @@ SKIP_STANDARD_RESUMPTION:
 		}
 #endif /* USE_CLIENT_AUTH */
 	}
+	/* Version, cipher suite and client auth are settled */
+	sslSelectHSHash(ssl);
+
 	/* Now that we've parsed the ClientHello, we need to tell the caller that
 		we have a handshake response to write out.
 		The caller should call sslWrite upon receiving this return code. */
@@ -659,6 +681,212 @@ SKIP_STANDARD_RESUMPTION:
 	return SSL_PROCESS_DATA;
 }
 
+/******************************************************************************/
+/*
+	Standalone look at a ClientHello record as read from the network, so a
+	server can route or refuse a connection before creating an ssl_t.  Does
+	not allocate and does not consume the data; the same bytes are later
+	given to matrixSslReceivedData as usual.  Returned pointers refer into buf.
+
+	Return	MATRIXSSL_SUCCESS if hello was filled in
+			MATRIXSSL_REQUEST_RECV if buf does not hold the whole first record
+			PS_UNSUPPORTED_FAIL for SSLv2 hellos and ClientHellos spread over
+				more than one record or DTLS fragment
+			PS_PROTOCOL_FAIL if the data is not a well formed ClientHello
+*/
+static uint32_t peekGet16(const unsigned char *c)
+{
+	return ((uint32_t)c[0] << 8) | c[1];
+}
+
+static uint32_t peekGet24(const unsigned char *c)
+{
+	return ((uint32_t)c[0] << 16) | ((uint32_t)c[1] << 8) | c[2];
+}
+
+int32_t matrixSslPeekClientHello(const unsigned char *buf, uint32_t len,
+				sslClientHelloInfo_t *hello)
+{
+	const unsigned char	*c, *end, *ext;
+	uint32_t			recLen, hsLen, hdrLen, n, extType, extLen;
+	int32_t				dtls;
+
+	if (buf == NULL || hello == NULL) {
+		return PS_ARG_FAIL;
+	}
+	memset(hello, 0x0, sizeof(sslClientHelloInfo_t));
+
+	if (len < SSL3_HEADER_LEN) {
+		return MATRIXSSL_REQUEST_RECV;
+	}
+	if (buf[0] != SSL_RECORD_TYPE_HANDSHAKE) {
+		/* Most likely an SSLv2 hello (high bit length header) */
+		return (buf[0] & 0x80) ? PS_UNSUPPORTED_FAIL : PS_PROTOCOL_FAIL;
+	}
+	dtls = (buf[1] == DTLS_MAJ_VER);
+	if (!dtls && buf[1] != SSL3_MAJ_VER) {
+		return PS_PROTOCOL_FAIL;
+	}
+	/* DTLS adds the 2 byte epoch and 6 byte sequence number */
+	hdrLen = dtls ? SSL3_HEADER_LEN + 8 : SSL3_HEADER_LEN;
+	if (len < hdrLen) {
+		return MATRIXSSL_REQUEST_RECV;
+	}
+	recLen = peekGet16(buf + hdrLen - 2);
+	if (recLen > SSL_MAX_RECORD_LEN) {
+		return PS_PROTOCOL_FAIL;
+	}
+	if (len < hdrLen + recLen) {
+		return MATRIXSSL_REQUEST_RECV;
+	}
+	c = buf + hdrLen;
+	end = c + recLen;
+
+	/* Handshake header.  DTLS adds message_seq, fragment offset and length */
+	n = dtls ? SSL3_HANDSHAKE_HEADER_LEN + 8 : SSL3_HANDSHAKE_HEADER_LEN;
+	if ((uint32_t)(end - c) < n || *c != SSL_HS_CLIENT_HELLO) {
+		return PS_PROTOCOL_FAIL;
+	}
+	hsLen = peekGet24(c + 1);
+	if (dtls && (peekGet24(c + 6) != 0 || peekGet24(c + 9) != hsLen)) {
+		return PS_UNSUPPORTED_FAIL;
+	}
+	c += n;
+	if ((uint32_t)(end - c) < hsLen) {
+		return PS_UNSUPPORTED_FAIL;
+	}
+	end = c + hsLen;
+
+	/* client_version, random and session_id */
+	if (end - c < 2 + SSL_HS_RANDOM_SIZE + 1) {
+		return PS_PROTOCOL_FAIL;
+	}
+	hello->majVer = c[0];
+	hello->minVer = c[1];
+	c += 2;
+	hello->random = c;
+	c += SSL_HS_RANDOM_SIZE;
+	n = *c++;
+	if (n > SSL_MAX_SESSION_ID_SIZE || (uint32_t)(end - c) < n) {
+		return PS_PROTOCOL_FAIL;
+	}
+	if (n > 0) {
+		hello->sessionId = c;
+		hello->sessionIdLen = (uint8_t)n;
+	}
+	c += n;
+
+	if (dtls) {
+		if (end - c < 1) {
+			return PS_PROTOCOL_FAIL;
+		}
+		n = *c++;
+		if ((uint32_t)(end - c) < n) {
+			return PS_PROTOCOL_FAIL;
+		}
+		if (n > 0) {
+			hello->cookie = c;
+			hello->cookieLen = (uint8_t)n;
+		}
+		c += n;
+	}
+
+	/* cipher_suites and compression_methods */
+	if (end - c < 2) {
+		return PS_PROTOCOL_FAIL;
+	}
+	n = peekGet16(c); c += 2;
+	if (n < 2 || (n & 1) || (uint32_t)(end - c) < n) {
+		return PS_PROTOCOL_FAIL;
+	}
+	hello->cipherSuites = c;
+	hello->cipherSuitesLen = (uint16_t)n;
+	c += n;
+	if (end - c < 1) {
+		return PS_PROTOCOL_FAIL;
+	}
+	n = *c++;
+	if (n < 1 || (uint32_t)(end - c) < n) {
+		return PS_PROTOCOL_FAIL;
+	}
+	c += n;
+
+	/* Extensions are optional */
+	if (c == end) {
+		return MATRIXSSL_SUCCESS;
+	}
+	if (end - c < 2) {
+		return PS_PROTOCOL_FAIL;
+	}
+	n = peekGet16(c); c += 2;
+	if ((uint32_t)(end - c) != n) {
+		return PS_PROTOCOL_FAIL;
+	}
+	while (c < end) {
+		if (end - c < 4) {
+			return PS_PROTOCOL_FAIL;
+		}
+		extType = peekGet16(c);
+		extLen = peekGet16(c + 2);
+		c += 4;
+		if ((uint32_t)(end - c) < extLen) {
+			return PS_PROTOCOL_FAIL;
+		}
+		ext = c;
+		c += extLen;
+
+		switch (extType) {
+		case EXT_SNI:
+			/* server_name_list of name_type, length, name.  Take host_name */
+			if (extLen < 2 || peekGet16(ext) != extLen - 2) {
+				return PS_PROTOCOL_FAIL;
+			}
+			for (ext += 2; ext < c; ext += 3 + n) {
+				if (c - ext < 3) {
+					return PS_PROTOCOL_FAIL;
+				}
+				n = peekGet16(ext + 1);
+				if ((uint32_t)(c - ext - 3) < n) {
+					return PS_PROTOCOL_FAIL;
+				}
+				if (*ext == 0x0 && hello->serverName == NULL && n > 0) {
+					hello->serverName = ext + 3;
+					hello->serverNameLen = (uint16_t)n;
+				}
+			}
+			break;
+
+		case EXT_ALPN:
+			/* ProtocolNameList, each name preceded by a length byte */
+			if (extLen < 2 || peekGet16(ext) != extLen - 2) {
+				return PS_PROTOCOL_FAIL;
+			}
+			for (n = 2; n < extLen; n += 1 + ext[n]) {
+				if (ext[n] == 0 || n + 1 + ext[n] > extLen) {
+					return PS_PROTOCOL_FAIL;
+				}
+			}
+			hello->alpn = ext + 2;
+			hello->alpnLen = (uint16_t)(extLen - 2);
+			break;
+
+		case EXT_ELLIPTIC_CURVE:
+			/* supported_groups, two bytes each */
+			if (extLen < 2 || peekGet16(ext) != extLen - 2 ||
+					(extLen & 1)) {
+				return PS_PROTOCOL_FAIL;
+			}
+			hello->groups = ext + 2;
+			hello->groupsLen = (uint16_t)(extLen - 2);
+			break;
+
+		default:
+			break;
+		}
+	}
+	return MATRIXSSL_SUCCESS;
+}
+
 /******************************************************************************/
 
 int32 parseClientKeyExchange(ssl_t *ssl, int32 hsLen, unsigned char **cp,
@@ -806,6 +1034,7 @@ int32 parseClientKeyExchange(ssl_t *ssl, int32 hsLen, unsigned char **cp,
 			if (ssl->sec.premaster == NULL) {
 				return SSL_MEM_ERROR;
 			}
+			SSL_STAT_PKA_BEGIN(ssl);
 			if ((rc = psEccGenSharedSecret(ssl->hsPool, ssl->sec.eccKeyPriv,
 					ssl->sec.eccKeyPub, ssl->sec.premaster,
 					&ssl->sec.premasterSize, pkiData)) < 0) {
@@ -814,6 +1043,7 @@ int32 parseClientKeyExchange(ssl_t *ssl, int32 hsLen, unsigned char **cp,
 				ssl->sec.premaster = NULL;
 				return MATRIXSSL_ERROR;
 			}
+			SSL_STAT_PKA_END(ssl);
 			psEccDeleteKey(&ssl->sec.eccKeyPub);
 			psEccDeleteKey(&ssl->sec.eccKeyPriv);
 		} else {
@@ -852,12 +1082,14 @@ int32 parseClientKeyExchange(ssl_t *ssl, int32 hsLen, unsigned char **cp,
 			if (ssl->sec.premaster == NULL) {
 				return SSL_MEM_ERROR;
 			}
+			SSL_STAT_PKA_BEGIN(ssl);
 			if ((rc = psDhGenSharedSecret(ssl->hsPool, ssl->sec.dhKeyPriv,
 					ssl->sec.dhKeyPub, ssl->sec.dhP, ssl->sec.dhPLen,
 					ssl->sec.premaster,
 					&ssl->sec.premasterSize, pkiData)) < 0) {
 				return MATRIXSSL_ERROR;
 			}
+			SSL_STAT_PKA_END(ssl);
 			psFree(ssl->sec.dhP, ssl->hsPool);
 			ssl->sec.dhP = NULL; ssl->sec.dhPLen = 0;
 			psFree(ssl->sec.dhG, ssl->hsPool);
@@ -978,6 +1210,7 @@ int32 parseClientKeyExchange(ssl_t *ssl, int32 hsLen, unsigned char **cp,
 					if (ssl->sec.premaster == NULL) {
 						return SSL_MEM_ERROR;
 					}
+					SSL_STAT_PKA_BEGIN(ssl);
 					if ((rc = psEccGenSharedSecret(ssl->hsPool,
 							&ssl->keys->privKey.key.ecc, ssl->sec.eccKeyPub,
 							ssl->sec.premaster,	&ssl->sec.premasterSize,
@@ -987,6 +1220,7 @@ int32 parseClientKeyExchange(ssl_t *ssl, int32 hsLen, unsigned char **cp,
 						ssl->sec.premaster = NULL;
 						return MATRIXSSL_ERROR;
 					}
+					SSL_STAT_PKA_END(ssl);
 					psEccDeleteKey(&ssl->sec.eccKeyPub);
 				} else {
 #endif /* USE_ECC_CIPHER_SUITE */
@@ -1019,9 +1253,11 @@ int32 parseClientKeyExchange(ssl_t *ssl, int32 hsLen, unsigned char **cp,
 				must be taken to avoid leaking the information to an attacker
 				(through, e.g., timing, log files, or other channels.)"
 */
+				SSL_STAT_PKA_BEGIN(ssl);
 				rc = psRsaDecryptPriv(ckepkiPool, &ssl->keys->privKey.key.rsa, c,
 						pubKeyLen, ssl->sec.premaster, ssl->sec.premasterSize,
 						pkiData);
+				SSL_STAT_PKA_END(ssl);
 				/* Step 1 of Bleichenbacher attack mitigation. We do it here
 				after the RSA op, but regardless of the result of the op. */
 				if (matrixCryptoGetPrngData(R, sizeof(R), ssl->userPtr) < 0) {
@@ -1192,7 +1428,10 @@ int32 parseCertificateVerify(ssl_t *ssl,
 #ifdef USE_SHA384
 		case HASH_SIG_SHA384:
 			/* The one-off grab of SHA-384 handshake hash */
-			sslSha384RetrieveHSHash(ssl, hsMsgHash);
+			if (sslSha384RetrieveHSHash(ssl, hsMsgHash) < 0) {
+				ssl->err = SSL_ALERT_INTERNAL_ERROR;
+				return MATRIXSSL_ERROR;
+			}
 			certVerifyLen = SHA384_HASH_SIZE;
 			break;
 #endif
@@ -1200,7 +1439,10 @@ int32 parseCertificateVerify(ssl_t *ssl,
 #ifdef USE_SHA512
 		case HASH_SIG_SHA512:
 			/* The one-off grab of SHA-512 handshake hash */
-			sslSha512RetrieveHSHash(ssl, hsMsgHash);
+			if (sslSha512RetrieveHSHash(ssl, hsMsgHash) < 0) {
+				ssl->err = SSL_ALERT_INTERNAL_ERROR;
+				return MATRIXSSL_ERROR;
+			}
 			certVerifyLen = SHA512_HASH_SIZE;
 			break;
 #endif
@@ -1208,7 +1450,10 @@ int32 parseCertificateVerify(ssl_t *ssl,
 #ifdef USE_SHA1
 		case HASH_SIG_SHA1:
 			/* The one-off grab of SHA-1 handshake hash */
-			sslSha1RetrieveHSHash(ssl, hsMsgHash);
+			if (sslSha1RetrieveHSHash(ssl, hsMsgHash) < 0) {
+				ssl->err = SSL_ALERT_INTERNAL_ERROR;
+				return MATRIXSSL_ERROR;
+			}
 			certVerifyLen = SHA1_HASH_SIZE;
 			break;
 #endif
@@ -1246,6 +1491,7 @@ int32 parseCertificateVerify(ssl_t *ssl,
 
 #ifdef USE_TLS_1_2
 		if (ssl->flags & SSL_FLAGS_TLS_1_2) {
+			SSL_STAT_PKA_BEGIN(ssl);
 			if ((i = psEccDsaVerify(cvpkiPool,
 					&ssl->sec.cert->publicKey.key.ecc,
 					hsMsgHash, certVerifyLen,
@@ -1254,8 +1500,10 @@ int32 parseCertificateVerify(ssl_t *ssl,
 				ssl->err = SSL_ALERT_BAD_CERTIFICATE;
 				return MATRIXSSL_ERROR;
 			}
+			SSL_STAT_PKA_END(ssl);
 		} else {
 			certVerifyLen = SHA1_HASH_SIZE; /* per spec */
+			SSL_STAT_PKA_BEGIN(ssl);
 			if ((i = psEccDsaVerify(cvpkiPool,
 					&ssl->sec.cert->publicKey.key.ecc,
 					hsMsgHash + MD5_HASH_SIZE, certVerifyLen,
@@ -1265,9 +1513,11 @@ int32 parseCertificateVerify(ssl_t *ssl,
 				ssl->err = SSL_ALERT_BAD_CERTIFICATE;
 				return MATRIXSSL_ERROR;
 			}
+			SSL_STAT_PKA_END(ssl);
 		}
 #else
 		certVerifyLen = SHA1_HASH_SIZE; /* per spec */
+		SSL_STAT_PKA_BEGIN(ssl);
 		if ((i = psEccDsaVerify(cvpkiPool,
 				&ssl->sec.cert->publicKey.key.ecc,
 				hsMsgHash + MD5_HASH_SIZE, certVerifyLen,
@@ -1277,6 +1527,7 @@ int32 parseCertificateVerify(ssl_t *ssl,
 			ssl->err = SSL_ALERT_BAD_CERTIFICATE;
 			return MATRIXSSL_ERROR;
 		}
+		SSL_STAT_PKA_END(ssl);
 #endif
 		if (rc != 1) {
 			psTraceInfo("Can't verify certVerify sig\n");
@@ -1290,25 +1541,31 @@ int32 parseCertificateVerify(ssl_t *ssl,
 
 #ifdef USE_TLS_1_2
 		if (ssl->flags & SSL_FLAGS_TLS_1_2) {
+			SSL_STAT_PKA_BEGIN(ssl);
 			if ((i = pubRsaDecryptSignedElement(cvpkiPool,
 					&ssl->sec.cert->publicKey.key.rsa, c, pubKeyLen, certVerify,
 					certVerifyLen, pkiData)) < 0) {
 				psTraceInfo("Unable to decrypt CertVerify digital element\n");
 				return MATRIXSSL_ERROR;
 			}
+			SSL_STAT_PKA_END(ssl);
 		} else {
+			SSL_STAT_PKA_BEGIN(ssl);
 			if ((i = psRsaDecryptPub(cvpkiPool, &ssl->sec.cert->publicKey.key.rsa, c,
 					pubKeyLen, certVerify, certVerifyLen, pkiData)) < 0) {
 				psTraceInfo("Unable to publicly decrypt Certificate Verify message\n");
 				return MATRIXSSL_ERROR;
 			}
+			SSL_STAT_PKA_END(ssl);
 		}
 #else /* !USE_TLS_1_2 */
+		SSL_STAT_PKA_BEGIN(ssl);
 		if ((i = psRsaDecryptPub(cvpkiPool, &ssl->sec.cert->publicKey.key.rsa, c,
 				pubKeyLen, certVerify, certVerifyLen, pkiData)) < 0) {
 			psTraceInfo("Unable to publicly decrypt Certificate Verify message\n");
 			return MATRIXSSL_ERROR;
 		}
+		SSL_STAT_PKA_END(ssl);
 #endif /* USE_TLS_1_2 */
 
 		if (memcmpct(certVerify, hsMsgHash, certVerifyLen) != 0) {
@@ -1637,6 +1894,20 @@ PROTOCOL_DETERMINED:
 		ssl->maxPtFrag = SSL_MAX_PLAINTEXT_LEN;
 	}
 
+	if (ssl->extFlags.req_record_size_limit) {
+		ssl->extFlags.req_record_size_limit = 0;
+		psTraceInfo("Server ignored record size limit ext request\n");
+	} else if (ssl->extFlags.record_size_limit) {
+		ssl->maxPtFrag = min(ssl->peerRecLimit, SSL_MAX_PLAINTEXT_LEN);
+	}
+
+#ifdef USE_DTLS
+	if (ssl->extFlags.req_connection_id) {
+		ssl->extFlags.req_connection_id = 0;
+		psTraceInfo("Server ignored connection id ext request\n");
+	}
+#endif
+
 	if (ssl->extFlags.req_sni) {
 		psTraceInfo("Server ignored SNI ext request\n");
 	}
@@ -1697,6 +1968,9 @@ PROTOCOL_DETERMINED:
 #endif /* ENABLE_SECURE_REHANDSHAKES */
 #endif
 
+	/* Version and cipher suite are known, so are the handshake hashes */
+	sslSelectHSHash(ssl);
+
 	if (ssl->flags & SSL_FLAGS_RESUMED) {
 		if (sslCreateKeys(ssl) < 0) {
 			ssl->err = SSL_ALERT_INTERNAL_ERROR;
@@ -2103,6 +2377,7 @@ int32 parseServerKeyExchange(ssl_t *ssl,
 						that expects an output length of a known size. These
 						signatures are done on elements with some ASN.1
 						wrapping so a special decryption with parse is needed */
+					SSL_STAT_PKA_BEGIN(ssl);
 					if ((i = pubRsaDecryptSignedElement(skepkiPool,
 							&ssl->sec.cert->publicKey.key.rsa, c, pubDhLen, sigOut,
 							hashSize, pkiData)) < 0) {
@@ -2111,10 +2386,12 @@ int32 parseServerKeyExchange(ssl_t *ssl,
 						ssl->err = SSL_ALERT_BAD_CERTIFICATE;
 						return MATRIXSSL_ERROR;
 					}
+					SSL_STAT_PKA_END(ssl);
 
 				} else {
 					hashSize = MD5_HASH_SIZE + SHA1_HASH_SIZE;
 
+					SSL_STAT_PKA_BEGIN(ssl);
 					if ((i = psRsaDecryptPub(skepkiPool,
 							&ssl->sec.cert->publicKey.key.rsa, c, pubDhLen, sigOut,
 							hashSize, pkiData)) < 0) {
@@ -2122,15 +2399,18 @@ int32 parseServerKeyExchange(ssl_t *ssl,
 						ssl->err = SSL_ALERT_BAD_CERTIFICATE;
 						return MATRIXSSL_ERROR;
 					}
+					SSL_STAT_PKA_END(ssl);
 				}
 #else /* ! USE_TLS_1_2 */
 				hashSize = MD5_HASH_SIZE + SHA1_HASH_SIZE;
+				SSL_STAT_PKA_BEGIN(ssl);
 				if ((i = psRsaDecryptPub(skepkiPool, &ssl->sec.cert->publicKey.key.rsa,
 						c, pubDhLen, sigOut, hashSize, pkiData)) < 0) {
 					psTraceInfo("Unable to decrypt server key exchange sig\n");
 					ssl->err = SSL_ALERT_BAD_CERTIFICATE;
 					return MATRIXSSL_ERROR;
 				}
+				SSL_STAT_PKA_END(ssl);
 #endif /* USE_TLS_1_2 */
 
 				/* Now have hash from the server. Create ours and check match */
@@ -2220,6 +2500,7 @@ int32 parseServerKeyExchange(ssl_t *ssl,
 
 				i = 0;
 
+				SSL_STAT_PKA_BEGIN(ssl);
 				if ((res = psEccDsaVerify(skepkiPool,
 						&ssl->sec.cert->publicKey.key.ecc,
 						hsMsgHash, hashSize,
@@ -2229,6 +2510,7 @@ int32 parseServerKeyExchange(ssl_t *ssl,
 					ssl->err = SSL_ALERT_BAD_CERTIFICATE;
 					return MATRIXSSL_ERROR;
 				}
+				SSL_STAT_PKA_END(ssl);
 				c += pubDhLen;
 /*
 				The validation code comes out of the final parameter
@@ -2395,6 +2677,7 @@ int32 parseServerHelloDone(ssl_t *ssl, int32 hsLen, unsigned char **cp,
 					ssl->sec.eccKeyPub->curve) < 0) {
 				return PS_MEM_FAIL;
 			}
+			SSL_STAT_PKA_BEGIN(ssl);
 			if ((rc = matrixSslGenEphemeralEcKey(ssl->keys,
 					ssl->sec.eccKeyPriv, ssl->sec.eccKeyPub->curve,
 					pkiData)) < 0) {
@@ -2403,6 +2686,7 @@ int32 parseServerHelloDone(ssl_t *ssl, int32 hsLen, unsigned char **cp,
 				ssl->err = SSL_ALERT_INTERNAL_ERROR;
 				return MATRIXSSL_ERROR;
 			}
+			SSL_STAT_PKA_END(ssl);
 		} else {
 #endif
 #ifdef REQUIRE_DH_PARAMS
@@ -2414,6 +2698,7 @@ int32 parseServerHelloDone(ssl_t *ssl, int32 hsLen, unsigned char **cp,
 					sizeof(psDhKey_t))) == NULL) {
 				return MATRIXSSL_ERROR;
 			}
+			SSL_STAT_PKA_BEGIN(ssl);
 			if ((rc = psDhGenKey(ssl->sec.dhKeyPool, ssl->sec.dhPLen,
 					ssl->sec.dhP, ssl->sec.dhPLen, ssl->sec.dhG,
 					ssl->sec.dhGLen, ssl->sec.dhKeyPriv, pkiData)) < 0) {
@@ -2421,6 +2706,7 @@ int32 parseServerHelloDone(ssl_t *ssl, int32 hsLen, unsigned char **cp,
 				ssl->sec.dhKeyPriv = NULL;
 				return MATRIXSSL_ERROR;
 			}
+			SSL_STAT_PKA_END(ssl);
 			/* Freeing as we go.  No more need for G */
 			psFree(ssl->sec.dhG, ssl->hsPool); ssl->sec.dhG = NULL;
 #endif /* REQUIRE_DH_PARAMS */
@@ -2430,6 +2716,11 @@ int32 parseServerHelloDone(ssl_t *ssl, int32 hsLen, unsigned char **cp,
 	}
 #endif /* USE_DHE_CIPHER_SUITE */
 
+	/* Without a CertificateRequest there will be no CertificateVerify */
+	if (!(ssl->flags & SSL_FLAGS_CLIENT_AUTH)) {
+		sslReleaseHSHash(ssl);
+	}
+
 	ssl->hsState = SSL_HS_FINISHED;
 	
 	*cp = c;
@@ -2790,7 +3081,7 @@ int32 parseFinished(ssl_t *ssl, int32 hsLen,
 	if (ssl->flags & SSL_FLAGS_DTLS) {
 		/* A successful parse of the FINISHED message means the record sequence
 		numbers have been reset so we need to clear out our replay detector */
-		zeroSixByte(ssl->lastRsn);
+		dtlsResetReplayWindow(ssl);
 
 		/* This will just be set between CCS parse and FINISHED parse */
 		ssl->parsedCCS = 1;
@@ -2839,6 +3130,9 @@ int32 parseCertificate(ssl_t *ssl, unsigned char **cp, unsigned char *end)
 	uint32			certLen;
 	int32			rc, i, certChainLen, parseLen = 0;
 	void			*pkiData = ssl->userPtr;
+#ifdef USE_CERT_CHAIN_CACHE
+	unsigned char	chainId[SHA256_HASH_SIZE];
+#endif
 
 	psTraceStrHs(">>> %s parsing CERTIFICATE message\n",
 		(ssl->flags & SSL_FLAGS_SERVER) ? "Server" : "Client");
@@ -2935,7 +3229,8 @@ SKIP_CERT_CHAIN_INIT:
 /*
 			Extract the binary cert message into the cert structure
 */
-			if ((parseLen = psX509ParseCert(ssl->hsPool, c, certLen, &cert, 0))
+			if ((parseLen = psX509ParseCert(ssl->hsPool, c, certLen, &cert,
+					ssl->certParseFlags))
 					< 0) {
 				psX509FreeCert(cert);
 				if (parseLen == PS_MEM_FAIL) {
@@ -2991,9 +3286,23 @@ SKIP_CERT_CHAIN_INIT:
 
 	/* Time to authenticate the supplied cert against our CAs */
 
+#ifdef USE_CERT_CHAIN_CACHE
+	/* Skip the signature checks for a chain that passed them recently */
+	if (matrixChainCacheFind(ssl, chainId) == PS_TRUE) {
+		rc = PS_SUCCESS;
+		goto CHAIN_VALIDATED;
+	}
+#endif
 	rc = matrixValidateCerts(ssl->hsPool, ssl->sec.cert,
-		ssl->keys == NULL ? NULL : ssl->keys->CAcerts, ssl->expectedName,
+		ssl->keys == NULL ? NULL : ssl->keys->CAcerts,
+		ssl->keys == NULL ? NULL : &ssl->keys->CAindex, ssl->expectedName,
 		&foundIssuer, pkiData, ssl->memAllocPtr);
+#ifdef USE_CERT_CHAIN_CACHE
+	if (rc == PS_SUCCESS) {
+		matrixChainCacheAdd(ssl, chainId);
+	}
+CHAIN_VALIDATED:
+#endif
 
 	if (rc == PS_MEM_FAIL) {
 		ssl->err = SSL_ALERT_INTERNAL_ERROR;
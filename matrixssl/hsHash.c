@@ -38,30 +38,91 @@
 #define FINISHED_LABEL_SIZE	15
 #define LABEL_CLIENT		"client finished"
 #define LABEL_SERVER		"server finished"
+/******************************************************************************/
+/*
+	Raw transcript buffer. Handshake messages are kept here until the
+	negotiated version and cipher suite tell us which hashes are needed,
+	and for as long as a TLS 1.2 CertificateVerify may still need a hash
+	the PRF does not use.
+*/
+#define HS_MSG_BUF_INIT		2048
+
+static int32_t hsMsgAppend(ssl_t *ssl, const unsigned char *in, uint32 len)
+{
+	unsigned char	*p;
+	uint32			size;
+
+	if (ssl->sec.hsMsgLen + len > ssl->sec.hsMsgSize) {
+		size = ssl->sec.hsMsgSize ? ssl->sec.hsMsgSize : HS_MSG_BUF_INIT;
+		while (size < ssl->sec.hsMsgLen + len) {
+			size *= 2;
+		}
+		if ((p = psRealloc(ssl->sec.hsMsgBuf, size, ssl->sPool)) == NULL) {
+			ssl->sec.hsHashErr = 1;
+			return PS_MEM_FAIL;
+		}
+		ssl->sec.hsMsgBuf = p;
+		ssl->sec.hsMsgSize = size;
+	}
+	memcpy(ssl->sec.hsMsgBuf + ssl->sec.hsMsgLen, in, len);
+	ssl->sec.hsMsgLen += len;
+	return 0;
+}
+
+void sslFreeHSHash(ssl_t *ssl)
+{
+	if (ssl->sec.hsMsgBuf) {
+		memzero_s(ssl->sec.hsMsgBuf, ssl->sec.hsMsgSize);
+		psFree(ssl->sec.hsMsgBuf, ssl->sPool);
+		ssl->sec.hsMsgBuf = NULL;
+	}
+	ssl->sec.hsMsgLen = ssl->sec.hsMsgSize = ssl->sec.hsMsgCvLen = 0;
+	ssl->sec.hsMsgKeep = 0;
+}
+
+static void hsHashUpdate(ssl_t *ssl, uint8_t mask, const unsigned char *in,
+				uint32 len)
+{
+#ifndef USE_ONLY_TLS_1_2
+	if (mask & HS_HASH_MD5SHA1) {
+		psMd5Sha1Update(&ssl->sec.msgHashMd5Sha1, in, len);
+	}
+#endif
+#ifdef USE_TLS_1_2
+	if (mask & HS_HASH_SHA256) {
+		psSha256Update(&ssl->sec.msgHashSha256, in, len);
+	}
+ #ifdef USE_SHA384
+	if (mask & HS_HASH_SHA384) {
+		psSha384Update(&ssl->sec.msgHashSha384, in, len);
+	}
+ #endif
+#endif
+}
+
 /******************************************************************************/
 /**
-	Initialize the SHA1 and MD5 hash contexts for the handshake messages.
+	Reset the handshake transcript.
 	The handshake hashes are used in 3 messages in TLS:
 	ClientFinished, ServerFinished and ClientCertificateVerify.
 	The version of TLS affects which hashes are used for the Finished messages.
 	TLS 1.2 allows a different hash algorithm for the CertificatVerify message
 	than is used by the Finished messages, determined by the
 	Signature Algorithms extension.
-	Multiple handshake hash contexts must be maintained until the handshake has
-	progressed enough to determine the negotiated TLS version and whether or
-	not Client Authentication is to be performed. Also, if USE_ONLY_TLS_1_2 is
-	defined at compile time, or USE_CLIENT_AUTH is undefined at compile time,
-	the potential runtime combinations are reduced.
+	Rather than running every possible hash over every message, the
+	messages are buffered until sslSelectHSHash() is called once the version
+	and cipher suite are known. From then on only the PRF hash is run.
 	The various algorithms are used as follows (+ means concatenation):
 		Client and Server Finished messages
 			< TLS 1.2 - MD5+SHA1
-			TLS 1.2 - SHA256
+			TLS 1.2 - SHA256, or SHA384 for SHA384 cipher suites
 		Client CertificateVerify message.
 			< TLS 1.2 - MD5+SHA1
 			TLS 1.2 - One of the hashes present in the union of the 
 			SignatureAlgorithms Client extension and the CertificateRequest
 			message from the server. At most this is the set
-			{SHA1,SHA256,SHA384,SHA512}.
+			{SHA1,SHA256,SHA384,SHA512}. It is computed from the buffered
+			messages when the CertificateVerify is written or parsed.
 	@return < 0 on failure.
 	@param[in,out] ssl TLS context
 */
@@ -76,24 +137,89 @@ int32_t sslInitHSHash(ssl_t *ssl)
 	}
 #endif /* USE_DTLS */
 
-#ifndef USE_ONLY_TLS_1_2
-	psMd5Sha1Init(&ssl->sec.msgHashMd5Sha1);
-#endif
+	/* The buffer itself is kept for reuse */
+	ssl->sec.hsHashMask = 0;
+	ssl->sec.hsHashErr = 0;
+	ssl->sec.hsMsgLen = ssl->sec.hsMsgCvLen = 0;
+	ssl->sec.hsMsgKeep = 0;
+	return 0;
+}
+
+/******************************************************************************/
+/**
+	Choose the running hashes once the protocol version and cipher suite
+	have been negotiated, and catch them up on the buffered messages.
+	Clients call this after parsing ServerHello and servers after parsing
+	ClientHello. Calling it again before the next sslInitHSHash() does
+	nothing.
+	@param[in,out] ssl TLS context
+*/
+void sslSelectHSHash(ssl_t *ssl)
+{
+	uint8_t		mask;
 
+	if (ssl->sec.hsHashMask != 0) {
+		return;
+	}
+	mask = 0;
 #ifdef USE_TLS_1_2
-	psSha256Init(&ssl->sec.msgHashSha256);
- #ifdef USE_SHA1
-	psSha1Init(&ssl->sec.msgHashSha1);
- #endif
+	if (ssl->flags & SSL_FLAGS_TLS_1_2) {
  #ifdef USE_SHA384
-	psSha384Init(&ssl->sec.msgHashSha384);
+		if (ssl->cipher->flags & CRYPTO_FLAGS_SHA3) {
+			mask = HS_HASH_SHA384;
+		} else {
+			mask = HS_HASH_SHA256;
+		}
+ #else
+		mask = HS_HASH_SHA256;
  #endif
- #ifdef USE_SHA512
-	psSha512Init(&ssl->sec.msgHashSha512);
+ #ifdef USE_CLIENT_AUTH
+		/* Keep buffering while a CertificateVerify can still follow.
+			Clients don't know yet if a CertificateRequest is coming. */
+		if (ssl->flags & SSL_FLAGS_SERVER) {
+			ssl->sec.hsMsgKeep = (ssl->flags & SSL_FLAGS_CLIENT_AUTH) ? 1 : 0;
+		} else {
+			ssl->sec.hsMsgKeep = (ssl->flags & SSL_FLAGS_RESUMED) ? 0 : 1;
+		}
  #endif
+	}
+#endif /* USE_TLS_1_2 */
+#ifndef USE_ONLY_TLS_1_2
+	if (mask == 0) {
+		mask = HS_HASH_MD5SHA1;
+	}
+	if (mask & HS_HASH_MD5SHA1) {
+		psMd5Sha1Init(&ssl->sec.msgHashMd5Sha1);
+	}
 #endif
+#ifdef USE_TLS_1_2
+	if (mask & HS_HASH_SHA256) {
+		psSha256Init(&ssl->sec.msgHashSha256);
+	}
+ #ifdef USE_SHA384
+	if (mask & HS_HASH_SHA384) {
+		psSha384Init(&ssl->sec.msgHashSha384);
+	}
+ #endif
+#endif
+	ssl->sec.hsHashMask = mask;
+	if (ssl->sec.hsMsgLen > 0) {
+		hsHashUpdate(ssl, mask, ssl->sec.hsMsgBuf, ssl->sec.hsMsgLen);
+	}
+	if (!ssl->sec.hsMsgKeep) {
+		sslFreeHSHash(ssl);
+	}
+}
 
-	return 0;
+/*
+	Called on a client once ServerHelloDone shows whether a
+	CertificateRequest was received
+*/
+void sslReleaseHSHash(ssl_t *ssl)
+{
+	if (ssl->sec.hsHashMask != 0 && ssl->sec.hsMsgKeep) {
+		sslFreeHSHash(ssl);
+	}
 }
 
 /******************************************************************************/
@@ -116,40 +242,83 @@ int32_t sslUpdateHSHash(ssl_t *ssl, const unsigned char *in, uint16_t len)
 	}
 #endif /* USE_DTLS */
 
+	if (ssl->sec.hsHashMask != 0) {
+		hsHashUpdate(ssl, ssl->sec.hsHashMask, in, len);
+	}
+	if (ssl->sec.hsHashMask == 0 || ssl->sec.hsMsgKeep) {
+		return hsMsgAppend(ssl, in, len);
+	}
+	return 0;
+}
+
 #ifdef USE_TLS_1_2
-	/* Keep a running total of each for greatest RFC support when it comes
-		to the CertificateVerify message.  Although, trying to be smart
-		about MD5 and SHA-2 based on protocol version. */
-	if ((ssl->majVer == 0 && ssl->minVer == 0) ||
-#ifdef USE_DTLS
-			ssl->minVer == DTLS_1_2_MIN_VER	||
-#endif
-			ssl->minVer == TLS_1_2_MIN_VER) {
-		psSha256Update(&ssl->sec.msgHashSha256, in, len);
+/******************************************************************************/
+/*
+	CertificateVerify hash of the messages up to the last sslSnapshotHSHash()
+	call with a negative senderFlag. Uses the running hash when it is the
+	requested one, otherwise hashes the buffered messages.
+*/
+static int32 hsCvDigest(ssl_t *ssl, uint8_t alg, unsigned char *out)
+{
+	const unsigned char	*buf;
+	uint32				len;
+	union {
  #ifdef USE_SHA1
-		psSha1Update(&ssl->sec.msgHashSha1, in, len);
+		psSha1_t	sha1;
  #endif
+		psSha256_t	sha256;
  #ifdef USE_SHA384
-		psSha384Update(&ssl->sec.msgHashSha384, in, len);
+		psSha384_t	sha384;
  #endif
  #ifdef USE_SHA512
-		psSha512Update(&ssl->sec.msgHashSha512, in, len);
+		psSha512_t	sha512;
  #endif
-	}
-#endif
-
-#ifndef USE_ONLY_TLS_1_2
-	/* Below TLS 1.2, the hash is always the md5sha1 hash. If we negotiate
-		to TLS 1.2 and need sha1, we use just that part of the md5Sha1. */
-//TODO	if (ssl->reqMinVer == 0 || ssl->minVer != TLS_1_2_MIN_VER) {
-	psMd5Sha1Update(&ssl->sec.msgHashMd5Sha1, in, len);
+	} md;
 
-#endif
-
-	return 0;
+	if (alg == HS_HASH_SHA256 && (ssl->sec.hsHashMask & HS_HASH_SHA256)) {
+		psSha256Cpy(&md.sha256, &ssl->sec.msgHashSha256);
+		psSha256Final(&md.sha256, out);
+		return SHA256_HASH_SIZE;
+	}
+	if (ssl->sec.hsMsgBuf == NULL || ssl->sec.hsHashErr) {
+		psTraceInfo("Handshake messages for CertificateVerify unavailable\n");
+		return PS_FAILURE;
+	}
+	buf = ssl->sec.hsMsgBuf;
+	len = ssl->sec.hsMsgCvLen;
+	switch (alg) {
+ #ifdef USE_SHA1
+	case HS_HASH_SHA1:
+		psSha1Init(&md.sha1);
+		psSha1Update(&md.sha1, buf, len);
+		psSha1Final(&md.sha1, out);
+		return SHA1_HASH_SIZE;
+ #endif
+	case HS_HASH_SHA256:
+		psSha256Init(&md.sha256);
+		psSha256Update(&md.sha256, buf, len);
+		psSha256Final(&md.sha256, out);
+		return SHA256_HASH_SIZE;
+ #ifdef USE_SHA384
+	case HS_HASH_SHA384:
+		psSha384Init(&md.sha384);
+		psSha384Update(&md.sha384, buf, len);
+		psSha384Final(&md.sha384, out);
+		return SHA384_HASH_SIZE;
+ #endif
+ #ifdef USE_SHA512
+	case HS_HASH_SHA512:
+		psSha512Init(&md.sha512);
+		psSha512Update(&md.sha512, buf, len);
+		psSha512Final(&md.sha512, out);
+		return SHA512_HASH_SIZE;
+ #endif
+	default:
+		break;
+	}
+	return PS_FAILURE;
 }
 
-#ifdef USE_TLS_1_2
 /*	Functions necessary to deal with needing to keep track of both SHA-1
 	and SHA-256 handshake hash states.  FINISHED message will always be
 	SHA-256 but client might be sending SHA-1 CertificateVerify message */
@@ -157,22 +326,19 @@ int32_t sslUpdateHSHash(ssl_t *ssl, const unsigned char *in, uint16_t len)
   #ifdef USE_SHA1
 int32 sslSha1RetrieveHSHash(ssl_t *ssl, unsigned char *out)
 {
-	memcpy(out, ssl->sec.sha1Snapshot, SHA1_HASH_SIZE);
-	return SHA1_HASH_SIZE;
+	return hsCvDigest(ssl, HS_HASH_SHA1, out);
 }
   #endif
   #ifdef USE_SHA384
 int32 sslSha384RetrieveHSHash(ssl_t *ssl, unsigned char *out)
 {
-	memcpy(out, ssl->sec.sha384Snapshot, SHA384_HASH_SIZE);
-	return SHA384_HASH_SIZE;
+	return hsCvDigest(ssl, HS_HASH_SHA384, out);
 }
   #endif
   #ifdef USE_SHA512
 int32 sslSha512RetrieveHSHash(ssl_t *ssl, unsigned char *out)
 {
-	memcpy(out, ssl->sec.sha512Snapshot, SHA512_HASH_SIZE);
-	return SHA512_HASH_SIZE;
+	return hsCvDigest(ssl, HS_HASH_SHA512, out);
 }
   #endif
  #endif /* USE_SERVER_SIDE_SSL && USE_CLIENT_AUTH */
@@ -180,35 +346,21 @@ int32 sslSha512RetrieveHSHash(ssl_t *ssl, unsigned char *out)
  #if defined(USE_CLIENT_SIDE_SSL) && defined(USE_CLIENT_AUTH)
   #ifdef USE_SHA1
 /*	It is possible the certificate verify message wants a non-SHA256 hash */
-void sslSha1SnapshotHSHash(ssl_t *ssl, unsigned char *out)
+int32 sslSha1SnapshotHSHash(ssl_t *ssl, unsigned char *out)
 {
-	psSha1Final(&ssl->sec.msgHashSha1, out);
+	return hsCvDigest(ssl, HS_HASH_SHA1, out);
 }
   #endif
   #ifdef USE_SHA384
-void sslSha384SnapshotHSHash(ssl_t *ssl, unsigned char *out)
+int32 sslSha384SnapshotHSHash(ssl_t *ssl, unsigned char *out)
 {
-	psSha384_t sha384;
-
-	/* SHA384 must copy the context because it could be needed again for
-		final handshake hash.  SHA1 doesn't need this because it will
-		not ever be used again after this client auth one-off */
-	psSha384Sync(&ssl->sec.msgHashSha384, 0);
-	sha384 = ssl->sec.msgHashSha384;
-	psSha384Final(&sha384, out);
+	return hsCvDigest(ssl, HS_HASH_SHA384, out);
 }
   #endif
   #ifdef USE_SHA512
-void sslSha512SnapshotHSHash(ssl_t *ssl, unsigned char *out)
+int32 sslSha512SnapshotHSHash(ssl_t *ssl, unsigned char *out)
 {
-	psSha512_t sha512;
-
-	/* SHA512 must copy the context because it could be needed again for
-		final handshake hash.  SHA1 doesn't need this because it will
-		not ever be used again after this client auth one-off */
-	psSha512Sync(&ssl->sec.msgHashSha512, 0);
-	sha512 = ssl->sec.msgHashSha512;
-	psSha512Final(&sha512, out);
+	return hsCvDigest(ssl, HS_HASH_SHA512, out);
 }
   #endif
  #endif /* USE_CLIENT_SIDE_SSL && USE_CLIENT_AUTH */
@@ -224,18 +376,10 @@ static int32_t tlsGenerateFinishedHash(ssl_t *ssl,
 				psMd5Sha1_t *md5sha1,
  #endif
  #ifdef USE_TLS_1_2
- #ifdef USE_SHA1
-				psSha1_t *sha1,
- #endif
- #ifdef USE_SHA256
 				psSha256_t *sha256,
- #endif
  #ifdef USE_SHA384
 				psSha384_t *sha384,
  #endif
- #ifdef USE_SHA512
-				psSha512_t *sha512,
- #endif
  #endif /* USE_TLS_1_2 */
 				unsigned char *masterSecret,
 				unsigned char *out, int32 senderFlag)
@@ -245,17 +389,11 @@ static int32_t tlsGenerateFinishedHash(ssl_t *ssl,
 #ifndef USE_ONLY_TLS_1_2
 	psMd5Sha1_t md5sha1_backup;
 #endif
-#ifdef USE_SHA1
-	psSha1_t sha1_backup;
-#endif
-#ifdef USE_SHA256
+#ifdef USE_TLS_1_2
 	psSha256_t sha256_backup;
-#endif
 #ifdef USE_SHA384
 	psSha384_t sha384_backup;
 #endif
-#ifdef USE_SHA512
-	psSha512_t sha512_backup;
 #endif
 /*
 	In each branch: Use a backup of the message hash-to-date because we don't
@@ -303,36 +441,11 @@ static int32_t tlsGenerateFinishedHash(ssl_t *ssl,
 			handshake hashing. */
  #ifdef USE_TLS_1_2
 		if (ssl->flags & SSL_FLAGS_TLS_1_2) {
-			psSha256Cpy(&sha256_backup, sha256);
-			psSha256Final(&sha256_backup, out);
-  #if defined(USE_SERVER_SIDE_SSL) && defined(USE_CLIENT_AUTH)
-			/* Check to make sure we are a server because clients come
-				through here as well and they do not need to snapshot any
-				hashes because they are in a write state during the
-				CERTIFICATE_VERIFY creation.  So if they detect a non-default 
-				in digest, they just run the sslSha384SnapshotHSHash family
-				of functions.  Servers really do have to save aside the
-				snapshots beause the CERTIFICATE_VERIFY is a parse and so the 
-				handshake hash is being set aside for all possible combos
-				here so the sslSha384RetrieveHSHash can fetch.  Previous
-				versions were not testing for SERVER here so clients were
-				running digest operations that were not needed in client auth */
-			if (ssl->flags & SSL_FLAGS_SERVER) {
-   #ifdef USE_SHA384
-				psSha384Cpy(&sha384_backup, sha384);
-				psSha384Final(&sha384_backup, ssl->sec.sha384Snapshot);
-   #endif
-   #ifdef USE_SHA512
-				psSha512Cpy(&sha512_backup, sha512);
-				psSha512Final(&sha512_backup, ssl->sec.sha512Snapshot);
-   #endif
-   #ifdef USE_SHA1
-				psSha1Cpy(&sha1_backup, sha1);
-				psSha1Final(&sha1_backup, ssl->sec.sha1Snapshot);
-   #endif
-			}
-  #endif
-			return SHA256_HASH_SIZE;
+			/* SHA-256 by default. The sslSha384SnapshotHSHash and
+				sslSha384RetrieveHSHash family of functions hash the same
+				messages with the algorithm the signature actually uses. */
+			ssl->sec.hsMsgCvLen = ssl->sec.hsMsgLen;
+			return hsCvDigest(ssl, HS_HASH_SHA256, out);
   #ifndef USE_ONLY_TLS_1_2
 		} else {
 			psMd5Sha1Cpy(&md5sha1_backup, md5sha1);
@@ -375,7 +488,11 @@ int32_t extMasterSecretSnapshotHSHash(ssl_t *ssl, unsigned char *out,
 */
 
 	*outLen = 0;
-	
+	sslSelectHSHash(ssl);
+	if (ssl->sec.hsHashErr) {
+		return PS_MEM_FAIL;
+	}
+
 #ifdef USE_TLS_1_2
 	if (ssl->flags & SSL_FLAGS_TLS_1_2) {
 		if (ssl->cipher->flags & CRYPTO_FLAGS_SHA3) {
@@ -426,6 +543,11 @@ int32_t sslSnapshotHSHash(ssl_t *ssl, unsigned char *out, int32 senderFlag)
 	}
 #endif /* USE_DTLS */
 
+	sslSelectHSHash(ssl);
+	if (ssl->sec.hsHashErr) {
+		return PS_MEM_FAIL;
+	}
+
 #ifdef USE_TLS
 	if (ssl->flags & SSL_FLAGS_TLS) {
 		len = tlsGenerateFinishedHash(ssl,
@@ -433,18 +555,10 @@ int32_t sslSnapshotHSHash(ssl_t *ssl, unsigned char *out, int32 senderFlag)
 			&ssl->sec.msgHashMd5Sha1,
  #endif
  #ifdef USE_TLS_1_2
- #ifdef USE_SHA1
-			&ssl->sec.msgHashSha1,
- #endif
- #ifdef USE_SHA256
 			&ssl->sec.msgHashSha256,
- #endif
  #ifdef USE_SHA384
 			&ssl->sec.msgHashSha384,
  #endif
- #ifdef USE_SHA512
-			&ssl->sec.msgHashSha512,
- #endif
  #endif /* USE_TLS_1_2 */
 			ssl->sec.masterSecret, out, senderFlag);
 
@@ -456,6 +570,11 @@ int32_t sslSnapshotHSHash(ssl_t *ssl, unsigned char *out, int32 senderFlag)
 	}
 #endif /* USE_TLS */
 
+	/* No CertificateVerify can follow a Finished message */
+	if (senderFlag >= 0) {
+		sslFreeHSHash(ssl);
+	}
+
 #ifdef USE_DTLS
 	if (ssl->flags & SSL_FLAGS_DTLS) {
 		if (len > 0) {
@@ -41,6 +41,8 @@ static const char copyright[] =
 #if defined(USE_RSA) || defined(USE_ECC)
 #if defined(USE_SERVER_SIDE_SSL) || defined(USE_CLIENT_AUTH)
 static int32 verifyReadKeys(psPool_t *pool, sslKeys_t *keys, void *poolUserPtr);
+static int32 encodeCertMsg(sslKeys_t *keys);
+static void freeCertMsg(sslKeys_t *keys);
 #endif /* USE_SERVER_SIDE_SSL || USE_CLIENT_AUTH */
 #endif /* USE_RSA || USE_ECC */
 
@@ -73,6 +75,27 @@ static void initSessionEntryChronList(void);
 
 #endif /* USE_SERVER_SIDE_SSL */
 
+#ifdef USE_CERT_CHAIN_CACHE
+/*
+	Static table of recently validated peer chains, see matrixChainCacheFind
+*/
+typedef struct {
+	unsigned char	id[SHA256_HASH_SIZE];
+	psTime_t		startTime;
+	uint8_t			inUse;
+} sslChainCacheEntry_t;
+
+#ifdef USE_MULTITHREADING
+static psMutex_t			g_chainCacheLock;
+#endif
+static sslChainCacheEntry_t	g_chainCache[SSL_CHAIN_CACHE_SIZE];
+static uint32_t				g_CAgeneration;
+#endif /* USE_CERT_CHAIN_CACHE */
+
+#ifdef USE_CERT_VALIDATE
+static int32 indexCAcerts(psPool_t *pool, sslKeys_t *keys);
+#endif
+
 #if defined(USE_RSA) || defined(USE_ECC)
 #ifdef MATRIX_USE_FILE_SYSTEM
 static int32 matrixSslLoadKeyMaterial(sslKeys_t *keys, const char *certFile,
@@ -119,6 +142,12 @@ int32_t matrixSslOpenWithConfig(const char *config)
 		psError("pscrypto open failure\n");
 		return PS_FAIL;
 	}
+	sslInitSuiteIndex();
+#ifdef USE_CERT_CHAIN_CACHE
+	if ((rc = psCreateMutex(&g_chainCacheLock, 0)) < 0) {
+		return rc;
+	}
+#endif /* USE_CERT_CHAIN_CACHE */
 
 #ifdef USE_SERVER_SIDE_SSL
 #ifdef USE_SHARED_SESSION_CACHE
@@ -187,6 +216,10 @@ void matrixSslClose(void)
 	}
 #endif
 #endif /* USE_SERVER_SIDE_SSL */
+#ifdef USE_CERT_CHAIN_CACHE
+	matrixSslFlushChainCache();
+	psDestroyMutex(&g_chainCacheLock);
+#endif /* USE_CERT_CHAIN_CACHE */
 	psCryptoClose();
 	*g_config = 'N';
 }
@@ -202,19 +235,23 @@ void matrixSslClose(void)
 */
 int32_t matrixSslNewKeys(sslKeys_t **keys, void *memAllocUserPtr)
 {
-	psPool_t	*pool = NULL;
+	psPool_t	*pool = psMemPoolOpen("sslKeys_t");
 	sslKeys_t	*lkeys;
 #if  defined(USE_ECC) || defined(REQUIRE_DH_PARAMS)
 	int32_t		rc;
 #endif
 
 	lkeys = psMalloc(pool, sizeof(sslKeys_t));
+	/* A closed accounting pool lives on until its last block, here the
+		sslKeys_t itself, is freed */
+	psMemPoolClose(pool);
 	if (lkeys == NULL) {
 		return PS_MEM_FAIL;
 	}
 	memset(lkeys, 0x0, sizeof(sslKeys_t));
 	lkeys->pool = pool;
 	lkeys->poolUserPtr = memAllocUserPtr;
+	updateSuiteCaps(lkeys);
 
 #if  defined(USE_ECC) || defined(REQUIRE_DH_PARAMS)
 	rc = psCreateMutex(&lkeys->cache.lock, 0);
@@ -380,7 +417,7 @@ static void ReorderCertChain(psX509Cert_t *a_cert)
 /*
 	File should be a binary .p12 or .pfx
 */
-int32 matrixSslLoadPkcs12(sslKeys_t *keys, const unsigned char *certFile,
+static int32 loadPkcs12(sslKeys_t *keys, const unsigned char *certFile,
 			const unsigned char *importPass, int32 ipasslen,
 			const unsigned char *macPass, int32 mpasslen, int32 flags)
 {
@@ -406,6 +443,7 @@ int32 matrixSslLoadPkcs12(sslKeys_t *keys, const unsigned char *certFile,
 		if (keys->cert) {
 			psX509FreeCert(keys->cert);
 			keys->cert = NULL;
+			freeCertMsg(keys);
 		}
 		psClearPubKey(&keys->privKey);
 		return rc;
@@ -419,11 +457,33 @@ int32 matrixSslLoadPkcs12(sslKeys_t *keys, const unsigned char *certFile,
 		psX509FreeCert(keys->cert);
 		psClearPubKey(&keys->privKey);
 		keys->cert = NULL;
+		freeCertMsg(keys);
 		return PS_CERT_AUTH_FAIL;
 	}
+	if (encodeCertMsg(keys) < 0) {
+		psX509FreeCert(keys->cert);
+		psClearPubKey(&keys->privKey);
+		keys->cert = NULL;
+		freeCertMsg(keys);
+		return PS_MEM_FAIL;
+	}
 #endif /* USE_SERVER_SIDE_SSL || USE_CLIENT_AUTH */
 	return PS_SUCCESS;
 }
+
+int32 matrixSslLoadPkcs12(sslKeys_t *keys, const unsigned char *certFile,
+			const unsigned char *importPass, int32 ipasslen,
+			const unsigned char *macPass, int32 mpasslen, int32 flags)
+{
+	int32	rc;
+
+	rc = loadPkcs12(keys, certFile, importPass, ipasslen, macPass, mpasslen,
+		flags);
+	if (keys) {
+		updateSuiteCaps(keys);
+	}
+	return rc;
+}
 #endif /* USE_PKCS12 */
 
 /******************************************************************************/
@@ -432,9 +492,14 @@ int32 matrixSslLoadPkcs12(sslKeys_t *keys, const unsigned char *certFile,
 int32 matrixSslLoadRsaKeys(sslKeys_t *keys, const char *certFile,
 				const char *privFile, const char *privPass, const char *CAfile)
 {
-	return matrixSslLoadKeyMaterial(keys, certFile, privFile, privPass, CAfile,
-				PS_RSA);
+	int32	rc;
 
+	rc = matrixSslLoadKeyMaterial(keys, certFile, privFile, privPass, CAfile,
+				PS_RSA);
+	if (keys) {
+		updateSuiteCaps(keys);
+	}
+	return rc;
 }
 #endif /* USE_RSA */
 
@@ -447,9 +512,14 @@ int32 matrixSslLoadRsaKeys(sslKeys_t *keys, const char *certFile,
 int32 matrixSslLoadEcKeys(sslKeys_t *keys, const char *certFile,
 				const char *privFile, const char *privPass, const char *CAfile)
 {
-	return matrixSslLoadKeyMaterial(keys, certFile, privFile, privPass, CAfile,
-				PS_ECC);
+	int32	rc;
 
+	rc = matrixSslLoadKeyMaterial(keys, certFile, privFile, privPass, CAfile,
+				PS_ECC);
+	if (keys) {
+		updateSuiteCaps(keys);
+	}
+	return rc;
 }
 #endif /* USE_ECC */
 
@@ -494,6 +564,7 @@ static int32 matrixSslLoadKeyMaterial(sslKeys_t *keys, const char *certFile,
 #ifdef POSIX /* TODO - implement date check on WIN32, etc. */
 			psX509FreeCert(keys->cert);
 			keys->cert = NULL;
+			freeCertMsg(keys);
 			return PS_CERT_AUTH_FAIL_EXTENSION;
 #endif /* POSIX */
 		}
@@ -513,6 +584,7 @@ static int32 matrixSslLoadKeyMaterial(sslKeys_t *keys, const char *certFile,
 			if (keys->cert) {
 				psX509FreeCert(keys->cert);
 				keys->cert = NULL;
+				freeCertMsg(keys);
 				return PS_UNSUPPORTED_FAIL;
 			}
 		}
@@ -524,6 +596,7 @@ static int32 matrixSslLoadKeyMaterial(sslKeys_t *keys, const char *certFile,
 				if (keys->cert) {
 					psX509FreeCert(keys->cert);
 					keys->cert = NULL;
+					freeCertMsg(keys);
 				}
 				return err;
 			}
@@ -538,6 +611,7 @@ static int32 matrixSslLoadKeyMaterial(sslKeys_t *keys, const char *certFile,
 				if (keys->cert) {
 					psX509FreeCert(keys->cert);
 					keys->cert = NULL;
+					freeCertMsg(keys);
 				}
 				return err;
 			}
@@ -556,8 +630,16 @@ static int32 matrixSslLoadKeyMaterial(sslKeys_t *keys, const char *certFile,
 		psX509FreeCert(keys->cert);
 		psClearPubKey(&keys->privKey);
 		keys->cert = NULL;
+		freeCertMsg(keys);
 		return PS_CERT_AUTH_FAIL;
 	}
+	if (certFile && encodeCertMsg(keys) < 0) {
+		psX509FreeCert(keys->cert);
+		psClearPubKey(&keys->privKey);
+		keys->cert = NULL;
+		freeCertMsg(keys);
+		return PS_MEM_FAIL;
+	}
 #endif /* USE_SERVER_SIDE_SSL || USE_CLIENT_AUTH */
 
 	/* Not necessary to store binary representations of CA certs */
@@ -581,11 +663,18 @@ static int32 matrixSslLoadKeyMaterial(sslKeys_t *keys, const char *certFile,
 #endif
 			}
 		}
+#ifdef USE_CERT_VALIDATE
+		if (err >= 0 && (err = indexCAcerts(pool, keys)) < 0) {
+			psX509FreeCert(keys->CAcerts);
+			keys->CAcerts = NULL;
+		}
+#endif
 		if (err < 0) {
 #if defined(USE_SERVER_SIDE_SSL) || defined(USE_CLIENT_AUTH)
 			if (keys->cert) {
 				psX509FreeCert(keys->cert);
 				keys->cert = NULL;
+				freeCertMsg(keys);
 			}
 			psClearPubKey(&keys->privKey);
 #endif /* USE_SERVER_SIDE_SSL || USE_CLIENT_AUTH */
@@ -614,9 +703,14 @@ int32 matrixSslLoadRsaKeysMem(sslKeys_t *keys, const unsigned char *certBuf,
 			int32 certLen, const unsigned char *privBuf, int32 privLen,
 			const unsigned char *CAbuf, int32 CAlen)
 {
-	return matrixSslLoadKeyMaterialMem(keys, certBuf, certLen, privBuf, privLen,
-				CAbuf, CAlen, PS_RSA);
+	int32	rc;
 
+	rc = matrixSslLoadKeyMaterialMem(keys, certBuf, certLen, privBuf, privLen,
+				CAbuf, CAlen, PS_RSA);
+	if (keys) {
+		updateSuiteCaps(keys);
+	}
+	return rc;
 }
 #endif /* USE_RSA */
 
@@ -625,9 +719,14 @@ int32 matrixSslLoadEcKeysMem(sslKeys_t *keys, const unsigned char *certBuf,
 				int32 certLen, const unsigned char *privBuf, int32 privLen,
 				const unsigned char *CAbuf, int32 CAlen)
 {
-	return matrixSslLoadKeyMaterialMem(keys, certBuf, certLen, privBuf, privLen,
-				CAbuf, CAlen, PS_ECC);
+	int32	rc;
 
+	rc = matrixSslLoadKeyMaterialMem(keys, certBuf, certLen, privBuf, privLen,
+				CAbuf, CAlen, PS_ECC);
+	if (keys) {
+		updateSuiteCaps(keys);
+	}
+	return rc;
 }
 /**
 	Generate and cache an ephemeral ECC key for later use in ECDHE key exchange.
@@ -740,6 +839,7 @@ static int32 matrixSslLoadKeyMaterialMem(sslKeys_t *keys,
 				(uint32)certLen, &keys->cert, flags)) < 0) {
 			psX509FreeCert(keys->cert);
 			keys->cert = NULL;
+			freeCertMsg(keys);
 			return err;
 		}
 #else
@@ -759,10 +859,12 @@ static int32 matrixSslLoadKeyMaterialMem(sslKeys_t *keys,
 				if ((err = pkcs8ParsePrivBin(pool, (unsigned char*)privBuf,
 						(uint32)privLen, NULL, &keys->privKey)) < 0) {
 					psX509FreeCert(keys->cert); keys->cert = NULL;
+					freeCertMsg(keys);
 					return err;
 				}
 #else
 				psX509FreeCert(keys->cert); keys->cert = NULL;
+				freeCertMsg(keys);
 				return err;
 #endif
 			}
@@ -779,10 +881,12 @@ static int32 matrixSslLoadKeyMaterialMem(sslKeys_t *keys,
 				if ((err = pkcs8ParsePrivBin(pool, (unsigned char*)privBuf,
 						(uint32)privLen, NULL, &keys->privKey)) < 0) {
 					psX509FreeCert(keys->cert); keys->cert = NULL;
+					freeCertMsg(keys);
 					return err;
 				}
 #else
 				psX509FreeCert(keys->cert); keys->cert = NULL;
+				freeCertMsg(keys);
 				return err;
 #endif
 			}
@@ -799,8 +903,16 @@ static int32 matrixSslLoadKeyMaterialMem(sslKeys_t *keys,
 		psX509FreeCert(keys->cert);
 		psClearPubKey(&keys->privKey);
 		keys->cert = NULL;
+		freeCertMsg(keys);
 		return PS_CERT_AUTH_FAIL;
 	}
+	if (certBuf && encodeCertMsg(keys) < 0) {
+		psX509FreeCert(keys->cert);
+		psClearPubKey(&keys->privKey);
+		keys->cert = NULL;
+		freeCertMsg(keys);
+		return PS_MEM_FAIL;
+	}
 #endif /* USE_SERVER_SIDE_SSL || USE_CLIENT_AUTH */
 
 /*
@@ -820,9 +932,23 @@ static int32 matrixSslLoadKeyMaterialMem(sslKeys_t *keys,
 			psX509FreeCert(keys->cert);
 			psX509FreeCert(keys->CAcerts);
 			keys->cert = keys->CAcerts = NULL;
+			freeCertMsg(keys);
 #endif
 			return err;
 		}
+#ifdef USE_CERT_VALIDATE
+		if ((err = indexCAcerts(pool, keys)) < 0) {
+#if defined(USE_SERVER_SIDE_SSL) || defined(USE_CLIENT_AUTH)
+			psClearPubKey(&keys->privKey);
+			psX509FreeCert(keys->cert);
+			keys->cert = NULL;
+			freeCertMsg(keys);
+#endif
+			psX509FreeCert(keys->CAcerts);
+			keys->CAcerts = NULL;
+			return err;
+		}
+#endif
 #else
 		psTraceInfo("Ignoring CAbuf in matrixSslReadKeysMem\n");
 #endif /* USE_CLIENT_SIDE_SSL || USE_CLIENT_AUTH */
@@ -846,16 +972,28 @@ int32_t matrixSslLoadOCSPResponse(sslKeys_t *keys,
 	PS_POOL_USED(pool);
 
 	/* Overwrite/Update any response being set */
-	if (keys->OCSPResponseBuf != NULL) {
-		psFree(keys->OCSPResponseBuf, pool);
-		keys->OCSPResponseBufLen = 0;
-	}
-	
-	keys->OCSPResponseBufLen = OCSPResponseBufLen;
-	if ((keys->OCSPResponseBuf = psMalloc(pool, OCSPResponseBufLen)) == NULL) {
+	if (keys->OCSPStatusMsg != NULL) {
+		psFree(keys->OCSPStatusMsg, pool);
+		keys->OCSPStatusMsg = keys->OCSPResponseBuf = NULL;
+		keys->OCSPStatusMsgLen = keys->OCSPResponseBufLen = 0;
+	}
+
+	/* Store the response as the complete CERTIFICATE_STATUS body so
+		the handshake can copy it out as is:
+		1 byte status_type (ocsp), 3 byte length, OCSPResponse */
+	keys->OCSPStatusMsgLen = 4 + OCSPResponseBufLen;
+	if ((keys->OCSPStatusMsg = psMalloc(pool, keys->OCSPStatusMsgLen))
+			== NULL) {
+		keys->OCSPStatusMsgLen = 0;
 		return PS_MEM_FAIL;
 	}
-	
+	keys->OCSPStatusMsg[0] = 0x1;
+	/* ocspLen is 16 bit value. */
+	keys->OCSPStatusMsg[1] = 0;
+	keys->OCSPStatusMsg[2] = (OCSPResponseBufLen & 0xFF00) >> 8;
+	keys->OCSPStatusMsg[3] = (OCSPResponseBufLen & 0xFF);
+	keys->OCSPResponseBuf = keys->OCSPStatusMsg + 4;
+	keys->OCSPResponseBufLen = OCSPResponseBufLen;
 	memcpy(keys->OCSPResponseBuf, OCSPResponseBuf, OCSPResponseBufLen);
 	return PS_SUCCESS;
 }
@@ -887,11 +1025,17 @@ void matrixSslDeleteKeys(sslKeys_t *keys)
 	if (keys->cert) {
 		psX509FreeCert(keys->cert);
 	}
+	if (keys->certMsg) {
+		psFree(keys->certMsg, keys->pool);
+	}
 
 	psClearPubKey(&keys->privKey);
 #endif /* USE_SERVER_SIDE_SSL || USE_CLIENT_AUTH */
 
 #if defined(USE_CLIENT_SIDE_SSL) || defined(USE_CLIENT_AUTH)
+#ifdef USE_CERT_VALIDATE
+	psX509FreeCertIndex(&keys->CAindex);
+#endif
 	if (keys->CAcerts) {
 		psX509FreeCert(keys->CAcerts);
 	}
@@ -938,8 +1082,8 @@ void matrixSslDeleteKeys(sslKeys_t *keys)
 #endif
 
 #if defined(USE_OCSP) && defined(USE_SERVER_SIDE_SSL)
-	if (keys->OCSPResponseBuf != NULL) {
-		psFree(keys->OCSPResponseBuf, keys->pool);
+	if (keys->OCSPStatusMsg != NULL) {
+		psFree(keys->OCSPStatusMsg, keys->pool);
 		keys->OCSPResponseBufLen = 0;
 	}
 #endif
@@ -1011,6 +1155,64 @@ static int32 verifyReadKeys(psPool_t *pool, sslKeys_t *keys, void *poolUserPtr)
 #endif /* USE_CERT_PARSE */
 	return PS_SUCCESS;
 }
+
+/*
+	Encode the body of the CERTIFICATE handshake message for the identity
+	chain once, so handshakes can copy it out rather than walking the chain.
+		3 byte length of all certificate data
+		3 byte length of each certificate, followed by its DER
+*/
+static int32 encodeCertMsg(sslKeys_t *keys)
+{
+	psX509Cert_t	*cert;
+	unsigned char	*c;
+	uint32_t		len;
+
+	freeCertMsg(keys);
+	if (keys->cert == NULL) {
+		return PS_SUCCESS;
+	}
+	len = 3;
+	for (cert = keys->cert; cert != NULL; cert = cert->next) {
+		psAssert(cert->unparsedBin != NULL);
+		if (cert->binLen > 0) {
+			len += 3 + cert->binLen;
+		}
+	}
+	if ((c = psMalloc(keys->pool, len)) == NULL) {
+		return PS_MEM_FAIL;
+	}
+	keys->certMsg = c;
+	keys->certMsgLen = len;
+
+	len -= 3;
+	*c = (unsigned char)((len & 0xFF0000) >> 16); c++;
+	*c = (len & 0xFF00) >> 8; c++;
+	*c = (len & 0xFF); c++;
+	for (cert = keys->cert; cert != NULL; cert = cert->next) {
+		len = cert->binLen;
+		if (len > 0) {
+			*c = (unsigned char)((len & 0xFF0000) >> 16); c++;
+			*c = (len & 0xFF00) >> 8; c++;
+			*c = (len & 0xFF); c++;
+			memcpy(c, cert->unparsedBin, len);
+			c += len;
+		}
+	}
+	return PS_SUCCESS;
+}
+
+/*
+	Drop the encoded CERTIFICATE body along with the identity chain
+*/
+static void freeCertMsg(sslKeys_t *keys)
+{
+	if (keys->certMsg) {
+		psFree(keys->certMsg, keys->pool);
+		keys->certMsg = NULL;
+		keys->certMsgLen = 0;
+	}
+}
 #endif /* USE_RSA || USE_ECC */
 #endif	/* USE_SERVER_SIDE_SSL || USE_CLIENT_AUTH */
 /******************************************************************************/
@@ -1023,10 +1225,14 @@ static int32 verifyReadKeys(psPool_t *pool, sslKeys_t *keys, void *poolUserPtr)
 #ifdef MATRIX_USE_FILE_SYSTEM
 int32 matrixSslLoadDhParams(sslKeys_t *keys, const char *paramFile)
 {
+	int32	rc;
+
 	if (keys == NULL) {
 		return PS_ARG_FAIL;
 	}
-	return pkcs3ParseDhParamFile(keys->pool, (char*)paramFile, &keys->dhParams);
+	rc = pkcs3ParseDhParamFile(keys->pool, (char*)paramFile, &keys->dhParams);
+	updateSuiteCaps(keys);
+	return rc;
 }
 #endif /* MATRIX_USE_FILE_SYSTEM */
 
@@ -1034,11 +1240,15 @@ int32 matrixSslLoadDhParams(sslKeys_t *keys, const char *paramFile)
 int32 matrixSslLoadDhParamsMem(sslKeys_t *keys,  const unsigned char *dhBin,
 			int32 dhBinLen)
 {
+	int32	rc;
+
 	if (keys == NULL) {
 		return PS_ARG_FAIL;
 	}
-	return pkcs3ParseDhParamBin(keys->pool, (unsigned char*)dhBin, dhBinLen,
+	rc = pkcs3ParseDhParamBin(keys->pool, (unsigned char*)dhBin, dhBinLen,
 		&keys->dhParams);
+	updateSuiteCaps(keys);
+	return rc;
 }
 #endif /* REQUIRE_DH_PARAMS */
 
@@ -1055,7 +1265,7 @@ int32 matrixSslLoadDhParamsMem(sslKeys_t *keys,  const unsigned char *dhBin,
 int32 matrixSslNewSession(ssl_t **ssl, const sslKeys_t *keys,
 					sslSessionId_t *session, sslSessOpts_t *options)
 {
-	psPool_t	*pool = NULL;
+	psPool_t	*pool;
 	ssl_t		*lssl;
 	int32_t		specificVersion, flags;
 #ifdef USE_STATELESS_SESSION_TICKETS
@@ -1108,7 +1318,25 @@ int32 matrixSslNewSession(ssl_t **ssl, const sslKeys_t *keys,
 		return PS_ARG_FAIL;
 	}
 
+	if (options->recordSizeLimit > 0 &&
+			(options->recordSizeLimit < SSL_MIN_RECORD_SIZE_LIMIT ||
+			options->recordSizeLimit > SSL_MAX_PLAINTEXT_LEN)) {
+		psTraceInfo("Unsupported recordSizeLimit value to session options\n");
+		return PS_ARG_FAIL;
+	}
+
+#ifdef USE_DTLS
+	if (options->dtlsCidLen > DTLS_MAX_CID_LEN || options->dtlsCidLen < -1) {
+		psTraceInfo("Unsupported dtlsCidLen value to session options\n");
+		return PS_ARG_FAIL;
+	}
+#endif
+
+	pool = psMemPoolOpen("ssl_t");
 	lssl = psMalloc(pool, sizeof(ssl_t));
+	/* A closed accounting pool lives on until its last block, here the
+		ssl_t itself, is freed */
+	psMemPoolClose(pool);
 	if (lssl == NULL) {
 		psTraceInfo("Out of memory for ssl_t in matrixSslNewSession\n");
 		return PS_MEM_FAIL;
@@ -1138,7 +1366,7 @@ int32 matrixSslNewSession(ssl_t **ssl, const sslKeys_t *keys,
 /*
 	Data buffers
 */
-	lssl->bufferPool = options->bufferPool;
+	lssl->bufferPool = options->bufferPool ? options->bufferPool : pool;
 	lssl->outsize = SSL_DEFAULT_OUT_BUF_SIZE;
 #ifdef USE_DTLS
 	if (flags & SSL_FLAGS_DTLS) {
@@ -1169,6 +1397,7 @@ int32 matrixSslNewSession(ssl_t **ssl, const sslKeys_t *keys,
 	}
 
 	lssl->sPool = pool;
+	lssl->hsPool = pool;
 	lssl->keys = (sslKeys_t*)keys;
 	if ((lssl->cipher = sslGetCipherSpec(lssl, SSL_NULL_WITH_NULL_NULL)) == NULL) {
 		psFree(lssl->outbuf, lssl->bufferPool);
@@ -1180,11 +1409,32 @@ int32 matrixSslNewSession(ssl_t **ssl, const sslKeys_t *keys,
 
 	lssl->recordHeadLen = SSL3_HEADER_LEN;
 	lssl->hshakeHeadLen = SSL3_HANDSHAKE_HEADER_LEN;
+	if (options->recordSizeLimit > 0) {
+		lssl->recLimit = options->recordSizeLimit;
+	}
+	if (options->lazyCertExtensions > 0) {
+		lssl->certParseFlags = CERT_LAZY_EXTENSIONS;
+	}
 
 #ifdef SSL_REHANDSHAKES_ENABLED
 	lssl->rehandshakeCount = DEFAULT_RH_CREDITS;
 #endif /* SSL_REHANDSHAKES_ENABLED */
 
+#ifdef USE_DYNAMIC_RECORD_SIZING
+	if (options->dynamicRecordSize > 0) {
+		lssl->drsRecordLen = options->drsRecordLen ?
+			options->drsRecordLen : SSL_DRS_RECORD_LEN;
+		lssl->drsBoostBytes = options->drsBoostBytes ?
+			options->drsBoostBytes : SSL_DRS_BOOST_BYTES;
+		lssl->drsIdleMsec = options->drsIdleMsec ?
+			options->drsIdleMsec : SSL_DRS_IDLE_MSEC;
+	}
+#endif /* USE_DYNAMIC_RECORD_SIZING */
+
+#ifdef USE_MATRIXSSL_STATS
+	psGetTime(&lssl->statHsStart, options->userPtr);
+#endif
+
 #ifdef USE_DTLS
 	if (flags & SSL_FLAGS_DTLS) {
 		lssl->flags |= SSL_FLAGS_DTLS;
@@ -1197,7 +1447,23 @@ int32 matrixSslNewSession(ssl_t **ssl, const sslKeys_t *keys,
 		lssl->flightDone = 0;
 		lssl->appDataExch = 0;
 		lssl->lastMsn = -1;
+		lssl->retransTimeout = DTLS_RETRANSMIT_MIN_MS;
 		dtlsInitFrag(lssl);
+		if (options->dtlsCidLen != 0) {
+			/* Offer RFC 9146 connection IDs.  -1 asks the peer for one but
+				takes none on the records sent to us */
+			lssl->extFlags.offer_connection_id = 1;
+			if (options->dtlsCidLen > 0) {
+				lssl->cidInLen = (uint8_t)options->dtlsCidLen;
+				if (options->dtlsCid) {
+					memcpy(lssl->cidIn, options->dtlsCid, lssl->cidInLen);
+				} else if (matrixCryptoGetPrngData(lssl->cidIn,
+						lssl->cidInLen, options->userPtr) < 0) {
+					matrixSslDeleteSession(lssl);
+					return PS_PLATFORM_FAIL;
+				}
+			}
+		}
 	}
 #endif /* USE_DTLS */
 
@@ -1459,6 +1725,7 @@ int32 matrixSslNewSession(ssl_t **ssl, const sslKeys_t *keys,
 */
 void matrixSslDeleteSession(ssl_t *ssl)
 {
+	psPool_t	*pool;
 
 	if (ssl == NULL) {
 		return;
@@ -1509,6 +1776,7 @@ void matrixSslDeleteSession(ssl_t *ssl)
 
 #endif /* USE_CLIENT_SIDE_SSL || USE_CLIENT_AUTH */
 #endif /* !USE_ONLY_PSK_CIPHER_SUITE */
+	sslFreeHSHash(ssl);
 
 #ifdef REQUIRE_DH_PARAMS
 	if (ssl->sec.dhP) {
@@ -1555,6 +1823,7 @@ void matrixSslDeleteSession(ssl_t *ssl)
 		psFree(ssl->helloExt, ssl->hsPool);
 	}
 	dtlsInitFrag(ssl);
+	dtlsFreeFlightCache(ssl);
 	if (ssl->ckeMsg) {
 		psFree(ssl->ckeMsg, ssl->hsPool);
 	}
@@ -1586,8 +1855,15 @@ void matrixSslDeleteSession(ssl_t *ssl)
 #endif
 /*
 	The cipher and mac contexts are inline in the ssl structure, so
-	clearing the structure clears those states as well.
+	clearing the structure clears those states as well.  The keyed record
+	MAC states are wiped explicitly since the memset below may be elided.
 */
+#if defined(USE_NATIVE_TLS_ALGS) && defined(USE_TLS)
+	memzero_s(&ssl->sec.writeHmac, sizeof(ssl->sec.writeHmac));
+	memzero_s(&ssl->sec.readHmac, sizeof(ssl->sec.readHmac));
+#endif
+	pool = ssl->sPool;
+	PS_VARIABLE_SET_BUT_UNUSED(pool);
 	memset(ssl, 0x0, sizeof(ssl_t));
 	psFree(ssl, pool);
 }
@@ -2788,17 +3064,21 @@ static int wildcardMatch(char *wild, char *s)
 /*
 	Subject certs is the leaf first chain of certs from the peer
 	Issuer certs is a flat list of trusted CAs loaded by LoadKeys
+	If issuerIndex is built over issuerCerts only the CAs it finds for the
+	parent-most subject are tried instead of the whole list
 */
 int32 matrixValidateCerts(psPool_t *pool, psX509Cert_t *subjectCerts,
-							psX509Cert_t *issuerCerts, char *expectedName,
-							psX509Cert_t **foundIssuer, void *hwCtx,
-							void *poolUserPtr)
+							psX509Cert_t *issuerCerts,
+							const psX509CertIndex_t *issuerIndex,
+							char *expectedName, psX509Cert_t **foundIssuer,
+							void *hwCtx, void *poolUserPtr)
 {
 	psX509Cert_t		*ic, *sc;
 	x509GeneralName_t	*n;
 	x509v3extensions_t	*ext;
 	char				ip[16];
 	int32				rc, pathLen = 0;
+	uint32_t			pos = 0;
 
 	*foundIssuer = NULL;
 /*
@@ -2863,7 +3143,15 @@ int32 matrixValidateCerts(psPool_t *pool, psX509Cert_t *subjectCerts,
 	 we only need to pass in the single parent-most cert to be tested against
 */
 	*foundIssuer = NULL;
-	ic = issuerCerts;
+	if (issuerIndex != NULL && issuerIndex->size > 0) {
+		if ((ic = psX509FindIssuer(issuerIndex, sc, &pos)) == NULL) {
+			/* What psX509AuthenticateCert would say for every CA */
+			sc->authStatus = PS_CERT_AUTH_FAIL_DN;
+		}
+	} else {
+		issuerIndex = NULL;
+		ic = issuerCerts;
+	}
 	while (ic != NULL) {
 		sc->authStatus = PS_FALSE;
 		if ((rc = psX509AuthenticateCert(pool, sc, ic, foundIssuer, hwCtx,
@@ -2941,7 +3229,11 @@ int32 matrixValidateCerts(psPool_t *pool, psX509Cert_t *subjectCerts,
 */
 			return rc;
 		}
-		ic = ic->next;
+		if (issuerIndex != NULL) {
+			ic = psX509FindIssuer(issuerIndex, sc, &pos);
+		} else {
+			ic = ic->next;
+		}
 	}
 /*
 	Success would have returned if it happen
@@ -2949,6 +3241,166 @@ int32 matrixValidateCerts(psPool_t *pool, psX509Cert_t *subjectCerts,
 	return PS_CERT_AUTH_FAIL;
 }
 
+/*
+	Build the issuer lookup over freshly loaded trusted CAs
+*/
+static int32 indexCAcerts(psPool_t *pool, sslKeys_t *keys)
+{
+	int32	rc;
+
+	if ((rc = psX509IndexCerts(pool, keys->CAcerts, &keys->CAindex)) < 0) {
+		return rc;
+	}
+#ifdef USE_CERT_CHAIN_CACHE
+	/* Never reused, unlike the address of the keys */
+	psLockMutex(&g_chainCacheLock);
+	keys->CAgeneration = ++g_CAgeneration;
+	psUnlockMutex(&g_chainCacheLock);
+#endif
+	return PS_SUCCESS;
+}
+
+#ifdef USE_CERT_CHAIN_CACHE
+/******************************************************************************/
+/*
+	Chain validation cache.  An entry records that the peer chain, checked
+	against one set of trusted CAs for one expected name, passed
+	matrixValidateCerts without any failure flags.  The id digests exactly
+	those inputs: the CA generation of the keys, the expected name and the
+	TBS hash and signature of every cert in the chain, which together
+	identify each cert.  Dates are checked when the peer certs are parsed,
+	so an expired chain never reaches the cache.
+*/
+static int32 chainCacheable(ssl_t *ssl)
+{
+	psX509Cert_t	*cert;
+
+	if (ssl->keys == NULL || ssl->keys->CAindex.size == 0) {
+		return PS_FALSE;
+	}
+	for (cert = ssl->sec.cert; cert != NULL; cert = cert->next) {
+		if (cert->authFailFlags) {
+			return PS_FALSE;
+		}
+	}
+	return PS_TRUE;
+}
+
+static void chainCacheId(ssl_t *ssl, unsigned char id[SHA256_HASH_SIZE])
+{
+	psSha256_t		md;
+	psX509Cert_t	*cert;
+	unsigned char	gen[4];
+
+	psSha256PreInit(&md);
+	psSha256Init(&md);
+	gen[0] = (ssl->keys->CAgeneration >> 24) & 0xFF;
+	gen[1] = (ssl->keys->CAgeneration >> 16) & 0xFF;
+	gen[2] = (ssl->keys->CAgeneration >> 8) & 0xFF;
+	gen[3] = ssl->keys->CAgeneration & 0xFF;
+	psSha256Update(&md, gen, sizeof(gen));
+	if (ssl->expectedName) {
+		psSha256Update(&md, (unsigned char *)ssl->expectedName,
+			(uint32_t)strlen(ssl->expectedName) + 1);
+	} else {
+		psSha256Update(&md, gen, 0);
+	}
+	for (cert = ssl->sec.cert; cert != NULL; cert = cert->next) {
+		psSha256Update(&md, cert->sigHash, MAX_HASH_SIZE);
+		psSha256Update(&md, cert->signature, cert->signatureLen);
+	}
+	psSha256Final(&md, id);
+}
+
+static sslChainCacheEntry_t *chainCacheSlot(const unsigned char *id)
+{
+	uint32_t	i;
+
+	i = ((uint32_t)id[0] << 24) | ((uint32_t)id[1] << 16) |
+		((uint32_t)id[2] << 8) | (uint32_t)id[3];
+	return &g_chainCache[i % SSL_CHAIN_CACHE_SIZE];
+}
+
+/*
+	Look the peer chain of ssl up in the cache.  On a hit the chain is marked
+	authenticated as matrixValidateCerts would and PS_TRUE is returned.
+	Otherwise id holds what to pass to matrixChainCacheAdd once the chain
+	has been validated.
+*/
+int32 matrixChainCacheFind(ssl_t *ssl, unsigned char id[SHA256_HASH_SIZE])
+{
+	sslChainCacheEntry_t	*entry;
+	psX509Cert_t			*cert;
+	psTime_t				now;
+	int32					hit;
+
+	if (!chainCacheable(ssl)) {
+		return PS_FALSE;
+	}
+	chainCacheId(ssl, id);
+	entry = chainCacheSlot(id);
+	psGetTime(&now, ssl->userPtr);
+	psLockMutex(&g_chainCacheLock);
+	hit = entry->inUse && memcmp(entry->id, id, SHA256_HASH_SIZE) == 0 &&
+		psDiffMsecs(entry->startTime, now, ssl->userPtr) <
+		SSL_CHAIN_CACHE_LIFE;
+	psUnlockMutex(&g_chainCacheLock);
+	if (!hit) {
+		return PS_FALSE;
+	}
+#ifdef USE_CRL
+	/* Revocation may have changed since, and the status is wanted anyway */
+	for (cert = ssl->sec.cert; cert != NULL; cert = cert->next) {
+		if (psCRL_determineRevokedStatus(cert) ==
+				CRL_CHECK_REVOKED_AND_AUTHENTICATED) {
+			return PS_FALSE;
+		}
+	}
+#endif
+	for (cert = ssl->sec.cert; cert != NULL; cert = cert->next) {
+		cert->authStatus = PS_CERT_AUTH_PASS;
+	}
+	psTraceInfo("Peer certificate chain found in validation cache\n");
+	return PS_TRUE;
+}
+
+/*
+	Remember a chain that matrixValidateCerts just passed cleanly
+*/
+void matrixChainCacheAdd(ssl_t *ssl, const unsigned char id[SHA256_HASH_SIZE])
+{
+	sslChainCacheEntry_t	*entry;
+	psX509Cert_t			*cert;
+	psTime_t				now;
+
+	if (!chainCacheable(ssl)) {
+		return;
+	}
+	for (cert = ssl->sec.cert; cert != NULL; cert = cert->next) {
+		if (cert->authStatus != PS_CERT_AUTH_PASS) {
+			return;
+		}
+	}
+	entry = chainCacheSlot(id);
+	psGetTime(&now, ssl->userPtr);
+	psLockMutex(&g_chainCacheLock);
+	memcpy(entry->id, id, SHA256_HASH_SIZE);
+	entry->startTime = now;
+	entry->inUse = 1;
+	psUnlockMutex(&g_chainCacheLock);
+}
+
+/*
+	Forget every validated chain
+*/
+void matrixSslFlushChainCache(void)
+{
+	psLockMutex(&g_chainCacheLock);
+	memset(g_chainCache, 0x0, sizeof(g_chainCache));
+	psUnlockMutex(&g_chainCacheLock);
+}
+#endif /* USE_CERT_CHAIN_CACHE */
+
 /******************************************************************************/
 /*
 	Calls a user defined callback to allow for manual validation of the
@@ -3010,6 +3462,80 @@ void matrixsslUpdateStat(ssl_t *ssl, int32 type, int32 value)
 	}
 }
 
+/*
+	Copy out the counters of a session. The structure is plain data so a
+	monitoring thread can collect many sessions into one array and export
+	them in bulk.
+*/
+int32 matrixSslGetStats(const ssl_t *ssl, sslStats_t *stats)
+{
+	if (ssl == NULL || stats == NULL) {
+		return PS_ARG_FAIL;
+	}
+	memcpy(stats, &ssl->stats, sizeof(sslStats_t));
+	return PS_SUCCESS;
+}
+
+void matrixSslResetStats(ssl_t *ssl)
+{
+	if (ssl) {
+		memset(&ssl->stats, 0x0, sizeof(sslStats_t));
+	}
+}
+
+/*
+	Time elapsed since start, at the best resolution the platform offers
+*/
+uint64_t matrixsslStatNsecs(ssl_t *ssl, psTime_t start)
+{
+	psTime_t	now;
+
+	psGetTime(&now, ssl->userPtr);
+#if defined(POSIX) && defined(USE_HIGHRES_TIME)
+	return (uint64_t)psDiffNsecs(start, now);
+#else
+	return (uint64_t)psDiffMsecs(start, now, ssl->userPtr) * 1000000;
+#endif
+}
+
 #endif /* USE_MATRIXSSL_STATS */
 /******************************************************************************/
 
+#ifdef USE_MEMORY_ACCOUNTING
+/******************************************************************************/
+/*
+	Memory footprint of a session: the ssl_t, its record buffers (unless the
+	caller supplied options.bufferPool) and everything allocated from the
+	session and handshake pools.  The peak right after the handshake is the
+	handshake footprint, current is the steady state footprint.
+*/
+int32_t matrixSslGetMemStats(const ssl_t *ssl, psMemStats_t *stats)
+{
+	if (ssl == NULL || ssl->sPool == NULL || stats == NULL) {
+		return PS_ARG_FAIL;
+	}
+	return psMemGetStats(ssl->sPool, stats);
+}
+
+/* Restart peak tracking, e.g. before a rehandshake */
+void matrixSslResetMemPeak(ssl_t *ssl)
+{
+	if (ssl != NULL && ssl->sPool != NULL) {
+		psMemResetPeak(ssl->sPool);
+	}
+}
+
+/*
+	Memory held by a key structure and all key material, certificates
+	and CAs loaded into it.
+*/
+int32_t matrixSslGetKeysMemStats(const sslKeys_t *keys, psMemStats_t *stats)
+{
+	if (keys == NULL || keys->pool == NULL || stats == NULL) {
+		return PS_ARG_FAIL;
+	}
+	return psMemGetStats(keys->pool, stats);
+}
+#endif /* USE_MEMORY_ACCOUNTING */
+/******************************************************************************/
+
@@ -169,6 +169,7 @@ RETRY_HELLO:
 			}
 			lssl->outbuf = tmp.buf;
 			lssl->outsize = len;
+			SSL_STAT_ADD(lssl, outbufGrow, 1);
 			goto RETRY_HELLO;
 		} else {
 			matrixSslDeleteSession(lssl);
@@ -342,11 +343,27 @@ int32 matrixSslNewServerSession(ssl_t **ssl, const sslKeys_t *keys,
 		/* User wants to deny a client request for changing max frag len */
 		lssl->extFlags.deny_max_fragment_len = 1;
 	}
+	if (options->recordSizeLimit < 0) {
+		lssl->extFlags.deny_record_size_limit = 1;
+	}
 	lssl->maxPtFrag = SSL_MAX_PLAINTEXT_LEN;
 
 	if (options->truncHmac < 0) {
 		lssl->extFlags.deny_truncated_hmac = 1;
 	}
+	if (options->serverCipherPref > 0) {
+		lssl->serverCipherPref = 1;
+	}
+#ifdef USE_DTLS
+	if (options->dtlsPeerIdLen > 0) {
+		if (options->dtlsPeerId == NULL ||
+				options->dtlsPeerIdLen > DTLS_MAX_PEER_ID_LEN) {
+			goto NEW_SVR_ERROR;
+		}
+		memcpy(lssl->dtlsPeerId, options->dtlsPeerId, options->dtlsPeerIdLen);
+		lssl->dtlsPeerIdLen = (uint8_t)options->dtlsPeerIdLen;
+	}
+#endif
 	
 	/* Extended master secret is enabled by default.  If user sets to 1 this
 		is a flag to REQUIRE its use */
@@ -444,6 +461,7 @@ int32 matrixSslGetReadbufOfSize(ssl_t *ssl, int32 size, unsigned char **buf)
 		}
 		ssl->inbuf = p;
 		ssl->insize = ssl->inlen + size;
+		SSL_STAT_ADD(ssl, inbufGrow, 1);
 		*buf = ssl->inbuf + ssl->inlen;
 		return size;
 	}
@@ -473,6 +491,58 @@ int32 matrixSslGetOutdata(ssl_t *ssl, unsigned char **buf)
 	return ssl->outlen;	/* Can be 0 */
 }
 
+#ifdef USE_DYNAMIC_RECORD_SIZING
+/******************************************************************************/
+/*
+	Largest plaintext for the next application data record. Until
+	drsBoostBytes have been sent, and again after drsIdleMsec without sending,
+	records are kept small enough to encode into drsRecordLen bytes.
+*/
+static int32 drsMaxPtFrag(ssl_t *ssl)
+{
+	psTime_t	now;
+	int32		overhead;
+
+	if (ssl->drsRecordLen == 0) {
+		return ssl->maxPtFrag;
+	}
+#ifdef USE_DTLS
+	if (ssl->flags & SSL_FLAGS_DTLS) {
+		return ssl->maxPtFrag;	/* Records are already limited by the PMTU */
+	}
+#endif
+	if (ssl->drsSent >= ssl->drsBoostBytes) {
+		psGetTime(&now, ssl->userPtr);
+		if (psDiffMsecs(ssl->drsLastSend, now, ssl->userPtr) <
+				(int32)ssl->drsIdleMsec) {
+			return ssl->maxPtFrag;
+		}
+		ssl->drsSent = 0;
+	}
+	overhead = matrixSslGetEncodedSize(ssl, 0) + ssl->enBlockSize;
+	if (ssl->drsRecordLen <= overhead) {
+		return ssl->maxPtFrag;
+	}
+	return min(ssl->drsRecordLen - overhead, ssl->maxPtFrag);
+}
+
+/*
+	Account for len encoded bytes of application data queued to send
+*/
+static void drsSentData(ssl_t *ssl, uint32 len)
+{
+	if (ssl->drsRecordLen == 0) {
+		return;
+	}
+	if (ssl->drsSent < ssl->drsBoostBytes) {
+		ssl->drsSent += len;
+	}
+	if (ssl->drsSent >= ssl->drsBoostBytes) {
+		psGetTime(&ssl->drsLastSend, ssl->userPtr);
+	}
+}
+#endif /* USE_DYNAMIC_RECORD_SIZING */
+
 /******************************************************************************/
 /*
 	Caller is asking for an allocated buffer to write plaintext into.
@@ -493,7 +563,8 @@ int32 matrixSslGetOutdata(ssl_t *ssl, unsigned char **buf)
  */
 int32 matrixSslGetWritebuf(ssl_t *ssl, unsigned char **buf, uint32 requestedLen)
 {
-	uint32			requiredLen, sz, overhead;
+	uint32			requiredLen, sz, overhead, headLen;
+	int32			maxFrag;
 #ifdef USE_DTLS
 	int32			pmtu;
 #endif
@@ -523,8 +594,13 @@ int32 matrixSslGetWritebuf(ssl_t *ssl, unsigned char **buf, uint32 requestedLen)
 	max for the calculations and make sure that exact max is returned to the
 	caller.  The responsibilty for fragmenting the message is left to them
 */
-	if (requestedLen > (uint32)ssl->maxPtFrag) {
-		requestedLen = ssl->maxPtFrag;
+#ifdef USE_DYNAMIC_RECORD_SIZING
+	maxFrag = drsMaxPtFrag(ssl);
+#else
+	maxFrag = ssl->maxPtFrag;
+#endif
+	if (requestedLen > (uint32)maxFrag) {
+		requestedLen = maxFrag;
 	}
 
 /*
@@ -544,7 +620,7 @@ int32 matrixSslGetWritebuf(ssl_t *ssl, unsigned char **buf, uint32 requestedLen)
 
 #ifdef USE_DTLS
 	if (ssl->flags & SSL_FLAGS_DTLS) {
-		pmtu = matrixDtlsGetPmtu();
+		pmtu = ssl->pmtu;
 		if (requiredLen > (uint32)pmtu) {
 			overhead = matrixSslGetEncodedSize(ssl, 0) + ssl->enBlockSize;
 			requiredLen = matrixSslGetEncodedSize(ssl, pmtu - overhead);
@@ -570,6 +646,7 @@ int32 matrixSslGetWritebuf(ssl_t *ssl, unsigned char **buf, uint32 requestedLen)
 		}
 		ssl->outbuf = p;
 		ssl->outsize = ssl->outsize + (requiredLen - sz);
+		SSL_STAT_ADD(ssl, outbufGrow, 1);
 /*
 		Recalculate available free space
 */
@@ -583,16 +660,22 @@ int32 matrixSslGetWritebuf(ssl_t *ssl, unsigned char **buf, uint32 requestedLen)
 	Now that requiredLen has been confirmed/created, return number of available
 	plaintext bytes
 */
-	if (requestedLen <= (uint32)ssl->maxPtFrag) {
+	if (requestedLen <= (uint32)maxFrag) {
 		requestedLen = sz - overhead;
-		if (requestedLen > (uint32)ssl->maxPtFrag) {
-			requestedLen = ssl->maxPtFrag;
+		if (requestedLen > (uint32)maxFrag) {
+			requestedLen = maxFrag;
 		}
 	}
 
 /*
 	Now return the pointer that has skipped past the record header
 */
+	headLen = ssl->recordHeadLen;
+#ifdef USE_DTLS
+	if (ssl->flags & SSL_FLAGS_WRITE_SECURE) {
+		headLen += ssl->cidOutLen;
+	}
+#endif
 #ifdef USE_TLS_1_1
 /*
 	If a block cipher is being used TLS 1.1 requires the use
@@ -602,13 +685,12 @@ int32 matrixSslGetWritebuf(ssl_t *ssl, unsigned char **buf, uint32 requestedLen)
 */
 	if ((ssl->flags & SSL_FLAGS_WRITE_SECURE) &&
 			(ssl->flags & SSL_FLAGS_TLS_1_1) &&	(ssl->enBlockSize > 1)) {
-		*buf = ssl->outbuf + ssl->outlen + ssl->recordHeadLen + ssl->enBlockSize;
+		*buf = ssl->outbuf + ssl->outlen + headLen + ssl->enBlockSize;
 		return requestedLen; /* may not be what was passed in */
 	}
 	/* GCM mode will need to save room for the nonce */
 	if (ssl->flags & SSL_FLAGS_AEAD_W) {
-		*buf = ssl->outbuf + ssl->outlen + ssl->recordHeadLen +
-			AEAD_NONCE_LEN(ssl);
+		*buf = ssl->outbuf + ssl->outlen + headLen + AEAD_NONCE_LEN(ssl);
 		return requestedLen; /* may not be what was passed in */
 	}
 #endif /* USE_TLS_1_1 */
@@ -623,10 +705,10 @@ int32 matrixSslGetWritebuf(ssl_t *ssl, unsigned char **buf, uint32 requestedLen)
 		*buf = ssl->outbuf + ssl->outlen + (2 * ssl->recordHeadLen) + overhead +
 			(ssl->enBlockSize * ((ssl->enMacSize + 1)/ssl->enBlockSize)) - 1;
 	} else {
-		*buf = ssl->outbuf + ssl->outlen + ssl->recordHeadLen;
+		*buf = ssl->outbuf + ssl->outlen + headLen;
 	}
 #else
-	*buf = ssl->outbuf + ssl->outlen + ssl->recordHeadLen;
+	*buf = ssl->outbuf + ssl->outlen + headLen;
 #endif
 	return requestedLen; /* may not be what was passed in */
 }
@@ -682,6 +764,11 @@ int32 matrixSslEncodeWritebuf(ssl_t *ssl, uint32 len)
 	}
 
 	reserved = ssl->recordHeadLen;
+#ifdef USE_DTLS
+	if (ssl->flags & SSL_FLAGS_WRITE_SECURE) {
+		reserved += ssl->cidOutLen;
+	}
+#endif
 #ifdef USE_BEAST_WORKAROUND
 	if (ssl->bFlags & BFLAG_STOP_BEAST) {
 		rc = ((ssl->enMacSize + 1) % ssl->enBlockSize) ? ssl->enBlockSize : 0;
@@ -714,6 +801,9 @@ int32 matrixSslEncodeWritebuf(ssl_t *ssl, uint32 len)
 	}
 #ifdef USE_MATRIXSSL_STATS
 	matrixsslUpdateStat(ssl, APP_DATA_SENT_STAT, len);
+#endif
+#ifdef USE_DYNAMIC_RECORD_SIZING
+	drsSentData(ssl, len);
 #endif
 	ssl->outlen += len;
 	return ssl->outlen;
@@ -747,7 +837,7 @@ int32 matrixSslEncodeToOutdata(ssl_t *ssl, unsigned char *ptBuf, uint32 len)
 #ifdef USE_DTLS
 	if (ssl->flags & SSL_FLAGS_DTLS) {
 		rc = matrixSslGetEncodedSize(ssl, len);
-		if (rc > matrixDtlsGetPmtu()) {
+		if (rc > ssl->pmtu) {
 			return PS_LIMIT_FAIL;
 		}
 	}
@@ -781,6 +871,9 @@ int32 matrixSslEncodeToOutdata(ssl_t *ssl, unsigned char *ptBuf, uint32 len)
 		len -= recLen;
 #ifdef USE_MATRIXSSL_STATS
 		matrixsslUpdateStat(ssl, APP_DATA_SENT_STAT, fragLen);
+#endif
+#ifdef USE_DYNAMIC_RECORD_SIZING
+		drsSentData(ssl, fragLen);
 #endif
 		ssl->outlen += fragLen;
 	}
@@ -809,12 +902,21 @@ static void revertToDefaultBufsize(ssl_t *ssl, uint16 inOrOut)
 #else
 		defaultSize = SSL_DEFAULT_IN_BUF_SIZE;
 #endif
+		/* The peer will not send protected records larger than this.
+			Datagrams still need the full PMTU. */
+		if (ssl->extFlags.record_size_limit &&
+				(ssl->bFlags & BFLAG_HS_COMPLETE) &&
+				!(ssl->flags & SSL_FLAGS_DTLS)) {
+			defaultSize = min(defaultSize, ssl->recordHeadLen +
+				ssl->recLimit + SSL_MAX_RECORD_EXPANSION);
+		}
 		if (ssl->insize > defaultSize && ssl->inlen < defaultSize) {
 			/* It's not fatal if we can't realloc it smaller */
 			if ((p = psRealloc(ssl->inbuf, defaultSize, ssl->bufferPool))
 					!= NULL) {
 				ssl->inbuf = p;
 				ssl->insize	 = defaultSize;
+				SSL_STAT_ADD(ssl, inbufShrink, 1);
 			}
 		}
 	} else {
@@ -827,17 +929,81 @@ static void revertToDefaultBufsize(ssl_t *ssl, uint16 inOrOut)
 #else
 		defaultSize = SSL_DEFAULT_OUT_BUF_SIZE;
 #endif
+		/* We will not send records larger than the peer asked for */
+		if (ssl->extFlags.record_size_limit &&
+				(ssl->bFlags & BFLAG_HS_COMPLETE) &&
+				!(ssl->flags & SSL_FLAGS_DTLS)) {
+			defaultSize = min(defaultSize, ssl->recordHeadLen +
+				ssl->maxPtFrag + SSL_MAX_RECORD_EXPANSION);
+		}
 		if (ssl->outsize > defaultSize && ssl->outlen < defaultSize) {
 			/* It's not fatal if we can't realloc it smaller */
 			if ((p = psRealloc(ssl->outbuf, defaultSize, ssl->bufferPool))
 					!= NULL) {
 				ssl->outbuf = p;
 				ssl->outsize = defaultSize;
+				SSL_STAT_ADD(ssl, outbufShrink, 1);
 			}
 		}
 	}
 }
 
+/******************************************************************************/
+/*
+	Called once matrixSslHandshakeIsComplete() first reports success
+*/
+static void setHandshakeComplete(ssl_t *ssl)
+{
+	ssl->bFlags |= BFLAG_HS_COMPLETE;
+#ifdef USE_CLIENT_SIDE_SSL
+	matrixSslGetSessionId(ssl, ssl->sid);
+#endif /* USE_CLIENT_SIDE_SSL */
+#ifdef USE_MATRIXSSL_STATS
+	ssl->stats.hsNsec = matrixsslStatNsecs(ssl, ssl->statHsStart);
+#endif
+}
+
+/******************************************************************************/
+/*
+	Length of the record consumed by the last SSL_PROCESS_DATA decode
+*/
+static uint32 decodedRecordLen(ssl_t *ssl)
+{
+	uint32	ctlen;
+
+	ctlen = ssl->rec.len + ssl->recordHeadLen;
+#ifdef USE_DTLS
+	ctlen += ssl->rec.cidLen;
+#endif
+	if (ssl->flags & SSL_FLAGS_AEAD_R) {
+		/* This overhead was removed from rec.len after the decryption
+			to keep buffer logic working. */
+		ctlen += AEAD_TAG_LEN(ssl) + AEAD_NONCE_LEN(ssl);
+	}
+	return ctlen;
+}
+
+/*
+	Move any data remaining after the decoded records to the beginning of
+	inbuf and shrink it to default size once inlen < default size
+*/
+static void packInbuf(ssl_t *ssl)
+{
+	uint32	ctlen;
+
+	if (ssl->inlen > 0) {
+		if (ssl->inDecoded > 0) {
+			ctlen = ssl->inDecoded;
+		} else {
+			ctlen = decodedRecordLen(ssl);
+		}
+		memmove(ssl->inbuf, ssl->inbuf + ctlen, ssl->inlen);
+		SSL_STAT_ADD(ssl, memmoveBytes, ssl->inlen);
+	}
+	ssl->inDecoded = 0;
+	revertToDefaultBufsize(ssl, SSL_INBUF);
+}
+
 /******************************************************************************/
 /*
 	Caller has received data from the network and is notifying the SSL layer
@@ -901,6 +1067,7 @@ DECODE_MORE:
 			outgoing data that needs to be written
 */
 			memmove(ssl->inbuf, buf, ssl->inlen);
+			SSL_STAT_ADD(ssl, memmoveBytes, ssl->inlen);
 			buf = ssl->inbuf;
 			goto DECODE_MORE;	/* More data in buffer to process */
 		}
@@ -911,10 +1078,7 @@ DECODE_MORE:
 */
 		if (!(ssl->bFlags & BFLAG_HS_COMPLETE)) {
 			if (matrixSslHandshakeIsComplete(ssl)) {
-				ssl->bFlags |= BFLAG_HS_COMPLETE;
-#ifdef USE_CLIENT_SIDE_SSL
-				matrixSslGetSessionId(ssl, ssl->sid);
-#endif /* USE_CLIENT_SIDE_SSL */
+				setHandshakeComplete(ssl);
 				rc = MATRIXSSL_HANDSHAKE_COMPLETE;
 			} else {
 				rc = MATRIXSSL_REQUEST_RECV; /* Need to recv more handshake data */
@@ -939,6 +1103,7 @@ DECODE_MORE:
 			outgoing data that needs to be written
 */
 			memmove(ssl->inbuf, buf, ssl->inlen);
+			SSL_STAT_ADD(ssl, memmoveBytes, ssl->inlen);
 			buf = ssl->inbuf;
 			goto DECODE_MORE;	/* More data in buffer to process */
 		}
@@ -967,6 +1132,7 @@ DECODE_MORE:
 			psAssert((uint32)ssl->inlen == start);
 			psAssert(buf > ssl->inbuf);
 			memmove(ssl->inbuf, buf, ssl->inlen);	/* Pack ssl->inbuf */
+			SSL_STAT_ADD(ssl, memmoveBytes, ssl->inlen);
 			buf = ssl->inbuf;
 			return MATRIXSSL_REQUEST_SEND;
 		}
@@ -1000,6 +1166,7 @@ DECODE_MORE:
 				}
 				ssl->outbuf = p;
 				ssl->outsize = ssl->outlen + len;
+				SSL_STAT_ADD(ssl, outbufGrow, 1);
 			}
 			memcpy(ssl->outbuf + ssl->outlen, ssl->inbuf, len);
 			ssl->outlen += len;
@@ -1054,6 +1221,7 @@ DECODE_MORE:
 			}
 			ssl->inbuf = p;
 			ssl->insize = reqLen;
+			SSL_STAT_ADD(ssl, inbufGrow, 1);
 			buf = ssl->inbuf;
 			/* Don't need to change inlen */
 		}
@@ -1087,6 +1255,7 @@ DECODE_MORE:
 			}
 			ssl->inbuf = p;
 			ssl->insize = reqLen;
+			SSL_STAT_ADD(ssl, inbufGrow, 1);
 			buf = ssl->inbuf + len;
 			/* Note we leave inlen untouched here */
 		} else {
@@ -1104,10 +1273,7 @@ DECODE_MORE:
  */
 		if (!(ssl->bFlags & BFLAG_HS_COMPLETE) &&
 			matrixSslHandshakeIsComplete(ssl)) {
-			ssl->bFlags |= BFLAG_HS_COMPLETE;
-#ifdef USE_CLIENT_SIDE_SSL
-			matrixSslGetSessionId(ssl, ssl->sid);
-#endif /* USE_CLIENT_SIDE_SSL */
+			setHandshakeComplete(ssl);
 		}
 /*
 		 .	prevbuf points to start of unencrypted data
@@ -1185,8 +1351,6 @@ DECODE_MORE:
  */
 int32 matrixSslProcessedData(ssl_t *ssl, unsigned char **ptbuf, uint32 *ptlen)
 {
-	uint32	ctlen;
-
 	if (!ssl || !ptbuf || !ptlen) {
 		return PS_ARG_FAIL;
 	}
@@ -1194,18 +1358,7 @@ int32 matrixSslProcessedData(ssl_t *ssl, unsigned char **ptbuf, uint32 *ptlen)
 	*ptlen = 0;
 
 	psAssert(ssl->insize > 0 && ssl->inbuf != NULL);
-	/* Move any remaining data to the beginning of the buffer */
-	if (ssl->inlen > 0) {
-		ctlen = ssl->rec.len + ssl->recordHeadLen;
-		if (ssl->flags & SSL_FLAGS_AEAD_R) {
-			/* This overhead was removed from rec.len after the decryption
-				to keep buffer logic working. */
-			ctlen += AEAD_TAG_LEN(ssl) + AEAD_NONCE_LEN(ssl);
-		}
-		memmove(ssl->inbuf, ssl->inbuf + ctlen, ssl->inlen);
-	}
-	/* Shrink inbuf to default size once inlen < default size */
-	revertToDefaultBufsize(ssl, SSL_INBUF);
+	packInbuf(ssl);
 
 	/* If there's more data, try to decode it here and return that code */
 	if (ssl->inlen > 0) {
@@ -1215,6 +1368,139 @@ int32 matrixSslProcessedData(ssl_t *ssl, unsigned char **ptbuf, uint32 *ptlen)
 	return MATRIXSSL_SUCCESS;
 }
 
+/******************************************************************************/
+/*
+	Same as matrixSslReceivedData(), but once a record of application data
+	has been decoded, every following complete application data record
+	already in inbuf is decrypted in place as well. A read carrying several
+	records is then handled with a single call and a single pack of inbuf
+	in matrixSslProcessedDataMulti().
+
+	Up to ptMax plaintext spans are returned in pt, and ptCount is set to
+	the number used. A MATRIXSSL_RECEIVED_ALERT is returned in pt[0].
+	Spans are valid until matrixSslProcessedDataMulti() is called.
+
+	Records are still decrypted one after another. The cipher layer works
+	on a single record at a time, so the gain is in skipping the per record
+	return to the caller and the memmove of the remaining data.
+ */
+int32 matrixSslReceivedDataMulti(ssl_t *ssl, uint32 bytes, sslPtSpan_t *pt,
+							uint16 ptMax, uint16 *ptCount)
+{
+	unsigned char	*buf, *prevBuf, *p;
+	int32			rc, decodeRet, decodeErr;
+	uint32			len, start, reqLen, recLen;
+	unsigned char	alertLevel, alertDesc;
+
+	if (!ssl || !pt || ptMax == 0 || !ptCount) {
+		return PS_ARG_FAIL;
+	}
+	*ptCount = 0;
+	rc = matrixSslReceivedData(ssl, bytes, &pt[0].buf, &pt[0].len);
+	if (pt[0].buf != NULL) {
+		*ptCount = 1;
+	}
+	if (rc != MATRIXSSL_APP_DATA) {
+		return rc;
+	}
+#ifdef USE_DTLS
+	/* Datagrams carry their own records and may be reordered */
+	if (ssl->flags & SSL_FLAGS_DTLS) {
+		return rc;
+	}
+#endif
+	ssl->inDecoded = decodedRecordLen(ssl);
+	buf = ssl->inbuf + ssl->inDecoded;
+	while (*ptCount < ptMax && ssl->inlen >= ssl->recordHeadLen &&
+			*buf == SSL_RECORD_TYPE_APPLICATION_DATA) {
+		/* Leave partial records for the next read */
+		recLen = buf[ssl->recordHeadLen - 2] << 8;
+		recLen += buf[ssl->recordHeadLen - 1];
+		if ((uint32)ssl->inlen < ssl->recordHeadLen + recLen) {
+			break;
+		}
+		len = ssl->inlen;
+		prevBuf = buf;
+		decodeRet = matrixSslDecode(ssl, &buf, &len,
+						ssl->insize - ssl->inDecoded, &start, &reqLen,
+						&decodeErr, &alertLevel, &alertDesc);
+
+		if (decodeRet == SSL_PROCESS_DATA) {
+			ssl->inlen -= buf - prevBuf;
+			ssl->inDecoded += buf - prevBuf;
+			psAssert((uint32)ssl->inlen == start);
+#ifdef USE_TLS_1_1
+			if ((ssl->flags & SSL_FLAGS_READ_SECURE) &&
+					(ssl->flags & SSL_FLAGS_TLS_1_1) &&
+					(ssl->deBlockSize > 1)) {
+				len -= ssl->deBlockSize;
+				prevBuf += ssl->deBlockSize;
+			}
+#endif /* USE_TLS_1_1 */
+			pt[*ptCount].buf = prevBuf;
+			pt[*ptCount].len = len;
+			(*ptCount)++;
+			continue;
+		}
+		if (decodeRet == SSL_SEND_RESPONSE) {
+/*
+			The record failed to decode and the alert was encoded in its
+			place. Records already returned are good, so queue the alert
+			for matrixSslProcessedDataMulti() and drop the rest of the data.
+*/
+			psAssert(prevBuf == buf);
+			if (ssl->outlen + (int32)len > ssl->outsize) {
+				if ((p = psRealloc(ssl->outbuf, ssl->outlen + len,
+						ssl->bufferPool)) == NULL) {
+					return PS_MEM_FAIL;
+				}
+				ssl->outbuf = p;
+				ssl->outsize = ssl->outlen + len;
+				SSL_STAT_ADD(ssl, outbufGrow, 1);
+			}
+			memcpy(ssl->outbuf + ssl->outlen, buf, len);
+			ssl->outlen += len;
+			ssl->inlen = 0;
+			if (alertDesc != SSL_ALERT_NONE) {
+				ssl->bFlags |= BFLAG_CLOSE_AFTER_SENT;
+			}
+			ssl->bFlags |= BFLAG_PENDING_ALERT;
+			break;
+		}
+		if (decodeRet == MATRIXSSL_ERROR) {
+			return decodeErr;
+		}
+		return PS_PROTOCOL_FAIL;
+	}
+	return rc;
+}
+
+/******************************************************************************/
+/*
+	Plaintext spans from matrixSslReceivedDataMulti() have been processed.
+	Return codes are as for matrixSslProcessedData(), with the pt, ptMax and
+	ptCount parameters as for matrixSslReceivedDataMulti().
+ */
+int32 matrixSslProcessedDataMulti(ssl_t *ssl, sslPtSpan_t *pt, uint16 ptMax,
+							uint16 *ptCount)
+{
+	if (!ssl || !pt || ptMax == 0 || !ptCount) {
+		return PS_ARG_FAIL;
+	}
+	*ptCount = 0;
+
+	psAssert(ssl->insize > 0 && ssl->inbuf != NULL);
+	packInbuf(ssl);
+
+	if (ssl->bFlags & BFLAG_PENDING_ALERT) {
+		ssl->bFlags &= ~BFLAG_PENDING_ALERT;
+		return MATRIXSSL_REQUEST_SEND;
+	}
+	if (ssl->inlen > 0) {
+		return matrixSslReceivedDataMulti(ssl, 0, pt, ptMax, ptCount);
+	}
+	return MATRIXSSL_SUCCESS;
+}
 
 /******************************************************************************/
 /*
@@ -1249,6 +1535,7 @@ L_CLOSUREALERT:
 			}
 			ssl->outbuf = p;
 			ssl->outsize = newLen;
+			SSL_STAT_ADD(ssl, outbufGrow, 1);
 			goto L_CLOSUREALERT; /* Try one more time */
 		} else if (rc != PS_SUCCESS) {
 			return rc;
@@ -1307,6 +1594,13 @@ int32_t matrixSslEncodeRehandshake(ssl_t *ssl, sslKeys_t *keys,
 		return PS_UNSUPPORTED_FAIL;
 	}
 #endif
+#ifdef USE_DTLS
+	/* Nor are they for sessions with a connection ID. See parseHandshake */
+	if ((ssl->flags & SSL_FLAGS_DTLS) && ssl->extFlags.connection_id) {
+		psTraceInfo("Re-handshakes not supported with a connection id\n");
+		return PS_UNSUPPORTED_FAIL;
+	}
+#endif
 /*
 	The only explicit option that can be passsed in is
 	SSL_OPTION_FULL_HANDSHAKE to indicate no resumption is allowed
@@ -1386,6 +1680,7 @@ L_REHANDSHAKE:
 					}
 					ssl->outbuf = p;
 					ssl->outsize = newLen;
+					SSL_STAT_ADD(ssl, outbufGrow, 1);
 					goto L_REHANDSHAKE;
 				}
 			}
@@ -1417,6 +1712,7 @@ L_REHANDSHAKE:
 					}
 					ssl->outbuf = p;
 					ssl->outsize = newLen;
+					SSL_STAT_ADD(ssl, outbufGrow, 1);
 					goto L_REHANDSHAKE;
 				}
 			}
@@ -1515,6 +1811,7 @@ int32 matrixSslSentData(ssl_t *ssl, uint32 bytes)
 	rc = MATRIXSSL_SUCCESS;
 	if (ssl->outlen > 0) {
 		memmove(ssl->outbuf, ssl->outbuf + bytes, ssl->outlen);
+		SSL_STAT_ADD(ssl, memmoveBytes, ssl->outlen);
 		/* This was changed during 3.7.1 DTLS work.  The line below used to be:
 			rc = MATRIXSSL_REQUEST_SEND; and it was possible for it to be
 			overridden with HANDSHAKE_COMPLETE below.  This was a problem
@@ -1551,10 +1848,7 @@ int32 matrixSslSentData(ssl_t *ssl, uint32 bytes)
 		is being/has been just sent. Occurs in session resumption. */
 	if (!(ssl->bFlags & BFLAG_HS_COMPLETE) &&
 			matrixSslHandshakeIsComplete(ssl)) {
-		ssl->bFlags |= BFLAG_HS_COMPLETE;
-#ifdef USE_CLIENT_SIDE_SSL
-		matrixSslGetSessionId(ssl, ssl->sid);
-#endif /* USE_CLIENT_SIDE_SSL */
+		setHandshakeComplete(ssl);
 		rc = MATRIXSSL_HANDSHAKE_COMPLETE;
 #ifdef USE_SSL_INFORMATIONAL_TRACE
 		/* Client side resumed completion or server standard completion */
@@ -116,6 +116,9 @@ PSPUBLIC int32_t matrixSslLoadOCSPResponse(sslKeys_t *keys,
 						const unsigned char *OCSPResponseBuf,
 						uint16_t OCSPResponseBufLen);
 #endif
+#ifdef USE_CERT_CHAIN_CACHE
+PSPUBLIC void	matrixSslFlushChainCache(void);
+#endif
 
 /******************************************************************************/
 /*
@@ -137,6 +140,10 @@ PSPUBLIC int32	matrixSslReceivedData(ssl_t *ssl, uint32 bytes,
 					unsigned char **ptbuf, uint32 *ptlen);
 PSPUBLIC int32	matrixSslProcessedData(ssl_t *ssl,
 					unsigned char **ptbuf, uint32 *ptlen);
+PSPUBLIC int32	matrixSslReceivedDataMulti(ssl_t *ssl, uint32 bytes,
+					sslPtSpan_t *pt, uint16 ptMax, uint16 *ptCount);
+PSPUBLIC int32	matrixSslProcessedDataMulti(ssl_t *ssl,
+					sslPtSpan_t *pt, uint16 ptMax, uint16 *ptCount);
 PSPUBLIC int32	matrixSslEncodeClosureAlert(ssl_t *ssl);
 PSPUBLIC void	matrixSslDeleteSession(ssl_t *ssl);
 
@@ -195,6 +202,8 @@ PSPUBLIC int32_t matrixSslNewServer(ssl_t **ssl,
 				sslSessOpts_t *options);
 PSPUBLIC int32 matrixSslSetCipherSuiteEnabledStatus(ssl_t *ssl, uint16 cipherId,
 				uint32 status);
+PSPUBLIC int32_t matrixSslPeekClientHello(const unsigned char *buf,
+				uint32_t len, sslClientHelloInfo_t *hello);
 PSPUBLIC void matrixSslRegisterSNICallback(ssl_t *ssl,
 				void (*sni_cb)(void *ssl, char *hostname, int32 hostnameLen,
 				sslKeys_t **newKeys));
@@ -227,6 +236,20 @@ PSPUBLIC int32	matrixDtlsSentData(ssl_t *ssl, uint32 bytes);
 PSPUBLIC int32	matrixDtlsGetOutdata(ssl_t *ssl, unsigned char **buf);
 PSPUBLIC int32	matrixDtlsSetPmtu(int32 pmtu);
 PSPUBLIC int32	matrixDtlsGetPmtu(void);
+PSPUBLIC int32	matrixDtlsSetSessionPmtu(ssl_t *ssl, int32 pmtu);
+PSPUBLIC int32	matrixDtlsGetSessionPmtu(ssl_t *ssl);
+PSPUBLIC int32	matrixDtlsGetTimeout(ssl_t *ssl, psTime_t *now);
+PSPUBLIC int32	matrixDtlsHandleTimeout(ssl_t *ssl, psTime_t *now);
+PSPUBLIC int32	matrixDtlsSwapReadbuf(ssl_t *ssl, unsigned char **buf,
+					uint32 *bufSize);
+#ifdef USE_SERVER_SIDE_SSL
+PSPUBLIC int32	matrixDtlsCheckCookie(const unsigned char *in, uint32 inLen,
+					const unsigned char *peerId, uint16 peerIdLen,
+					unsigned char *out, uint32 *outLen);
+PSPUBLIC int32	matrixDtlsRotateCookieKey(void);
+PSPUBLIC int32	matrixDtlsGetConnectionId(const unsigned char *in,
+					uint32 inLen, uint16 cidLen, const unsigned char **cid);
+#endif
 #endif /* USE_DTLS */
 /******************************************************************************/
 
@@ -287,10 +310,26 @@ enum {
 PSPUBLIC void matrixSslRegisterStatCallback(ssl_t *ssl,
 	void (*stat_cb)(void *ssl, void *stat_ptr, int32 type, int32 value),
 	void *stats);
+PSPUBLIC int32 matrixSslGetStats(const ssl_t *ssl, sslStats_t *stats);
+PSPUBLIC void matrixSslResetStats(ssl_t *ssl);
 
 #endif
 /******************************************************************************/
 
+#ifdef USE_MEMORY_ACCOUNTING
+/******************************************************************************/
+/*
+	Memory accounting (see USE_MEMORY_ACCOUNTING in coreConfig.h)
+	Global and per call site counters are available from psMemGetStats(NULL)
+	and psMemWalkSites(), the CRL cache from psCRL_GetMemStats().
+*/
+PSPUBLIC int32_t matrixSslGetMemStats(const ssl_t *ssl, psMemStats_t *stats);
+PSPUBLIC void matrixSslResetMemPeak(ssl_t *ssl);
+PSPUBLIC int32_t matrixSslGetKeysMemStats(const sslKeys_t *keys,
+				psMemStats_t *stats);
+#endif /* USE_MEMORY_ACCOUNTING */
+/******************************************************************************/
+
 #ifdef __cplusplus
 }
 #endif
@@ -1122,6 +1122,14 @@ typedef int32 psX509Cert_t;
 #endif /* USE_CERT_PARSE && USE_ONLY_PSK_CIPHER_SUITE */
 #endif /* USE_CLIENT_AUTH || USE_CLIENT_SIDE_SSL */
 
+#ifdef USE_CERT_CHAIN_CACHE
+#ifndef USE_CERT_VALIDATE
+#undef USE_CERT_CHAIN_CACHE /* No peer chains to validate */
+#elif !defined(USE_SHA256)
+#error "Must enable USE_SHA256 for USE_CERT_CHAIN_CACHE"
+#endif
+#endif /* USE_CERT_CHAIN_CACHE */
+
 #ifdef USE_TRUSTED_CA_INDICATION
  #ifndef ENABLE_CA_CERT_HASH
   #error "Define ENABLE_CA_CERT_HASH in cryptoConfig.h for Trusted CA Indication"
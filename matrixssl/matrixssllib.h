@@ -225,6 +225,26 @@ extern "C" {
 /******************************************************************************/
  /** DTLS definitions */
  #define DTLS_COOKIE_SIZE	16
+ #define DTLS_MAX_PEER_ID_LEN	32 /* Transport identity bound into cookies */
+ #ifndef DTLS_PMTU_BACKOFF_RESENDS
+  #define DTLS_PMTU_BACKOFF_RESENDS	2 /* Shrink session PMTU after this
+										many resends of a flight, 0 never */
+ #endif
+ #ifndef DTLS_RETRANSMIT_MIN_MS
+  #define DTLS_RETRANSMIT_MIN_MS	1000 /* Initial retransmit timer */
+ #endif
+ #ifndef DTLS_RETRANSMIT_MAX_MS
+  #define DTLS_RETRANSMIT_MAX_MS	60000 /* Back-off limit, then give up */
+ #endif
+ #ifndef DTLS_REPLAY_WINDOW
+  #define DTLS_REPLAY_WINDOW	1024
+ #endif
+ #if DTLS_REPLAY_WINDOW < 64 || (DTLS_REPLAY_WINDOW & (DTLS_REPLAY_WINDOW - 1))
+  #error "DTLS_REPLAY_WINDOW must be a power of two, 64 or more"
+ #endif
+ #ifndef DTLS_MAX_CID_LEN
+  #define DTLS_MAX_CID_LEN	16 /* RFC 9146 allows 255 */
+ #endif
 #endif /* USE_DTLS */
 
 /******************************************************************************/
@@ -245,6 +265,13 @@ extern "C" {
 #define USE_NATIVE_TLS_HS_HASH
 #define USE_NATIVE_SYMMETRIC
 
+/* Running handshake transcript hashes, see sslSelectHSHash() */
+#define HS_HASH_MD5SHA1		0x01
+#define HS_HASH_SHA1		0x02
+#define HS_HASH_SHA256		0x04
+#define HS_HASH_SHA384		0x08
+#define HS_HASH_SHA512		0x10
+
 /******************************************************************************/
 /**
 	Do sanity checks on configuration.
@@ -274,7 +301,13 @@ extern "C" {
 #define     SSL_MAX_PLAINTEXT_LEN		0x4000  /* 16KB */
 #define     SSL_MAX_RECORD_LEN			SSL_MAX_PLAINTEXT_LEN + 2048
 #define     SSL_MAX_BUF_SIZE			SSL_MAX_RECORD_LEN + 0x5
+/* Most a protected record can grow past its plaintext (IV, MAC and pad) */
+#define		SSL_MAX_RECORD_EXPANSION	(SSL_MAX_IV_SIZE + SSL_MAX_MAC_SIZE + 256)
+/* Smallest record_size_limit allowed by RFC 8449 */
+#define		SSL_MIN_RECORD_SIZE_LIMIT	64
 #define		SSL_MAX_DISABLED_CIPHERS	8
+/* Words in a bitmap with one bit per supportedCiphers[] entry (256 max) */
+#define		SSL_SUITE_WORDS				8
 /*
 	Maximum buffer sizes for static SSL array types
 */
@@ -306,6 +339,10 @@ extern "C" {
 #define SSL3_HANDSHAKE_HEADER_LEN	4
 #ifdef USE_DTLS
  #define DTLS_HEADER_ADD_LEN		8
+/* RFC 9146 MAC input or AEAD additional data ahead of a CID record's
+	DTLSInnerPlaintext: seq_num_placeholder(8) tls12_cid(1) cid_length(1)
+	tls12_cid(1) version(2) epoch(2) sequence_number(6) cid length(2) */
+ #define DTLS_CID_AAD_LEN(CIDLEN)	(23 + (CIDLEN))
 #endif
 
 #define TLS_CHACHA20_POLY1305_AAD_LEN	13
@@ -426,6 +463,7 @@ extern "C" {
 #define BFLAG_CLOSE_AFTER_SENT	(1<<0)
 #define BFLAG_HS_COMPLETE		(1<<1)
 #define BFLAG_STOP_BEAST		(1<<2)
+#define BFLAG_PENDING_ALERT		(1<<3) /* Alert queued behind decoded records */
 
 /*
 	Number of bytes server must send before creating a re-handshake credit
@@ -469,6 +507,7 @@ enum PACKED {
 #define SSL_RECORD_TYPE_ALERT					(uint8_t)21
 #define SSL_RECORD_TYPE_HANDSHAKE				(uint8_t)22
 #define SSL_RECORD_TYPE_APPLICATION_DATA		(uint8_t)23
+#define SSL_RECORD_TYPE_TLS12_CID				(uint8_t)25 /* RFC 9146 */
 #define SSL_RECORD_TYPE_HANDSHAKE_FIRST_FRAG	(uint8_t)90 /* internal */
 #define SSL_RECORD_TYPE_HANDSHAKE_FRAG			(uint8_t)91 /* non-standard types */
 
@@ -660,7 +699,9 @@ static __inline uint16_t HASH_SIG_MASK(uint8_t hash, uint8_t sig)
 #define EXT_ALPN							16
 #define EXT_SIGNED_CERTIFICATE_TIMESTAMP	18
 #define EXT_EXTENDED_MASTER_SECRET			23
+#define EXT_RECORD_SIZE_LIMIT				28
 #define EXT_SESSION_TICKET					35
+#define EXT_CONNECTION_ID					54
 #define EXT_RENEGOTIATION_INFO				0xFF01
 
 /* How large the ALPN extension arrary is.  Number of protos client can talk */
@@ -753,6 +794,56 @@ struct ssl;
 
 typedef psBuf_t	sslBuf_t;
 
+/* Plaintext of one decoded record, see matrixSslReceivedDataMulti() */
+typedef struct {
+	unsigned char	*buf;
+	uint32			len;
+} sslPtSpan_t;
+
+#ifdef USE_MATRIXSSL_STATS
+/*
+	Per session counters, see matrixSslGetStats(). A session is only ever
+	used by one thread at a time, so they are updated without locking.
+	Times are in nanoseconds where the platform clock allows, otherwise they
+	have millisecond resolution.
+*/
+typedef struct {
+	uint64_t	recordsIn;		/* Records decoded */
+	uint64_t	recordsOut;		/* Records encoded */
+	uint64_t	bytesIn;		/* Encoded bytes decoded, incl. headers */
+	uint64_t	bytesOut;		/* Encoded bytes produced, incl. headers */
+	uint64_t	decryptNsec;	/* Record decryption and MAC verification */
+	uint64_t	encryptNsec;	/* Record MAC and encryption */
+	uint64_t	hsNsec;			/* Session creation to handshake complete */
+	uint64_t	hsParseNsec;	/* Parsing received handshake messages */
+	uint64_t	hsWriteNsec;	/* Encoding handshake flights */
+	uint64_t	pkaOps;			/* Key exchange and handshake signatures */
+	uint64_t	pkaNsec;		/* Time spent in those operations */
+	uint64_t	memmoveBytes;	/* Bytes moved when packing inbuf and outbuf */
+	uint32_t	inbufGrow;
+	uint32_t	inbufShrink;
+	uint32_t	outbufGrow;
+	uint32_t	outbufShrink;
+} sslStats_t;
+
+#define SSL_STAT_ADD(ssl, field, n)		((ssl)->stats.field += (n))
+/*
+	Bracket a single RSA, ECC or DH operation.  Certificate chain signature
+	checks happen inside psX509AuthenticateCert and are left in hsParseNsec.
+*/
+#define SSL_STAT_PKA_BEGIN(ssl) \
+	psGetTime(&(ssl)->statPkaStart, (ssl)->userPtr)
+#define SSL_STAT_PKA_END(ssl) \
+	do { \
+		(ssl)->stats.pkaOps++; \
+		(ssl)->stats.pkaNsec += matrixsslStatNsecs(ssl, (ssl)->statPkaStart); \
+	} while (0)
+#else
+#define SSL_STAT_ADD(ssl, field, n)
+#define SSL_STAT_PKA_BEGIN(ssl)
+#define SSL_STAT_PKA_END(ssl)
+#endif /* USE_MATRIXSSL_STATS */
+
 /******************************************************************************/
 
 #ifdef USE_PSK_CIPHER_SUITE
@@ -816,9 +907,17 @@ typedef struct {
 	//in the cert
 	psPubKey_t		privKey;
 	psX509Cert_t	*cert;
+	unsigned char	*certMsg;	/* Pre-encoded CERTIFICATE message body */
+	uint32_t		certMsgLen;
 #endif /* USE_SERVER_SIDE_SSL || USE_CLIENT_AUTH */
 #if defined(USE_CLIENT_SIDE_SSL) || defined(USE_CLIENT_AUTH)
 	psX509Cert_t	*CAcerts;
+#ifdef USE_CERT_VALIDATE
+	psX509CertIndex_t	CAindex;	/* Issuer lookup over CAcerts */
+#endif
+#ifdef USE_CERT_CHAIN_CACHE
+	uint32_t		CAgeneration;	/* Identifies CAcerts to the chain cache */
+#endif
 #endif /* USE_CLIENT_SIDE_SSL || USE_CLIENT_AUTH */
 #ifdef REQUIRE_DH_PARAMS
 	psDhParams_t	dhParams;
@@ -826,13 +925,21 @@ typedef struct {
 #ifdef USE_PSK_CIPHER_SUITE
 	psPsk_t			*pskKeys;
 #endif /* USE_PSK_CIPHER_SUITE */
+	/* What the loaded material can support, refreshed by every key loader.
+		The type masks have a bit per CS_ cipher type, suiteCaps a bit per
+		supportedCiphers[] entry usable by a server */
+	uint16_t		serverCipherTypes;
+	uint16_t		clientCipherTypes;
+	uint32_t		suiteCaps[SSL_SUITE_WORDS];
 #if defined(USE_SERVER_SIDE_SSL) && defined(USE_STATELESS_SESSION_TICKETS)
 	psSessionTicketKeys_t	*sessTickets;
 	sslSessTicketCb_t		ticket_cb;
 #endif
 #if defined(USE_OCSP) && defined(USE_SERVER_SIDE_SSL)
-	unsigned char	*OCSPResponseBuf;
+	unsigned char	*OCSPResponseBuf;	/* Points into OCSPStatusMsg */
 	uint16_t		OCSPResponseBufLen;
+	unsigned char	*OCSPStatusMsg;	/* Pre-encoded CERTIFICATE_STATUS body */
+	uint32_t		OCSPStatusMsgLen;
 #endif
 	void			*poolUserPtr; /* Data that will be given to psOpenPool
 									for any operations involving these keys */
@@ -861,8 +968,55 @@ typedef struct {
 	void		*memAllocPtr; /* Will be passed to psOpenPool for each call
 								related to this session */
 	psPool_t	*bufferPool; /* Optional mem pool for inbuf and outbuf */
+	short		recordSizeLimit; /* Largest record plaintext we will receive,
+									64 to 16384. Server: -1 to disable */
+	short		serverCipherPref; /* Server: 1 to choose the cipher suite by
+									our preference rather than the client's */
+	short		lazyCertExtensions; /* 1 to leave the rarely used extensions
+									of peer certs undecoded.  The cert
+									callback must call
+									psX509DecodeExtensions before reading
+									them */
+#ifdef USE_DTLS
+	const unsigned char *dtlsPeerId; /* Server: client transport address
+									bound into cookies. See
+									matrixDtlsCheckCookie */
+	uint16_t	dtlsPeerIdLen; /* Up to DTLS_MAX_PEER_ID_LEN */
+	const unsigned char *dtlsCid; /* Connection ID the peer is to put on
+									records to us.  NULL for a random one */
+	short		dtlsCidLen; /* Negotiate RFC 9146 connection IDs: length
+									of dtlsCid, up to DTLS_MAX_CID_LEN, or
+									-1 to use only the peer's */
+#endif
+#ifdef USE_DYNAMIC_RECORD_SIZING
+	short		dynamicRecordSize; /* 1 to start with small records */
+	uint16_t	drsRecordLen; /* 0 for SSL_DRS_RECORD_LEN */
+	uint32_t	drsBoostBytes; /* 0 for SSL_DRS_BOOST_BYTES */
+	uint32_t	drsIdleMsec; /* 0 for SSL_DRS_IDLE_MSEC */
+#endif
 } sslSessOpts_t;
 
+/******************************************************************************/
+/* Filled in by matrixSslPeekClientHello.  Pointers refer into the caller's
+	buffer and are NULL if the item wasn't sent. */
+typedef struct {
+	uint8_t				majVer;	/* client_version */
+	uint8_t				minVer;
+	const unsigned char	*random; /* SSL_HS_RANDOM_SIZE bytes */
+	const unsigned char	*sessionId;
+	uint8_t				sessionIdLen;
+	const unsigned char	*cookie; /* DTLS only */
+	uint8_t				cookieLen;
+	const unsigned char	*cipherSuites; /* Two byte suite ids */
+	uint16_t			cipherSuitesLen; /* In bytes */
+	const unsigned char	*serverName; /* SNI host_name, not terminated */
+	uint16_t			serverNameLen;
+	const unsigned char	*alpn; /* ALPN names, each after a length byte */
+	uint16_t			alpnLen;
+	const unsigned char	*groups; /* Two byte supported_groups ids */
+	uint16_t			groupsLen; /* In bytes */
+} sslClientHelloInfo_t;
+
 typedef struct {
     unsigned short  keyType;
     unsigned short	hashAlg;
@@ -892,6 +1046,7 @@ typedef struct {
 #ifdef USE_DTLS
 	unsigned char	epoch[2];	/* incoming epoch number */
 	unsigned char	rsn[6];		/* incoming record sequence number */
+	uint8_t			cidLen;		/* Connection ID bytes in the header */
 #endif /* USE_DTLS */
 #ifdef USE_CERT_CHAIN_PARSING
 	unsigned short	hsBytesHashed;
@@ -923,6 +1078,10 @@ typedef struct {
 	unsigned char	readMAC[SSL_MAX_MAC_SIZE];
 	unsigned char	writeKey[SSL_MAX_SYM_KEY_SIZE];
 	unsigned char	readKey[SSL_MAX_SYM_KEY_SIZE];
+#ifdef USE_TLS
+	psHmac_t		writeHmac;	/* Record MAC keyed with writeMAC */
+	psHmac_t		readHmac;	/* Record MAC keyed with readMAC */
+#endif
 #endif
 	unsigned char	*wIVptr;
 	unsigned char	*rIVptr;
@@ -963,24 +1122,20 @@ typedef struct {
 #ifdef USE_TLS_1_2
 #ifdef USE_NATIVE_TLS_HS_HASH
 	psSha256_t			msgHashSha256;
-
-#ifdef USE_SHA1
-	psSha1_t			msgHashSha1;
-#endif
 #ifdef USE_SHA384
 	psSha384_t			msgHashSha384;
 #endif
-#ifdef USE_SHA512
-	psSha512_t			msgHashSha512;
-#endif
 #endif
 #endif /* USE_TLS_1_2 */
 
-#if defined(USE_SERVER_SIDE_SSL) && defined(USE_CLIENT_AUTH)
-	unsigned char		sha1Snapshot[SHA1_HASH_SIZE];
-	unsigned char		sha384Snapshot[SHA384_HASH_SIZE]; /* HW crypto uses
-															outside TLS 1.2 */
-	unsigned char		sha512Snapshot[SHA512_HASH_SIZE];
+#ifdef USE_NATIVE_TLS_HS_HASH
+	unsigned char		*hsMsgBuf;	/* Handshake messages not yet hashed */
+	uint32				hsMsgLen;
+	uint32				hsMsgSize;
+	uint32				hsMsgCvLen;	/* Messages covered by CertificateVerify */
+	uint8_t				hsMsgKeep;	/* Still buffering after selection */
+	uint8_t				hsHashMask;	/* HS_HASH_ running hashes, 0 if unknown */
+	uint8_t				hsHashErr;
 #endif
 
 #if defined(USE_PSK_CIPHER_SUITE) && defined(USE_CLIENT_SIDE_SSL)
@@ -1141,8 +1296,10 @@ struct ssl {
 	char			*expectedName;	/* Clients: The expected cert subject name
 											passed to NewClient Session 
 									   Servers: Holds SNI value */
+	int32			certParseFlags;	/* psX509ParseCert flags for peer certs */
 #ifdef USE_SERVER_SIDE_SSL
 	uint16			disabledCiphers[SSL_MAX_DISABLED_CIPHERS];
+	uint8_t			serverCipherPref; /* Choose suites in our order */
 	void			(*sni_cb)(void *ssl, char *hostname, int32 hostnameLen,
 						sslKeys_t **newKeys);
 #ifdef USE_ALPN
@@ -1165,13 +1322,23 @@ struct ssl {
 	int32			inlen;		/* Bytes unprocessed in inbuf */
 	int32			outlen;		/* Bytes unsent in outbuf */
 	int32			insize;		/* Total allocated size of inbuf */
+	int32			inDecoded;	/* Bytes of decoded records ahead of inlen */
 	int32			outsize;	/* Total allocated size of outbuf */
 	uint32			bFlags;		/* Buffer related flags */
 
 	int32			maxPtFrag;	/* 16K by default - SSL_MAX_PLAINTEXT_LEN */
+	uint16_t		recLimit;	/* record_size_limit we advertise, 0 if none */
+	uint16_t		peerRecLimit; /* record_size_limit the peer advertised */
 	unsigned char	*fragMessage; /* holds the constructed fragmented message */
 	uint32			fragIndex;	/* How much data has been written to msg */
 	uint32			fragTotal;	/* Total length of fragmented message */
+#ifdef USE_DYNAMIC_RECORD_SIZING
+	uint16_t		drsRecordLen;	/* Encoded small record size, 0 if off */
+	uint32_t		drsBoostBytes;	/* Bytes to send before full size records */
+	uint32_t		drsIdleMsec;	/* Idle time before small records again */
+	uint32_t		drsSent;		/* Bytes sent since start or last idle */
+	psTime_t		drsLastSend;	/* Time of last send with full records */
+#endif
 
 	/* Pointer to the negotiated cipher information */
 	const sslCipherSpec_t	*cipher;
@@ -1242,6 +1409,8 @@ struct ssl {
 #ifdef USE_DTLS
 #ifdef USE_SERVER_SIDE_SSL
 	unsigned char	srvCookie[DTLS_COOKIE_SIZE]; /* server can avoid allocs */
+	unsigned char	dtlsPeerId[DTLS_MAX_PEER_ID_LEN];
+	uint8_t			dtlsPeerIdLen;
 #endif
 #ifdef USE_CLIENT_SIDE_SSL
 	unsigned char	*cookie;	/* hello_verify_request cookie */
@@ -1260,17 +1429,32 @@ struct ssl {
 	unsigned char	largestEpoch[2]; /* FINISH resends need to incr epoch */
 	unsigned char	rsn[6];			/* Last Record Sequence Number sent */
 	unsigned char	largestRsn[6];	/* Needed for resends of CCS flight */
-	unsigned char	lastRsn[6];	/* Last RSN received (for replay detection) */
-	unsigned long	dtlsBitmap; /* Record replay helper */
+	uint64_t		replayTop;	/* Highest 48 bit RSN received */
+	uint64_t		replayBits[DTLS_REPLAY_WINDOW / 64]; /* Seen RSNs, ring
+									indexed by RSN mod DTLS_REPLAY_WINDOW */
 	int32			parsedCCS;	/* Set between CCS parse and FINISHED parse */
 	int32			msn;		/* Current Message Sequence Number to send */
 	int32			resendMsn;	/* Starting MSN to use for resends */
 	int32			lastMsn;	/* Last MSN successfully parsed from peer */
 	int32			pmtu;		/* path maximum trasmission unit */
+	unsigned char	cidIn[DTLS_MAX_CID_LEN]; /* Peer sends records to us
+									with this connection ID */
+	unsigned char	cidOut[DTLS_MAX_CID_LEN]; /* And we send with this one */
+	uint8_t			cidInLen;
+	uint8_t			cidOutLen;	/* Non-zero once negotiated */
+	uint16_t		flightResends; /* Resends of the current flight */
+	uint16_t		retransArmed; /* BOOL retransmit timer is running */
+	uint32			retransTimeout; /* Current timer in msecs, doubles */
+	psTime_t		retransStart; /* When the flight was last sent */
+	unsigned char	*flightCache; /* Plaintext records of the last flight */
+	int32			flightCacheLen;
+	int32			flightCacheSize;
+	int32			flightCacheMaxRec; /* Largest cached record */
 	int32			retransmit; /* Flag to know not to update handshake hash */
 	uint16			flightDone; /* BOOL to flag when entire hs flight sent */
 	uint16			appDataExch; /* BOOL to flag if in application data mode */
 	int32			fragMsn;	/* fragment MSN */
+	uint32			fragMsgLen;	/* Allocated length of fragMessage */
 	dtlsFragHdr_t	fragHeaders[MAX_FRAGMENTS]; /* header storage for hash */
 	int32 (*oencrypt)(void *ctx, unsigned char *in,
 					 unsigned char *out, uint32 len);
@@ -1318,12 +1502,15 @@ struct ssl {
 		uint32		req_renegotiation_info: 1;
 		uint32		req_fallback_scsv: 1;
 		uint32		req_status_request: 1;
+		uint32		req_record_size_limit: 1;
+		uint32		req_connection_id: 1;
 #endif
 #ifdef USE_SERVER_SIDE_SSL
 		/* Whether the server will deny the extension */
 		uint32		deny_truncated_hmac: 1;
 		uint32		deny_max_fragment_len: 1;
 		uint32		deny_session_ticket: 1;
+		uint32		deny_record_size_limit: 1;
 #endif
 		/* Set if the extension was negotiated successfully */
 		uint32		sni: 1;
@@ -1334,6 +1521,10 @@ struct ssl {
 		uint32		status_request: 1;	/* received EXT_STATUS_REQUEST */
 		uint32		status_request_v2: 1;	/* received EXT_STATUS_REQUEST_V2 */
 		uint32		require_extended_master_secret: 1; /* peer may require */
+		uint32		record_size_limit: 1;
+		uint32		offer_connection_id: 1; /* dtlsCidLen option was set */
+		uint32		connection_id: 1;
+		uint32		connection_id_ext: 1; /* in this ClientHello */
 #ifdef USE_EAP_FAST
 		uint32		eap_fast_master_secret: 1; /* Using eap_fast key derivation */
 #endif
@@ -1347,6 +1538,9 @@ struct ssl {
 #ifdef USE_MATRIXSSL_STATS
 	void (*statCb)(void *ssl, void *stats_ptr, int32 type, int32 value);
 	void *statsPtr;
+	sslStats_t		stats;
+	psTime_t		statHsStart;	/* Start of the current handshake */
+	psTime_t		statPkaStart;	/* Start of the current PKA operation */
 #endif
 	void *memAllocPtr; /* Will be passed to psOpenPool for each call
 							related to this session */
@@ -1409,10 +1603,17 @@ PSPUBLIC int32 matrixSslIsSessionCompressionOn(ssl_t *ssl);
 
 #ifndef USE_ONLY_PSK_CIPHER_SUITE
 extern int32 matrixValidateCerts(psPool_t *pool, psX509Cert_t *subjectCerts,
-				psX509Cert_t *issuerCerts, char *expectedName,
-				psX509Cert_t **foundIssuer, void *pkiData, void *userPoolPtr);
+				psX509Cert_t *issuerCerts, const psX509CertIndex_t *issuerIndex,
+				char *expectedName, psX509Cert_t **foundIssuer, void *pkiData,
+				void *userPoolPtr);
 extern int32 matrixUserCertValidator(ssl_t *ssl, int32 alert,
 				 psX509Cert_t *subjectCert, sslCertCb_t certCb);
+#ifdef USE_CERT_CHAIN_CACHE
+extern int32 matrixChainCacheFind(ssl_t *ssl,
+				unsigned char id[SHA256_HASH_SIZE]);
+extern void matrixChainCacheAdd(ssl_t *ssl,
+				const unsigned char id[SHA256_HASH_SIZE]);
+#endif /* USE_CERT_CHAIN_CACHE */
 #endif /* USE_ONLY_PSK_CIPHER_SUITE */
 
 
@@ -1482,6 +1683,9 @@ extern int32 sslActivateReadCipher(ssl_t *ssl);
 extern int32 sslActivateWriteCipher(ssl_t *ssl);
 extern int32_t sslUpdateHSHash(ssl_t *ssl, const unsigned char *in, uint16_t len);
 extern int32 sslInitHSHash(ssl_t *ssl);
+extern void sslSelectHSHash(ssl_t *ssl);
+extern void sslReleaseHSHash(ssl_t *ssl);
+extern void sslFreeHSHash(ssl_t *ssl);
 extern int32 sslSnapshotHSHash(ssl_t *ssl, unsigned char *out, int32 senderFlag);
 extern int32 sslWritePad(unsigned char *p, unsigned char padLen);
 extern int32 sslCreateKeys(ssl_t *ssl);
@@ -1509,15 +1713,21 @@ extern int32 matrixSessionTicketLen(void);
 #endif /* USE_SERVER_SIDE_SSL */
 
 #ifdef USE_DTLS
-extern int32 dtlsChkReplayWindow(ssl_t *ssl, unsigned char *seq64);
-extern int32 dtlsWriteCertificate(ssl_t *ssl, int32 certLen,
-								  int32 lsize, unsigned char *c);
+extern int32 dtlsChkReplayWindow(ssl_t *ssl, const unsigned char *seq64);
+extern void dtlsMarkReplayWindow(ssl_t *ssl, const unsigned char *seq64);
+extern void dtlsResetReplayWindow(ssl_t *ssl);
+extern int32 dtlsWriteCertificate(ssl_t *ssl, const unsigned char *msg,
+								  int32 msgLen, unsigned char *c);
 extern int32 dtlsWriteCertificateRequest(psPool_t *pool, ssl_t *ssl, int32 certLen,
 						   int32 certCount, int32 sigHashLen, unsigned char *c);
 extern int32 dtlsComputeCookie(ssl_t *ssl, unsigned char *helloBytes,
 							   int32 helloLen);
 extern void dtlsInitFrag(ssl_t *ssl);
-extern int32 dtlsSeenFrag(ssl_t *ssl, int32 fragOffset, int32 *hdrIndex);
+extern void dtlsCacheFlight(ssl_t *ssl, unsigned char *start,
+				unsigned char *end);
+extern void dtlsFreeFlightCache(ssl_t *ssl);
+extern int32 dtlsSeenFrag(ssl_t *ssl, int32 fragOffset, int32 fragLen,
+				int32 *hdrIndex);
 extern int32 dtlsHsHashFragMsg(ssl_t *ssl);
 extern int32 dtlsCompareEpoch(unsigned char *incoming, unsigned char *expected);
 extern void incrTwoByte(ssl_t *ssl, unsigned char *c, int sending);
@@ -1525,6 +1735,14 @@ extern void zeroTwoByte(unsigned char *c);
 extern void dtlsIncrRsn(ssl_t *ssl);
 extern void zeroSixByte(unsigned char *c);
 extern int32 dtlsGenCookieSecret(void);
+extern int32 dtlsCidAdditionalData(ssl_t *ssl, int32 mode, uint32 len,
+				unsigned char *out);
+extern int32 dtlsCidCapable(ssl_t *ssl);
+#ifdef USE_SERVER_SIDE_SSL
+extern int32 dtlsCheckCookie(const unsigned char *peerId, uint16_t peerIdLen,
+				const unsigned char *helloBytes, uint32_t helloLen,
+				const unsigned char cookie[DTLS_COOKIE_SIZE]);
+#endif
 extern int32 dtlsEncryptFragRecord(ssl_t *ssl, flightEncode_t *msg,
 				sslBuf_t *out, unsigned char **c);
 #endif /* USE_DTLS */
@@ -1540,6 +1758,8 @@ extern int32_t sslGetCipherSpecListLen(const ssl_t *ssl);
 extern int32_t sslGetCipherSpecList(ssl_t *ssl, unsigned char *c, int32 len,
 				int32 addScsv);
 extern int32_t haveKeyMaterial(const ssl_t *ssl, int32 cipherType, short reallyTest);
+extern void updateSuiteCaps(sslKeys_t *keys);
+extern void sslInitSuiteIndex(void);
 #ifdef USE_CLIENT_SIDE_SSL
 int32 csCheckCertAgainstCipherSuite(int32 sigAlg, int32 cipherType);
 #endif
@@ -1576,6 +1796,8 @@ extern int32 ssl3HMACMd5(unsigned char *key, unsigned char *seq,
 */
 extern int32 tlsDeriveKeys(ssl_t *ssl);
 extern int32 tlsExtendedDeriveKeys(ssl_t *ssl);
+extern int32 tlsInitRecordHmac(psHmac_t *ctx, const unsigned char *key,
+						uint16_t macSize);
 extern int32 tlsHMACSha1(ssl_t *ssl, int32 mode, unsigned char type,
 						unsigned char *data, uint32 len, unsigned char *mac);
 
@@ -1600,12 +1822,12 @@ extern int32 sslSha512RetrieveHSHash(ssl_t *ssl, unsigned char *out);
 #endif
 #endif
 #ifdef USE_CLIENT_SIDE_SSL
-extern void sslSha1SnapshotHSHash(ssl_t *ssl, unsigned char *out);
+extern int32 sslSha1SnapshotHSHash(ssl_t *ssl, unsigned char *out);
 #ifdef USE_SHA384
-extern void sslSha384SnapshotHSHash(ssl_t *ssl, unsigned char *out);
+extern int32 sslSha384SnapshotHSHash(ssl_t *ssl, unsigned char *out);
 #endif
 #ifdef USE_SHA512
-extern void sslSha512SnapshotHSHash(ssl_t *ssl, unsigned char *out);
+extern int32 sslSha512SnapshotHSHash(ssl_t *ssl, unsigned char *out);
 #endif
 #endif
 #endif /* USE_TLS_1_2 */
@@ -1720,6 +1942,7 @@ extern int32_t tprf(const unsigned char *key, uint16_t keyLen,
 
 #ifdef USE_MATRIXSSL_STATS
 extern void matrixsslUpdateStat(ssl_t *ssl, int32_t type, int32_t value);
+extern uint64_t matrixsslStatNsecs(ssl_t *ssl, psTime_t start);
 #else
 #ifdef __GNUC__
 static __inline
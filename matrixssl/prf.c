@@ -69,7 +69,7 @@ __inline static int32_t pMd5(const unsigned char *key, uint16_t keyLen,
 				const unsigned char *text, uint16_t textLen,
 				unsigned char *out, uint16_t outLen)
 {
-	psHmacMd5_t		ctx;
+	psHmacMd5_t		keyed, ctx;
 	unsigned char	a[MD5_HASH_SIZE];
 	unsigned char	mac[MD5_HASH_SIZE];
 	unsigned char	hmacKey[MD5_HASH_SIZE];
@@ -94,10 +94,12 @@ __inline static int32_t pMd5(const unsigned char *key, uint16_t keyLen,
 		key = (const unsigned char *)hmacKey;
 		keyLen = hmacKeyLen;
 	}
+	/* Key once, each iteration below starts from a copy */
+	if ((rc = psHmacMd5Init(&keyed, key, keyLen)) < 0) {
+		goto L_RETURN;
+	}
 	for (i = 0; i < keyIter; i++) {
-		if ((rc = psHmacMd5Init(&ctx, key, keyLen)) < 0) {
-			goto L_RETURN;
-		}
+		psHmacMd5Cpy(&ctx, &keyed);
 		psHmacMd5Update(&ctx, a, MD5_HASH_SIZE);
 		psHmacMd5Update(&ctx, text, textLen);
 		psHmacMd5Final(&ctx, mac);
@@ -105,10 +107,9 @@ __inline static int32_t pMd5(const unsigned char *key, uint16_t keyLen,
 			memcpy(out + (MD5_HASH_SIZE*i), mac, outLen - (MD5_HASH_SIZE*i));
 		} else {
 			memcpy(out + (MD5_HASH_SIZE * i), mac, MD5_HASH_SIZE);
-			if ((rc = psHmacMd5(key, keyLen, a, MD5_HASH_SIZE, a,
-					hmacKey, &hmacKeyLen)) < 0) {
-				goto L_RETURN;
-			}
+			psHmacMd5Cpy(&ctx, &keyed);
+			psHmacMd5Update(&ctx, a, MD5_HASH_SIZE);
+			psHmacMd5Final(&ctx, a);
 		}
 	}
 	rc = PS_SUCCESS;
@@ -116,6 +117,7 @@ L_RETURN:
 	memzero_s(a, MD5_HASH_SIZE);
 	memzero_s(mac, MD5_HASH_SIZE);
 	memzero_s(hmacKey, MD5_HASH_SIZE);
+	memzero_s(&keyed, sizeof(keyed));
 	if (rc < 0) {
 		memzero_s(out, outLen);	/* zero any partial result on error */
 	}
@@ -130,7 +132,7 @@ __inline static int32_t pSha1(const unsigned char *key, uint16_t keyLen,
 					const unsigned char *text, uint16_t textLen,
 					unsigned char *out, uint16_t outLen)
 {
-	psHmacSha1_t	ctx;
+	psHmacSha1_t	keyed, ctx;
 	unsigned char	a[SHA1_HASH_SIZE];
 	unsigned char	mac[SHA1_HASH_SIZE];
 	unsigned char	hmacKey[SHA1_HASH_SIZE];
@@ -155,10 +157,12 @@ __inline static int32_t pSha1(const unsigned char *key, uint16_t keyLen,
 		key = (const unsigned char *)hmacKey;
 		keyLen = hmacKeyLen;
 	}
+	/* Key once, each iteration below starts from a copy */
+	if ((rc = psHmacSha1Init(&keyed, key, keyLen)) < 0) {
+		goto L_RETURN;
+	}
 	for (i = 0; i < keyIter; i++) {
-		if ((rc = psHmacSha1Init(&ctx, key, keyLen)) < 0) {
-			goto L_RETURN;
-		}
+		psHmacSha1Cpy(&ctx, &keyed);
 		psHmacSha1Update(&ctx, a, SHA1_HASH_SIZE);
 		psHmacSha1Update(&ctx, text, textLen);
 		psHmacSha1Final(&ctx, mac);
@@ -167,10 +171,9 @@ __inline static int32_t pSha1(const unsigned char *key, uint16_t keyLen,
 				outLen - (SHA1_HASH_SIZE * i));
 		} else {
 			memcpy(out + (SHA1_HASH_SIZE * i), mac, SHA1_HASH_SIZE);
-			if ((rc = psHmacSha1(key, keyLen, a, SHA1_HASH_SIZE, a,
-					hmacKey, &hmacKeyLen)) < 0) {
-				goto L_RETURN;
-			}
+			psHmacSha1Cpy(&ctx, &keyed);
+			psHmacSha1Update(&ctx, a, SHA1_HASH_SIZE);
+			psHmacSha1Final(&ctx, a);
 		}
 	}
 	rc = PS_SUCCESS;
@@ -178,6 +181,7 @@ L_RETURN:
 	memzero_s(a, SHA1_HASH_SIZE);
 	memzero_s(mac, SHA1_HASH_SIZE);
 	memzero_s(hmacKey, SHA1_HASH_SIZE);
+	memzero_s(&keyed, sizeof(keyed));
 	if (rc < 0) {
 		memzero_s(out, outLen);	/* zero any partial result on error */
 	}
@@ -230,15 +234,9 @@ __inline static int32_t pSha2(const unsigned char *key, uint16_t keyLen,
 					const unsigned char *text, uint16_t textLen,
 					unsigned char *out, uint16_t outLen, uint32_t flags)
 {
-	/* Use a union to save a bit of stack space */
-	union {
-#ifdef USE_SHA384
-		psHmacSha384_t		sha384;
-#endif
-		psHmacSha256_t		sha256;
-	} u;
-	unsigned char		a[SHA384_HASH_SIZE];
-	unsigned char		mac[SHA384_HASH_SIZE];
+	psHmac_t			keyed, ctx;
+	unsigned char		a[MAX_HASHLEN];
+	unsigned char		mac[MAX_HASHLEN];
 	unsigned char		hmacKey[SHA384_HASH_SIZE];
 	int32_t				rc = PS_FAIL;
 	uint16_t			hashSize, hmacKeyLen, i, keyIter;
@@ -274,51 +272,32 @@ __inline static int32_t pSha2(const unsigned char *key, uint16_t keyLen,
 		key = (const unsigned char *)hmacKey;
 		keyLen = hmacKeyLen;
 	}
+	/* Key once, each iteration below starts from a copy */
+	if ((rc = psHmacInit(&keyed, (hashSize == SHA384_HASH_SIZE) ?
+			HMAC_SHA384 : HMAC_SHA256, key, keyLen)) < 0) {
+		goto L_RETURN;
+	}
 	for (i = 0; i < keyIter; i++) {
-#ifdef USE_SHA384
-		if (flags & CRYPTO_FLAGS_SHA3) {
-			if ((rc = psHmacSha384Init(&u.sha384, key, keyLen)) < 0) {
-				goto L_RETURN;
-			}
-			psHmacSha384Update(&u.sha384, a, hashSize);
-			psHmacSha384Update(&u.sha384, text, textLen);
-			psHmacSha384Final(&u.sha384, mac);
-		} else
-#endif
-		{
-			if ((rc = psHmacSha256Init(&u.sha256, key, keyLen)) < 0) {
-				goto L_RETURN;
-			}
-			psHmacSha256Update(&u.sha256, a, hashSize);
-			psHmacSha256Update(&u.sha256, text, textLen);
-			psHmacSha256Final(&u.sha256, mac);
-		}
+		psHmacCpy(&ctx, &keyed);
+		psHmacUpdate(&ctx, a, hashSize);
+		psHmacUpdate(&ctx, text, textLen);
+		psHmacFinal(&ctx, mac);
 		if (i == keyIter - 1) {
 			memcpy(out + (hashSize * i), mac,
 				outLen - ((uint32_t)hashSize * i));
 		} else {
 			memcpy(out + ((uint32_t)hashSize * i), mac, hashSize);
-#ifdef USE_SHA384
-			if (flags & CRYPTO_FLAGS_SHA3) {
-				if ((rc = psHmacSha384(key, keyLen, a, hashSize, a,
-						hmacKey, &hmacKeyLen)) < 0) {
-					goto L_RETURN;
-				}
-			} else
-#endif
-			{
-				if ((rc = psHmacSha256(key, keyLen, a, hashSize, a,
-						hmacKey, &hmacKeyLen)) < 0) {
-					goto L_RETURN;
-				}
-			}
+			psHmacCpy(&ctx, &keyed);
+			psHmacUpdate(&ctx, a, hashSize);
+			psHmacFinal(&ctx, a);
 		}
 	}
 	rc =  PS_SUCCESS;
 L_RETURN:
-	memzero_s(a, SHA384_HASH_SIZE);
-	memzero_s(mac, SHA384_HASH_SIZE);
+	memzero_s(a, sizeof(a));
+	memzero_s(mac, sizeof(mac));
 	memzero_s(hmacKey, SHA384_HASH_SIZE);
+	memzero_s(&keyed, sizeof(keyed));
 	if (rc < 0) {
 		memzero_s(out, outLen);	/* zero any partial result on error */
 	}
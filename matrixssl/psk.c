@@ -93,6 +93,7 @@ int32_t matrixSslLoadPsk(sslKeys_t *keys,
 		}
 		list->next = psk;
 	}
+	updateSuiteCaps(keys);
 
 	return 0;
 }
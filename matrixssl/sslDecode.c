@@ -131,6 +131,12 @@ int32 matrixSslDecode(ssl_t *ssl, unsigned char **buf, uint32 *len,
 	int32	preInflateLen, postInflateLen, currLen;
 	int zret;
 #endif
+#ifdef USE_MATRIXSSL_STATS
+	psTime_t		statStart;
+#endif
+#ifdef USE_DTLS
+	unsigned char	recType, cidMismatch, *recEnd;
+#endif
 /*
 	If we've had a protocol error, don't allow further use of the session
 */
@@ -145,6 +151,9 @@ int32 matrixSslDecode(ssl_t *ssl, unsigned char **buf, uint32 *len,
 
 	p = pend = mac = ctStart = NULL;
 	padLen = 0;
+#ifdef USE_DTLS
+	cidMismatch = 0;
+#endif
 
 /*
 	This flag is set if the previous call to this routine returned an SSL_FULL
@@ -237,6 +246,23 @@ decodeMore:
 				ssl->rec.rsn[3] = *c++;
 				ssl->rec.rsn[4] = *c++;
 				ssl->rec.rsn[5] = *c++;
+				ssl->rec.cidLen = 0;
+				cidMismatch = 0;
+				if (ssl->rec.type == SSL_RECORD_TYPE_TLS12_CID &&
+						ssl->extFlags.connection_id && ssl->cidInLen > 0) {
+					/* RFC 9146 header: our connection ID precedes length */
+					if (end - c < ssl->cidInLen + 2) {
+						*requiredLen = ssl->recordHeadLen + ssl->cidInLen;
+						return SSL_PARTIAL;
+					}
+					ssl->rec.cidLen = ssl->cidInLen;
+					cidMismatch = memcmpct(c, ssl->cidIn, ssl->cidInLen) != 0;
+					c += ssl->cidInLen;
+				} else if (ssl->extFlags.connection_id && ssl->cidInLen > 0 &&
+						(ssl->rec.epoch[0] | ssl->rec.epoch[1]) != 0) {
+					/* Once it is negotiated, protected records need it too */
+					cidMismatch = 1;
+				}
 			} else {
 				psTraceIntDtls("Expecting DTLS record version. Got %d\n",
 					ssl->rec.majVer);
@@ -284,6 +310,13 @@ decodeMore:
 	case SSL_RECORD_TYPE_HANDSHAKE:
 	case SSL_RECORD_TYPE_APPLICATION_DATA:
 		break;
+#ifdef USE_DTLS
+	case SSL_RECORD_TYPE_TLS12_CID:
+		/* Only once we've asked the peer to use a connection ID */
+		if (ssl->rec.cidLen > 0) {
+			break;
+		}
+#endif
 	/* Any other case is unrecognized */
 	default:
 		ssl->err = SSL_ALERT_UNEXPECTED_MESSAGE;
@@ -325,6 +358,17 @@ decodeMore:
 		psTraceIntInfo("Record header length not valid: %d\n", ssl->rec.len);
 		goto encodeResponse;
 	}
+/*
+	Refuse protected records past our record_size_limit before the buffer
+	is grown to hold them
+*/
+	if (ssl->extFlags.record_size_limit &&
+			(ssl->flags & SSL_FLAGS_READ_SECURE) &&
+			ssl->rec.len > ssl->recLimit + SSL_MAX_RECORD_EXPANSION) {
+		ssl->err = SSL_ALERT_RECORD_OVERFLOW;
+		psTraceIntInfo("Record exceeds size limit: %d\n", ssl->rec.len);
+		goto encodeResponse;
+	}
 /*
 	This implementation requires the entire SSL record to be in the 'in' buffer
 	before we parse it.  This is because we need to MAC the entire record before
@@ -462,6 +506,24 @@ SKIP_RECORD_PARSE:
 #ifdef USE_DTLS
 	if (ssl->flags & SSL_FLAGS_DTLS) {
 
+		/* A connection ID that isn't ours can't be authenticated. Drop it */
+		if (cidMismatch) {
+			psTraceDtls("Ignoring record with unknown connection id\n");
+			c += ssl->rec.len;
+			*buf = c;
+			if (end - c > 0) {
+				goto decodeMore;
+			}
+			return MATRIXSSL_SUCCESS;
+		}
+		/* The real type of a connection ID record is encrypted.  Go by the
+			state: a FINISHED during the handshake, else application data */
+		recType = ssl->rec.type;
+		if (recType == SSL_RECORD_TYPE_TLS12_CID) {
+			recType = ssl->hsState == SSL_HS_DONE ?
+				SSL_RECORD_TYPE_APPLICATION_DATA : SSL_RECORD_TYPE_HANDSHAKE;
+		}
+
 		/* Epoch and RSN validation. Silently ignore most mismatches (SUCCESS) */
 		rc = dtlsCompareEpoch(ssl->rec.epoch, ssl->expectedEpoch);
 		/* These cases have become pretty complex due to a code change in which
@@ -473,7 +535,7 @@ SKIP_RECORD_PARSE:
 			real mess trying to keep the expectedEpoch up-to-date when we can't
 			possibly know how many epoch increments the peer has made before we
 			receive a FINISHED message or an APPLICATION DATA record */
-		if (rc == 1 && ssl->rec.type == SSL_RECORD_TYPE_HANDSHAKE &&
+		if (rc == 1 && recType == SSL_RECORD_TYPE_HANDSHAKE &&
 				ssl->hsState == SSL_HS_FINISHED) {
 			/* Special handlers for these CCS/Finished cases because epoch
 				could be larger for a good reason */
@@ -504,7 +566,7 @@ SKIP_RECORD_PARSE:
 				the peer finally gets around to sending application data it
 				will be sending it on the last epoch it sent for the final
 				FINISHED. */
-			if (rc == 1 && ssl->rec.type == SSL_RECORD_TYPE_HANDSHAKE &&
+			if (rc == 1 && recType == SSL_RECORD_TYPE_HANDSHAKE &&
 					ssl->hsState == SSL_HS_DONE) {
 				ssl->expectedEpoch[0] = ssl->rec.epoch[0];
 				ssl->expectedEpoch[1] = ssl->rec.epoch[1];
@@ -517,7 +579,7 @@ SKIP_RECORD_PARSE:
 				are	in the done state.  If we didn't receive those duplicate
 				FINISHED messages and are now getting an APPLICATION record,
 				let's just try to decrypt it and get this communication going */
-			if (rc == 1 && ssl->rec.type == SSL_RECORD_TYPE_APPLICATION_DATA &&
+			if (rc == 1 && recType == SSL_RECORD_TYPE_APPLICATION_DATA &&
 					ssl->hsState == SSL_HS_DONE) {
 				ssl->expectedEpoch[0] = ssl->rec.epoch[0];
 				ssl->expectedEpoch[1] = ssl->rec.epoch[1];
@@ -539,9 +601,23 @@ SKIP_RECORD_PARSE:
 				The CCS message can be passed in here with the FINISHED tacked
 				on.  OpenSSL sends them separately but most wouldn't */
 				if (end != c) {
-					psAssert(*c == SSL_RECORD_TYPE_HANDSHAKE); /* Finished */
-					c += 11; /* Skip type, version, epoch to get to length */
-					/* borrow rc since we will be leaving here anyway */
+					/* Finished, possibly behind our connection ID. Borrow
+						rc since we will be leaving here anyway: the bytes
+						of type, version, epoch and rsn before the length */
+					rc = -1;
+					if (*c == SSL_RECORD_TYPE_HANDSHAKE) {
+						rc = 11;
+					} else if (*c == SSL_RECORD_TYPE_TLS12_CID) {
+						rc = 11 + ssl->cidInLen;
+					}
+					if (rc < 0 || end - c < rc + 2 ||
+							end - c - rc - 2 < ((c[rc] << 8) | c[rc + 1])) {
+						psTraceDtls("Malformed record after resent CCS\n");
+						ssl->err = SSL_ALERT_DECODE_ERROR;
+						*buf = origbuf;
+						goto encodeResponse;
+					}
+					c += rc;
 					rc = *c << 8; c++;
 					rc += *c; c++;
 					c += rc; /* Skip FINISHED message we've already accepted */
@@ -593,6 +669,14 @@ ADVANCE_TO_APP_DATA:
 		matrixsslUpdateStat(ssl, APP_DATA_RECV_STAT, ssl->rec.len +
 			ssl->recordHeadLen);
 	}
+	ssl->stats.recordsIn++;
+	ssl->stats.bytesIn += ssl->rec.len + ssl->recordHeadLen;
+#ifdef USE_DTLS
+	ssl->stats.bytesIn += ssl->rec.cidLen; /* Not in recordHeadLen */
+#endif
+	if (ssl->flags & SSL_FLAGS_READ_SECURE) {
+		psGetTime(&statStart, ssl->userPtr);
+	}
 #endif
 
 /*
@@ -603,6 +687,9 @@ ADVANCE_TO_APP_DATA:
 */
 
 	ctStart = origbuf; /* Clear-text start.  Decrypt to the front */
+#ifdef USE_DTLS
+	recEnd = c + ssl->rec.len;
+#endif
 
 	/* Sanity check ct len.  Step 1 of Lucky 13 MEE-TLS-CBC decryption.
 		max{b, t + 1} is always "t + 1" because largest possible blocksize
@@ -616,20 +703,20 @@ ADVANCE_TO_APP_DATA:
 			if (ssl->rec.len < (ssl->deMacSize + 1 + ssl->deBlockSize)) {
 				ssl->err = SSL_ALERT_BAD_RECORD_MAC;
 				psTraceInfo("Ciphertext length failed sanity\n");
-				goto encodeResponse;
+				goto recordAuthFail;
 			}
 		} else {
 			if (ssl->rec.len < (ssl->deMacSize + 1)) {
 				ssl->err = SSL_ALERT_BAD_RECORD_MAC;
 				psTraceInfo("Ciphertext length failed sanity\n");
-				goto encodeResponse;
+				goto recordAuthFail;
 			}
 		}
 #else
 		if (ssl->rec.len < (ssl->deMacSize + 1)) {
 			ssl->err = SSL_ALERT_BAD_RECORD_MAC;
 			psTraceInfo("Ciphertext length failed sanity\n");
-			goto encodeResponse;
+			goto recordAuthFail;
 		}
 #endif /* USE_TLS_1_1 */
 	}
@@ -638,7 +725,7 @@ ADVANCE_TO_APP_DATA:
 	if (ssl->decrypt(ssl, c, ctStart, ssl->rec.len) < 0) {
 		ssl->err = SSL_ALERT_DECRYPT_ERROR;
 		psTraceInfo("Couldn't decrypt record data 2\n");
-		goto encodeResponse;
+		goto recordAuthFail;
 	}
 
 	c += ssl->rec.len;
@@ -863,7 +950,7 @@ ADVANCE_TO_APP_DATA:
 				(uint32)(mac - ctStart), mac) < 0 || macError) {
 			ssl->err = SSL_ALERT_BAD_RECORD_MAC;
 			psTraceInfo("Couldn't verify MAC or pad of record data\n");
-			goto encodeResponse;
+			goto recordAuthFail;
 		}
 
 		memset(mac, 0x0, ssl->deMacSize);
@@ -878,6 +965,46 @@ ADVANCE_TO_APP_DATA:
 		p = ctStart;
 		pend = mac = ctStart + ssl->rec.len;
 	}
+#ifdef USE_DTLS
+	/* Only now that the record is authentic may it move the window */
+	if (ssl->flags & SSL_FLAGS_DTLS) {
+		dtlsMarkReplayWindow(ssl, ssl->rec.rsn);
+	}
+	if (ssl->rec.type == SSL_RECORD_TYPE_TLS12_CID) {
+/*
+		Authenticated DTLSInnerPlaintext.  The real content type is the
+		last non-zero byte
+*/
+		if (!(ssl->flags & SSL_FLAGS_READ_SECURE)) {
+			ssl->err = SSL_ALERT_UNEXPECTED_MESSAGE;
+			psTraceInfo("Connection id record before ChangeCipherSpec\n");
+			goto encodeResponse;
+		}
+		while (pend > p && *(pend - 1) == 0) {
+			pend--;
+		}
+		if (pend == p) {
+			ssl->err = SSL_ALERT_UNEXPECTED_MESSAGE;
+			psTraceInfo("Connection id record has no content type\n");
+			goto encodeResponse;
+		}
+		pend--;
+		ssl->rec.type = *pend;
+		mac = pend;
+		if (ssl->rec.type < SSL_RECORD_TYPE_CHANGE_CIPHER_SPEC ||
+				ssl->rec.type > SSL_RECORD_TYPE_APPLICATION_DATA) {
+			ssl->err = SSL_ALERT_UNEXPECTED_MESSAGE;
+			psTraceIntInfo("Inner record type not valid: %d\n",
+				ssl->rec.type);
+			goto encodeResponse;
+		}
+	}
+#endif /* USE_DTLS */
+#ifdef USE_MATRIXSSL_STATS
+	if (ssl->flags & SSL_FLAGS_READ_SECURE) {
+		ssl->stats.decryptNsec += matrixsslStatNsecs(ssl, statStart);
+	}
+#endif
 
 #ifdef USE_ZLIB_COMPRESSION
 	/* Currently only supporting compression of FINISHED message.
@@ -1010,6 +1137,14 @@ ADVANCE_TO_APP_DATA:
 			psTraceInfo("Record overflow\n");
 			goto encodeResponse;
 		}
+	} else if (ssl->extFlags.record_size_limit) {
+		/* The limit we advertised applies to protected records only */
+		if ((int32)(pend - p) > ((ssl->flags & SSL_FLAGS_READ_SECURE) ?
+				ssl->recLimit : SSL_MAX_PLAINTEXT_LEN)) {
+			ssl->err = SSL_ALERT_RECORD_OVERFLOW;
+			psTraceInfo("Record overflow\n");
+			goto encodeResponse;
+		}
 	} else {
 		if ((int32)(pend - p) > ssl->maxPtFrag) {
 			ssl->err = SSL_ALERT_RECORD_OVERFLOW;
@@ -1414,6 +1549,26 @@ ADVANCE_TO_APP_DATA:
 	*error = PS_PROTOCOL_FAIL;
 	return MATRIXSSL_ERROR;
 
+/*
+	A protected record failed decryption or its MAC.  That is fatal in TLS,
+	but DTLS drops the record silently (RFC 6347 4.1.2.7), so a forged
+	datagram can neither end the session nor move its replay window.
+*/
+recordAuthFail:
+#ifdef USE_DTLS
+	if (ssl->flags & SSL_FLAGS_DTLS) {
+		psTraceDtls("Dropping record that failed authentication\n");
+		ssl->err = SSL_ALERT_NONE;
+		c = recEnd;
+		*buf = c;
+		if (end - c > 0) {
+			goto decodeMore;
+		}
+		return MATRIXSSL_SUCCESS;
+	}
+#endif /* USE_DTLS */
+	goto encodeResponse;
+
 encodeResponse:
 /*
 	We decoded a record that needs a response, either a handshake response
@@ -1461,7 +1616,13 @@ encodeResponse:
 			&options);
 	} else {
 #endif /* USE_CLIENT_SIDE_SSL */
+#ifdef USE_MATRIXSSL_STATS
+		psGetTime(&statStart, ssl->userPtr);
+#endif
 		rc = sslEncodeResponse(ssl, &tmpout, requiredLen);
+#ifdef USE_MATRIXSSL_STATS
+		ssl->stats.hsWriteNsec += matrixsslStatNsecs(ssl, statStart);
+#endif
 #ifdef USE_CLIENT_SIDE_SSL
 	}
 #endif /* USE_CLIENT_SIDE_SSL */
@@ -1530,6 +1691,12 @@ static int32 addCompressCount(ssl_t *ssl, int32 padLen)
 	if (ssl->flags & SSL_FLAGS_TLS_1_1) {
 		len -= ssl->deBlockSize; /* skip explicit IV */
 	}
+#endif
+#ifdef USE_DTLS
+	if (ssl->rec.type == SSL_RECORD_TYPE_TLS12_CID) {
+		/* MAC header is DTLS_CID_AAD_LEN rather than 13 bytes */
+		len += DTLS_CID_AAD_LEN(ssl->rec.cidLen) - 13;
+	}
 #endif
 	l1 = 13 + len - ssl->deMacSize;
 	l2 = 13 + len - padLen - 1 - ssl->deMacSize;
@@ -1595,6 +1762,9 @@ static int32 parseSSLHandshake(ssl_t *ssl, char *inbuf, uint32 len)
 	int32			rc;
 	uint32			hsLen;
 	unsigned char	hsMsgHash[SHA512_HASH_SIZE];
+#ifdef USE_MATRIXSSL_STATS
+	psTime_t		statStart;
+#endif
 
 #ifdef USE_DTLS
 	uint32		fragLen;
@@ -1671,6 +1841,19 @@ parseHandshake:
 #endif  /* SSL_REHANDSHAKES_ENABLED */
 
 #ifdef USE_DTLS
+/*
+	Fragmented handshake records are encoded without a connection ID, which
+	RFC 9146 requires on every protected record once negotiated.  Refuse to
+	renegotiate such a session rather than send them.
+*/
+	if ((ssl->flags & SSL_FLAGS_DTLS) && ssl->extFlags.connection_id &&
+			ssl->hsState == SSL_HS_DONE &&
+			(hsType == SSL_HS_CLIENT_HELLO || hsType == SSL_HS_HELLO_REQUEST)) {
+		psTraceInfo("Closing conn with peer. Rehandshake with connection id\n");
+		ssl->err = SSL_ALERT_NO_RENEGOTIATION;
+		return MATRIXSSL_ERROR;
+	}
+
 /*
 	The MSN helpes keep the state machine sane prior to passing through to
 	the hsType exceptions because if they are received out-of-order it could
@@ -1688,6 +1871,16 @@ parseHandshake:
 		}
 		msn = c[3] << 8;
 		msn += c[4];
+#ifdef USE_SERVER_SIDE_SSL
+		/* A ClientHello that went through a stateless cookie exchange
+			(matrixDtlsCheckCookie) is the first message this session sees
+			but carries the client's already advanced message_seq */
+		if (ssl->lastMsn == -1 && hsType == SSL_HS_CLIENT_HELLO &&
+				(ssl->flags & SSL_FLAGS_SERVER) && msn > 0) {
+			ssl->lastMsn = msn - 1;
+			ssl->msn = msn;
+		}
+#endif
 		if (msn > (ssl->lastMsn + 1)) {
 			psTraceIntDtls("Ignoring future handshake msg %d\n", hsType);
 			return MATRIXSSL_SUCCESS;
@@ -1966,6 +2159,11 @@ hsStateDetermined:
 			fragLen += *c << 8; c++;
 			fragLen += *c; c++;
 			if (fragLen != hsLen) {
+				if (fragLen > hsLen || fragOffset > hsLen - fragLen) {
+					ssl->err = SSL_ALERT_ILLEGAL_PARAMETER;
+					psTraceInfo("Invalid fragment offset or length\n");
+					return MATRIXSSL_ERROR;
+				}
 /*
 				Have a fragmented message here.  Allocate if first time
 				seen and assign msn.  Can only deal with single fragmented
@@ -1998,6 +2196,7 @@ hsStateDetermined:
 						return SSL_MEM_ERROR;
 					}
 					ssl->fragMsn = msn;
+					ssl->fragMsgLen = hsLen;
 				}
 
 				if (ssl->fragMsn != msn) {
@@ -2006,13 +2205,29 @@ hsStateDetermined:
 */
 					return MATRIXSSL_SUCCESS;
 				}
+/*
+				Every fragment of a message must carry the same total length
+				and land inside the buffer sized by the first one
+*/
+				if (hsLen != ssl->fragMsgLen ||
+						fragOffset + fragLen > ssl->fragMsgLen ||
+						ssl->fragTotal + fragLen > ssl->fragMsgLen) {
+					ssl->err = SSL_ALERT_ILLEGAL_PARAMETER;
+					psTraceInfo("Fragment does not match its message\n");
+					return MATRIXSSL_ERROR;
+				}
 /*
 				Still could be a duplicate fragment.  Make sure we haven't
 				seen it before.  If we haven't this routine also returns
 				the next open fragment header index for use below.
 */
-				if ((rc = dtlsSeenFrag(ssl, fragOffset, &j)) == 1) {
+				if ((rc = dtlsSeenFrag(ssl, fragOffset, fragLen, &j)) == 1) {
 					return MATRIXSSL_SUCCESS;
+				} else if (rc == 2) {
+					/* Resent with different fragment sizes.  Keep just
+						this one and collect the rest of the new layout */
+					dtlsInitFrag(ssl);
+					j = 0;
 				} else if (rc == -1) { /* MAX_FRAGMENTS exceeded */
 					dtlsInitFrag(ssl); /* init will free memory */
 					if (ssl->fragMessage != NULL) {
@@ -2140,6 +2355,9 @@ SKIP_HSHEADER_PARSE:
 /*
 	Finished with header.  Process each type of handshake message.
 */
+#ifdef USE_MATRIXSSL_STATS
+	psGetTime(&statStart, ssl->userPtr);
+#endif
 	switch (ssl->hsState) {
 
 /******************************************************************************/
@@ -2447,6 +2665,10 @@ SKIP_HSHEADER_PARSE:
 		return MATRIXSSL_ERROR;
 	}
 
+#ifdef USE_MATRIXSSL_STATS
+	ssl->stats.hsParseNsec += matrixsslStatNsecs(ssl, statStart);
+#endif
+
 #ifdef USE_DTLS
 	if (ssl->flags & SSL_FLAGS_DTLS) {
 		ssl->lastMsn = msn; /* MSN of last message sucessfully parsed */
@@ -2475,7 +2697,8 @@ static int32 parseSingleCert(ssl_t *ssl, unsigned char *c, unsigned char *end,
 /*
 	Extract the binary cert message into the cert structure
 */
-	if ((parseLen = psX509ParseCert(ssl->hsPool, c, certLen, &cert, 0)) < 0) {
+	if ((parseLen = psX509ParseCert(ssl->hsPool, c, certLen, &cert,
+			ssl->certParseFlags)) < 0) {
 		psX509FreeCert(cert);
 		if (parseLen == PS_MEM_FAIL) {
 			ssl->err = SSL_ALERT_INTERNAL_ERROR;
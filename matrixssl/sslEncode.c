@@ -59,6 +59,13 @@ static int32 writeHelloVerifyRequest(ssl_t *ssl, sslBuf_t *out);
 static int32 encryptRecord(ssl_t *ssl, int32 type, int32 hsMsgType,
 				int32 messageSize,	int32 padLen, unsigned char *pt,
 				sslBuf_t *out, unsigned char **c);
+#ifdef USE_MATRIXSSL_STATS
+static int32 encryptRecordData(ssl_t *ssl, int32 type, int32 hsMsgType,
+				int32 messageSize,	int32 padLen, unsigned char *pt,
+				sslBuf_t *out, unsigned char **c);
+#else
+#define encryptRecordData encryptRecord
+#endif
 
 #ifdef USE_CLIENT_SIDE_SSL
 static int32 writeClientKeyExchange(ssl_t *ssl, sslBuf_t *out);
@@ -227,6 +234,11 @@ int32 matrixSslGetEncodedSize(ssl_t *ssl, uint32 len)
 {
 	len += ssl->recordHeadLen;
 	if (ssl->flags & SSL_FLAGS_WRITE_SECURE) {
+#ifdef USE_DTLS
+		if (ssl->cidOutLen > 0) {
+			len += 1; /* Inner content type, the ID itself is added below */
+		}
+#endif
 		len += ssl->enMacSize;
 #ifdef USE_TLS_1_1
 /*
@@ -256,6 +268,9 @@ int32 matrixSslGetEncodedSize(ssl_t *ssl, uint32 len)
 		}
 #else
 		len += psPadLenPwr2(len - ssl->recordHeadLen, ssl->enBlockSize);
+#endif
+#ifdef USE_DTLS
+		len += ssl->cidOutLen;
 #endif
 	}
 	return len;
@@ -1017,13 +1032,6 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 	int32			messageSize = 0;
 	int32			rc = MATRIXSSL_ERROR;
 	uint32			alertReqLen;
-#if defined(USE_SERVER_SIDE_SSL) || defined(USE_CLIENT_AUTH)
-	int32			i;
-#ifndef USE_ONLY_PSK_CIPHER_SUITE
-	psX509Cert_t	*cert;
-#endif /* USE_ONLY_PSK_CIPHER_SUITE */
-#endif /* USE_SERVER_SIDE_SSL */
-
 #if defined(USE_SERVER_SIDE_SSL)
 	int32			extSize;
 	int32			stotalCertLen;
@@ -1048,6 +1056,7 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 
 #ifdef USE_DTLS
 	sslSessOpts_t	options;
+	int32			flightStart = 0;
 	memset(&options, 0x0, sizeof(sslSessOpts_t));
 #endif
 
@@ -1088,6 +1097,13 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 		ssl->resendMsn = ssl->msn;
 		ssl->resendEpoch[0] = ssl->epoch[0];
 		ssl->resendEpoch[1] = ssl->epoch[1];
+		if (!ssl->retransmit) {
+			/* A new flight, so the last one got through */
+			ssl->flightResends = 0;
+			ssl->retransArmed = 0;
+			ssl->retransTimeout = DTLS_RETRANSMIT_MIN_MS;
+		}
+		flightStart = (int32)(out->end - out->buf);
 	}
 #endif /* USE_DTLS */
 
@@ -1296,18 +1312,13 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 #ifdef USE_ECC_CIPHER_SUITE
 				}
 #endif /* USE_ECC_CIPHER_SUITE */
-				stotalCertLen = i = 0;
+				stotalCertLen = 0;
 #ifndef USE_ONLY_PSK_CIPHER_SUITE
-				cert = ssl->keys->cert;
-				for (i = 0; cert != NULL; i++) {
-					stotalCertLen += cert->binLen;
-					cert = cert->next;
-				}
+				stotalCertLen = ssl->keys->certMsgLen;
 				/* Are we going to have to fragment the CERTIFICATE message? */
-				if ((stotalCertLen + 3 + (i * 3) + ssl->hshakeHeadLen) >
-						ssl->maxPtFrag) {
+				if ((stotalCertLen + ssl->hshakeHeadLen) > ssl->maxPtFrag) {
 					stotalCertLen += addCertFragOverhead(ssl,
-						stotalCertLen + 3 + (i * 3) + ssl->hshakeHeadLen);
+						stotalCertLen + ssl->hshakeHeadLen);
 				}
 #endif /* USE_ONLY_PSK_CIPHER_SUITE  */
 				messageSize =
@@ -1315,7 +1326,7 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 					4 * ssl->hshakeHeadLen +
 					38 + SSL_MAX_SESSION_ID_SIZE +  /* server hello */
 					srvKeyExLen + /* server key exchange */
-					3 + (i * 3) + stotalCertLen; /* certificate */
+					stotalCertLen; /* certificate */
 #ifdef USE_CLIENT_AUTH
 #ifndef USE_ONLY_PSK_CIPHER_SUITE
 				if (ssl->flags & SSL_FLAGS_CLIENT_AUTH) {
@@ -1364,23 +1375,17 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 			} else {
 #endif
 #ifndef USE_ONLY_PSK_CIPHER_SUITE
-				cert = ssl->keys->cert;
-				for (i = 0; cert != NULL; i++) {
-					psAssert(cert->unparsedBin != NULL);
-					stotalCertLen += cert->binLen;
-					cert = cert->next;
-				}
+				stotalCertLen = ssl->keys->certMsgLen;
 				/* Are we going to have to fragment the CERTIFICATE message? */
-				if ((stotalCertLen + 3 + (i * 3) + ssl->hshakeHeadLen) >
-						ssl->maxPtFrag) {
+				if ((stotalCertLen + ssl->hshakeHeadLen) > ssl->maxPtFrag) {
 					stotalCertLen += addCertFragOverhead(ssl,
-						stotalCertLen + 3 + (i * 3) + ssl->hshakeHeadLen);
+						stotalCertLen + ssl->hshakeHeadLen);
 				}
 				messageSize =
 					3 * ssl->recordHeadLen +
 					3 * ssl->hshakeHeadLen +
 					38 + SSL_MAX_SESSION_ID_SIZE +  /* server hello */
-					3 + (i * 3) + stotalCertLen; /* certificate */
+					stotalCertLen; /* certificate */
 #endif /* !USE_ONLY_PSK_CIPHER_SUITE */
 #ifdef USE_PSK_CIPHER_SUITE
 			}
@@ -1438,11 +1443,17 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 		Add extensions
 */
 		extSize = 0; /* Two byte total length for all extensions */
-		if (ssl->maxPtFrag < SSL_MAX_PLAINTEXT_LEN) {
+		if (ssl->maxPtFrag < SSL_MAX_PLAINTEXT_LEN &&
+				!ssl->extFlags.record_size_limit) {
 			extSize = 2;
 			messageSize += 5; /* 2 type, 2 length, 1 value */
 		}
 
+		if (ssl->extFlags.record_size_limit) {
+			extSize = 2;
+			messageSize += 6; /* 2 type, 2 length, 2 value */
+		}
+
 		if (ssl->extFlags.truncated_hmac) {
 			extSize = 2;
 			messageSize += 4; /* 2 type, 2 length, 0 value */
@@ -1463,8 +1474,8 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 			/* And the handshake message oh.  1 type, 3 len, x OCSPResponse 
 				The status_request flag will only have been set if a 
 				ssl->keys->OCSPResponseBuf was present during extension parse */
-			messageSize += ssl->hshakeHeadLen + ssl->recordHeadLen + 4 +
-				ssl->keys->OCSPResponseBufLen;
+			messageSize += ssl->hshakeHeadLen + ssl->recordHeadLen +
+				ssl->keys->OCSPStatusMsgLen;
 			messageSize += secureWriteAdditions(ssl, 1);
 		}
 #endif
@@ -1488,6 +1499,13 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 		}
 #endif
 
+#ifdef USE_DTLS
+		if (ssl->extFlags.connection_id_ext) {
+			extSize = 2;
+			messageSize += 5 + ssl->cidInLen; /* 4 type/len + 1 len + cid */
+		}
+#endif
+
 #ifdef ENABLE_SECURE_REHANDSHAKES
 /*
 		The RenegotiationInfo extension lengths are well known
@@ -1675,6 +1693,12 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 			}
 		}
 #endif /* USE_TLS_1_1 */
+#ifdef USE_DTLS
+		/* Connection ID and inner content type on the encrypted FINISHED */
+		if (ssl->cidOutLen > 0) {
+			messageSize += ssl->cidOutLen + 1;
+		}
+#endif
 
 #ifdef USE_ZLIB_COMPRESSION
 		/* Lastly, add the zlib overhead for the FINISHED message */
@@ -1786,6 +1810,12 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 				}
 			}
 #endif /* USE_TLS_1_1 */
+#ifdef USE_DTLS
+			/* Connection ID and inner content type on the encrypted FINISHED */
+			if (ssl->cidOutLen > 0) {
+				messageSize += ssl->cidOutLen + 1;
+			}
+#endif
 
 #ifdef USE_ZLIB_COMPRESSION
 			/* Lastly, add the zlib overhead for the FINISHED message */
@@ -1897,19 +1927,13 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 /*
 					Account for the certificate and certificateVerify messages
 */
-					cert = ssl->keys->cert;
-					ctotalCertLen = 0;
-					for (i = 0; cert != NULL; i++) {
-						ctotalCertLen += cert->binLen;
-						cert = cert->next;
-					}
+					ctotalCertLen = ssl->keys->certMsgLen;
 					/* Are we going to have to fragment the CERT message? */
-					if ((ctotalCertLen + 3 + (i * 3) + ssl->hshakeHeadLen) >
-							ssl->maxPtFrag) {
+					if ((ctotalCertLen + ssl->hshakeHeadLen) > ssl->maxPtFrag) {
 						ctotalCertLen += addCertFragOverhead(ssl,
-							ctotalCertLen + 3 + (i * 3) + ssl->hshakeHeadLen);
+							ctotalCertLen + ssl->hshakeHeadLen);
 					}
-					messageSize += (2 * ssl->recordHeadLen) + 3 + (i * 3) +
+					messageSize += (2 * ssl->recordHeadLen) +
 						(2 * ssl->hshakeHeadLen) + ctotalCertLen +
 						2 +	ssl->keys->privKey.keysize;
 
@@ -2026,6 +2050,12 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 				}
 			}
 #endif /* USE_TLS_1_1 */
+#ifdef USE_DTLS
+			/* Connection ID and inner content type on the encrypted FINISHED */
+			if (ssl->cidOutLen > 0) {
+				messageSize += ssl->cidOutLen + 1;
+			}
+#endif
 #ifdef USE_ZLIB_COMPRESSION
 			/* Lastly, add the zlib overhead for the FINISHED message */
 			if (ssl->compression) {
@@ -2133,9 +2163,11 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 		generation during ServerKeyExchange write.  */
 	if (ssl->flags & SSL_FLAGS_SERVER) {
 		if (ssl->pkaAfter[0].type > 0) {
+			SSL_STAT_PKA_BEGIN(ssl);
 			if ((rc = nowDoSkePka(ssl, out)) < 0) {
 				return rc;
 			}
+			SSL_STAT_PKA_END(ssl);
 		}
 	}
 #endif
@@ -2145,9 +2177,11 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 		ClientKeyExchange write.  */
 	if (!(ssl->flags & SSL_FLAGS_SERVER)) {
 		if (ssl->pkaAfter[0].type > 0) {
+			SSL_STAT_PKA_BEGIN(ssl);
 			if ((rc = nowDoCkePka(ssl)) < 0) {
 				return rc;
 			}
+			SSL_STAT_PKA_END(ssl);
 		}
 	}
 #endif
@@ -2159,6 +2193,13 @@ int32 sslEncodeResponse(ssl_t *ssl, psBuf_t *out, uint32 *requiredLen)
 		}
 	}
 
+#ifdef USE_DTLS
+	if (ssl->flags & SSL_FLAGS_DTLS) {
+		/* Timer resends can reuse the records as written */
+		dtlsCacheFlight(ssl, out->buf + flightStart, out->end);
+	}
+#endif /* USE_DTLS */
+
 	return rc;
 }
 
@@ -2183,7 +2224,7 @@ static int32 encryptFlight(ssl_t *ssl, unsigned char **end)
 	sslBuf_t		cvFlight;
 #endif
 	unsigned char	*c, *origEnd;
-	int32			rc;
+	int32			rc, cidLen;
 
 	/* NEGATIVE ECDSA - save the end of the flight buffer */
 	origEnd = *end;
@@ -2192,8 +2233,13 @@ static int32 encryptFlight(ssl_t *ssl, unsigned char **end)
 	msg = ssl->flightEncode;
 	while (msg) {
 		c = msg->start + msg->len;
+		cidLen = 0;
 #ifdef USE_DTLS
 		if (ssl->flags & SSL_FLAGS_DTLS) {
+			/* seqDelay is the epoch, just past the type and version */
+			if (msg->seqDelay[-3] == SSL_RECORD_TYPE_TLS12_CID) {
+				cidLen = ssl->cidOutLen;
+			}
 			if (msg->hsMsg == SSL_HS_FINISHED) {
 				/*	Epoch is incremented and the sequence numbers are reset for
 					this message */
@@ -2211,6 +2257,7 @@ static int32 encryptFlight(ssl_t *ssl, unsigned char **end)
 			*msg->seqDelay = ssl->rsn[3]; msg->seqDelay++;
 			*msg->seqDelay = ssl->rsn[4]; msg->seqDelay++;
 			*msg->seqDelay = ssl->rsn[5]; msg->seqDelay++;
+			msg->seqDelay += cidLen;
 			msg->seqDelay++;
 			msg->seqDelay++; /* Last two incremements skipped recLen */
 		}
@@ -2254,7 +2301,7 @@ static int32 encryptFlight(ssl_t *ssl, unsigned char **end)
 
 		if (ssl->flags & SSL_FLAGS_NONCE_W) {
 			out.start = out.buf = out.end = msg->start - ssl->recordHeadLen -
-				TLS_EXPLICIT_NONCE_LEN;
+				cidLen - TLS_EXPLICIT_NONCE_LEN;
 #ifdef USE_DTLS
 			if (ssl->flags & SSL_FLAGS_DTLS) {
 				/* nonce */
@@ -2280,7 +2327,8 @@ static int32 encryptFlight(ssl_t *ssl, unsigned char **end)
 			}
 #endif
 		} else {
-			out.start = out.buf = out.end = msg->start - ssl->recordHeadLen;
+			out.start = out.buf = out.end = msg->start - ssl->recordHeadLen -
+				cidLen;
 		}
 
 #ifndef USE_ONLY_PSK_CIPHER_SUITE
@@ -2293,14 +2341,17 @@ static int32 encryptFlight(ssl_t *ssl, unsigned char **end)
 			cvFlight.start = cvFlight.buf = out.start;
 			cvFlight.end = origEnd;
 			cvFlight.size = ssl->insize - (cvFlight.end - cvFlight.buf);
+			SSL_STAT_PKA_BEGIN(ssl);
 			nowDoCvPka(ssl, &cvFlight);
+			SSL_STAT_PKA_END(ssl);
 			/* NEGATIVE ECDSA - account for message may have changed size */
 			c = msg->start + msg->len;
 			if (ssl->flags & SSL_FLAGS_AEAD_W) {
-				out.start = out.buf = out.end =
-					(msg->start - ssl->recordHeadLen) - AEAD_NONCE_LEN(ssl);
+				out.start = out.buf = out.end = (msg->start -
+					ssl->recordHeadLen - cidLen) - AEAD_NONCE_LEN(ssl);
 			} else {
-				out.start = out.buf = out.end = msg->start - ssl->recordHeadLen;
+				out.start = out.buf = out.end = msg->start -
+					ssl->recordHeadLen - cidLen;
 			}
 		}
 #endif /* Client */
@@ -2311,6 +2362,12 @@ static int32 encryptFlight(ssl_t *ssl, unsigned char **end)
 #ifndef USE_ONLY_PSK_CIPHER_SUITE
 #if defined(USE_SERVER_SIDE_SSL) || defined(USE_CLIENT_AUTH)
 			rc = dtlsEncryptFragRecord(ssl, msg, &out, &c);
+#ifdef USE_MATRIXSSL_STATS
+			if (rc == PS_SUCCESS) {
+				ssl->stats.recordsOut++;
+				ssl->stats.bytesOut += c - out.end;
+			}
+#endif
 #endif /* SERVER || CLIENT_AUTH */
 #endif /* PSK_ONLY */
 		} else {
@@ -2326,7 +2383,8 @@ static int32 encryptFlight(ssl_t *ssl, unsigned char **end)
 		if (rc == PS_PENDING) {
 			/* Eat this message from flight encode, moving next to the front */
 			/* Save how far along we are to be picked up next time */
-			*end = msg->start + msg->messageSize - ssl->recordHeadLen;
+			*end = msg->start + msg->messageSize - ssl->recordHeadLen -
+				cidLen;
 			if (ssl->flags & SSL_FLAGS_AEAD_W) {
 				*end -= AEAD_NONCE_LEN(ssl);
 			}
@@ -2433,6 +2491,12 @@ static int32 secureWriteAdditions(ssl_t *ssl, int32 numRecs)
 		if (ssl->flags & SSL_FLAGS_AEAD_W) {
 			add += (numRecs * (AEAD_TAG_LEN(ssl) + AEAD_NONCE_LEN(ssl)));
 		}
+#ifdef USE_DTLS
+		if (ssl->cidOutLen > 0) {
+			/* Connection ID in the header, content type inside */
+			add += numRecs * (ssl->cidOutLen + 1);
+		}
+#endif
 	}
 	return add;
 }
@@ -2476,7 +2540,7 @@ static int32_t writeRecordHeader(ssl_t *ssl, uint8_t type, uint8_t hsType,
 				unsigned char **encryptStart, const unsigned char *end,
 				unsigned char **c)
 {
-	int32	messageData, msn;
+	int32	messageData, msn, cidLen;
 
 	messageData = *messageSize - ssl->recordHeadLen;
 	if (type == SSL_RECORD_TYPE_HANDSHAKE) {
@@ -2515,6 +2579,19 @@ static int32_t writeRecordHeader(ssl_t *ssl, uint8_t type, uint8_t hsType,
 	} else if (ssl->flags & SSL_FLAGS_AEAD_W) {
 		*messageSize += (AEAD_TAG_LEN(ssl) + AEAD_NONCE_LEN(ssl));
 	}
+
+/*
+	Once a connection ID is negotiated every protected record carries it in
+	the header and hides the real content type after the plaintext
+*/
+	cidLen = 0;
+#ifdef USE_DTLS
+	if (ssl->cidOutLen > 0 && (hsType == SSL_HS_FINISHED ||
+			(ssl->flags & SSL_FLAGS_WRITE_SECURE))) {
+		cidLen = ssl->cidOutLen;
+		*messageSize += cidLen + 1;
+	}
+#endif /* USE_DTLS */
 /*
 	If this session is already in a secure-write state, determine padding.
 	Again, the FINISHED message is explicitly checked due to the delay
@@ -2530,13 +2607,13 @@ static int32_t writeRecordHeader(ssl_t *ssl, uint8_t type, uint8_t hsType,
 				*messageSize += ssl->cipher->macSize;
 			}
 		}
-		*padLen = psPadLenPwr2(*messageSize - ssl->recordHeadLen,
+		*padLen = psPadLenPwr2(*messageSize - ssl->recordHeadLen - cidLen,
 			ssl->cipher->blockSize);
 		*messageSize += *padLen;
 	} else if ((ssl->flags & SSL_FLAGS_WRITE_SECURE) &&
 			!(ssl->flags & SSL_FLAGS_AEAD_W)) {
 		*messageSize += ssl->enMacSize;
-		*padLen = psPadLenPwr2(*messageSize - ssl->recordHeadLen,
+		*padLen = psPadLenPwr2(*messageSize - ssl->recordHeadLen - cidLen,
 			ssl->enBlockSize);
 		*messageSize += *padLen;
 	}
@@ -2563,8 +2640,17 @@ static int32_t writeRecordHeader(ssl_t *ssl, uint8_t type, uint8_t hsType,
 	}
 #endif /* USE_DTLS */
 
+#ifdef USE_DTLS
+	if (cidLen > 0) {
+		*c += psWriteRecordInfo(ssl, SSL_RECORD_TYPE_TLS12_CID,
+			*messageSize - ssl->recordHeadLen - cidLen, *c, hsType);
+	} else {
+#endif
 	*c += psWriteRecordInfo(ssl, (unsigned char)type,
 		*messageSize - ssl->recordHeadLen, *c, hsType);
+#ifdef USE_DTLS
+	}
+#endif
 
 /*
 	All data written after this point is to be encrypted (if secure-write)
@@ -2867,6 +2953,12 @@ static int32 postponeEncryptRecord(ssl_t *ssl, int32 type, int32 hsMsg,
 	} else if (ssl->flags & SSL_FLAGS_AEAD_W) {
 		encryptStart += AEAD_NONCE_LEN(ssl); /* Move past the plaintext nonce */
 	}
+#ifdef USE_DTLS
+	if ((ssl->flags & SSL_FLAGS_DTLS) &&
+			*out->end == SSL_RECORD_TYPE_TLS12_CID) {
+		encryptStart += ssl->cidOutLen;
+	}
+#endif
 
 	ptLen = (int32)(*c - encryptStart);
 
@@ -2877,6 +2969,12 @@ static int32 postponeEncryptRecord(ssl_t *ssl, int32 type, int32 hsMsg,
 	flight->messageSize = messageSize;
 	flight->hsMsg = hsMsg;
 	flight->seqDelay = ssl->seqDelay;
+#ifdef USE_DTLS
+	if ((ssl->flags & SSL_FLAGS_DTLS) &&
+			*out->end == SSL_RECORD_TYPE_TLS12_CID) {
+		*c += 1; /* Room for the inner content type */
+	}
+#endif
 
 	if (hsMsg == SSL_HS_FINISHED) {
 		if (!(ssl->cipher->flags &
@@ -2927,12 +3025,37 @@ static int32 postponeEncryptRecord(ssl_t *ssl, int32 type, int32 hsMsg,
 	messageSize - 5 = ssl.recLen
 	*c - encryptStart = plaintext length
 */
+#ifdef USE_MATRIXSSL_STATS
 static int32 encryptRecord(ssl_t *ssl, int32 type, int32 hsMsgType,
 							int32 messageSize, int32 padLen, unsigned char *pt,
 							sslBuf_t *out, unsigned char **c)
+{
+	psTime_t	start;
+	int32		rc;
+
+	if (ssl->flags & SSL_FLAGS_WRITE_SECURE) {
+		psGetTime(&start, ssl->userPtr);
+	}
+	rc = encryptRecordData(ssl, type, hsMsgType, messageSize, padLen, pt,
+		out, c);
+	if (rc == MATRIXSSL_SUCCESS) {
+		ssl->stats.recordsOut++;
+		ssl->stats.bytesOut += messageSize;
+		if (ssl->flags & SSL_FLAGS_WRITE_SECURE) {
+			ssl->stats.encryptNsec += matrixsslStatNsecs(ssl, start);
+		}
+	}
+	return rc;
+}
+#endif /* USE_MATRIXSSL_STATS */
+
+static int32 encryptRecordData(ssl_t *ssl, int32 type, int32 hsMsgType,
+							int32 messageSize, int32 padLen, unsigned char *pt,
+							sslBuf_t *out, unsigned char **c)
 {
 	unsigned char	*encryptStart;
-	int32			rc, ptLen, divLen, modLen;
+	int32			rc, ptLen, divLen, modLen, cid;
+	unsigned char	macType;
 
 #ifdef USE_ZLIB_COMPRESSION
 	/* In the current implementation, MatrixSSL will only internally handle
@@ -2951,10 +3074,42 @@ static int32 encryptRecord(ssl_t *ssl, int32 type, int32 hsMsgType,
 #endif
 
 	encryptStart = out->end + ssl->recordHeadLen;
+	macType = (unsigned char)type;
+	cid = 0;
+#ifdef USE_DTLS
+	if ((ssl->flags & SSL_FLAGS_DTLS) &&
+			*out->end == SSL_RECORD_TYPE_TLS12_CID) {
+/*
+		DTLSInnerPlaintext is the content followed by the real type, all
+		protected under the tls12_cid type.  Bring any external plaintext
+		in-situ so the type byte can follow it.
+*/
+		encryptStart += ssl->cidOutLen;
+		if (type == SSL_RECORD_TYPE_APPLICATION_DATA) {
+			/* User data ends the record body, after any nonce or IV */
+			divLen = (int32)(*c - encryptStart);
+			if (ssl->flags & SSL_FLAGS_AEAD_W) {
+				divLen -= AEAD_NONCE_LEN(ssl);
+			}
+#ifdef USE_TLS_1_1
+			if ((ssl->flags & SSL_FLAGS_TLS_1_1) && (ssl->enBlockSize > 1)) {
+				divLen -= ssl->enBlockSize;
+			}
+#endif
+			if (pt != *c - divLen) {
+				memmove(*c - divLen, pt, divLen);
+				pt = *c - divLen;
+			}
+		}
+		**c = (unsigned char)type; *c += 1;
+		macType = SSL_RECORD_TYPE_TLS12_CID;
+		cid = 1;
+	}
+#endif /* USE_DTLS */
 
 	if (ssl->flags & SSL_FLAGS_AEAD_W) {
 		encryptStart += AEAD_NONCE_LEN(ssl); /* Move past the plaintext nonce */
-		ssl->outRecType = (unsigned char) type;
+		ssl->outRecType = macType;
 	}
 
 	ptLen = (int32)(*c - encryptStart);
@@ -2968,7 +3123,7 @@ static int32 encryptRecord(ssl_t *ssl, int32 type, int32 hsMsgType,
 */
 		if (type == SSL_RECORD_TYPE_HANDSHAKE) {
 			sslUpdateHSHash(ssl, pt + ssl->enBlockSize,
-				ptLen - ssl->enBlockSize);
+				ptLen - ssl->enBlockSize - cid);
 			if (hsMsgType == SSL_HS_CLIENT_KEY_EXCHANGE &&
 					ssl->extFlags.extended_master_secret == 1) {
 				if (tlsExtendedDeriveKeys(ssl) < 0) {
@@ -2979,7 +3134,7 @@ static int32 encryptRecord(ssl_t *ssl, int32 type, int32 hsMsgType,
 		if (type == SSL_RECORD_TYPE_APPLICATION_DATA) {
 			/* Application data is passed in with real pt from user but
 				with the length of the explict IV added already */
-			*c += ssl->generateMac(ssl, (unsigned char)type,
+			*c += ssl->generateMac(ssl, macType,
 				pt, ptLen - ssl->enBlockSize, *c);
 			/* While we are in here, let's see if this is an in-situ case */
 			if (encryptStart + ssl->enBlockSize == pt) {
@@ -2997,13 +3152,13 @@ static int32 encryptRecord(ssl_t *ssl, int32 type, int32 hsMsgType,
 		} else {
 			/* Handshake messages have been passed in with plaintext that
 				begins with the explicit IV and size included */
-			*c += ssl->generateMac(ssl, (unsigned char)type,
+			*c += ssl->generateMac(ssl, macType,
 				pt + ssl->enBlockSize, ptLen - ssl->enBlockSize, *c);
 		}
 	} else {
 #endif /* USE_TLS_1_1 */
 		if (type == SSL_RECORD_TYPE_HANDSHAKE) {
-			if ((rc = sslUpdateHSHash(ssl, pt, ptLen)) < 0) {
+			if ((rc = sslUpdateHSHash(ssl, pt, ptLen - cid)) < 0) {
 				return rc;
 			}
 			/* Explicit state test for peforming the extended master secret
@@ -3018,16 +3173,16 @@ static int32 encryptRecord(ssl_t *ssl, int32 type, int32 hsMsgType,
 			}
 		}
 		if (ssl->generateMac) {
-			*c += ssl->generateMac(ssl, (unsigned char)type, pt, ptLen, *c);
+			*c += ssl->generateMac(ssl, macType, pt, ptLen, *c);
 		}
 #ifdef USE_TLS_1_1
 	}
 #endif /* USE_TLS_1_1 */
 #else /* USE_TLS */
 	if (type == SSL_RECORD_TYPE_HANDSHAKE) {
-		sslUpdateHSHash(ssl, pt, ptLen);
+		sslUpdateHSHash(ssl, pt, ptLen - cid);
 	}
-	*c += ssl->generateMac(ssl, (unsigned char)type, pt,
+	*c += ssl->generateMac(ssl, macType, pt,
 		ptLen, *c);
 #endif /* USE_TLS */
 
@@ -3168,13 +3323,21 @@ static int32 writeServerHello(ssl_t *ssl, sslBuf_t *out)
 	}
 #endif /* USE_ECC_CIPHER_SUITE */
 
-	if (ssl->maxPtFrag < SSL_MAX_PLAINTEXT_LEN) {
+	if (ssl->maxPtFrag < SSL_MAX_PLAINTEXT_LEN &&
+			!ssl->extFlags.record_size_limit) {
 		if (extLen == 0) {
 			extLen = 2;
 		}
 		extLen += 5;
 	}
 
+	if (ssl->extFlags.record_size_limit) {
+		if (extLen == 0) {
+			extLen = 2;
+		}
+		extLen += 6;
+	}
+
 	if (ssl->extFlags.truncated_hmac) {
 		if (extLen == 0) {
 			extLen = 2;
@@ -3222,6 +3385,15 @@ static int32 writeServerHello(ssl_t *ssl, sslBuf_t *out)
 	}
 #endif
 
+#ifdef USE_DTLS
+	if (ssl->extFlags.connection_id_ext) {
+		if (extLen == 0) {
+			extLen = 2;
+		}
+		extLen += 5 + ssl->cidInLen; /* 4 type/len + 1 len + cid */
+	}
+#endif
+
 	messageSize += extLen;
 	t = 1;
 #ifdef USE_DTLS
@@ -3322,7 +3494,8 @@ static int32 writeServerHello(ssl_t *ssl, sslBuf_t *out)
 		*c = (extLen & 0xFF00) >> 8; c++;
 		*c = extLen & 0xFF; c++;
 
-		if (ssl->maxPtFrag < SSL_MAX_PLAINTEXT_LEN) {
+		if (ssl->maxPtFrag < SSL_MAX_PLAINTEXT_LEN &&
+				!ssl->extFlags.record_size_limit) {
 			*c = 0x0; c++;
 			*c = 0x1; c++;
 			*c = 0x0; c++;
@@ -3341,6 +3514,14 @@ static int32 writeServerHello(ssl_t *ssl, sslBuf_t *out)
 				*c = 0x4; c++;
 			}
 		}
+		if (ssl->extFlags.record_size_limit) {
+			*c = (EXT_RECORD_SIZE_LIMIT & 0xFF00) >> 8; c++;
+			*c = EXT_RECORD_SIZE_LIMIT & 0xFF; c++;
+			*c = 0x00; c++;
+			*c = 0x02; c++;
+			*c = (ssl->recLimit & 0xFF00) >> 8; c++;
+			*c = ssl->recLimit & 0xFF; c++;
+		}
 		if (ssl->extFlags.truncated_hmac) {
 			*c = (EXT_TRUNCATED_HMAC & 0xFF00) >> 8; c++;
 			*c = EXT_TRUNCATED_HMAC & 0xFF; c++;
@@ -3399,6 +3580,19 @@ static int32 writeServerHello(ssl_t *ssl, sslBuf_t *out)
 		}
 #endif
 
+#ifdef USE_DTLS
+		if (ssl->extFlags.connection_id_ext) {
+			/* The connection ID the client is to put on records to us */
+			*c = (EXT_CONNECTION_ID & 0xFF00) >> 8; c++;
+			*c = EXT_CONNECTION_ID & 0xFF; c++;
+			*c = 0; c++;
+			*c = ssl->cidInLen + 1; c++;
+			*c = ssl->cidInLen; c++;
+			memcpy(c, ssl->cidIn, ssl->cidInLen);
+			c += ssl->cidInLen;
+		}
+#endif
+
 #ifdef ENABLE_SECURE_REHANDSHAKES
 		if (ssl->secureRenegotiationFlag == PS_TRUE) {
 			/* RenegotiationInfo*/
@@ -4125,217 +4319,70 @@ int32 matrixSslEncodeHelloRequest(ssl_t *ssl, sslBuf_t *out,
 	only handshake message that supports fragmentation because it is the only
 	message where the 512byte plaintext max of the max_fragment extension can
 	be exceeded.
+
+	The message body is the pre-encoded sslKeys_t certMsg so each record is
+	a straight slice of it.  The first record carries the handshake header.
 */
 static int32 writeMultiRecordCertificate(ssl_t *ssl, sslBuf_t *out,
-				int32 notEmpty, int32 totalClen, int32 lsize)
+				const unsigned char *msg, uint32_t msgLen)
 {
-	psX509Cert_t	*cert, *future;
 	unsigned char	*c, *end, *encryptStart;
 	uint8_t			padLen;
 	uint16_t		messageSize;
-	uint32_t		certLen;
+	uint32_t		offset, fragLen;
 	int32_t			rc;
-	int32			midWrite, midSizeWrite, countDown, firstOne = 1;
 
 	c = out->end;
 	end = out->buf + out->size;
 
-	midSizeWrite = midWrite = certLen = 0;
-	cert = NULL;
-
-	while (totalClen > 0) {
-		if (firstOne) {
-			firstOne = 0;
-			countDown = ssl->maxPtFrag;
-			messageSize = totalClen + lsize + ssl->recordHeadLen + ssl->hshakeHeadLen;
+	for (offset = 0; offset < msgLen; offset += fragLen) {
+		if (offset == 0) {
+			messageSize = msgLen + ssl->recordHeadLen + ssl->hshakeHeadLen;
 			if ((rc = writeRecordHeader(ssl,
 					SSL_RECORD_TYPE_HANDSHAKE_FIRST_FRAG, SSL_HS_CERTIFICATE,
 					&messageSize, &padLen, &encryptStart, end, &c)) < 0) {
 				return rc;
 			}
-			/*	Write out the certs	*/
-			*c = (unsigned char)(((totalClen + (lsize - 3)) & 0xFF0000) >> 16);
-			c++;
-			*c = ((totalClen + (lsize - 3)) & 0xFF00) >> 8; c++;
-			*c = ((totalClen + (lsize - 3)) & 0xFF); c++;
-			countDown -= ssl->hshakeHeadLen + 3;
-
-			if (notEmpty) {
-				cert = ssl->keys->cert;
-				while (cert) {
-					psAssert(cert->unparsedBin != NULL);
-					certLen = cert->binLen;
-					midWrite = 0;
-					if (certLen > 0) {
-						if (countDown <= 3) {
-							/* Fragment falls right on cert len write.  Has
-								to be at least one byte or countDown would have
-								been 0 and got us out of here already*/
-							*c = (unsigned char)((certLen & 0xFF0000) >> 16);
-							c++; countDown--;
-							midSizeWrite = 2;
-							if (countDown != 0) {
-								*c = (certLen & 0xFF00) >> 8; c++; countDown--;
-								midSizeWrite = 1;
-								if (countDown != 0) {
-									*c = (certLen & 0xFF); c++; countDown--;
-									midSizeWrite = 0;
-								}
-							}
-							break;
-						} else {
-							*c = (unsigned char)((certLen & 0xFF0000) >> 16);
-							c++;
-							*c = (certLen & 0xFF00) >> 8; c++;
-							*c = (certLen & 0xFF); c++;
-							countDown -= 3;
-						}
-						midWrite = min(certLen, countDown);
-						memcpy(c, cert->unparsedBin, midWrite);
-						certLen -= midWrite;
-						c += midWrite;
-						totalClen -= midWrite;
-						countDown -= midWrite;
-						if (countDown == 0) {
-							break;
-						}
-					}
-					cert = cert->next;
-				}
-			}
-			if ((rc = postponeEncryptRecord(ssl, SSL_RECORD_TYPE_HANDSHAKE,
-					SSL_HS_CERTIFICATE, messageSize, padLen, encryptStart, out,
-					&c)) < 0) {
-				return rc;
-			}
-			out->end = c;
+			fragLen = ssl->maxPtFrag - ssl->hshakeHeadLen;
 		} else {
-			/* Not-first fragments */
-			if (!cert) {
-				return PS_FAIL;
-			}
-			if (midSizeWrite > 0) {
-				messageSize = midSizeWrite;
-			} else {
-				messageSize = 0;
-			}
-			if ((certLen + messageSize) > ssl->maxPtFrag) {
-				messageSize += ssl->maxPtFrag;
-			} else {
-				messageSize += certLen;
-				if (cert->next != NULL) {
-					future = cert->next;
-					while (future != NULL) {
-						if (messageSize + future->binLen + 3 >
-								(uint32)ssl->maxPtFrag) {
-							messageSize = ssl->maxPtFrag;
-							future = NULL;
-						} else {
-							messageSize += 3 + future->binLen;
-							future = future->next;
-						}
-
-					}
-				}
-			}
-
-			countDown = messageSize;
-			messageSize += ssl->recordHeadLen;
-			/* Second, etc... */
+			fragLen = min(msgLen - offset, (uint32_t)ssl->maxPtFrag);
+			messageSize = fragLen + ssl->recordHeadLen;
 			if ((rc = writeRecordHeader(ssl, SSL_RECORD_TYPE_HANDSHAKE_FRAG,
 					SSL_HS_CERTIFICATE, &messageSize, &padLen, &encryptStart,
 					end, &c)) < 0) {
 				return rc;
 			}
-
-			if (midSizeWrite > 0) {
-				if (midSizeWrite == 2) {
-					*c = (certLen & 0xFF00) >> 8; c++;
-					*c = (certLen & 0xFF); c++;
-					countDown -= 2;
-				} else {
-					*c = (certLen & 0xFF); c++;
-					countDown -= 1;
-				}
-				midSizeWrite = 0;
-			}
-
-			if (countDown < certLen) {
-				memcpy(c, cert->unparsedBin + midWrite, countDown);
-				certLen -= countDown;
-				c += countDown;
-				totalClen -= countDown;
-				midWrite += countDown;
-				countDown = 0;
-			} else {
-				memcpy(c, cert->unparsedBin + midWrite, certLen);
-				c += certLen;
-				totalClen -= certLen;
-				countDown -= certLen;
-				certLen -= certLen;
-			}
-
-			while (countDown > 0) {
-				cert = cert->next;
-				if (!cert) {
-					return PS_FAIL;
-				}
-				certLen = cert->binLen;
-				midWrite = 0;
-				if (countDown <= 3) {
-					/* Fragment falls right on cert len write */
-					*c = (unsigned char)((certLen & 0xFF0000) >> 16);
-					c++; countDown--;
-					midSizeWrite = 2;
-					if (countDown != 0) {
-						*c = (certLen & 0xFF00) >> 8; c++; countDown--;
-						midSizeWrite = 1;
-						if (countDown != 0) {
-							*c = (certLen & 0xFF); c++; countDown--;
-							midSizeWrite = 0;
-						}
-					}
-					break;
-				} else {
-					*c = (unsigned char)((certLen & 0xFF0000) >> 16);
-					c++;
-					*c = (certLen & 0xFF00) >> 8; c++;
-					*c = (certLen & 0xFF); c++;
-					countDown -= 3;
-				}
-				midWrite = min(certLen, countDown);
-				memcpy(c, cert->unparsedBin, midWrite);
-				certLen -= midWrite;
-				c += midWrite;
-				totalClen -= midWrite;
-				countDown -= midWrite;
-				if (countDown == 0) {
-					break;
-				}
-
-			}
-			if ((rc = postponeEncryptRecord(ssl, SSL_RECORD_TYPE_HANDSHAKE,
-					SSL_HS_CERTIFICATE, messageSize, padLen, encryptStart, out,
-					&c)) < 0) {
-				return rc;
-			}
-			out->end = c;
 		}
+		memcpy(c, msg + offset, fragLen);
+		c += fragLen;
+		if ((rc = postponeEncryptRecord(ssl, SSL_RECORD_TYPE_HANDSHAKE,
+				SSL_HS_CERTIFICATE, messageSize, padLen, encryptStart, out,
+				&c)) < 0) {
+			return rc;
+		}
+		out->end = c;
 	}
-
-	out->end = c;
 	return MATRIXSSL_SUCCESS;
 }
 #endif /* USE_SERVER_SIDE_SSL || USE_CLIENT_AUTH */
 
 
 #if defined(USE_OCSP) && defined(USE_SERVER_SIDE_SSL)
+/*
+	The CertificateStatus body is encoded once by matrixSslLoadOCSPResponse
+	  struct {
+          CertificateStatusType status_type;
+          select (status_type) {
+              case ocsp: OCSPResponse;
+          } response;
+      } CertificateStatus;
+*/
 static int32 writeCertificateStatus(ssl_t *ssl, sslBuf_t *out)
 {
 	unsigned char	*c, *end, *encryptStart;
 	uint8_t			padLen;
 	int32			rc;
-	uint16_t		messageSize, ocspLen;
+	uint16_t		messageSize;
 
 
 	/* Easier to exclude this message internally rather than futher muddy the
@@ -4349,27 +4396,16 @@ static int32 writeCertificateStatus(ssl_t *ssl, sslBuf_t *out)
 	c = out->end;
 	end = out->buf + out->size;
 	
-	ocspLen = ssl->keys->OCSPResponseBufLen;
-	messageSize = ssl->recordHeadLen + ssl->hshakeHeadLen + 4 + ocspLen;
+	messageSize = ssl->recordHeadLen + ssl->hshakeHeadLen +
+		ssl->keys->OCSPStatusMsgLen;
 
 	if ((rc = writeRecordHeader(ssl, SSL_RECORD_TYPE_HANDSHAKE,
 			SSL_HS_CERTIFICATE_STATUS, &messageSize, &padLen, &encryptStart,
 			end, &c)) < 0) {
 		return rc;
 	}
-	/*  struct {
-          CertificateStatusType status_type;
-          select (status_type) {
-              case ocsp: OCSPResponse;
-          } response;
-      } CertificateStatus; */
-	*c = 0x1; c++;
-	/* ocspLen is 16 bit value. */
-	*c = 0; c++;
-	*c = (ocspLen & 0xFF00) >> 8; c++;
-	*c = (ocspLen & 0xFF); c++;
-	memcpy(c, ssl->keys->OCSPResponseBuf, ocspLen);
-	c += ocspLen;
+	memcpy(c, ssl->keys->OCSPStatusMsg, ssl->keys->OCSPStatusMsgLen);
+	c += ssl->keys->OCSPStatusMsgLen;
 	
 	if ((rc = postponeEncryptRecord(ssl, SSL_RECORD_TYPE_HANDSHAKE,
 			SSL_HS_CERTIFICATE_STATUS, messageSize, padLen, encryptStart, out,
@@ -4401,17 +4437,18 @@ static int32 writeCertificateStatus(ssl_t *ssl, sslBuf_t *out)
 			second certificate data
 	Certificate data is the base64 section of an X.509 certificate file
 	in PEM format decoded to binary.  No additional interpretation is required.
+
+	A non-empty message body is encoded once when the keys are loaded
+	(sslKeys_t certMsg) and copied here as is.
 */
 static int32 writeCertificate(ssl_t *ssl, sslBuf_t *out, int32 notEmpty)
 {
-#if defined(USE_SERVER_SIDE_SSL) || defined(USE_CLIENT_AUTH)
-	psX509Cert_t	*cert;
-	uint32			certLen;
-#endif /* USE_SERVER_SIDE_SSL || USE_CLIENT_AUTH */
-
+	static const unsigned char	emptyCertMsg[3] = { 0, 0, 0 };
+	const unsigned char	*certMsg;
+	uint32_t		certMsgLen;
 	unsigned char	*c, *end, *encryptStart;
 	uint8_t			padLen;
-	int32			totalCertLen, lsize, i, rc;
+	int32			rc;
 	uint16_t		messageSize;
 
 	psTraceStrHs("<<< %s creating CERTIFICATE  message\n",
@@ -4431,40 +4468,29 @@ static int32 writeCertificate(ssl_t *ssl, sslBuf_t *out, int32 notEmpty)
 	c = out->end;
 	end = out->buf + out->size;
 
-/*
-	Determine total length of certs
-*/
-	totalCertLen = i = 0;
+	certMsg = emptyCertMsg;
+	certMsgLen = sizeof(emptyCertMsg);
 	if (notEmpty) {
 #if defined(USE_SERVER_SIDE_SSL) || defined(USE_CLIENT_AUTH)
-		cert = ssl->keys->cert;
-		for (; cert != NULL; i++) {
-			psAssert(cert->unparsedBin != NULL);
-			totalCertLen += cert->binLen;
-			cert = cert->next;
-		}
+		psAssert(ssl->keys->certMsg != NULL);
+		certMsg = ssl->keys->certMsg;
+		certMsgLen = ssl->keys->certMsgLen;
 #else
 		return PS_DISABLED_FEATURE_FAIL;
 #endif /* USE_SERVER_SIDE_SSL || USE_CLIENT_AUTH */
 	}
 
-/*
-	Account for the 3 bytes of certChain len for each cert and get messageSize
-*/
-	lsize = 3 + (i * 3);
-
 	/* TODO DTLS: Make sure this maxPtFrag is consistent with the fragment
 		extension and is not interfering with DTLS notions of fragmentation */
-	if ((totalCertLen + lsize + ssl->hshakeHeadLen) > ssl->maxPtFrag) {
+	if ((certMsgLen + ssl->hshakeHeadLen) > (uint32_t)ssl->maxPtFrag) {
 #if defined(USE_SERVER_SIDE_SSL) || defined(USE_CLIENT_AUTH)
-		return writeMultiRecordCertificate(ssl, out, notEmpty,
-				totalCertLen, lsize);
+		return writeMultiRecordCertificate(ssl, out, certMsg, certMsgLen);
 #endif /* USE_SERVER_SIDE_SSL || USE_CLIENT_AUTH */
 	} else {
 		messageSize =
 			ssl->recordHeadLen +
 			ssl->hshakeHeadLen +
-			lsize + totalCertLen;
+			certMsgLen;
 
 		if ((rc = writeRecordHeader(ssl, SSL_RECORD_TYPE_HANDSHAKE,
 				SSL_HS_CERTIFICATE, &messageSize, &padLen, &encryptStart,
@@ -4475,7 +4501,7 @@ static int32 writeCertificate(ssl_t *ssl, sslBuf_t *out, int32 notEmpty)
 				Is this the fragment case?
 */
 				if (rc == DTLS_MUST_FRAG) {
-					rc = dtlsWriteCertificate(ssl, totalCertLen, lsize, c);
+					rc = dtlsWriteCertificate(ssl, certMsg, certMsgLen, c);
 					if (rc < 0) {
 						return rc;
 					}
@@ -4488,31 +4514,8 @@ static int32 writeCertificate(ssl_t *ssl, sslBuf_t *out, int32 notEmpty)
 			return rc;
 		}
 
-/*
-		Write out the certs
-*/
-		*c = (unsigned char)(((totalCertLen + (lsize - 3)) & 0xFF0000) >> 16);
-		c++;
-		*c = ((totalCertLen + (lsize - 3)) & 0xFF00) >> 8; c++;
-		*c = ((totalCertLen + (lsize - 3)) & 0xFF); c++;
-
-#if defined(USE_SERVER_SIDE_SSL) || defined(USE_CLIENT_AUTH)
-		if (notEmpty) {
-			cert = ssl->keys->cert;
-			while (cert) {
-				psAssert(cert->unparsedBin != NULL);
-				certLen = cert->binLen;
-				if (certLen > 0) {
-					*c = (unsigned char)((certLen & 0xFF0000) >> 16); c++;
-					*c = (certLen & 0xFF00) >> 8; c++;
-					*c = (certLen & 0xFF); c++;
-					memcpy(c, cert->unparsedBin, certLen);
-					c += certLen;
-				}
-				cert = cert->next;
-			}
-		}
-#endif /* USE_SERVER_SIDE_SSL || USE_CLIENT_AUTH */
+		memcpy(c, certMsg, certMsgLen);
+		c += certMsgLen;
 
 		if ((rc = postponeEncryptRecord(ssl, SSL_RECORD_TYPE_HANDSHAKE,
 				SSL_HS_CERTIFICATE, messageSize, padLen, encryptStart, out,
@@ -4767,6 +4770,7 @@ int32_t matrixSslEncodeClientHello(ssl_t *ssl, sslBuf_t *out,
 #endif /* USE_ECC_CIPHER_SUITE */
 #ifdef USE_DTLS
 	unsigned char	*extStart = NULL;
+	unsigned char	*recordStart;
 	int				cipherCount;
 #endif
 
@@ -4903,6 +4907,26 @@ int32_t matrixSslEncodeClientHello(ssl_t *ssl, sslBuf_t *out,
 		}
 	}
 
+	/* Record size limit. Takes effect again only if the server agrees */
+	ssl->extFlags.record_size_limit = 0;
+	if (ssl->minVer > 0 && ssl->recLimit > 0) {
+		if (extLen == 0) {
+			extLen = 2; /* First extension found so total len */
+		}
+		extLen += 6; /* 2 type, 2 length, 2 limit */
+	}
+
+#ifdef USE_DTLS
+	/* Connection IDs are settled by the first handshake */
+	if ((ssl->flags & SSL_FLAGS_DTLS) && ssl->extFlags.offer_connection_id &&
+			!ssl->extFlags.connection_id) {
+		if (extLen == 0) {
+			extLen = 2; /* First extension found so total len */
+		}
+		extLen += 5 + ssl->cidInLen; /* 4 type/len + 1 len + cid */
+	}
+#endif
+
 	if (options->truncHmac) {
 		if (extLen == 0) {
 			extLen = 2; /* First extension found so total len */
@@ -5087,6 +5111,9 @@ int32_t matrixSslEncodeClientHello(ssl_t *ssl, sslBuf_t *out,
 
 	c = out->end;
 	end = out->buf + out->size;
+#ifdef USE_DTLS
+	recordStart = c;
+#endif
 
 	if ((rc = writeRecordHeader(ssl, SSL_RECORD_TYPE_HANDSHAKE,
 			SSL_HS_CLIENT_HELLO, &messageSize, &padLen, &encryptStart,
@@ -5300,6 +5327,30 @@ int32_t matrixSslEncodeClientHello(ssl_t *ssl, sslBuf_t *out,
 				*c = 0x04; c++;
 			}
 		}
+
+		if (ssl->minVer > 0 && ssl->recLimit > 0) {
+			ssl->extFlags.req_record_size_limit = 1;
+			*c = (EXT_RECORD_SIZE_LIMIT & 0xFF00) >> 8; c++;
+			*c = EXT_RECORD_SIZE_LIMIT & 0xFF; c++;
+			*c = 0x00; c++;
+			*c = 0x02; c++;
+			*c = (ssl->recLimit & 0xFF00) >> 8; c++;
+			*c = ssl->recLimit & 0xFF; c++;
+		}
+#ifdef USE_DTLS
+		if ((ssl->flags & SSL_FLAGS_DTLS) &&
+				ssl->extFlags.offer_connection_id &&
+				!ssl->extFlags.connection_id) {
+			ssl->extFlags.req_connection_id = 1;
+			*c = (EXT_CONNECTION_ID & 0xFF00) >> 8; c++;
+			*c = EXT_CONNECTION_ID & 0xFF; c++;
+			*c = 0; c++;
+			*c = ssl->cidInLen + 1; c++;
+			*c = ssl->cidInLen; c++;
+			memcpy(c, ssl->cidIn, ssl->cidInLen);
+			c += ssl->cidInLen;
+		}
+#endif
 #ifdef ENABLE_SECURE_REHANDSHAKES
 /*
 		Populated RenegotiationInfo extension
@@ -5444,6 +5495,11 @@ int32_t matrixSslEncodeClientHello(ssl_t *ssl, sslBuf_t *out,
 		return rc;
 	}
 	out->end = c;
+#ifdef USE_DTLS
+	if (ssl->flags & SSL_FLAGS_DTLS) {
+		dtlsCacheFlight(ssl, recordStart, out->end);
+	}
+#endif /* USE_DTLS */
 
 /*
 	Could be a rehandshake so clean	up old context if necessary.
@@ -5899,6 +5955,34 @@ static int32 writeClientKeyExchange(ssl_t *ssl, sslBuf_t *out)
 
 #ifndef USE_ONLY_PSK_CIPHER_SUITE
 #ifdef USE_CLIENT_AUTH
+#ifdef USE_TLS_1_2
+/******************************************************************************/
+/*
+	Replace the default snapshot in out with the hashLen digest the
+	CertificateVerify signature is made over.  SHA-256 is the default.
+*/
+static int32 cvSnapshotHSHash(ssl_t *ssl, int32 hashLen, unsigned char *out)
+{
+	switch (hashLen) {
+#ifdef USE_SHA1
+	case SHA1_HASH_SIZE:
+		return sslSha1SnapshotHSHash(ssl, out);
+#endif
+#ifdef USE_SHA384
+	case SHA384_HASH_SIZE:
+		return sslSha384SnapshotHSHash(ssl, out);
+#endif
+#ifdef USE_SHA512
+	case SHA512_HASH_SIZE:
+		return sslSha512SnapshotHSHash(ssl, out);
+#endif
+	default:
+		break;
+	}
+	return PS_SUCCESS;
+}
+#endif /* USE_TLS_1_2 */
+
 /******************************************************************************/
 /*	Postponed CERTIFICATE_VERIFY PKA operation */
 static int32 nowDoCvPka(ssl_t *ssl, psBuf_t *out)
@@ -5945,24 +6029,9 @@ static int32 nowDoCvPka(ssl_t *ssl, psBuf_t *out)
 #ifdef USE_TLS_1_2
 		/* Tweak if needed */
 		if (ssl->flags & SSL_FLAGS_TLS_1_2) {
-			switch(pka->inlen) {
-#ifdef USE_SHA1
-			case SHA1_HASH_SIZE:
-				sslSha1SnapshotHSHash(ssl, msgHash);
-				break;
-#endif
-#ifdef USE_SHA384
-			case SHA384_HASH_SIZE:
-				sslSha384SnapshotHSHash(ssl, msgHash);
-				break;
-#endif
-#ifdef USE_SHA512
-			case SHA512_HASH_SIZE:
-				sslSha512SnapshotHSHash(ssl, msgHash);
-				break;
-#endif
-			default:
-				break;
+			if (cvSnapshotHSHash(ssl, pka->inlen, msgHash) < 0) {
+				psFree(tmpEcdsa, ssl->hsPool);
+				return MATRIXSSL_ERROR;
 			}
 #ifdef USE_DTLS
 			ssl->ecdsaSizeChange = 0;
@@ -6050,17 +6119,8 @@ static int32 nowDoCvPka(ssl_t *ssl, psBuf_t *out)
 				hash strength because the sig alg might not match the
 				pubkey alg.  This was also already confirmed in
 				CertRequest parse so wouldn't be here if not allowed */
-			if (pka->inlen == SHA1_HASH_SIZE) {
-				sslSha1SnapshotHSHash(ssl, msgHash);
-			} else if (pka->inlen == SHA256_HASH_SIZE) {
-#ifdef USE_SHA384
-			} else if (pka->inlen == SHA384_HASH_SIZE) {
-				sslSha384SnapshotHSHash(ssl, msgHash);
-#endif /* USE_SHA384 */
-#ifdef USE_SHA512
-			} else if (pka->inlen == SHA512_HASH_SIZE) {
-				sslSha512SnapshotHSHash(ssl, msgHash);
-#endif /* USE_SHA512 */
+			if (cvSnapshotHSHash(ssl, pka->inlen, msgHash) < 0) {
+				return MATRIXSSL_ERROR;
 			}
 
 			/* The signed element is not the straight hash */
@@ -6892,7 +6952,7 @@ static int32 writeHelloVerifyRequest(ssl_t *ssl, sslBuf_t *out)
 int32 psWriteRecordInfo(ssl_t *ssl, unsigned char type, int32 len,
 							   unsigned char *c, int32 hsType)
 {
-	int32	explicitNonce = 0;
+	int32	explicitNonce = 0, cidLen = 0;
 
 	if (type == SSL_RECORD_TYPE_HANDSHAKE_FRAG) {
 		type = SSL_RECORD_TYPE_HANDSHAKE;
@@ -6911,6 +6971,12 @@ int32 psWriteRecordInfo(ssl_t *ssl, unsigned char type, int32 len,
 		*c = ssl->rsn[3]; c++;
 		*c = ssl->rsn[4]; c++;
 		*c = ssl->rsn[5]; c++;
+		if (type == SSL_RECORD_TYPE_TLS12_CID) {
+			/* RFC 9146 header has the peer's connection ID before length */
+			cidLen = ssl->cidOutLen;
+			memcpy(c, ssl->cidOut, cidLen);
+			c += cidLen;
+		}
 	}
 #endif /* USE_DTLS */
 	*c = (len & 0xFF00) >> 8; c++;
@@ -6950,10 +7016,10 @@ int32 psWriteRecordInfo(ssl_t *ssl, unsigned char type, int32 len,
 #ifdef USE_DTLS
 		}
 #endif
-		return ssl->recordHeadLen + TLS_EXPLICIT_NONCE_LEN;
+		return ssl->recordHeadLen + cidLen + TLS_EXPLICIT_NONCE_LEN;
 	}
 
-	return ssl->recordHeadLen;
+	return ssl->recordHeadLen + cidLen;
 }
 
 /******************************************************************************/
@@ -120,6 +120,7 @@ static char *errtostr(int rc)
 int32 main(int32 argc, char **argv)
 {
 	psX509Cert_t	*trusted, *chain, *cert;
+	psX509CertIndex_t	index;
 	psPool_t		*pool;
 	int32			rc, i;
 	uint32			faildate, flags, depth;
@@ -128,6 +129,7 @@ int32 main(int32 argc, char **argv)
 	faildate = 0;
 	pool = NULL;
 	trusted = chain = NULL;
+	memset(&index, 0x0, sizeof(index));
 
 	if (argc != 4) {
 		usage();
@@ -155,6 +157,10 @@ int32 main(int32 argc, char **argv)
 			faildate |= cert->authFailFlags & PS_CERT_AUTH_FAIL_DATE_FLAG;
 			psAssert((cert->authFailFlags & ~faildate) == 0);
 		}
+		if ((rc = psX509IndexCerts(pool, trusted, &index)) < 0) {
+			printf("FAIL index %s %d\n", argv[1], rc);
+			goto L_EXIT;
+		}
 	}
 
 	if ((rc = psX509ParseCertFile(pool, argv[2], &chain, 0)) < 0) {
@@ -178,11 +184,12 @@ int32 main(int32 argc, char **argv)
 			printf("FAIL validate general name %s\n", argv[3]);
 			goto L_EXIT;
 		}
-		rc = matrixValidateCerts(pool, chain, trusted, argv[3], &cert, NULL,
-			NULL);
+		rc = matrixValidateCerts(pool, chain, trusted, &index, argv[3], &cert,
+			NULL, NULL);
 	} else {
 		printf("WARN subject not validated\n");
-		rc = matrixValidateCerts(pool, chain, trusted, NULL, &cert, NULL, NULL);
+		rc = matrixValidateCerts(pool, chain, trusted, &index, NULL, &cert,
+			NULL, NULL);
 	}
 	if (rc < 0) {
 		printf("%s\n", errtostr(rc));
@@ -226,6 +233,7 @@ int32 main(int32 argc, char **argv)
 	rc = 0;
 
 L_EXIT:
+	psX509FreeCertIndex(&index);
 	if (trusted) psX509FreeCert(trusted);
 	if (chain) psX509FreeCert(chain);
 	matrixSslClose();
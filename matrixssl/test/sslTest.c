@@ -233,6 +233,9 @@ static char dhParamFile[] = "../../testkeys/DH/1024_DH_PARAMS.pem";
 #include "testkeys/RSA/2048_RSA_KEY.h"
 #include "testkeys/RSA/2048_RSA.h"
 #include "testkeys/RSA/2048_RSA_CA.h"
+#include "testkeys/RSA/3072_RSA_KEY.h"
+#include "testkeys/RSA/3072_RSA.h"
+#include "testkeys/RSA/3072_RSA_CA.h"
 #include "testkeys/RSA/4096_RSA_KEY.h"
 #include "testkeys/RSA/4096_RSA.h"
 #include "testkeys/RSA/4096_RSA_CA.h"
@@ -278,9 +281,23 @@ static uint32_t DH_SIZE;
 
 #endif /* USE_HEADER_KEYS */
 
+/*
+	Benchmark mode, see sslBench().  Needs threads and the header keys
+*/
+#if !defined(EMBEDDED) && defined(POSIX) && defined(USE_MULTITHREADING) && \
+	defined(USE_HEADER_KEYS)
+#define SSL_BENCH
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+
 /******************************************************************************/
 
 int sslTest(void);
+#ifdef SSL_BENCH
+static int sslBench(int argc, char **argv);
+#endif
 
 static void freeSessionAndConnection(sslConn_t *cpp);
 
@@ -325,6 +342,51 @@ static int32 initializeClientAuthHandshake(sslConn_t *clnConn,
 
 static int32 performHandshake(sslConn_t *sendingSide, sslConn_t *receivingSide);
 static int32 exchangeAppData(sslConn_t *sendingSide, sslConn_t *receivingSide, uint32_t bytes);
+static int32 exchangeAppDataMulti(sslConn_t *sendingSide, sslConn_t *receivingSide);
+#ifdef USE_DYNAMIC_RECORD_SIZING
+static int32 dynamicRecordTest(sslConn_t *sendingSide, sslConn_t *receivingSide);
+#endif
+#if defined(USE_SERVER_SIDE_SSL) && defined(USE_CLIENT_SIDE_SSL)
+#define TEST_RECORD_SIZE_LIMIT
+static int32 recordSizeLimitTest(sslConn_t *clnConn, sslConn_t *svrConn);
+#endif
+#ifdef USE_SERVER_SIDE_SSL
+static int32 peekHelloTest(sslConn_t *clnConn, uint16_t cipherSuite);
+#endif
+#ifdef USE_DTLS
+static int32 dtlsSwapReadbufTest(sslConn_t *sendingSide,
+				sslConn_t *receivingSide);
+static int32 dtlsReplayTest(sslConn_t *clnConn);
+#if defined(USE_SERVER_SIDE_SSL) && defined(USE_CLIENT_SIDE_SSL)
+#define TEST_DTLS_COOKIE
+static int32 dtlsCookieTest(sslConn_t *clnConn, sslConn_t *svrConn);
+static int32 dtlsCidTest(sslConn_t *clnConn, sslConn_t *svrConn);
+static int32 dtlsForgedRecordTest(sslConn_t *clnConn, sslConn_t *svrConn);
+static int32 dtlsResentFinishedTest(sslConn_t *clnConn, sslConn_t *svrConn);
+#if defined(POSIX) && !defined(__APPLE__) && !defined(__tile__)
+#define TEST_DTLS_RETRANSMIT
+static int32 dtlsPmtuTest(sslConn_t *clnConn, sslConn_t *svrConn);
+static int32 dtlsTimerTest(sslConn_t *clnConn, sslConn_t *svrConn);
+#endif
+#endif
+#endif
+#if defined(USE_SERVER_SIDE_SSL) && defined(USE_CLIENT_SIDE_SSL) && \
+	defined(USE_TLS_RSA_WITH_AES_128_CBC_SHA) && \
+	defined(USE_TLS_RSA_WITH_AES_256_CBC_SHA)
+#define TEST_SERVER_CIPHER_PREF
+static int32 serverCipherPrefTest(sslConn_t *clnConn, sslConn_t *svrConn);
+#endif
+#if defined(USE_CERT_CHAIN_CACHE) && defined(USE_CLIENT_SIDE_SSL) && \
+	defined(USE_TLS_RSA_WITH_AES_128_CBC_SHA)
+#define TEST_CERT_CHAIN_CACHE
+static int32 chainCacheTest(sslConn_t *clnConn);
+#endif
+#ifdef USE_MEMORY_ACCOUNTING
+static int32 memoryReport(sslConn_t *clnConn, sslConn_t *svrConn);
+#endif
+#ifdef USE_MATRIXSSL_STATS
+static int32 statsReport(sslConn_t *clnConn, sslConn_t *svrConn);
+#endif
 #ifdef ENABLE_PERF_TIMING
 static int32_t throughputTest(sslConn_t *s, sslConn_t *r, uint16_t nrec, uint16_t reclen);
 static void print_throughput(void);
@@ -667,6 +729,11 @@ static const char *cipher_name(uint16_t cid)
 #ifndef EMBEDDED
 int main(int argc, char **argv)
 {
+#ifdef SSL_BENCH
+	if (argc > 1 && strcmp(argv[1], "-B") == 0) {
+		return sslBench(argc - 1, argv + 1);
+	}
+#endif
 	return sslTest();
 }
 #endif
@@ -914,6 +981,12 @@ L_NEXT_DH:
 			_psTrace("		FAILED: initializing Standard handshake\n");
 			goto LBL_FREE;
 		}
+#ifdef USE_SERVER_SIDE_SSL
+		if (peekHelloTest(clnConn, ciphers[id].id) < 0) {
+			_psTrace("		FAILED: ClientHello peek\n");
+			goto LBL_FREE;
+		}
+#endif
 #ifdef USE_MATRIXSSL_STATS
 		matrixSslRegisterStatCallback(clnConn->ssl, statCback, NULL);
 		matrixSslRegisterStatCallback(svrConn->ssl, statCback, NULL);
@@ -930,6 +1003,94 @@ L_NEXT_DH:
 			} else {
 				testTrace("\n");
 			}
+			if (exchangeAppDataMulti(clnConn, svrConn) < 0) {
+				_psTrace("		FAILED: multi record receive\n");
+				goto LBL_FREE;
+			}
+#ifdef USE_DYNAMIC_RECORD_SIZING
+			if (dynamicRecordTest(svrConn, clnConn) < 0) {
+				_psTrace("		FAILED: dynamic record sizing\n");
+				goto LBL_FREE;
+			}
+#endif
+#ifdef TEST_RECORD_SIZE_LIMIT
+			if (recordSizeLimitTest(clnConn, svrConn) < 0) {
+				_psTrace("		FAILED: record size limit\n");
+				goto LBL_FREE;
+			}
+#endif
+#ifdef USE_DTLS
+			if ((clnConn->ssl->flags & SSL_FLAGS_DTLS) &&
+					dtlsSwapReadbufTest(clnConn, svrConn) < 0) {
+				_psTrace("		FAILED: DTLS read buffer swap\n");
+				goto LBL_FREE;
+			}
+			if ((clnConn->ssl->flags & SSL_FLAGS_DTLS) &&
+					dtlsReplayTest(clnConn) < 0) {
+				_psTrace("		FAILED: DTLS replay window\n");
+				goto LBL_FREE;
+			}
+#endif
+#ifdef TEST_DTLS_COOKIE
+			if ((clnConn->ssl->flags & SSL_FLAGS_DTLS) &&
+					dtlsCookieTest(clnConn, svrConn) < 0) {
+				_psTrace("		FAILED: DTLS stateless cookie\n");
+				goto LBL_FREE;
+			}
+			if ((clnConn->ssl->flags & SSL_FLAGS_DTLS) &&
+					dtlsCidTest(clnConn, svrConn) < 0) {
+				_psTrace("		FAILED: DTLS connection id\n");
+				goto LBL_FREE;
+			}
+			if ((clnConn->ssl->flags & SSL_FLAGS_DTLS) &&
+					dtlsForgedRecordTest(clnConn, svrConn) < 0) {
+				_psTrace("		FAILED: DTLS forged record\n");
+				goto LBL_FREE;
+			}
+			if ((clnConn->ssl->flags & SSL_FLAGS_DTLS) &&
+					dtlsResentFinishedTest(clnConn, svrConn) < 0) {
+				_psTrace("		FAILED: DTLS resent FINISHED\n");
+				goto LBL_FREE;
+			}
+#endif
+#ifdef TEST_DTLS_RETRANSMIT
+			if ((clnConn->ssl->flags & SSL_FLAGS_DTLS) &&
+					dtlsPmtuTest(clnConn, svrConn) < 0) {
+				_psTrace("		FAILED: DTLS PMTU backoff\n");
+				goto LBL_FREE;
+			}
+			if ((clnConn->ssl->flags & SSL_FLAGS_DTLS) &&
+					dtlsTimerTest(clnConn, svrConn) < 0) {
+				_psTrace("		FAILED: DTLS retransmit timer\n");
+				goto LBL_FREE;
+			}
+#endif
+#ifdef TEST_SERVER_CIPHER_PREF
+			if (ciphers[id].id == TLS_RSA_WITH_AES_128_CBC_SHA &&
+					serverCipherPrefTest(clnConn, svrConn) < 0) {
+				_psTrace("		FAILED: server cipher preference\n");
+				goto LBL_FREE;
+			}
+#endif
+#ifdef TEST_CERT_CHAIN_CACHE
+			if (ciphers[id].id == TLS_RSA_WITH_AES_128_CBC_SHA &&
+					chainCacheTest(clnConn) < 0) {
+				_psTrace("		FAILED: certificate chain cache\n");
+				goto LBL_FREE;
+			}
+#endif
+#ifdef USE_MEMORY_ACCOUNTING
+			if (memoryReport(clnConn, svrConn) < 0) {
+				_psTrace("		FAILED: session memory limit\n");
+				goto LBL_FREE;
+			}
+#endif
+#ifdef USE_MATRIXSSL_STATS
+			if (statsReport(clnConn, svrConn) < 0) {
+				_psTrace("		FAILED: session statistics\n");
+				goto LBL_FREE;
+			}
+#endif
 #ifdef ENABLE_PERF_TIMING
 			if (throughputTest(clnConn, svrConn, THROUGHPUT_NREC, THROUGHPUT_RECSIZE) < 0) {
 				_psTrace(" but FAILED throughputTest\n");
@@ -1331,6 +1492,14 @@ LBL_FREE:
 
 	psFree(svrConn, NULL);
 	psFree(clnConn, NULL);
+#ifdef USE_MEMORY_ACCOUNTING
+	{
+		psMemStats_t	all;
+		psMemGetStats(NULL, &all);
+		_psTraceInt("Memory high water mark: %d bytes", (int32)all.peak);
+		_psTraceInt(", %d bytes not freed\n", (int32)all.current);
+	}
+#endif
 	matrixSslClose();
 
 #ifdef WIN32
@@ -1341,142 +1510,1476 @@ LBL_FREE:
 	return PS_SUCCESS;
 }
 
-static int32 initializeHandshake(sslConn_t *clnConn, sslConn_t *svrConn,
-							uint16_t cipherSuite, sslSessionId_t *sid)
+#ifdef USE_MEMORY_ACCOUNTING
+/*
+	Report the footprint of a connected client/server pair. The session peak
+	covers the handshake, current is what an idle connection costs.
+	Build with -DSSL_TEST_MAX_SESSION_MEMORY=<bytes> to fail the test when
+	either side exceeds the limit, for catching regressions in CI.
+*/
+static int32 memoryReport(sslConn_t *clnConn, sslConn_t *svrConn)
 {
-	int32	rc;
+	psMemStats_t	cln, svr, keys;
 
-	if ((rc = initializeServer(svrConn, cipherSuite)) < 0) {
-		return rc;
+	if (matrixSslGetMemStats(clnConn->ssl, &cln) < 0 ||
+			matrixSslGetMemStats(svrConn->ssl, &svr) < 0) {
+		return PS_FAILURE;
 	}
-	return initializeClient(clnConn, cipherSuite, sid);
-
+	_psTraceInt("		MEMORY: client peak %d", (int32)cln.peak);
+	_psTraceInt(" current %d,", (int32)cln.current);
+	_psTraceInt(" server peak %d", (int32)svr.peak);
+	_psTraceInt(" current %d", (int32)svr.current);
+	if (matrixSslGetKeysMemStats(svrConn->keys, &keys) == PS_SUCCESS) {
+		_psTraceInt(", server keys %d", (int32)keys.current);
+	}
+	_psTrace("\n");
+#ifdef SSL_TEST_MAX_SESSION_MEMORY
+	if (cln.peak > SSL_TEST_MAX_SESSION_MEMORY ||
+			svr.peak > SSL_TEST_MAX_SESSION_MEMORY) {
+		return PS_FAILURE;
+	}
+#endif
+	return PS_SUCCESS;
 }
+#endif /* USE_MEMORY_ACCOUNTING */
 
-#ifdef SSL_REHANDSHAKES_ENABLED
-static int32 initializeReHandshake(sslConn_t *clnConn, sslConn_t *svrConn,
-								   uint16_t cipherSuite)
+#ifdef USE_MATRIXSSL_STATS
+/*
+	Everything one side encoded has been decoded by the other by now
+*/
+static int32 statsReport(sslConn_t *clnConn, sslConn_t *svrConn)
 {
-	return matrixSslEncodeRehandshake(clnConn->ssl, NULL, NULL,
-		SSL_OPTION_FULL_HANDSHAKE, &cipherSuite, 1);
-}
+	sslStats_t	cln, svr;
 
-static int32 initializeServerInitiatedReHandshake(sslConn_t *clnConn,
-								sslConn_t *svrConn, uint16_t cipherSuite)
-{
-	return matrixSslEncodeRehandshake(svrConn->ssl, NULL, NULL,
-		SSL_OPTION_FULL_HANDSHAKE, &cipherSuite, 1);
+	if (matrixSslGetStats(clnConn->ssl, &cln) < 0 ||
+			matrixSslGetStats(svrConn->ssl, &svr) < 0) {
+		return PS_FAILURE;
+	}
+	if (cln.recordsOut != svr.recordsIn || cln.bytesOut != svr.bytesIn ||
+			svr.recordsOut != cln.recordsIn || svr.bytesOut != cln.bytesIn) {
+		return PS_FAILURE;
+	}
+	matrixSslResetStats(clnConn->ssl);
+	if (matrixSslGetStats(clnConn->ssl, &cln) < 0 || cln.recordsOut != 0) {
+		return PS_FAILURE;
+	}
+	return PS_SUCCESS;
 }
+#endif /* USE_MATRIXSSL_STATS */
 
-static int32 initializeServerInitiatedResumedReHandshake(sslConn_t *clnConn,
-								sslConn_t *svrConn, uint16_t cipherSuite)
-{
-	return matrixSslEncodeRehandshake(svrConn->ssl, NULL, NULL, 0, &cipherSuite,
-		1);
+#ifdef USE_SERVER_SIDE_SSL
+/*
+	TLS 1.2 ClientHello carrying SNI "localhost", ALPN "h2","http/1.1" and
+	supported_groups secp256r1, secp384r1.  Offsets below index into it.
+*/
+static const unsigned char peekHello[] = {
+	0x16, 0x03, 0x01, 0x00, 0x5D,					/* record, len 93 */
+	0x01, 0x00, 0x00, 0x59,							/* ClientHello, 89 */
+	0x03, 0x03,
+	0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	0x00,											/* session_id */
+	0x00, 0x02, 0x00, 0x2F,							/* cipher_suites */
+	0x01, 0x00,										/* compression */
+	0x00, 0x2E,										/* extensions, 46 */
+	0x00, 0x00, 0x00, 0x0E, 0x00, 0x0C,				/* 52: server_name */
+	0x00, 0x00, 0x09,
+	'l', 'o', 'c', 'a', 'l', 'h', 'o', 's', 't',
+	0x00, 0x10, 0x00, 0x0E, 0x00, 0x0C,				/* 70: ALPN */
+	0x02, 'h', '2',
+	0x08, 'h', 't', 't', 'p', '/', '1', '.', '1',
+	0x00, 0x0A, 0x00, 0x06, 0x00, 0x04,				/* 88: supported_groups */
+	0x00, 0x17, 0x00, 0x18
+};
 
-}
+/* One byte overwritten in peekHello and the result expected */
+static const struct {
+	uint8_t		off;
+	uint8_t		val;
+	int32		rc;
+} peekHelloBad[] = {
+	{ 0, 0x17, PS_PROTOCOL_FAIL },		/* not a handshake record */
+	{ 3, 0xFF, PS_PROTOCOL_FAIL },		/* record over SSL_MAX_RECORD_LEN */
+	{ 4, 0x5E, MATRIXSSL_REQUEST_RECV },	/* record runs past the buffer */
+	{ 8, 0x5A, PS_UNSUPPORTED_FAIL },	/* message spans records */
+	{ 51, 0x2F, PS_PROTOCOL_FAIL },		/* extensions block length */
+	{ 55, 0x0F, PS_PROTOCOL_FAIL },		/* server_name extension length */
+	{ 60, 0x0A, PS_PROTOCOL_FAIL },		/* host_name past the list */
+	{ 76, 0x00, PS_PROTOCOL_FAIL },		/* empty ALPN name */
+	{ 79, 0x09, PS_PROTOCOL_FAIL },		/* ALPN name past the list */
+	{ 91, 0x07, PS_PROTOCOL_FAIL },		/* extension past the message */
+	{ 93, 0x05, PS_PROTOCOL_FAIL },		/* odd supported_groups list */
+};
 
-static int32 initializeResumedReHandshake(sslConn_t *clnConn,
-							sslConn_t *svrConn, uint16_t cipherSuite)
+/*
+	The client's first flight must be readable without a server session and
+	offer the suite under test.  A partial record asks for more data.  The
+	fixed hello checks the extension values and that malformed copies are
+	refused without reading past the buffer.
+*/
+static int32 peekHelloTest(sslConn_t *clnConn, uint16_t cipherSuite)
 {
-	return matrixSslEncodeRehandshake(clnConn->ssl, NULL, NULL, 0, &cipherSuite,
-		1);
-}
+	sslClientHelloInfo_t	hello;
+	unsigned char			*buf;
+	unsigned char			bad[sizeof(peekHello)];
+	int32					len;
+	uint16_t				i;
 
-static int32 initializeUpgradeCertCbackReHandshake(sslConn_t *clnConn,
-							sslConn_t *svrConn, uint16_t cipherSuite)
-{
-	return matrixSslEncodeRehandshake(clnConn->ssl, NULL, clnCertCheckerUpdate,
-							0, &cipherSuite, 1);
-}
+	if ((len = matrixSslGetOutdata(clnConn->ssl, &buf)) <= 0) {
+		return PS_FAILURE;
+	}
+	if (matrixSslPeekClientHello(buf, len - 1, &hello) !=
+			MATRIXSSL_REQUEST_RECV) {
+		return PS_FAILURE;
+	}
+	if (matrixSslPeekClientHello(buf, len, &hello) != MATRIXSSL_SUCCESS ||
+			hello.majVer != clnConn->ssl->majVer) {
+		return PS_FAILURE;
+	}
+	for (i = 0; i < hello.cipherSuitesLen; i += 2) {
+		if (((hello.cipherSuites[i] << 8) | hello.cipherSuites[i + 1]) ==
+				cipherSuite) {
+			break;
+		}
+	}
+	if (i >= hello.cipherSuitesLen) {
+		return PS_FAILURE;
+	}
 
-static int32 initializeUpgradeKeysReHandshake(sslConn_t *clnConn,
-							sslConn_t *svrConn, uint16_t cipherSuite)
-{
-/*
-	Not really changing the keys but this still tests that passing a
-	valid arg will force a full handshake
-*/
-	return matrixSslEncodeRehandshake(clnConn->ssl, clnConn->ssl->keys, NULL,
-							0, &cipherSuite, 1);
+	if (matrixSslPeekClientHello(peekHello, sizeof(peekHello), &hello) !=
+			MATRIXSSL_SUCCESS) {
+		return PS_FAILURE;
+	}
+	if (hello.majVer != 3 || hello.minVer != 3 ||
+			hello.random != peekHello + 11 || hello.sessionId != NULL ||
+			hello.cipherSuitesLen != 2 || hello.cipherSuites[1] != 0x2F) {
+		return PS_FAILURE;
+	}
+	if (hello.serverNameLen != 9 || hello.serverName != peekHello + 61) {
+		return PS_FAILURE;
+	}
+	if (hello.alpnLen != 12 || hello.alpn != peekHello + 76 ||
+			memcmp(hello.alpn, "\x02h2\x08http/1.1", 12) != 0) {
+		return PS_FAILURE;
+	}
+	if (hello.groupsLen != 4 ||
+			memcmp(hello.groups, "\x00\x17\x00\x18", 4) != 0) {
+		return PS_FAILURE;
+	}
+	for (i = 1; i < sizeof(peekHello); i++) {
+		if (matrixSslPeekClientHello(peekHello, i, &hello) !=
+				MATRIXSSL_REQUEST_RECV) {
+			return PS_FAILURE;
+		}
+	}
+	for (i = 0; i < sizeof(peekHelloBad) / sizeof(peekHelloBad[0]); i++) {
+		memcpy(bad, peekHello, sizeof(peekHello));
+		bad[peekHelloBad[i].off] = peekHelloBad[i].val;
+		if (matrixSslPeekClientHello(bad, sizeof(bad), &hello) !=
+				peekHelloBad[i].rc) {
+			_psTraceInt("		peek of bad hello %d accepted\n", i);
+			return PS_FAILURE;
+		}
+	}
+	return PS_SUCCESS;
 }
+#endif /* USE_SERVER_SIDE_SSL */
 
-static int32 initializeChangeCipherReHandshake(sslConn_t *clnConn,
-							sslConn_t *svrConn, uint16_t cipherSuite)
-{
+#ifdef USE_DTLS
 /*
-	Just picking the most common suite
+	Receive one datagram by handing the receiver a buffer that already
+	holds it, as a recvmmsg loop does, instead of copying it in.
 */
-#ifdef USE_SSL_RSA_WITH_3DES_EDE_CBC_SHA
-	uint16_t suite;
-	suite = SSL_RSA_WITH_3DES_EDE_CBC_SHA;
-	return matrixSslEncodeRehandshake(clnConn->ssl, NULL, NULL,
-					0, &suite, 1);
-#else
-	return matrixSslEncodeRehandshake(clnConn->ssl, NULL, NULL, 0, 0, 0);
-#endif
+static int32 dtlsSwapReadbufTest(sslConn_t *sendingSide,
+				sslConn_t *receivingSide)
+{
+	ssl_t			*ssl = receivingSide->ssl;
+	const char		*msg = "swapped datagram";
+	unsigned char	*buf, *mine, *old, *out, *pt;
+	uint32			size, mineSize, oldSize, ptLen;
+	int32			len, rc;
+
+	size = (uint32)matrixDtlsGetPmtu();
+	if ((buf = psMalloc(ssl->bufferPool, size)) == NULL) {
+		return PS_FAILURE;
+	}
+	/* Smaller than a datagram can be, or while data is still held */
+	size--;
+	rc = matrixDtlsSwapReadbuf(ssl, &buf, &size);
+	size++;
+	if (rc != PS_ARG_FAIL) {
+		goto L_FAIL;
+	}
+	ssl->inlen = 1;
+	rc = matrixDtlsSwapReadbuf(ssl, &buf, &size);
+	ssl->inlen = 0;
+	if (rc != PS_PENDING) {
+		goto L_FAIL;
+	}
+
+	len = (int32)strlen(msg);
+	if (matrixSslGetWritebuf(sendingSide->ssl, &out, len) < len) {
+		goto L_FAIL;
+	}
+	memcpy(out, msg, len);
+	if (matrixSslEncodeWritebuf(sendingSide->ssl, len) < 0 ||
+			(len = matrixDtlsGetOutdata(sendingSide->ssl, &out)) <= 0 ||
+			(uint32)len > size) {
+		goto L_FAIL;
+	}
+	memcpy(buf, out, len);
+	if (matrixDtlsSentData(sendingSide->ssl, len) < 0) {
+		goto L_FAIL;
+	}
+
+	/* The session takes the datagram and hands back its old buffer */
+	mine = buf;
+	mineSize = size;
+	old = ssl->inbuf;
+	oldSize = (uint32)ssl->insize;
+	if (matrixDtlsSwapReadbuf(ssl, &buf, &size) != PS_SUCCESS ||
+			ssl->inbuf != mine || (uint32)ssl->insize != mineSize ||
+			buf != old || size != oldSize) {
+		goto L_FAIL;
+	}
+	rc = matrixSslReceivedData(ssl, len, &pt, &ptLen);
+	if (rc != MATRIXSSL_APP_DATA || ptLen != strlen(msg) ||
+			memcmp(pt, msg, ptLen) != 0) {
+		goto L_FAIL;
+	}
+	if (matrixSslProcessedData(ssl, &pt, &ptLen) != 0) {
+		goto L_FAIL;
+	}
+	psFree(buf, ssl->bufferPool);
+	return PS_SUCCESS;
+
+L_FAIL:
+	psFree(buf, ssl->bufferPool);
+	return PS_FAILURE;
 }
 
-#ifdef USE_CLIENT_AUTH
-static int32 initializeReHandshakeClientAuth(sslConn_t *clnConn,
-						sslConn_t *svrConn, uint16_t cipherSuite)
+/* Check a sequence number and, as an authentic record would, mark it */
+static int32 replaySeq(ssl_t *ssl, uint64_t seq)
 {
-	return matrixSslEncodeRehandshake(svrConn->ssl, NULL, svrCertChecker, 0,
-			&cipherSuite, 1);
+	unsigned char	b[6];
+	int32			i;
+
+	for (i = 5; i >= 0; i--, seq >>= 8) {
+		b[i] = (unsigned char)seq;
+	}
+	if (dtlsChkReplayWindow(ssl, b) != 1) {
+		return 0;
+	}
+	dtlsMarkReplayWindow(ssl, b);
+	return 1;
 }
-#endif /* USE_CLIENT_AUTH */
-#endif /* SSL_REHANDSHAKES_ENABLED */
 
-static int32 initializeResumedHandshake(sslConn_t *clnConn, sslConn_t *svrConn,
-										uint16_t cipherSuite)
+#define REPLAY_TEST_SPAN	(8 * DTLS_REPLAY_WINDOW)
+
+/*
+	The replay window on a fresh session: the edge cases, then a long run
+	of jumps, reorders and repeats checked against a plain bitmap of every
+	sequence number seen.
+*/
+static int32 dtlsReplayTest(sslConn_t *clnConn)
 {
-	sslSessionId_t	*sessionId;
+	const uint64_t	w = DTLS_REPLAY_WINDOW;
+	const uint64_t	max = ((uint64_t)1 << 48) - 1;
+	ssl_t			*ssl = NULL;
 	sslSessOpts_t	options;
-#ifdef ENABLE_PERF_TIMING
-	psTime_t		start, end;
-#endif /* ENABLE_PERF_TIMING */
-
-	sessionId = clnConn->ssl->sid;
+	unsigned char	*seen = NULL;
+	uint64_t		seq, top;
+	uint32_t		r;
+	int32			i, expect;
 
 	memset(&options, 0x0, sizeof(sslSessOpts_t));
 	options.versionFlag = g_versionFlag;
-#ifdef USE_ECC_CIPHER_SUITE
-	options.ecFlags = clnConn->ssl->ecInfo.ecFlags;
-#endif
-#ifdef TEST_RESUMPTIONS_WITH_SESSION_TICKETS
-	options.ticketResumption = 1;
-#endif
+	if (matrixSslNewClientSession(&ssl, clnConn->keys, NULL, NULL, 0,
+			clnCertChecker, NULL, NULL, NULL, &options) < 0) {
+		return PS_FAILURE;
+	}
+	dtlsResetReplayWindow(ssl);
 
-	matrixSslDeleteSession(clnConn->ssl);
+	/* In order from the first record, then duplicates */
+	for (seq = 0; seq < 4; seq++) {
+		if (replaySeq(ssl, seq) != 1) {
+			goto L_FAIL;
+		}
+	}
+	if (replaySeq(ssl, 2) != 0 || replaySeq(ssl, 0) != 0) {
+		goto L_FAIL;
+	}
+	/* Out of order inside the window, once */
+	if (replaySeq(ssl, 10) != 1 || replaySeq(ssl, 7) != 1 ||
+			replaySeq(ssl, 7) != 0) {
+		goto L_FAIL;
+	}
+	/* A jump past the whole window forgets everything, including the
+		slots 7 and 10 share with the new ones */
+	if (replaySeq(ssl, w + 100) != 1 || replaySeq(ssl, w + 7) != 1 ||
+			replaySeq(ssl, w + 10) != 1) {
+		goto L_FAIL;
+	}
+	/* Too old is exactly a window behind */
+	if (replaySeq(ssl, 100) != 0 || replaySeq(ssl, 101) != 1) {
+		goto L_FAIL;
+	}
+	/* A partial jump clears the slots it reuses, here not word aligned */
+	if (replaySeq(ssl, w - 400) != 1 || replaySeq(ssl, w + 700) != 1 ||
+			replaySeq(ssl, 2 * w - 400) != 1 ||
+			replaySeq(ssl, w + 101) != 1 || replaySeq(ssl, w + 7) != 0) {
+		goto L_FAIL;
+	}
 
-#ifdef ENABLE_PERF_TIMING
-	clnConn->hsTime = 0;
-	psGetTime(&start, NULL);
-#endif /* ENABLE_PERF_TIMING */
-	if (matrixSslNewClientSession(&clnConn->ssl, clnConn->keys, sessionId,
-			&cipherSuite, 1, clnCertChecker, "localhost", NULL, NULL,
-			&options)
-			< 0) {
-		return PS_FAILURE;
+	/* A new epoch starts over at zero */
+	ssl->rec.epoch[1]++;
+	i = replaySeq(ssl, 0) == 1 && replaySeq(ssl, 3) == 1 &&
+		replaySeq(ssl, 3) == 0;
+	ssl->rec.epoch[1]--;
+	if (!i) {
+		goto L_FAIL;
 	}
-#ifdef ENABLE_PERF_TIMING
-	psGetTime(&end, NULL);
-	clnConn->hsTime += psDiffMsecs(start, end, NULL);
-#endif /* ENABLE_PERF_TIMING */
 
-	matrixSslDeleteSession(svrConn->ssl);
-#ifdef ENABLE_PERF_TIMING
-	svrConn->hsTime = 0;
-	psGetTime(&start, NULL);
-#endif /* ENABLE_PERF_TIMING */
-#ifdef USE_SERVER_SIDE_SSL
-	if (matrixSslNewServerSession(&svrConn->ssl, svrConn->keys, NULL,
-			&options) < 0) {
-		return PS_FAILURE;
+	/* Top of the 48 bit space never wraps back to small numbers */
+	dtlsResetReplayWindow(ssl);
+	if (replaySeq(ssl, max - 200) != 1 || replaySeq(ssl, max) != 1 ||
+			replaySeq(ssl, max - 1) != 1 || replaySeq(ssl, max) != 0 ||
+			replaySeq(ssl, max - w) != 0 || replaySeq(ssl, 0) != 0 ||
+			replaySeq(ssl, 1) != 0) {
+		goto L_FAIL;
 	}
-#endif
-#ifdef ENABLE_PERF_TIMING
-	psGetTime(&end, NULL);
+
+	/* Random walk against the bitmap model */
+	if ((seen = psMalloc(NULL, REPLAY_TEST_SPAN)) == NULL) {
+		goto L_FAIL;
+	}
+	r = 0x2545F491;
+	top = REPLAY_TEST_SPAN;
+	for (i = 0; i < 20000; i++) {
+		r = r * 1103515245 + 12345;
+		if (top >= REPLAY_TEST_SPAN - 2 * w) {
+			dtlsResetReplayWindow(ssl);
+			memset(seen, 0x0, REPLAY_TEST_SPAN);
+			top = 0;
+			seq = 1 + (r >> 16) % 64;
+		} else if ((r >> 8) % 64 == 0) {
+			seq = top + w + (r >> 16) % w;		/* Past the window */
+		} else {
+			seq = top + (r >> 16) % (w + 64);	/* Mostly behind */
+			seq = seq > w ? seq - w : 1;
+		}
+		expect = seq > top || (top - seq < w && !seen[seq]);
+		if (replaySeq(ssl, seq) != expect) {
+			_psTraceInt("		Replay verdict wrong at step %d\n", i);
+			goto L_FAIL;
+		}
+		if (expect) {
+			seen[seq] = 1;
+			top = seq > top ? seq : top;
+		}
+	}
+
+	psFree(seen, NULL);
+	matrixSslDeleteSession(ssl);
+	return PS_SUCCESS;
+
+L_FAIL:
+	if (seen) {
+		psFree(seen, NULL);
+	}
+	matrixSslDeleteSession(ssl);
+	return PS_FAILURE;
+}
+#endif /* USE_DTLS */
+
+#ifdef TEST_DTLS_COOKIE
+/* Move one datagram of outdata from 'from' into 'to' */
+static int32 dtlsDeliver(ssl_t *from, ssl_t *to)
+{
+	unsigned char	*out, *in, *pt;
+	uint32			ptLen;
+	int32			len;
+
+	if ((len = matrixDtlsGetOutdata(from, &out)) <= 0 ||
+			matrixSslGetReadbuf(to, &in) < len) {
+		return PS_FAILURE;
+	}
+	memcpy(in, out, len);
+	if (matrixDtlsSentData(from, len) < 0) {
+		return PS_FAILURE;
+	}
+	return matrixSslReceivedData(to, len, &pt, &ptLen);
+}
+
+/*
+	Answer the first ClientHello statelessly and create the server session
+	only for the one that comes back with the cookie.  That cookie must
+	then fail for another peer, survive one key rotation and not two.
+*/
+static int32 dtlsCookieTest(sslConn_t *clnConn, sslConn_t *svrConn)
+{
+	static const unsigned char	peerA[] = { 192, 0, 2, 1, 0x11, 0x5C };
+	static const unsigned char	peerB[] = { 192, 0, 2, 2, 0x11, 0x5C };
+	sslConn_t		cln, svr;
+	sslSessOpts_t	options;
+	unsigned char	*out, *in, *pt, *hello = NULL, hvr[128];
+	uint32			helloLen, hvrLen, ptLen, size;
+	int32			len;
+
+	memset(&cln, 0x0, sizeof(sslConn_t));
+	memset(&svr, 0x0, sizeof(sslConn_t));
+	cln.keys = clnConn->keys;
+	svr.keys = svrConn->keys;
+	size = (uint32)matrixDtlsGetPmtu();
+	if ((hello = psMalloc(NULL, size)) == NULL) {
+		return PS_FAILURE;
+	}
+	memset(&options, 0x0, sizeof(sslSessOpts_t));
+	options.versionFlag = g_versionFlag;
+	if (matrixSslNewClientSession(&cln.ssl, cln.keys, NULL,
+			&clnConn->ssl->cipher->ident, 1, clnCertChecker, "localhost",
+			NULL, NULL, &options) < 0) {
+		goto L_FAIL;
+	}
+
+	/* No cookie yet, so a HelloVerifyRequest comes back */
+	if ((len = matrixDtlsGetOutdata(cln.ssl, &out)) <= 0 ||
+			(uint32)len > size) {
+		goto L_FAIL;
+	}
+	memcpy(hello, out, len);
+	helloLen = (uint32)len;
+	matrixDtlsSentData(cln.ssl, len);
+	hvrLen = sizeof(hvr);
+	if (matrixDtlsCheckCookie(hello, helloLen, peerA, sizeof(peerA), hvr,
+			&hvrLen) != MATRIXSSL_REQUEST_SEND ||
+			hvr[SSL3_HEADER_LEN + DTLS_HEADER_ADD_LEN] !=
+			SSL_HS_HELLO_VERIFY_REQUEST) {
+		goto L_FAIL;
+	}
+	if (matrixSslGetReadbuf(cln.ssl, &in) < (int32)hvrLen) {
+		goto L_FAIL;
+	}
+	memcpy(in, hvr, hvrLen);
+	if (matrixSslReceivedData(cln.ssl, hvrLen, &pt, &ptLen) !=
+			MATRIXSSL_REQUEST_SEND) {
+		goto L_FAIL;
+	}
+
+	/* The second ClientHello carries the cookie, for peerA only */
+	if ((len = matrixDtlsGetOutdata(cln.ssl, &out)) <= 0 ||
+			(uint32)len > size) {
+		goto L_FAIL;
+	}
+	memcpy(hello, out, len);
+	helloLen = (uint32)len;
+	hvrLen = sizeof(hvr);
+	if (matrixDtlsCheckCookie(hello, helloLen, peerA, sizeof(peerA), hvr,
+			&hvrLen) != PS_SUCCESS) {
+		goto L_FAIL;
+	}
+	hvrLen = sizeof(hvr);
+	if (matrixDtlsCheckCookie(hello, helloLen, peerB, sizeof(peerB), hvr,
+			&hvrLen) != MATRIXSSL_REQUEST_SEND) {
+		goto L_FAIL;
+	}
+
+	/* A session created now goes straight on to ServerHello */
+	memset(&options, 0x0, sizeof(sslSessOpts_t));
+	options.versionFlag = g_versionFlag;
+	options.dtlsPeerId = peerA;
+	options.dtlsPeerIdLen = sizeof(peerA);
+	if (matrixSslNewServerSession(&svr.ssl, svr.keys, NULL, &options) < 0 ||
+			dtlsDeliver(cln.ssl, svr.ssl) !=
+			MATRIXSSL_REQUEST_SEND) {
+		goto L_FAIL;
+	}
+	if (matrixDtlsGetOutdata(svr.ssl, &out) <= 0 ||
+			out[SSL3_HEADER_LEN + DTLS_HEADER_ADD_LEN] !=
+			SSL_HS_SERVER_HELLO) {
+		goto L_FAIL;
+	}
+	if (performHandshake(&svr, &cln) < 0 ||
+			exchangeAppData(&cln, &svr, CLI_APP_DATA) < 0) {
+		goto L_FAIL;
+	}
+
+	/* Issued under the previous key is still good, two back is not */
+	if (matrixDtlsRotateCookieKey() < 0) {
+		goto L_FAIL;
+	}
+	hvrLen = sizeof(hvr);
+	if (matrixDtlsCheckCookie(hello, helloLen, peerA, sizeof(peerA), hvr,
+			&hvrLen) != PS_SUCCESS) {
+		goto L_FAIL;
+	}
+	if (matrixDtlsRotateCookieKey() < 0) {
+		goto L_FAIL;
+	}
+	hvrLen = sizeof(hvr);
+	if (matrixDtlsCheckCookie(hello, helloLen, peerA, sizeof(peerA), hvr,
+			&hvrLen) != MATRIXSSL_REQUEST_SEND) {
+		goto L_FAIL;
+	}
+
+	psFree(hello, NULL);
+	matrixSslDeleteSession(cln.ssl);
+	matrixSslDeleteSession(svr.ssl);
+	return PS_SUCCESS;
+
+L_FAIL:
+	psFree(hello, NULL);
+	if (cln.ssl) {
+		matrixSslDeleteSession(cln.ssl);
+	}
+	if (svr.ssl) {
+		matrixSslDeleteSession(svr.ssl);
+	}
+	return PS_FAILURE;
+}
+
+/*
+	Both sides ask for a connection ID.  Suites whose record protection
+	can authenticate one must put the other side's ID on every protected
+	record, and those that can't must complete without one.  A record
+	without the ID is dropped, and neither side renegotiates with one.
+*/
+static int32 dtlsCidTest(sslConn_t *clnConn, sslConn_t *svrConn)
+{
+	static const unsigned char	clnCid[] = { 'c', 'l', 'n', 'c', 'i', 'd' };
+	static const unsigned char	svrCid[] = { 's', 'v', 'r', 'c', 'i', 'd' };
+	sslConn_t		cln, svr;
+	sslSessOpts_t	options;
+	const unsigned char	*cid;
+	unsigned char	*buf, *out, *pt;
+	uint32			ptLen;
+	int32			len, rc;
+
+	memset(&cln, 0x0, sizeof(sslConn_t));
+	memset(&svr, 0x0, sizeof(sslConn_t));
+	cln.keys = clnConn->keys;
+	svr.keys = svrConn->keys;
+	memset(&options, 0x0, sizeof(sslSessOpts_t));
+	options.versionFlag = g_versionFlag;
+	options.dtlsCid = clnCid;
+	options.dtlsCidLen = sizeof(clnCid);
+	if (matrixSslNewClientSession(&cln.ssl, cln.keys, NULL,
+			&clnConn->ssl->cipher->ident, 1, clnCertChecker, "localhost",
+			NULL, NULL, &options) < 0) {
+		goto L_FAIL;
+	}
+	memset(&options, 0x0, sizeof(sslSessOpts_t));
+	options.versionFlag = g_versionFlag;
+	options.dtlsCid = svrCid;
+	options.dtlsCidLen = sizeof(svrCid);
+	if (matrixSslNewServerSession(&svr.ssl, svr.keys, NULL, &options) < 0 ||
+			performHandshake(&cln, &svr) < 0) {
+		goto L_FAIL;
+	}
+
+	if (!dtlsCidCapable(svr.ssl)) {
+		if (cln.ssl->extFlags.connection_id || cln.ssl->cidOutLen != 0 ||
+				svr.ssl->extFlags.connection_id || svr.ssl->cidOutLen != 0) {
+			goto L_FAIL;
+		}
+	} else if (cln.ssl->cidOutLen != sizeof(svrCid) ||
+			svr.ssl->cidOutLen != sizeof(clnCid)) {
+		goto L_FAIL;
+	}
+
+	/* A protected record to the server carries the server's ID */
+	if ((len = matrixSslGetWritebuf(cln.ssl, &buf, CLI_APP_DATA)) <
+			CLI_APP_DATA) {
+		goto L_FAIL;
+	}
+	memset(buf, 'C', CLI_APP_DATA);
+	if (matrixSslEncodeWritebuf(cln.ssl, CLI_APP_DATA) < 0 ||
+			(len = matrixDtlsGetOutdata(cln.ssl, &out)) <= 0) {
+		goto L_FAIL;
+	}
+	if (dtlsCidCapable(cln.ssl) && (out[0] != SSL_RECORD_TYPE_TLS12_CID ||
+			matrixDtlsGetConnectionId(out, len, sizeof(svrCid), &cid) < 0 ||
+			memcmp(cid, svrCid, sizeof(svrCid)) != 0)) {
+		goto L_FAIL;
+	}
+	if (dtlsDeliver(cln.ssl, svr.ssl) != MATRIXSSL_APP_DATA ||
+			matrixSslProcessedData(svr.ssl, &pt, &ptLen) != 0) {
+		goto L_FAIL;
+	}
+	if (exchangeAppData(&svr, &cln, CLI_APP_DATA) < 0 ||
+			exchangeAppData(&cln, &svr, CLI_APP_DATA) < 0) {
+		goto L_FAIL;
+	}
+#ifdef USE_MATRIXSSL_STATS
+	if (statsReport(&cln, &svr) < 0) {
+		goto L_FAIL;
+	}
+#endif
+
+	/* A protected record without the server's ID is dropped */
+	if (dtlsCidCapable(cln.ssl)) {
+		len = cln.ssl->cidOutLen;
+		cln.ssl->cidOutLen = 0;
+		if (matrixSslGetWritebuf(cln.ssl, &buf, CLI_APP_DATA) <
+				CLI_APP_DATA) {
+			goto L_FAIL;
+		}
+		memset(buf, 'C', CLI_APP_DATA);
+		rc = matrixSslEncodeWritebuf(cln.ssl, CLI_APP_DATA);
+		cln.ssl->cidOutLen = (uint8_t)len;
+		if (rc < 0 || matrixDtlsGetOutdata(cln.ssl, &out) <= 0 ||
+				out[0] != SSL_RECORD_TYPE_APPLICATION_DATA ||
+				dtlsDeliver(cln.ssl, svr.ssl) != MATRIXSSL_REQUEST_RECV ||
+				matrixDtlsGetOutdata(svr.ssl, &out) != 0) {
+			goto L_FAIL;
+		}
+	}
+
+#ifdef SSL_REHANDSHAKES_ENABLED
+	/* No renegotiation once there is an ID, asked for or answered */
+	if (dtlsCidCapable(cln.ssl)) {
+		if (matrixSslEncodeRehandshake(cln.ssl, NULL, NULL, 0, NULL, 0) !=
+				PS_UNSUPPORTED_FAIL ||
+				matrixSslEncodeRehandshake(svr.ssl, NULL, NULL, 0, NULL, 0) !=
+				PS_UNSUPPORTED_FAIL) {
+			goto L_FAIL;
+		}
+		cln.ssl->extFlags.connection_id = 0;
+		if (matrixSslEncodeRehandshake(cln.ssl, NULL, NULL, 0, NULL, 0) < 0 ||
+				dtlsDeliver(cln.ssl, svr.ssl) != MATRIXSSL_REQUEST_SEND ||
+				svr.ssl->hsState != SSL_HS_DONE) {
+			goto L_FAIL;
+		}
+	}
+#endif
+
+	matrixSslDeleteSession(cln.ssl);
+	matrixSslDeleteSession(svr.ssl);
+	return PS_SUCCESS;
+
+L_FAIL:
+	if (cln.ssl) {
+		matrixSslDeleteSession(cln.ssl);
+	}
+	if (svr.ssl) {
+		matrixSslDeleteSession(svr.ssl);
+	}
+	return PS_FAILURE;
+}
+
+/*
+	A record that fails authentication is dropped without an alert, and
+	must not move the replay window.  A forgery numbered past the window is
+	sent first, then the genuine record it was made from still gets
+	through, once.
+*/
+static int32 dtlsForgedRecordTest(sslConn_t *clnConn, sslConn_t *svrConn)
+{
+	sslConn_t		cln, svr;
+	sslSessOpts_t	options;
+	unsigned char	*buf, *out, *in, *pt, *saved = NULL;
+	uint64_t		seq, top;
+	uint32			ptLen;
+	int32			len, i;
+
+	memset(&cln, 0x0, sizeof(sslConn_t));
+	memset(&svr, 0x0, sizeof(sslConn_t));
+	cln.keys = clnConn->keys;
+	svr.keys = svrConn->keys;
+	memset(&options, 0x0, sizeof(sslSessOpts_t));
+	options.versionFlag = g_versionFlag;
+	if (matrixSslNewClientSession(&cln.ssl, cln.keys, NULL,
+			&clnConn->ssl->cipher->ident, 1, clnCertChecker, "localhost",
+			NULL, NULL, &options) < 0 ||
+			matrixSslNewServerSession(&svr.ssl, svr.keys, NULL,
+			&options) < 0 ||
+			performHandshake(&cln, &svr) < 0) {
+		goto L_FAIL;
+	}
+
+	if (matrixSslGetWritebuf(cln.ssl, &buf, CLI_APP_DATA) < CLI_APP_DATA) {
+		goto L_FAIL;
+	}
+	memset(buf, 'F', CLI_APP_DATA);
+	if (matrixSslEncodeWritebuf(cln.ssl, CLI_APP_DATA) < 0 ||
+			(len = matrixDtlsGetOutdata(cln.ssl, &out)) <= 0 ||
+			(saved = psMalloc(NULL, len)) == NULL) {
+		goto L_FAIL;
+	}
+	memcpy(saved, out, len);
+	if (matrixDtlsSentData(cln.ssl, len) < 0) {
+		goto L_FAIL;
+	}
+
+	/* Same record, sequence number moved two windows ahead */
+	if (matrixSslGetReadbuf(svr.ssl, &in) < len) {
+		goto L_FAIL;
+	}
+	memcpy(in, saved, len);
+	for (seq = 0, i = 5; i < 11; i++) {
+		seq = (seq << 8) | in[i];
+	}
+	seq += 2 * DTLS_REPLAY_WINDOW;
+	for (i = 10; i >= 5; i--, seq >>= 8) {
+		in[i] = (unsigned char)seq;
+	}
+	top = svr.ssl->replayTop;
+	if (matrixSslReceivedData(svr.ssl, len, &pt, &ptLen) !=
+			MATRIXSSL_REQUEST_RECV || svr.ssl->replayTop != top ||
+			matrixDtlsGetOutdata(svr.ssl, &out) != 0) {
+		goto L_FAIL;
+	}
+
+	/* The genuine record, then a replay of it */
+	if (matrixSslGetReadbuf(svr.ssl, &in) < len) {
+		goto L_FAIL;
+	}
+	memcpy(in, saved, len);
+	if (matrixSslReceivedData(svr.ssl, len, &pt, &ptLen) !=
+			MATRIXSSL_APP_DATA || ptLen != CLI_APP_DATA ||
+			matrixSslProcessedData(svr.ssl, &pt, &ptLen) != 0) {
+		goto L_FAIL;
+	}
+	if (matrixSslGetReadbuf(svr.ssl, &in) < len) {
+		goto L_FAIL;
+	}
+	memcpy(in, saved, len);
+	if (matrixSslReceivedData(svr.ssl, len, &pt, &ptLen) !=
+			MATRIXSSL_REQUEST_RECV) {
+		goto L_FAIL;
+	}
+	if (exchangeAppData(&svr, &cln, CLI_APP_DATA) < 0 ||
+			exchangeAppData(&cln, &svr, CLI_APP_DATA) < 0) {
+		goto L_FAIL;
+	}
+
+	psFree(saved, NULL);
+	matrixSslDeleteSession(cln.ssl);
+	matrixSslDeleteSession(svr.ssl);
+	return PS_SUCCESS;
+
+L_FAIL:
+	if (saved) {
+		psFree(saved, NULL);
+	}
+	if (cln.ssl) {
+		matrixSslDeleteSession(cln.ssl);
+	}
+	if (svr.ssl) {
+		matrixSslDeleteSession(svr.ssl);
+	}
+	return PS_FAILURE;
+}
+
+/*
+	Lose the server's last flight so the client's CCS and FINISHED come in
+	again once the server is done.  The whole datagram asks for the flight
+	to be resent; one cut short in the FINISHED that follows the CCS must be
+	refused rather than skipped past its end.
+*/
+static int32 dtlsResentFinishedTest(sslConn_t *clnConn, sslConn_t *svrConn)
+{
+	sslConn_t		cln, svr;
+	sslSessOpts_t	options;
+	ssl_t			*from, *to;
+	unsigned char	*out, *in, *pt, saved[DTLS_PMTU];
+	uint32			ptLen;
+	int32			len, savedLen, fin, cut, rc, i;
+
+	for (i = 0; i < 2; i++) {
+		memset(&cln, 0x0, sizeof(sslConn_t));
+		memset(&svr, 0x0, sizeof(sslConn_t));
+		cln.keys = clnConn->keys;
+		svr.keys = svrConn->keys;
+		memset(&options, 0x0, sizeof(sslSessOpts_t));
+		options.versionFlag = g_versionFlag;
+		if (matrixSslNewClientSession(&cln.ssl, cln.keys, NULL,
+				&clnConn->ssl->cipher->ident, 1, clnCertChecker, "localhost",
+				NULL, NULL, &options) < 0 ||
+				matrixSslNewServerSession(&svr.ssl, svr.keys, NULL,
+				&options) < 0) {
+			goto L_FAIL;
+		}
+		/* Keep the client's last datagram before the server is done */
+		savedLen = 0;
+		from = cln.ssl;
+		to = svr.ssl;
+		while (svr.ssl->hsState != SSL_HS_DONE) {
+			if ((len = matrixDtlsGetOutdata(from, &out)) <= 0 ||
+					len > (int32)sizeof(saved)) {
+				goto L_FAIL;
+			}
+			if (from == cln.ssl) {
+				memcpy(saved, out, len);
+				savedLen = len;
+			}
+			if ((rc = dtlsDeliver(from, to)) == MATRIXSSL_REQUEST_SEND) {
+				from = to;
+				to = (from == cln.ssl) ? svr.ssl : cln.ssl;
+			} else if (rc != MATRIXSSL_REQUEST_RECV) {
+				goto L_FAIL;
+			}
+		}
+		while ((len = matrixDtlsGetOutdata(svr.ssl, &out)) > 0) {
+			matrixDtlsSentData(svr.ssl, len);
+		}
+
+		/* The CCS and the FINISHED record after it */
+		rc = 0;
+		for (fin = 0; savedLen - fin >= SSL3_HEADER_LEN +
+				DTLS_HEADER_ADD_LEN; ) {
+			rc = saved[fin];
+			fin += SSL3_HEADER_LEN + DTLS_HEADER_ADD_LEN +
+				((saved[fin + 11] << 8) | saved[fin + 12]);
+			if (rc == SSL_RECORD_TYPE_CHANGE_CIPHER_SPEC) {
+				break;
+			}
+		}
+		if (rc != SSL_RECORD_TYPE_CHANGE_CIPHER_SPEC || fin >= savedLen) {
+			goto L_FAIL;
+		}
+
+		if (matrixSslGetReadbuf(svr.ssl, &in) < savedLen) {
+			goto L_FAIL;
+		}
+		memcpy(in, saved, savedLen);
+		if (matrixSslReceivedData(svr.ssl, savedLen, &pt, &ptLen) !=
+				MATRIXSSL_REQUEST_SEND || svr.ssl->err != SSL_ALERT_NONE) {
+			goto L_FAIL;
+		}
+		while ((len = matrixDtlsGetOutdata(svr.ssl, &out)) > 0) {
+			dtlsDeliver(svr.ssl, cln.ssl);
+		}
+		if (cln.ssl->hsState != SSL_HS_DONE) {
+			goto L_FAIL;
+		}
+
+		/* Short of the length, then one byte short of the body */
+		cut = (i == 0) ? fin + 12 : savedLen - 1;
+		if (matrixSslGetReadbuf(svr.ssl, &in) < cut) {
+			goto L_FAIL;
+		}
+		memcpy(in, saved, cut);
+		if (matrixSslReceivedData(svr.ssl, cut, &pt, &ptLen) !=
+				MATRIXSSL_REQUEST_SEND ||
+				svr.ssl->err != SSL_ALERT_DECODE_ERROR) {
+			goto L_FAIL;
+		}
+		matrixSslDeleteSession(cln.ssl);
+		matrixSslDeleteSession(svr.ssl);
+	}
+	return PS_SUCCESS;
+
+L_FAIL:
+	if (cln.ssl) {
+		matrixSslDeleteSession(cln.ssl);
+	}
+	if (svr.ssl) {
+		matrixSslDeleteSession(svr.ssl);
+	}
+	return PS_FAILURE;
+}
+
+#ifdef TEST_DTLS_RETRANSMIT
+/* Move a time forward, to drive the retransmit timer without waiting */
+static void dtlsAdvanceTime(psTime_t *t, uint32 msecs)
+{
+#ifdef USE_HIGHRES_TIME
+	t->tv_sec += msecs / 1000;
+	t->tv_nsec += (long)(msecs % 1000) * 1000000L;
+	if (t->tv_nsec >= 1000000000L) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000L;
+	}
+#else
+	t->tv_sec += msecs / 1000;
+	t->tv_usec += (long)(msecs % 1000) * 1000L;
+	if (t->tv_usec >= 1000000L) {
+		t->tv_sec++;
+		t->tv_usec -= 1000000L;
+	}
+#endif
+}
+
+/*
+	New DTLS pair sharing the keys of the main one, with the server limited
+	to pmtu.  Returns once the server's first flight is queued.
+*/
+static int32 dtlsStartPair(sslConn_t *clnConn, sslConn_t *svrConn,
+				sslConn_t *cln, sslConn_t *svr, int32 pmtu)
+{
+	sslSessOpts_t	options;
+	unsigned char	*out;
+
+	memset(cln, 0x0, sizeof(sslConn_t));
+	memset(svr, 0x0, sizeof(sslConn_t));
+	cln->keys = clnConn->keys;
+	svr->keys = svrConn->keys;
+	memset(&options, 0x0, sizeof(sslSessOpts_t));
+	options.versionFlag = g_versionFlag;
+	if (matrixSslNewClientSession(&cln->ssl, cln->keys, NULL,
+			&clnConn->ssl->cipher->ident, 1, clnCertChecker, "localhost",
+			NULL, NULL, &options) < 0) {
+		return PS_FAILURE;
+	}
+	memset(&options, 0x0, sizeof(sslSessOpts_t));
+	options.versionFlag = g_versionFlag;
+	if (matrixSslNewServerSession(&svr->ssl, svr->keys, NULL, &options) < 0 ||
+			matrixDtlsSetSessionPmtu(svr->ssl, pmtu) != pmtu) {
+		return PS_FAILURE;
+	}
+	if (dtlsDeliver(cln->ssl, svr->ssl) != MATRIXSSL_REQUEST_SEND ||
+			matrixDtlsGetOutdata(svr->ssl, &out) <= 0) {
+		return PS_FAILURE;
+	}
+	if (out[SSL3_HEADER_LEN + DTLS_HEADER_ADD_LEN] ==
+			SSL_HS_HELLO_VERIFY_REQUEST) {
+		if (dtlsDeliver(svr->ssl, cln->ssl) != MATRIXSSL_REQUEST_SEND ||
+				dtlsDeliver(cln->ssl, svr->ssl) != MATRIXSSL_REQUEST_SEND) {
+			return PS_FAILURE;
+		}
+	}
+	return PS_SUCCESS;
+}
+
+/* Send the queued flight nowhere, checking no datagram is over the PMTU */
+static int32 dtlsLoseFlight(ssl_t *ssl)
+{
+	unsigned char	*out;
+	int32			len;
+
+	while ((len = matrixDtlsGetOutdata(ssl, &out)) > 0) {
+		if (len > matrixDtlsGetSessionPmtu(ssl)) {
+			return PS_FAILURE;
+		}
+		matrixDtlsSentData(ssl, len);
+	}
+	return len;
+}
+
+/* Deliver the queued flight a datagram at a time, none over the PMTU */
+static int32 dtlsDeliverFlight(ssl_t *from, ssl_t *to)
+{
+	unsigned char	*out;
+	int32			len, rc;
+
+	do {
+		if ((len = matrixDtlsGetOutdata(from, &out)) <= 0 ||
+				len > matrixDtlsGetSessionPmtu(from)) {
+			return PS_FAILURE;
+		}
+		rc = dtlsDeliver(from, to);
+	} while (rc == MATRIXSSL_REQUEST_RECV);
+	return rc;
+}
+
+/*
+	Lose the server's first flight until resends back the PMTU off, then
+	check the flight is re-fragmented to the new size and the handshake and
+	application data still go through under it.  Last, a fragment that
+	disagrees with the rest of its message about the total length must be
+	answered with an alert rather than copied.
+*/
+static int32 dtlsPmtuTest(sslConn_t *clnConn, sslConn_t *svrConn)
+{
+	sslConn_t		cln, svr;
+	psTime_t		now;
+	unsigned char	*out, *rec, *hs, *end, big[600];
+	uint32			hsLen;
+	int32			len, rc, i;
+
+	if (dtlsStartPair(clnConn, svrConn, &cln, &svr, 768) < 0) {
+		goto L_FAIL;
+	}
+	if (dtlsLoseFlight(svr.ssl) < 0) {
+		goto L_FAIL;
+	}
+	for (i = 0; matrixDtlsGetSessionPmtu(svr.ssl) == 768; i++) {
+		if (i == DTLS_PMTU_BACKOFF_RESENDS) {
+			goto L_FAIL;
+		}
+		psGetTime(&now, NULL);
+		if ((rc = matrixDtlsGetTimeout(svr.ssl, &now)) <= 0) {
+			goto L_FAIL;
+		}
+		dtlsAdvanceTime(&now, rc);
+		if (matrixDtlsHandleTimeout(svr.ssl, &now) !=
+				MATRIXSSL_REQUEST_SEND) {
+			goto L_FAIL;
+		}
+		if (matrixDtlsGetSessionPmtu(svr.ssl) == 768 &&
+				dtlsLoseFlight(svr.ssl) < 0) {
+			goto L_FAIL;
+		}
+	}
+	if (matrixDtlsGetSessionPmtu(svr.ssl) != 576 ||
+			dtlsDeliverFlight(svr.ssl, cln.ssl) != MATRIXSSL_REQUEST_SEND ||
+			performHandshake(&cln, &svr) < 0) {
+		goto L_FAIL;
+	}
+	/* Records are limited by the session PMTU, not the global one */
+	memset(big, 0x0, sizeof(big));
+	if (matrixSslEncodeToOutdata(svr.ssl, big, sizeof(big)) !=
+			PS_LIMIT_FAIL ||
+			exchangeAppData(&cln, &svr, CLI_APP_DATA) < 0 ||
+			exchangeAppData(&svr, &cln, CLI_APP_DATA) < 0) {
+		goto L_FAIL;
+	}
+	matrixSslDeleteSession(cln.ssl);
+	matrixSslDeleteSession(svr.ssl);
+
+	/* Claim one more byte in the first non-initial fragment of the flight */
+	if (dtlsStartPair(clnConn, svrConn, &cln, &svr, 576) < 0) {
+		goto L_FAIL;
+	}
+	rc = MATRIXSSL_REQUEST_RECV;
+	while (rc == MATRIXSSL_REQUEST_RECV) {
+		if ((len = matrixDtlsGetOutdata(svr.ssl, &out)) <= 0) {
+			goto L_FAIL;
+		}
+		for (rec = out, end = out + len; end - rec >= SSL3_HEADER_LEN +
+				DTLS_HEADER_ADD_LEN + SSL3_HANDSHAKE_HEADER_LEN +
+				DTLS_HEADER_ADD_LEN; ) {
+			hs = rec + SSL3_HEADER_LEN + DTLS_HEADER_ADD_LEN;
+			if (rec[0] == SSL_RECORD_TYPE_HANDSHAKE &&
+					(hs[6] | hs[7] | hs[8]) != 0) {
+				hsLen = ((uint32)hs[1] << 16) + (hs[2] << 8) + hs[3] + 1;
+				hs[1] = (unsigned char)(hsLen >> 16);
+				hs[2] = (unsigned char)(hsLen >> 8);
+				hs[3] = (unsigned char)hsLen;
+				rc = PS_SUCCESS;
+				break;
+			}
+			rec += SSL3_HEADER_LEN + DTLS_HEADER_ADD_LEN +
+				((rec[11] << 8) | rec[12]);
+		}
+		if (rc == PS_SUCCESS) {
+			break;
+		}
+		rc = dtlsDeliver(svr.ssl, cln.ssl);
+	}
+	/* Suites without a certificate may not fragment at all */
+	if (rc == PS_SUCCESS) {
+		if (dtlsDeliver(svr.ssl, cln.ssl) != MATRIXSSL_REQUEST_SEND ||
+				cln.ssl->err != SSL_ALERT_ILLEGAL_PARAMETER) {
+			goto L_FAIL;
+		}
+	} else if (rc != MATRIXSSL_REQUEST_SEND) {
+		goto L_FAIL;
+	}
+	matrixSslDeleteSession(cln.ssl);
+	matrixSslDeleteSession(svr.ssl);
+	return PS_SUCCESS;
+
+L_FAIL:
+	if (cln.ssl) {
+		matrixSslDeleteSession(cln.ssl);
+	}
+	if (svr.ssl) {
+		matrixSslDeleteSession(svr.ssl);
+	}
+	return PS_FAILURE;
+}
+
+/*
+	True if the datagram resent is the one sent, record for record, with
+	only each record sequence number moved on
+*/
+static int32 dtlsSameRecords(const unsigned char *sent,
+				const unsigned char *resent, int32 len)
+{
+	int32	recLen;
+
+	while (len >= SSL3_HEADER_LEN + DTLS_HEADER_ADD_LEN) {
+		recLen = SSL3_HEADER_LEN + DTLS_HEADER_ADD_LEN +
+			((sent[11] << 8) | sent[12]);
+		/* type(1) version(2) epoch(2) rsn(6) length(2) */
+		if (recLen > len || memcmp(resent, sent, 5) != 0 ||
+				memcmp(resent + 5, sent + 5, 6) <= 0 ||
+				memcmp(resent + 11, sent + 11, recLen - 11) != 0) {
+			return 0;
+		}
+		sent += recLen;
+		resent += recLen;
+		len -= recLen;
+	}
+	return len == 0;
+}
+
+/*
+	Drive the server's retransmit timer with explicit times.  It must not
+	fire a millisecond early, must double up to DTLS_RETRANSMIT_MAX_MS and
+	give up once that expires.  The first resend comes from the flight
+	cache with only the record numbers changed.  The PMTU backoff then
+	drops the limit below the cached records, so the flight is encoded
+	again from its first message.
+*/
+static int32 dtlsTimerTest(sslConn_t *clnConn, sslConn_t *svrConn)
+{
+	sslConn_t		cln, svr;
+	psTime_t		now;
+	unsigned char	*out, first[768];
+	uint32			timeout;
+	int32			len, firstLen, maxRec, rc, i;
+
+	if (dtlsStartPair(clnConn, svrConn, &cln, &svr, 768) < 0 ||
+			(firstLen = matrixDtlsGetOutdata(svr.ssl, &out)) <= 0 ||
+			firstLen > (int32)sizeof(first)) {
+		goto L_FAIL;
+	}
+	memcpy(first, out, firstLen);
+	if (dtlsLoseFlight(svr.ssl) < 0) {
+		goto L_FAIL;
+	}
+	timeout = DTLS_RETRANSMIT_MIN_MS;
+	for (i = 0; ; i++) {
+		psGetTime(&now, NULL);
+		if ((rc = matrixDtlsGetTimeout(svr.ssl, &now)) <= 0 ||
+				(uint32)rc > timeout) {
+			goto L_FAIL;
+		}
+		dtlsAdvanceTime(&now, rc - 1);
+		if (matrixDtlsHandleTimeout(svr.ssl, &now) != PS_SUCCESS) {
+			goto L_FAIL;
+		}
+		maxRec = svr.ssl->flightCacheMaxRec;
+		dtlsAdvanceTime(&now, 1);
+		rc = matrixDtlsHandleTimeout(svr.ssl, &now);
+		if (timeout == DTLS_RETRANSMIT_MAX_MS) {
+			break;
+		}
+		timeout = min(timeout * 2, DTLS_RETRANSMIT_MAX_MS);
+		if (rc != MATRIXSSL_REQUEST_SEND ||
+				svr.ssl->retransTimeout != timeout ||
+				(len = matrixDtlsGetOutdata(svr.ssl, &out)) <= 0) {
+			goto L_FAIL;
+		}
+		if (i == 0 && (len != firstLen ||
+				!dtlsSameRecords(first, out, len))) {
+			goto L_FAIL;
+		}
+		if (i == DTLS_PMTU_BACKOFF_RESENDS - 1) {
+			if (matrixDtlsGetSessionPmtu(svr.ssl) != 576) {
+				goto L_FAIL;
+			}
+			/* Encoded again from the same first message, hsType(1)
+				length(3) msn(2) after the record header, and cached
+				again at the new size */
+			if (maxRec > 576 && (out[13] != first[13] ||
+					memcmp(out + 17, first + 17, 2) != 0 ||
+					svr.ssl->flightCacheMaxRec > 576)) {
+				goto L_FAIL;
+			}
+		}
+		if (dtlsLoseFlight(svr.ssl) < 0) {
+			goto L_FAIL;
+		}
+	}
+	if (rc != PS_TIMEOUT_FAIL ||
+			matrixDtlsGetTimeout(svr.ssl, &now) != PS_FAILURE) {
+		goto L_FAIL;
+	}
+
+	matrixSslDeleteSession(cln.ssl);
+	matrixSslDeleteSession(svr.ssl);
+	return PS_SUCCESS;
+
+L_FAIL:
+	if (cln.ssl) {
+		matrixSslDeleteSession(cln.ssl);
+	}
+	if (svr.ssl) {
+		matrixSslDeleteSession(svr.ssl);
+	}
+	return PS_FAILURE;
+}
+#endif /* TEST_DTLS_RETRANSMIT */
+#endif /* TEST_DTLS_COOKIE */
+
+#ifdef TEST_SERVER_CIPHER_PREF
+/*
+	The client offers AES128 ahead of AES256 while supportedCiphers lists
+	AES256 first.  The server must follow the client's order by default and
+	its own with serverCipherPref.  Fresh sessions share the RSA keys of the
+	pair under test so the main connections are left alone.
+*/
+static int32 serverCipherPrefTest(sslConn_t *clnConn, sslConn_t *svrConn)
+{
+	sslConn_t		cln, svr;
+	sslSessOpts_t	options;
+	uint16_t		offer[2];
+	int32			pref;
+
+	offer[0] = TLS_RSA_WITH_AES_128_CBC_SHA;
+	offer[1] = TLS_RSA_WITH_AES_256_CBC_SHA;
+	memset(&cln, 0x0, sizeof(sslConn_t));
+	memset(&svr, 0x0, sizeof(sslConn_t));
+	cln.keys = clnConn->keys;
+	svr.keys = svrConn->keys;
+
+	for (pref = 0; pref < 2; pref++) {
+		memset(&options, 0x0, sizeof(sslSessOpts_t));
+		options.versionFlag = g_versionFlag;
+		options.serverCipherPref = (short)pref;
+		if (matrixSslNewServerSession(&svr.ssl, svr.keys, NULL,
+				&options) < 0) {
+			goto L_FAIL;
+		}
+		/* The server session marks options as its own; start over */
+		memset(&options, 0x0, sizeof(sslSessOpts_t));
+		options.versionFlag = g_versionFlag;
+		if (matrixSslNewClientSession(&cln.ssl, cln.keys, NULL, offer, 2,
+				clnCertChecker, "localhost", NULL, NULL, &options) < 0) {
+			goto L_FAIL;
+		}
+		if (performHandshake(&cln, &svr) < 0) {
+			goto L_FAIL;
+		}
+		if (svr.ssl->cipher->ident != offer[pref] ||
+				cln.ssl->cipher->ident != offer[pref]) {
+			goto L_FAIL;
+		}
+		if (exchangeAppData(&cln, &svr, CLI_APP_DATA) < 0) {
+			goto L_FAIL;
+		}
+		matrixSslDeleteSession(cln.ssl); cln.ssl = NULL;
+		matrixSslDeleteSession(svr.ssl); svr.ssl = NULL;
+	}
+	return PS_SUCCESS;
+
+L_FAIL:
+	if (cln.ssl) {
+		matrixSslDeleteSession(cln.ssl);
+	}
+	if (svr.ssl) {
+		matrixSslDeleteSession(svr.ssl);
+	}
+	return PS_FAILURE;
+}
+#endif /* TEST_SERVER_CIPHER_PREF */
+
+#ifdef TEST_CERT_CHAIN_CACHE
+/*
+	The peer chain only lives until the handshake completes, so the cache
+	is driven directly with the server cert of the pair under test as the
+	peer chain of a fresh client session on the same keys.
+*/
+static int32 chainCacheTest(sslConn_t *clnConn)
+{
+	ssl_t			*ssl = NULL;
+	psX509Cert_t	*cert;
+	sslSessOpts_t	options;
+	unsigned char	id[SHA256_HASH_SIZE];
+	char			*name;
+	uint32_t		gen;
+	int32			rc;
+
+	memset(&options, 0x0, sizeof(sslSessOpts_t));
+	options.versionFlag = g_versionFlag;
+	if (matrixSslNewClientSession(&ssl, clnConn->keys, NULL, NULL, 0,
+			clnCertChecker, "localhost", NULL, NULL, &options) < 0) {
+		return PS_FAILURE;
+	}
+	if (psX509ParseCert(NULL, RSACERT, RSA_SIZE, &ssl->sec.cert, 0) < 0) {
+		goto L_FAIL;
+	}
+	cert = ssl->sec.cert;
+	/* The test certs are past notAfter; pretend this one is current */
+	cert->authFailFlags &= ~PS_CERT_AUTH_FAIL_DATE_FLAG;
+
+	/* Miss, and a chain that was never validated is not added */
+	matrixSslFlushChainCache();
+	if (matrixChainCacheFind(ssl, id) != PS_FALSE) {
+		goto L_FAIL;
+	}
+	matrixChainCacheAdd(ssl, id);
+	if (matrixChainCacheFind(ssl, id) != PS_FALSE) {
+		goto L_FAIL;
+	}
+	/* Hit once validated and added */
+	cert->authStatus = PS_CERT_AUTH_PASS;
+	matrixChainCacheAdd(ssl, id);
+	cert->authStatus = PS_FALSE;
+	if (matrixChainCacheFind(ssl, id) != PS_TRUE ||
+			cert->authStatus != PS_CERT_AUTH_PASS) {
+		goto L_FAIL;
+	}
+	/* Reloaded trusted CAs get a new generation */
+	gen = ssl->keys->CAgeneration;
+	ssl->keys->CAgeneration = gen + 1;
+	rc = matrixChainCacheFind(ssl, id);
+	ssl->keys->CAgeneration = gen;
+	if (rc != PS_FALSE) {
+		goto L_FAIL;
+	}
+	/* Another expected name */
+	name = ssl->expectedName;
+	ssl->expectedName = (char *)"otherhost";
+	rc = matrixChainCacheFind(ssl, id);
+	ssl->expectedName = name;
+	if (rc != PS_FALSE) {
+		goto L_FAIL;
+	}
+	/* An expired cert is neither looked up nor added */
+	cert->authFailFlags |= PS_CERT_AUTH_FAIL_DATE_FLAG;
+	if (matrixChainCacheFind(ssl, id) != PS_FALSE) {
+		goto L_FAIL;
+	}
+	cert->authFailFlags &= ~PS_CERT_AUTH_FAIL_DATE_FLAG;
+	if (matrixChainCacheFind(ssl, id) != PS_TRUE) {
+		goto L_FAIL;
+	}
+	/* Flushed */
+	matrixSslFlushChainCache();
+	if (matrixChainCacheFind(ssl, id) != PS_FALSE) {
+		goto L_FAIL;
+	}
+	matrixSslDeleteSession(ssl);
+	return PS_SUCCESS;
+
+L_FAIL:
+	matrixSslDeleteSession(ssl);
+	return PS_FAILURE;
+}
+#endif /* TEST_CERT_CHAIN_CACHE */
+
+static int32 initializeHandshake(sslConn_t *clnConn, sslConn_t *svrConn,
+							uint16_t cipherSuite, sslSessionId_t *sid)
+{
+	int32	rc;
+
+	if ((rc = initializeServer(svrConn, cipherSuite)) < 0) {
+		return rc;
+	}
+	return initializeClient(clnConn, cipherSuite, sid);
+
+}
+
+#ifdef SSL_REHANDSHAKES_ENABLED
+static int32 initializeReHandshake(sslConn_t *clnConn, sslConn_t *svrConn,
+								   uint16_t cipherSuite)
+{
+	return matrixSslEncodeRehandshake(clnConn->ssl, NULL, NULL,
+		SSL_OPTION_FULL_HANDSHAKE, &cipherSuite, 1);
+}
+
+static int32 initializeServerInitiatedReHandshake(sslConn_t *clnConn,
+								sslConn_t *svrConn, uint16_t cipherSuite)
+{
+	return matrixSslEncodeRehandshake(svrConn->ssl, NULL, NULL,
+		SSL_OPTION_FULL_HANDSHAKE, &cipherSuite, 1);
+}
+
+static int32 initializeServerInitiatedResumedReHandshake(sslConn_t *clnConn,
+								sslConn_t *svrConn, uint16_t cipherSuite)
+{
+	return matrixSslEncodeRehandshake(svrConn->ssl, NULL, NULL, 0, &cipherSuite,
+		1);
+
+}
+
+static int32 initializeResumedReHandshake(sslConn_t *clnConn,
+							sslConn_t *svrConn, uint16_t cipherSuite)
+{
+	return matrixSslEncodeRehandshake(clnConn->ssl, NULL, NULL, 0, &cipherSuite,
+		1);
+}
+
+static int32 initializeUpgradeCertCbackReHandshake(sslConn_t *clnConn,
+							sslConn_t *svrConn, uint16_t cipherSuite)
+{
+	return matrixSslEncodeRehandshake(clnConn->ssl, NULL, clnCertCheckerUpdate,
+							0, &cipherSuite, 1);
+}
+
+static int32 initializeUpgradeKeysReHandshake(sslConn_t *clnConn,
+							sslConn_t *svrConn, uint16_t cipherSuite)
+{
+/*
+	Not really changing the keys but this still tests that passing a
+	valid arg will force a full handshake
+*/
+	return matrixSslEncodeRehandshake(clnConn->ssl, clnConn->ssl->keys, NULL,
+							0, &cipherSuite, 1);
+}
+
+static int32 initializeChangeCipherReHandshake(sslConn_t *clnConn,
+							sslConn_t *svrConn, uint16_t cipherSuite)
+{
+/*
+	Just picking the most common suite
+*/
+#ifdef USE_SSL_RSA_WITH_3DES_EDE_CBC_SHA
+	uint16_t suite;
+	suite = SSL_RSA_WITH_3DES_EDE_CBC_SHA;
+	return matrixSslEncodeRehandshake(clnConn->ssl, NULL, NULL,
+					0, &suite, 1);
+#else
+	return matrixSslEncodeRehandshake(clnConn->ssl, NULL, NULL, 0, 0, 0);
+#endif
+}
+
+#ifdef USE_CLIENT_AUTH
+static int32 initializeReHandshakeClientAuth(sslConn_t *clnConn,
+						sslConn_t *svrConn, uint16_t cipherSuite)
+{
+	return matrixSslEncodeRehandshake(svrConn->ssl, NULL, svrCertChecker, 0,
+			&cipherSuite, 1);
+}
+#endif /* USE_CLIENT_AUTH */
+#endif /* SSL_REHANDSHAKES_ENABLED */
+
+static int32 initializeResumedHandshake(sslConn_t *clnConn, sslConn_t *svrConn,
+										uint16_t cipherSuite)
+{
+	sslSessionId_t	*sessionId;
+	sslSessOpts_t	options;
+#ifdef ENABLE_PERF_TIMING
+	psTime_t		start, end;
+#endif /* ENABLE_PERF_TIMING */
+
+	sessionId = clnConn->ssl->sid;
+
+	memset(&options, 0x0, sizeof(sslSessOpts_t));
+	options.versionFlag = g_versionFlag;
+#ifdef USE_ECC_CIPHER_SUITE
+	options.ecFlags = clnConn->ssl->ecInfo.ecFlags;
+#endif
+#ifdef TEST_RESUMPTIONS_WITH_SESSION_TICKETS
+	options.ticketResumption = 1;
+#endif
+	matrixSslDeleteSession(clnConn->ssl);
+
+#ifdef ENABLE_PERF_TIMING
+	clnConn->hsTime = 0;
+	psGetTime(&start, NULL);
+#endif /* ENABLE_PERF_TIMING */
+	if (matrixSslNewClientSession(&clnConn->ssl, clnConn->keys, sessionId,
+			&cipherSuite, 1, clnCertChecker, "localhost", NULL, NULL,
+			&options)
+			< 0) {
+		return PS_FAILURE;
+	}
+#ifdef ENABLE_PERF_TIMING
+	psGetTime(&end, NULL);
+	clnConn->hsTime += psDiffMsecs(start, end, NULL);
+#endif /* ENABLE_PERF_TIMING */
+
+	matrixSslDeleteSession(svrConn->ssl);
+#ifdef ENABLE_PERF_TIMING
+	svrConn->hsTime = 0;
+	psGetTime(&start, NULL);
+#endif /* ENABLE_PERF_TIMING */
+#ifdef USE_SERVER_SIDE_SSL
+	if (matrixSslNewServerSession(&svrConn->ssl, svrConn->keys, NULL,
+			&options) < 0) {
+		return PS_FAILURE;
+	}
+#endif
+#ifdef ENABLE_PERF_TIMING
+	psGetTime(&end, NULL);
 	svrConn->hsTime += psDiffMsecs(start, end, NULL);
 #endif /* ENABLE_PERF_TIMING */
 	return PS_SUCCESS;
@@ -1896,41 +3399,343 @@ SEND_MORE:
 	} else {
 		sentRc = matrixSslSentData(sendingSide->ssl, dataSent);
 	}
-#else
-	sentRc = matrixSslSentData(sendingSide->ssl, dataSent);
-#endif
+#else
+	sentRc = matrixSslSentData(sendingSide->ssl, dataSent);
+#endif
+
+	/* Received data */
+	rc = matrixSslReceivedData(receivingSide->ssl, dataSent, &plaintextBuf,
+		&ptLen);
+
+	if (rc == MATRIXSSL_REQUEST_RECV) {
+		goto SEND_MORE;
+	} else if (rc == MATRIXSSL_APP_DATA || rc == MATRIXSSL_APP_DATA_COMPRESSED){
+		while (rc == MATRIXSSL_APP_DATA || rc == MATRIXSSL_APP_DATA_COMPRESSED){
+			//psTraceBytes("received", plaintextBuf, ptLen);
+			if ((rc = matrixSslProcessedData(receivingSide->ssl, &plaintextBuf,
+					&ptLen)) != 0) {
+				if (rc == MATRIXSSL_APP_DATA ||
+						rc == MATRIXSSL_APP_DATA_COMPRESSED) {
+					continue;
+				} else if (rc == MATRIXSSL_REQUEST_RECV) {
+					goto SEND_MORE;
+				} else {
+					return PS_FAILURE;
+				}
+			}
+		}
+		if (sentRc == MATRIXSSL_REQUEST_SEND) {
+			goto SEND_MORE;
+		}
+	} else {
+		printf("Unexpected error in exchangeAppData: %d\n", rc);
+		return PS_FAILURE;
+	}
+
+	return PS_SUCCESS;
+}
+
+
+/*
+	Send several records in a single buffer and receive them with the
+	multi record API, checking the plaintext arrives intact and in order.
+	return 0 on success, -1 on failure
+*/
+#define MULTI_APP_RECORDS	5
+#define MULTI_APP_RECLEN	100
+
+static int32 exchangeAppDataMulti(sslConn_t *sendingSide, sslConn_t *receivingSide)
+{
+	int32			writeBufLen, inBufLen, rc;
+	uint32			i, j, received;
+	uint16			count;
+	unsigned char	*writeBuf, *inBuf;
+	sslPtSpan_t		pt[MULTI_APP_RECORDS];
+
+#ifdef USE_DTLS
+	if (sendingSide->ssl->flags & SSL_FLAGS_DTLS) {
+		return PS_SUCCESS;
+	}
+#endif
+#ifdef USE_ZLIB_COMPRESSION
+	if (sendingSide->ssl->compression > 0) {
+		return PS_SUCCESS;
+	}
+#endif
+	for (i = 0; i < MULTI_APP_RECORDS; i++) {
+		writeBufLen = matrixSslGetWritebuf(sendingSide->ssl, &writeBuf,
+			MULTI_APP_RECLEN);
+		if (writeBufLen < MULTI_APP_RECLEN) {
+			return PS_FAILURE;
+		}
+		for (j = 0; j < MULTI_APP_RECLEN; j++) {
+			writeBuf[j] = (unsigned char)(i * MULTI_APP_RECLEN + j);
+		}
+		if (matrixSslEncodeWritebuf(sendingSide->ssl, MULTI_APP_RECLEN) < 0) {
+			return PS_FAILURE;
+		}
+	}
+	writeBufLen = matrixSslGetOutdata(sendingSide->ssl, &writeBuf);
+	inBufLen = matrixSslGetReadbufOfSize(receivingSide->ssl, writeBufLen,
+		&inBuf);
+	if (writeBufLen <= 0 || inBufLen < writeBufLen) {
+		return PS_FAILURE;
+	}
+	memcpy(inBuf, writeBuf, writeBufLen);
+	if (matrixSslSentData(sendingSide->ssl, writeBufLen) < 0) {
+		return PS_FAILURE;
+	}
+
+	received = 0;
+	rc = matrixSslReceivedDataMulti(receivingSide->ssl, writeBufLen, pt,
+		MULTI_APP_RECORDS, &count);
+	while (rc == MATRIXSSL_APP_DATA) {
+		for (i = 0; i < count; i++) {
+			for (j = 0; j < pt[i].len; j++, received++) {
+				if (pt[i].buf[j] != (unsigned char)received) {
+					return PS_FAILURE;
+				}
+			}
+		}
+		rc = matrixSslProcessedDataMulti(receivingSide->ssl, pt,
+			MULTI_APP_RECORDS, &count);
+	}
+	if (rc != MATRIXSSL_SUCCESS ||
+			received != MULTI_APP_RECORDS * MULTI_APP_RECLEN) {
+		return PS_FAILURE;
+	}
+	return PS_SUCCESS;
+}
+
+
+#ifdef USE_DYNAMIC_RECORD_SIZING
+/*
+	Move everything queued on the sending side to the receiving side and
+	consume the plaintext.  Returns the number of plaintext bytes received.
+*/
+static int32 deliverAppData(sslConn_t *sendingSide, sslConn_t *receivingSide)
+{
+	int32			writeBufLen, inBufLen, rc, received;
+	uint32			ptLen;
+	unsigned char	*writeBuf, *inBuf, *pt;
+
+	writeBufLen = matrixSslGetOutdata(sendingSide->ssl, &writeBuf);
+	inBufLen = matrixSslGetReadbufOfSize(receivingSide->ssl, writeBufLen,
+		&inBuf);
+	if (writeBufLen <= 0 || inBufLen < writeBufLen) {
+		return PS_FAILURE;
+	}
+	memcpy(inBuf, writeBuf, writeBufLen);
+	if (matrixSslSentData(sendingSide->ssl, writeBufLen) < 0) {
+		return PS_FAILURE;
+	}
+	received = 0;
+	rc = matrixSslReceivedData(receivingSide->ssl, writeBufLen, &pt, &ptLen);
+	while (rc == MATRIXSSL_APP_DATA) {
+		received += ptLen;
+		rc = matrixSslProcessedData(receivingSide->ssl, &pt, &ptLen);
+	}
+	return (rc == MATRIXSSL_SUCCESS) ? received : PS_FAILURE;
+}
+
+/*
+	Records stay within drsRecordLen until drsBoostBytes have been sent, are
+	full size after that, and drop back to small once the sender goes idle.
+	The session limits are set directly to keep the test short.
+*/
+#define DRS_TEST_RECLEN		512
+#define DRS_TEST_BOOST		4096
+#define DRS_TEST_IDLE		2
+#define DRS_TEST_REQLEN		4096
+
+static int32 dynamicRecordTest(sslConn_t *sendingSide, sslConn_t *receivingSide)
+{
+	ssl_t			*ssl = sendingSide->ssl;
+	unsigned char	*buf;
+	psTime_t		last, now;
+	int32			len, i;
+
+#ifdef USE_DTLS
+	if (ssl->flags & SSL_FLAGS_DTLS) {
+		return PS_SUCCESS;
+	}
+#endif
+	ssl->drsRecordLen = DRS_TEST_RECLEN;
+	ssl->drsBoostBytes = DRS_TEST_BOOST;
+	ssl->drsIdleMsec = DRS_TEST_IDLE;
+	ssl->drsSent = 0;
+
+	/* Slow start: every record must encode within DRS_TEST_RECLEN */
+	for (i = 0; ssl->drsSent < DRS_TEST_BOOST; i++) {
+		if (i > DRS_TEST_BOOST / 16) {
+			goto L_FAIL;
+		}
+		len = matrixSslGetWritebuf(ssl, &buf, DRS_TEST_REQLEN);
+		if (len <= 0 || matrixSslGetEncodedSize(ssl, len) > DRS_TEST_RECLEN) {
+			goto L_FAIL;
+		}
+		memset(buf, 0x5A, len);
+		if (matrixSslEncodeWritebuf(ssl, len) < 0 ||
+				deliverAppData(sendingSide, receivingSide) != len) {
+			goto L_FAIL;
+		}
+	}
+	if (i < 2) {
+		goto L_FAIL;	/* Boost reached without a single small record */
+	}
+
+	/* Boosted: the full request fits in one record */
+	len = matrixSslGetWritebuf(ssl, &buf, DRS_TEST_REQLEN);
+	if (len != min(DRS_TEST_REQLEN, ssl->maxPtFrag)) {
+		goto L_FAIL;
+	}
+	memset(buf, 0x5A, len);
+	if (matrixSslEncodeWritebuf(ssl, len) < 0 ||
+			deliverAppData(sendingSide, receivingSide) != len) {
+		goto L_FAIL;
+	}
+
+	/* Idle: back to small records */
+	psGetTime(&last, NULL);
+	do {
+		psGetTime(&now, NULL);
+	} while (psDiffMsecs(last, now, NULL) <= DRS_TEST_IDLE);
+	len = matrixSslGetWritebuf(ssl, &buf, DRS_TEST_REQLEN);
+	if (len <= 0 || matrixSslGetEncodedSize(ssl, len) > DRS_TEST_RECLEN ||
+			ssl->drsSent != 0) {
+		goto L_FAIL;
+	}
+	ssl->drsRecordLen = 0;
+	return PS_SUCCESS;
+
+L_FAIL:
+	ssl->drsRecordLen = 0;
+	return PS_FAILURE;
+}
+#endif /* USE_DYNAMIC_RECORD_SIZING */
+
+#ifdef TEST_RECORD_SIZE_LIMIT
+/*
+	Both sides advertise RSL_TEST_LIMIT.  Application data must go out in
+	records no larger than that, the record buffers must shrink to fit it,
+	and a larger record from a peer that ignores the limit must be refused
+	with a record_overflow alert.
+*/
+#define RSL_TEST_LIMIT		512
+#define RSL_TEST_BUFSIZE(ssl) \
+	((ssl)->recordHeadLen + RSL_TEST_LIMIT + SSL_MAX_RECORD_EXPANSION)
+
+static int32 recordSizeLimitTest(sslConn_t *clnConn, sslConn_t *svrConn)
+{
+	sslConn_t		cln, svr;
+	sslSessOpts_t	options;
+	unsigned char	data[4 * RSL_TEST_LIMIT];
+	unsigned char	*buf, *in, *pt;
+	uint32			ptLen;
+	int32			len, inLen, rc, received;
+
+#ifdef USE_DTLS
+	if (clnConn->ssl->flags & SSL_FLAGS_DTLS) {
+		return PS_SUCCESS;
+	}
+#endif
+	memset(&cln, 0x0, sizeof(sslConn_t));
+	memset(&svr, 0x0, sizeof(sslConn_t));
+	cln.keys = clnConn->keys;
+	svr.keys = svrConn->keys;
+	memset(&options, 0x0, sizeof(sslSessOpts_t));
+	options.versionFlag = g_versionFlag;
+	options.recordSizeLimit = RSL_TEST_LIMIT;
+	if (matrixSslNewClientSession(&cln.ssl, cln.keys, NULL,
+			&clnConn->ssl->cipher->ident, 1, clnCertChecker, "localhost",
+			NULL, NULL, &options) < 0 ||
+			matrixSslNewServerSession(&svr.ssl, svr.keys, NULL,
+			&options) < 0 ||
+			performHandshake(&cln, &svr) < 0) {
+		goto L_FAIL;
+	}
+	/* SSL 3.0 has no extensions */
+	if (cln.ssl->minVer == SSL3_MIN_VER) {
+		matrixSslDeleteSession(cln.ssl);
+		matrixSslDeleteSession(svr.ssl);
+		return PS_SUCCESS;
+	}
+	if (!cln.ssl->extFlags.record_size_limit ||
+			!svr.ssl->extFlags.record_size_limit ||
+			cln.ssl->maxPtFrag > RSL_TEST_LIMIT ||
+			svr.ssl->maxPtFrag > RSL_TEST_LIMIT) {
+		goto L_FAIL;
+	}
+
+	/* A large write is split into records of at most RSL_TEST_LIMIT */
+	memset(data, 0x5A, sizeof(data));
+	if (matrixSslEncodeToOutdata(cln.ssl, data, sizeof(data)) < 0) {
+		goto L_FAIL;
+	}
+	len = matrixSslGetOutdata(cln.ssl, &buf);
+	inLen = matrixSslGetReadbufOfSize(svr.ssl, len, &in);
+	if (len <= 0 || inLen < len) {
+		goto L_FAIL;
+	}
+	memcpy(in, buf, len);
+	if (matrixSslSentData(cln.ssl, len) < 0) {
+		goto L_FAIL;
+	}
+	received = 0;
+	rc = matrixSslReceivedData(svr.ssl, len, &pt, &ptLen);
+	while (rc == MATRIXSSL_APP_DATA) {
+		if (ptLen > RSL_TEST_LIMIT) {
+			goto L_FAIL;
+		}
+		received += ptLen;
+		rc = matrixSslProcessedData(svr.ssl, &pt, &ptLen);
+	}
+	if (rc != MATRIXSSL_SUCCESS || received != (int32)sizeof(data)) {
+		goto L_FAIL;
+	}
+	if (exchangeAppData(&svr, &cln, SVR_APP_DATA) < 0) {
+		goto L_FAIL;
+	}
 
-	/* Received data */
-	rc = matrixSslReceivedData(receivingSide->ssl, dataSent, &plaintextBuf,
-		&ptLen);
+	/* Neither side keeps buffers bigger than a limited record */
+	if (cln.ssl->insize > RSL_TEST_BUFSIZE(cln.ssl) ||
+			cln.ssl->outsize > RSL_TEST_BUFSIZE(cln.ssl) ||
+			svr.ssl->insize > RSL_TEST_BUFSIZE(svr.ssl) ||
+			svr.ssl->outsize > RSL_TEST_BUFSIZE(svr.ssl)) {
+		goto L_FAIL;
+	}
 
-	if (rc == MATRIXSSL_REQUEST_RECV) {
-		goto SEND_MORE;
-	} else if (rc == MATRIXSSL_APP_DATA || rc == MATRIXSSL_APP_DATA_COMPRESSED){
-		while (rc == MATRIXSSL_APP_DATA || rc == MATRIXSSL_APP_DATA_COMPRESSED){
-			//psTraceBytes("received", plaintextBuf, ptLen);
-			if ((rc = matrixSslProcessedData(receivingSide->ssl, &plaintextBuf,
-					&ptLen)) != 0) {
-				if (rc == MATRIXSSL_APP_DATA ||
-						rc == MATRIXSSL_APP_DATA_COMPRESSED) {
-					continue;
-				} else if (rc == MATRIXSSL_REQUEST_RECV) {
-					goto SEND_MORE;
-				} else {
-					return PS_FAILURE;
-				}
-			}
-		}
-		if (sentRc == MATRIXSSL_REQUEST_SEND) {
-			goto SEND_MORE;
-		}
-	} else {
-		printf("Unexpected error in exchangeAppData: %d\n", rc);
-		return PS_FAILURE;
+	/* A client ignoring the server's limit gets record_overflow */
+	cln.ssl->maxPtFrag = SSL_MAX_PLAINTEXT_LEN;
+	if (matrixSslEncodeToOutdata(cln.ssl, data, sizeof(data)) < 0) {
+		goto L_FAIL;
+	}
+	len = matrixSslGetOutdata(cln.ssl, &buf);
+	inLen = matrixSslGetReadbufOfSize(svr.ssl, len, &in);
+	if (len <= 0 || inLen < len) {
+		goto L_FAIL;
+	}
+	memcpy(in, buf, len);
+	if (matrixSslReceivedData(svr.ssl, len, &pt, &ptLen) !=
+			MATRIXSSL_REQUEST_SEND ||
+			svr.ssl->err != SSL_ALERT_RECORD_OVERFLOW) {
+		goto L_FAIL;
 	}
 
+	matrixSslDeleteSession(cln.ssl);
+	matrixSslDeleteSession(svr.ssl);
 	return PS_SUCCESS;
+
+L_FAIL:
+	if (cln.ssl) {
+		matrixSslDeleteSession(cln.ssl);
+	}
+	if (svr.ssl) {
+		matrixSslDeleteSession(svr.ssl);
+	}
+	return PS_FAILURE;
 }
+#endif /* TEST_RECORD_SIZE_LIMIT */
 
 
 static int32 initializeServer(sslConn_t *conn, uint16_t cipherSuite)
@@ -1945,6 +3750,9 @@ static int32 initializeServer(sslConn_t *conn, uint16_t cipherSuite)
 
 	memset(&options, 0x0, sizeof(sslSessOpts_t));
 	options.versionFlag = g_versionFlag;
+	/* Negotiate in server order.  The client only offers the suite under
+		test so the outcome is the same as client order */
+	options.serverCipherPref = 1;
 
 	if (conn->keys == NULL) {
 		if ((spec = sslGetDefinedCipherSpec(cipherSuite)) == NULL) {
@@ -2252,6 +4060,664 @@ static int32 svrCertChecker(ssl_t *ssl, psX509Cert_t *cert, int32 alert)
 }
 #endif /* USE_CLIENT_AUTH */
 
+#ifdef SSL_BENCH
+/******************************************************************************/
+/*
+	Benchmark mode, "sslTest -B [options]".  The same in memory client and
+	server pairs as the tests, run from several threads at once and timed
+	instead of checked.  Each cipher suite is run with every key that can
+	be used with it: full handshakes, session id resumptions and then bulk
+	records of several sizes.  There is one result per measurement, as CSV
+	or JSON so runs can be compared over time.
+*/
+#define BENCH_MAX_THREADS	64
+#define BENCH_MAX_SUITES	64
+#define BENCH_HANDSHAKES	100	/* Per thread and test, default */
+#define BENCH_RECORD_MB		4	/* Per thread and record size, default */
+
+enum {
+	BENCH_KEY_RSA = 1,
+	BENCH_KEY_ECC,
+	BENCH_KEY_PSK
+};
+
+enum {
+	BENCH_FULL,
+	BENCH_RESUMED,
+	BENCH_RECORDS
+};
+
+typedef struct {
+	const char			*name;
+	int32				type;
+	const unsigned char	*cert;
+	int32				certLen;
+	const unsigned char	*key;
+	int32				keyLen;
+	const unsigned char	*CA;
+	int32				CAlen;
+	int32				ecFlags;	/* Curve offered for ECDHE */
+} benchKey_t;
+
+static const benchKey_t	g_benchKeys[] = {
+#ifndef USE_ONLY_PSK_CIPHER_SUITE
+#ifdef USE_RSA
+#ifdef USE_SECP256R1
+	{ "RSA-2048", BENCH_KEY_RSA, RSA2048, RSA2048_SIZE,
+		RSA2048KEY, RSA2048KEY_SIZE, RSA2048CA, RSA2048CA_SIZE,
+		SSL_OPT_SECP256R1 },
+	{ "RSA-3072", BENCH_KEY_RSA, RSA3072, RSA3072_SIZE,
+		RSA3072KEY, RSA3072KEY_SIZE, RSA3072CA, RSA3072CA_SIZE,
+		SSL_OPT_SECP256R1 },
+#else
+	{ "RSA-2048", BENCH_KEY_RSA, RSA2048, RSA2048_SIZE,
+		RSA2048KEY, RSA2048KEY_SIZE, RSA2048CA, RSA2048CA_SIZE, 0 },
+	{ "RSA-3072", BENCH_KEY_RSA, RSA3072, RSA3072_SIZE,
+		RSA3072KEY, RSA3072KEY_SIZE, RSA3072CA, RSA3072CA_SIZE, 0 },
+#endif
+#endif /* USE_RSA */
+#ifdef USE_ECC
+#ifdef USE_SECP256R1
+	{ "P-256", BENCH_KEY_ECC, EC256, EC256_SIZE,
+		EC256KEY, EC256KEY_SIZE, EC256CA, EC256CA_SIZE, SSL_OPT_SECP256R1 },
+#endif
+#ifdef USE_SECP384R1
+	{ "P-384", BENCH_KEY_ECC, EC384, EC384_SIZE,
+		EC384KEY, EC384KEY_SIZE, EC384CA, EC384CA_SIZE, SSL_OPT_SECP384R1 },
+#endif
+#endif /* USE_ECC */
+#endif /* !USE_ONLY_PSK_CIPHER_SUITE */
+#ifdef USE_PSK_CIPHER_SUITE
+	{ "PSK", BENCH_KEY_PSK, NULL, 0, NULL, 0, NULL, 0, 0 },
+#endif
+	{ NULL, 0, NULL, 0, NULL, 0, NULL, 0, 0 } /* must be last */
+};
+
+/* Suites run when -c isn't given, the common choice for each key type */
+static const uint16_t	g_benchSuites[] = {
+#ifdef USE_TLS_RSA_WITH_AES_128_GCM_SHA256
+	TLS_RSA_WITH_AES_128_GCM_SHA256,
+#endif
+#ifdef USE_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256
+	TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+#endif
+#ifdef USE_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256
+	TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+#endif
+#ifdef USE_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384
+	TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+#endif
+#ifdef USE_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256
+	TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+#endif
+#ifdef USE_TLS_PSK_WITH_AES_128_CBC_SHA256
+	TLS_PSK_WITH_AES_128_CBC_SHA256,
+#endif
+	0 /* must be last */
+};
+
+static const uint32_t	g_benchRecLens[] = { 64, 256, 1024, 4096, 16384, 0 };
+
+static const char		*g_benchTestName[] = { "full", "resumed", "records" };
+
+/* State shared by the threads of one measurement */
+typedef struct {
+	const benchKey_t	*key;
+	sslKeys_t			*svrKeys;
+	sslKeys_t			*clnKeys;
+	uint16_t			cipher;
+	int32				test;		/* BENCH_FULL etc. */
+	uint32_t			count;		/* Handshakes per thread */
+	uint32_t			recLen;
+	uint32_t			nrec;		/* Records per thread */
+	pthread_barrier_t	start;
+} benchRun_t;
+
+typedef struct {
+	pthread_t		tid;
+	benchRun_t		*run;
+	uint32_t		*lat;		/* Handshake times, usecs */
+	uint32_t		ops;
+	uint32_t		errors;
+	uint64_t		busy;		/* Usecs spent sending records */
+	psTime_t		start;		/* Of the timed part */
+	psTime_t		end;
+} benchThread_t;
+
+static int				g_benchThreads;
+static uint32_t			g_benchCount = BENCH_HANDSHAKES;
+static uint32_t			g_benchMb = BENCH_RECORD_MB;
+static int				g_benchJson;
+static int				g_benchRows;
+static FILE				*g_benchOut;
+
+static uint64_t benchUsecs(psTime_t start, psTime_t end)
+{
+#ifdef USE_HIGHRES_TIME
+	return (uint64_t)psDiffUsecs(start, end);
+#else
+	return (uint64_t)psDiffMsecs(start, end, NULL) * 1000;
+#endif
+}
+
+static const char *benchSuiteName(uint16_t cipher)
+{
+	static char		hex[8];
+	int				id;
+
+	for (id = 0; ciphers[id].id > 0; id++) {
+		if (ciphers[id].id == cipher) {
+			return ciphers[id].name;
+		}
+	}
+	snprintf(hex, sizeof(hex), "0x%04x", cipher);
+	return hex;
+}
+
+static int32 benchKeyFits(const benchKey_t *key, const sslCipherSpec_t *spec)
+{
+	switch (spec->type) {
+	case CS_RSA:
+	case CS_DHE_RSA:
+	case CS_ECDHE_RSA:
+		return key->type == BENCH_KEY_RSA;
+	case CS_ECDH_ECDSA:
+	case CS_ECDHE_ECDSA:
+		return key->type == BENCH_KEY_ECC;
+	case CS_PSK:
+	case CS_DHE_PSK:
+		return key->type == BENCH_KEY_PSK;
+	}
+	return 0;	/* ECDH_RSA and anon suites aren't benchmarked */
+}
+
+static int32 benchLoadKeys(const benchKey_t *key, sslKeys_t *svrKeys,
+				sslKeys_t *clnKeys)
+{
+	int32	rc = PS_SUCCESS;
+
+	switch (key->type) {
+#ifndef USE_ONLY_PSK_CIPHER_SUITE
+#ifdef USE_RSA
+	case BENCH_KEY_RSA:
+		if ((rc = matrixSslLoadRsaKeysMem(svrKeys, key->cert, key->certLen,
+				key->key, key->keyLen, NULL, 0)) < 0) {
+			return rc;
+		}
+		rc = matrixSslLoadRsaKeysMem(clnKeys, NULL, 0, NULL, 0,
+			key->CA, key->CAlen);
+		break;
+#endif
+#ifdef USE_ECC
+	case BENCH_KEY_ECC:
+		if ((rc = matrixSslLoadEcKeysMem(svrKeys, key->cert, key->certLen,
+				key->key, key->keyLen, NULL, 0)) < 0) {
+			return rc;
+		}
+		rc = matrixSslLoadEcKeysMem(clnKeys, NULL, 0, NULL, 0,
+			key->CA, key->CAlen);
+		break;
+#endif
+#endif /* !USE_ONLY_PSK_CIPHER_SUITE */
+#ifdef USE_PSK_CIPHER_SUITE
+	case BENCH_KEY_PSK:
+		for (rc = 0; rc < PSK_HEADER_TABLE_COUNT; rc++) {
+			matrixSslLoadPsk(svrKeys,
+				PSK_HEADER_TABLE[rc].key, sizeof(PSK_HEADER_TABLE[rc].key),
+				PSK_HEADER_TABLE[rc].id, sizeof(PSK_HEADER_TABLE[rc].id));
+		}
+		rc = matrixSslLoadPsk(clnKeys,
+			PSK_HEADER_TABLE[0].key, sizeof(PSK_HEADER_TABLE[0].key),
+			PSK_HEADER_TABLE[0].id, sizeof(PSK_HEADER_TABLE[0].id));
+		break;
+#endif
+	}
+#ifdef REQUIRE_DH_PARAMS
+	if (rc >= 0 && key->type != BENCH_KEY_ECC) {
+		rc = matrixSslLoadDhParamsMem(svrKeys, DHPARAM2048, DHPARAM2048_SIZE);
+	}
+#endif
+	return rc;
+}
+
+/* Delete both sessions.  The keys belong to the run */
+static void benchClose(sslConn_t *cln, sslConn_t *svr)
+{
+	if (cln->ssl != NULL) {
+		matrixSslDeleteSession(cln->ssl);
+		cln->ssl = NULL;
+	}
+	if (svr->ssl != NULL) {
+		matrixSslDeleteSession(svr->ssl);
+		svr->ssl = NULL;
+	}
+}
+
+static int32 benchConnect(benchRun_t *run, sslConn_t *cln, sslConn_t *svr,
+				sslSessionId_t *sid)
+{
+	sslSessOpts_t	options;
+
+	memset(&options, 0x0, sizeof(sslSessOpts_t));
+	options.ecFlags = run->key->ecFlags;
+	cln->keys = run->clnKeys;
+	if (matrixSslNewClientSession(&cln->ssl, run->clnKeys, sid, &run->cipher,
+			1, clnCertChecker, "localhost", NULL, NULL, &options) < 0) {
+		cln->ssl = NULL;
+		return PS_FAILURE;
+	}
+	memset(&options, 0x0, sizeof(sslSessOpts_t));
+	svr->keys = run->svrKeys;
+	if (matrixSslNewServerSession(&svr->ssl, run->svrKeys, NULL,
+			&options) < 0) {
+		svr->ssl = NULL;
+		return PS_FAILURE;
+	}
+	return performHandshake(cln, svr);
+}
+
+/* One record from cln to svr */
+static int32 benchRecord(sslConn_t *cln, sslConn_t *svr, uint32_t recLen)
+{
+	unsigned char	*wb, *rb, *pt;
+	int32			rc, len;
+	uint32			ptLen;
+
+	if (matrixSslGetWritebuf(cln->ssl, &wb, recLen) < (int32)recLen) {
+		return PS_FAILURE;
+	}
+	if (matrixSslEncodeWritebuf(cln->ssl, recLen) < 0) {
+		return PS_FAILURE;
+	}
+	if ((len = matrixSslGetOutdata(cln->ssl, &wb)) <= 0) {
+		return PS_FAILURE;
+	}
+	if (matrixSslGetReadbufOfSize(svr->ssl, len, &rb) < len) {
+		return PS_FAILURE;
+	}
+	memcpy(rb, wb, len);
+	if (matrixSslSentData(cln->ssl, len) < 0) {
+		return PS_FAILURE;
+	}
+	rc = matrixSslReceivedData(svr->ssl, len, &pt, &ptLen);
+	/* Loop, since with BEAST mode, 2 records may result from one encode */
+	while (rc == MATRIXSSL_APP_DATA) {
+		rc = matrixSslProcessedData(svr->ssl, &pt, &ptLen);
+	}
+	return rc == 0 ? PS_SUCCESS : PS_FAILURE;
+}
+
+static void *benchThread(void *arg)
+{
+	benchThread_t	*t = arg;
+	benchRun_t		*run = t->run;
+	sslConn_t		cln, svr;
+	sslSessionId_t	*sid = NULL;
+	psTime_t		start, end;
+	uint32_t		i;
+	int32			rc;
+
+	memset(&cln, 0x0, sizeof(sslConn_t));
+	memset(&svr, 0x0, sizeof(sslConn_t));
+	rc = PS_SUCCESS;
+	/* Untimed setup: a session to resume, or a connection for records */
+	if (run->test == BENCH_RESUMED) {
+		if ((rc = matrixSslNewSessionId(&sid, NULL)) >= 0) {
+			rc = benchConnect(run, &cln, &svr, sid);
+			benchClose(&cln, &svr);
+		}
+	} else if (run->test == BENCH_RECORDS) {
+		rc = benchConnect(run, &cln, &svr, NULL);
+	}
+	pthread_barrier_wait(&run->start);
+	psGetTime(&t->start, NULL);
+	if (rc < 0) {
+		t->errors++;
+		goto L_DONE;
+	}
+
+	if (run->test == BENCH_RECORDS) {
+		psGetTime(&start, NULL);
+		for (i = 0; i < run->nrec; i++) {
+			if (benchRecord(&cln, &svr, run->recLen) < 0) {
+				t->errors++;
+				break;
+			}
+			t->ops++;
+		}
+		psGetTime(&end, NULL);
+		t->busy = benchUsecs(start, end);
+		goto L_DONE;
+	}
+
+	for (i = 0; i < run->count; i++) {
+		psGetTime(&start, NULL);
+		rc = benchConnect(run, &cln, &svr, sid);
+		psGetTime(&end, NULL);
+		/* A resumption the server turned into a full handshake is an error */
+		if (rc == PS_SUCCESS && run->test == BENCH_RESUMED &&
+				!(svr.ssl->flags & SSL_FLAGS_RESUMED)) {
+			rc = PS_FAILURE;
+		}
+		benchClose(&cln, &svr);
+		if (rc < 0) {
+			t->errors++;
+			continue;
+		}
+		t->lat[t->ops++] = (uint32_t)benchUsecs(start, end);
+	}
+
+L_DONE:
+	psGetTime(&t->end, NULL);
+	benchClose(&cln, &svr);
+	if (sid != NULL) {
+		matrixSslDeleteSessionId(sid);
+	}
+	return NULL;
+}
+
+static int benchCmpU32(const void *a, const void *b)
+{
+	uint32_t	x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Print one result.  Negative values are "not applicable" */
+static void benchEmit(const benchRun_t *run, uint64_t ops, uint32_t errors,
+				double secs, double mibs, double mean, int64_t p50, int64_t p99)
+{
+	const char	*suite = benchSuiteName(run->cipher);
+	uint32_t	recLen = run->test == BENCH_RECORDS ? run->recLen : 0;
+	double		rate = secs > 0 ? ops / secs : 0;
+	char		mibStr[32], p50Str[24], p99Str[24];
+	const char	*na = g_benchJson ? "null" : "";
+
+	if (mibs < 0) {
+		strcpy(mibStr, na);
+	} else {
+		snprintf(mibStr, sizeof(mibStr), "%.2f", mibs);
+	}
+	if (p50 < 0) {
+		strcpy(p50Str, na);
+		strcpy(p99Str, na);
+	} else {
+		snprintf(p50Str, sizeof(p50Str), "%lld", (long long)p50);
+		snprintf(p99Str, sizeof(p99Str), "%lld", (long long)p99);
+	}
+	if (g_benchJson) {
+		fprintf(g_benchOut, "%s\n    { \"suite\": \"%s\", \"key\": \"%s\", "
+			"\"test\": \"%s\", \"record_size\": %u, \"threads\": %d, "
+			"\"ops\": %llu, \"errors\": %u, \"seconds\": %.4f, "
+			"\"per_sec\": %.1f, \"mib_per_sec\": %s, \"mean_us\": %.2f, "
+			"\"p50_us\": %s, \"p99_us\": %s }",
+			g_benchRows ? "," : "", suite, run->key->name,
+			g_benchTestName[run->test], recLen, g_benchThreads,
+			(unsigned long long)ops, errors, secs, rate, mibStr, mean,
+			p50Str, p99Str);
+	} else {
+		fprintf(g_benchOut, "%s,%s,%s,%u,%d,%llu,%u,%.4f,%.1f,%s,%.2f,%s,%s\n",
+			suite, run->key->name, g_benchTestName[run->test], recLen,
+			g_benchThreads, (unsigned long long)ops, errors, secs, rate,
+			mibStr, mean, p50Str, p99Str);
+	}
+	fflush(g_benchOut);
+	g_benchRows++;
+}
+
+/* Run one measurement on all threads and print it */
+static int32 benchMeasure(benchRun_t *run, benchThread_t *threads,
+				uint32_t *lat)
+{
+	benchThread_t	*t;
+	psTime_t		base;
+	uint64_t		ops, busy, wall, sum, first, last;
+	uint32_t		errors, n, i;
+	int				tn;
+
+	pthread_barrier_init(&run->start, NULL, g_benchThreads + 1);
+	psGetTime(&base, NULL);
+	for (tn = 0; tn < g_benchThreads; tn++) {
+		t = &threads[tn];
+		t->run = run;
+		t->ops = t->errors = 0;
+		t->busy = 0;
+		if (pthread_create(&t->tid, NULL, benchThread, t) != 0) {
+			/* Threads already started are stuck at the barrier */
+			fprintf(stderr, "Unable to start thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_barrier_wait(&run->start);
+	for (tn = 0; tn < g_benchThreads; tn++) {
+		pthread_join(threads[tn].tid, NULL);
+	}
+	pthread_barrier_destroy(&run->start);
+
+	/* From the first thread starting to the last one finishing */
+	ops = busy = 0;
+	errors = n = 0;
+	first = UINT64_MAX;
+	last = 0;
+	for (tn = 0; tn < g_benchThreads; tn++) {
+		t = &threads[tn];
+		if (benchUsecs(base, t->start) < first) {
+			first = benchUsecs(base, t->start);
+		}
+		if (benchUsecs(base, t->end) > last) {
+			last = benchUsecs(base, t->end);
+		}
+		ops += t->ops;
+		errors += t->errors;
+		busy += t->busy;
+		if (run->test != BENCH_RECORDS) {
+			memcpy(lat + n, t->lat, t->ops * sizeof(uint32_t));
+			n += t->ops;
+		}
+	}
+	wall = last - first;
+	if (run->test == BENCH_RECORDS) {
+		benchEmit(run, ops, errors, wall / 1000000.0,
+			wall ? (double)ops * run->recLen / BYTES_PER_MB /
+				(wall / 1000000.0) : 0,
+			ops ? (double)busy / ops : 0, -1, -1);
+	} else {
+		qsort(lat, n, sizeof(uint32_t), benchCmpU32);
+		for (sum = 0, i = 0; i < n; i++) {
+			sum += lat[i];
+		}
+		benchEmit(run, ops, errors, wall / 1000000.0, -1,
+			n ? (double)sum / n : 0,
+			n ? lat[n / 2] : 0, n ? lat[(uint64_t)n * 99 / 100] : 0);
+	}
+	return errors ? PS_FAILURE : PS_SUCCESS;
+}
+
+static void benchUsage(void)
+{
+	fprintf(stderr, "\nusage: sslTest -B { options }\n"
+		"\n"
+		"Options can be one or more of the following:\n"
+		"\n"
+		"-t <threads>            - Threads, default one per core\n"
+		"-n <handshakes>         - Handshakes per thread and test, default %d\n"
+		"-m <MiB>                - Record data per thread and record size,\n"
+		"                          default %d, 0 skips the record tests\n"
+		"-c <cipherList>         - Comma separated list of cipher numbers,\n"
+		"                          default a common suite per key type\n"
+		"-f <csv|json>           - Output format, default csv\n"
+		"-o <file>               - Output file, default stdout\n"
+		"\n", BENCH_HANDSHAKES, BENCH_RECORD_MB);
+}
+
+static int sslBench(int argc, char **argv)
+{
+	benchThread_t			*threads = NULL;
+	benchRun_t				run;
+	const benchKey_t		*key;
+	const sslCipherSpec_t	*spec;
+	uint16_t				suites[BENCH_MAX_SUITES];
+	uint8_t					recordsDone[BENCH_MAX_SUITES];
+	uint32_t				*lat = NULL;
+	char					*p, ts[32];
+	time_t					now;
+	int						nsuites, s, r, tn, opt, rc;
+
+	g_benchOut = stdout;
+	g_benchThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	for (nsuites = 0; g_benchSuites[nsuites] != 0; nsuites++) {
+		suites[nsuites] = g_benchSuites[nsuites];
+	}
+	while ((opt = getopt(argc, argv, "c:f:hm:n:o:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			nsuites = 0;
+			for (p = strtok(optarg, ","); p != NULL && nsuites < BENCH_MAX_SUITES;
+					p = strtok(NULL, ",")) {
+				suites[nsuites++] = (uint16_t)strtoul(p, NULL, 0);
+			}
+			break;
+		case 'f':
+			if (strcmp(optarg, "json") == 0) {
+				g_benchJson = 1;
+			} else if (strcmp(optarg, "csv") != 0) {
+				benchUsage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			g_benchMb = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			g_benchCount = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			if ((g_benchOut = fopen(optarg, "w")) == NULL) {
+				fprintf(stderr, "Unable to open %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			g_benchThreads = atoi(optarg);
+			break;
+		default:
+			benchUsage();
+			return EXIT_FAILURE;
+		}
+	}
+	if (g_benchThreads < 1) {
+		g_benchThreads = 1;
+	} else if (g_benchThreads > BENCH_MAX_THREADS) {
+		g_benchThreads = BENCH_MAX_THREADS;
+	}
+	if (g_benchCount < 1) {
+		g_benchCount = 1;
+	}
+
+	if (matrixSslOpen() < 0) {
+		fprintf(stderr, "matrixSslOpen failed, exiting...\n");
+		return EXIT_FAILURE;
+	}
+	threads = calloc(g_benchThreads, sizeof(benchThread_t));
+	lat = calloc((size_t)g_benchThreads * g_benchCount, sizeof(uint32_t));
+	if (threads == NULL || lat == NULL) {
+		rc = PS_MEM_FAIL;
+		goto L_EXIT;
+	}
+	for (tn = 0; tn < g_benchThreads; tn++) {
+		if ((threads[tn].lat = calloc(g_benchCount, sizeof(uint32_t))) == NULL) {
+			rc = PS_MEM_FAIL;
+			goto L_EXIT;
+		}
+	}
+
+	if (g_benchJson) {
+		now = time(NULL);
+		strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+		fprintf(g_benchOut, "{\n  \"matrixssl\": \"%s\",\n  \"time\": \"%s\",\n"
+			"  \"threads\": %d,\n  \"results\": [", MATRIXSSL_VERSION, ts,
+			g_benchThreads);
+	} else {
+		fprintf(g_benchOut, "suite,key,test,record_size,threads,ops,errors,"
+			"seconds,per_sec,mib_per_sec,mean_us,p50_us,p99_us\n");
+	}
+
+	rc = PS_SUCCESS;
+	memset(recordsDone, 0x0, sizeof(recordsDone));
+	memset(&run, 0x0, sizeof(benchRun_t));
+	run.count = g_benchCount;
+	for (key = g_benchKeys; key->name != NULL; key++) {
+		run.key = key;
+		run.svrKeys = run.clnKeys = NULL;
+		if (matrixSslNewKeys(&run.svrKeys, NULL) < 0 ||
+				matrixSslNewKeys(&run.clnKeys, NULL) < 0 ||
+				benchLoadKeys(key, run.svrKeys, run.clnKeys) < 0) {
+			fprintf(stderr, "Unable to load %s keys\n", key->name);
+			rc = PS_FAILURE;
+			goto L_NEXT_KEY;
+		}
+		for (s = 0; s < nsuites; s++) {
+			if ((spec = sslGetDefinedCipherSpec(suites[s])) == NULL ||
+					!benchKeyFits(key, spec)) {
+				continue;
+			}
+			run.cipher = suites[s];
+			fprintf(stderr, "%s with %s, %d threads\n",
+				benchSuiteName(run.cipher), key->name, g_benchThreads);
+			run.test = BENCH_FULL;
+			if (benchMeasure(&run, threads, lat) < 0) {
+				rc = PS_FAILURE;
+				continue;	/* Nothing more will work either */
+			}
+			run.test = BENCH_RESUMED;
+			if (benchMeasure(&run, threads, lat) < 0) {
+				rc = PS_FAILURE;
+			}
+			/* Bulk speed doesn't depend on the key */
+			if (recordsDone[s] || g_benchMb == 0) {
+				continue;
+			}
+			recordsDone[s] = 1;
+			run.test = BENCH_RECORDS;
+			for (r = 0; g_benchRecLens[r] != 0; r++) {
+				run.recLen = g_benchRecLens[r];
+				run.nrec = (uint32_t)((uint64_t)g_benchMb * BYTES_PER_MB /
+					run.recLen);
+				if (benchMeasure(&run, threads, lat) < 0) {
+					rc = PS_FAILURE;
+				}
+			}
+		}
+L_NEXT_KEY:
+		matrixSslDeleteKeys(run.svrKeys);
+		matrixSslDeleteKeys(run.clnKeys);
+	}
+	for (s = 0; s < nsuites; s++) {
+		if (sslGetDefinedCipherSpec(suites[s]) == NULL) {
+			fprintf(stderr, "Cipher suite %hu is not enabled\n", suites[s]);
+		}
+	}
+
+	if (g_benchJson) {
+		fprintf(g_benchOut, "\n  ]\n}\n");
+	}
+
+L_EXIT:
+	if (threads != NULL) {
+		for (tn = 0; tn < g_benchThreads; tn++) {
+			free(threads[tn].lat);
+		}
+		free(threads);
+	}
+	free(lat);
+	if (g_benchOut != stdout) {
+		fclose(g_benchOut);
+	}
+	matrixSslClose();
+	return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif /* SSL_BENCH */
+
 
 #ifdef USE_MATRIXSSL_STATS
 static void statCback(void *ssl, void *stat_ptr, int32 type, int32 value)
@@ -320,6 +320,39 @@ int32_t tlsExtendedDeriveKeys(ssl_t *ssl)
 	return genKeyBlock(ssl);
 }
 
+/******************************************************************************/
+/*
+	Key a record MAC context when a cipher is activated.  The per record MAC
+	routines below start from a copy of it, so the ipad and opad blocks are
+	hashed once per key rather than once per record.
+*/
+int32_t tlsInitRecordHmac(psHmac_t *ctx, const unsigned char *key,
+			uint16_t macSize)
+{
+	switch (macSize) {
+#ifdef USE_HMAC_MD5
+	case MD5_HASH_SIZE:
+		return psHmacInit(ctx, HMAC_MD5, key, macSize);
+#endif
+#ifdef USE_HMAC_SHA1
+	case SHA1_HASH_SIZE:
+		return psHmacInit(ctx, HMAC_SHA1, key, macSize);
+#endif
+#ifdef USE_HMAC_SHA256
+	case SHA256_HASH_SIZE:
+		return psHmacInit(ctx, HMAC_SHA256, key, macSize);
+#endif
+#ifdef USE_HMAC_SHA384
+	case SHA384_HASH_SIZE:
+		return psHmacInit(ctx, HMAC_SHA384, key, macSize);
+#endif
+	default:
+		/* AEAD and NULL ciphers have no record MAC */
+		memzero_s(ctx, sizeof(psHmac_t));
+		return PS_SUCCESS;
+	}
+}
+
 #ifdef USE_SHA_MAC
 #ifdef USE_SHA1
 /******************************************************************************/
@@ -331,12 +364,13 @@ int32_t tlsHMACSha1(ssl_t *ssl, int32 mode, unsigned char type,
 {
 #ifndef USE_HMAC_TLS
 	psHmacSha1_t		ctx;
+	psHmac_t			*keyed;
 #endif
 	unsigned char		*key, *seq;
 	unsigned char		majVer, minVer, tmp[5];
-	int32				i;
+	int32				i, seqLen;
 #ifdef USE_DTLS
-	unsigned char		dtls_seq[8];
+	unsigned char		dtls_seq[DTLS_CID_AAD_LEN(DTLS_MAX_CID_LEN)];
 #endif /* USE_DTLS */
 #ifdef USE_HMAC_TLS
 	uint32				alt_len;
@@ -348,9 +382,15 @@ int32_t tlsHMACSha1(ssl_t *ssl, int32 mode, unsigned char type,
 	if (mode == HMAC_CREATE) {
 		key = ssl->sec.writeMAC;
 		seq = ssl->sec.seq;
+#ifndef USE_HMAC_TLS
+		keyed = &ssl->sec.writeHmac;
+#endif
 	} else { /* HMAC_VERIFY */
 		key = ssl->sec.readMAC;
 		seq = ssl->sec.remSeq;
+#ifndef USE_HMAC_TLS
+		keyed = &ssl->sec.readHmac;
+#endif
 	}
 	
 	/* Sanity */
@@ -377,6 +417,15 @@ int32_t tlsHMACSha1(ssl_t *ssl, int32 mode, unsigned char type,
 	tmp[2] = minVer;
 	tmp[3] = (len & 0xFF00) >> 8;
 	tmp[4] = len & 0xFF;
+	seqLen = 8;
+#ifdef USE_DTLS
+	if ((ssl->flags & SSL_FLAGS_DTLS) && type == SSL_RECORD_TYPE_TLS12_CID) {
+		/* RFC 9146 MAC header, fed through as seq || tmp */
+		seqLen = dtlsCidAdditionalData(ssl, mode, len, dtls_seq) - 5;
+		seq = dtls_seq;
+		memcpy(tmp, dtls_seq + seqLen, 5);
+	}
+#endif /* USE_DTLS */
 #ifdef USE_HMAC_TLS
 #ifdef USE_HMAC_TLS_LUCKY13_COUNTERMEASURE
 	alt_len = mode == HMAC_CREATE ? len : ssl->rec.len;
@@ -384,15 +433,16 @@ int32_t tlsHMACSha1(ssl_t *ssl, int32 mode, unsigned char type,
 	alt_len = len;
 #endif
 	(void)psHmacSha1Tls(key, SHA1_HASH_SIZE,
-						seq, 8,
+						seq, seqLen,
 						tmp, 5,
 						data, len, alt_len,
 						mac);
 #else
-	if (psHmacSha1Init(&ctx, key, SHA1_HASH_SIZE) < 0) {
+	if (keyed->type != HMAC_SHA1) {
 		return PS_FAIL;
 	}
-	psHmacSha1Update(&ctx, seq, 8);
+	psHmacSha1Cpy(&ctx, &keyed->u.sha1);
+	psHmacSha1Update(&ctx, seq, seqLen);
 	psHmacSha1Update(&ctx, tmp, 5);
 	psHmacSha1Update(&ctx, data, len);
 	psHmacSha1Final(&ctx, mac);
@@ -417,13 +467,13 @@ int32_t tlsHMACSha2(ssl_t *ssl, int32 mode, unsigned char type,
 			unsigned char *data, uint32 len, unsigned char *mac, int32 hashLen)
 {
 #ifndef USE_HMAC_TLS
-	psHmac_t			ctx;
+	psHmac_t			ctx, *keyed;
 #endif
 	unsigned char		*key, *seq;
 	unsigned char		majVer, minVer, tmp[5];
-	int32				i;
+	int32				i, seqLen;
 #ifdef USE_DTLS
-	unsigned char		dtls_seq[8];
+	unsigned char		dtls_seq[DTLS_CID_AAD_LEN(DTLS_MAX_CID_LEN)];
 #endif /* USE_DTLS */
 #ifdef USE_HMAC_TLS
 	uint32				alt_len;
@@ -435,9 +485,15 @@ int32_t tlsHMACSha2(ssl_t *ssl, int32 mode, unsigned char type,
 	if (mode == HMAC_CREATE) {
 		key = ssl->sec.writeMAC;
 		seq = ssl->sec.seq;
+#ifndef USE_HMAC_TLS
+		keyed = &ssl->sec.writeHmac;
+#endif
 	} else { /* HMAC_VERIFY */
 		key = ssl->sec.readMAC;
 		seq = ssl->sec.remSeq;
+#ifndef USE_HMAC_TLS
+		keyed = &ssl->sec.readHmac;
+#endif
 	}
 	/* Sanity */
 	if (key == NULL) {
@@ -463,6 +519,15 @@ int32_t tlsHMACSha2(ssl_t *ssl, int32 mode, unsigned char type,
 	tmp[2] = minVer;
 	tmp[3] = (len & 0xFF00) >> 8;
 	tmp[4] = len & 0xFF;
+	seqLen = 8;
+#ifdef USE_DTLS
+	if ((ssl->flags & SSL_FLAGS_DTLS) && type == SSL_RECORD_TYPE_TLS12_CID) {
+		/* RFC 9146 MAC header, fed through as seq || tmp */
+		seqLen = dtlsCidAdditionalData(ssl, mode, len, dtls_seq) - 5;
+		seq = dtls_seq;
+		memcpy(tmp, dtls_seq + seqLen, 5);
+	}
+#endif /* USE_DTLS */
 
 #ifdef USE_HMAC_TLS
 #ifdef USE_HMAC_TLS_LUCKY13_COUNTERMEASURE
@@ -471,26 +536,27 @@ int32_t tlsHMACSha2(ssl_t *ssl, int32 mode, unsigned char type,
 	alt_len = len;
 #endif
 	(void)psHmacSha2Tls(key, hashLen,
-						seq, 8,
+						seq, seqLen,
 						tmp, 5,
 						data, len, alt_len,
 						mac, hashLen);
 #else
 	switch(hashLen) {
 	case SHA256_HASHLEN:
-		if (psHmacInit(&ctx, HMAC_SHA256, key, hashLen) < 0) {
+		if (keyed->type != HMAC_SHA256) {
 			return PS_FAIL;
 		}
 		break;
 	case SHA384_HASHLEN:
-		if (psHmacInit(&ctx, HMAC_SHA384, key, hashLen) < 0) {
+		if (keyed->type != HMAC_SHA384) {
 			return PS_FAIL;
 		}
 		break;
 	default:
 		return PS_FAIL;
 	}
-	psHmacUpdate(&ctx, seq, 8);
+	psHmacCpy(&ctx, keyed);
+	psHmacUpdate(&ctx, seq, seqLen);
 	psHmacUpdate(&ctx, tmp, 5);
 	psHmacUpdate(&ctx, data, len);
 	psHmacFinal(&ctx, mac);
@@ -517,6 +583,7 @@ int32_t tlsHMACMd5(ssl_t *ssl, int32 mode, unsigned char type,
 				 unsigned char *data, uint32 len, unsigned char *mac)
 {
 	psHmacMd5_t			ctx;
+	psHmac_t			*keyed;
 	unsigned char		*key, *seq;
 	unsigned char		majVer, minVer, tmp[5];
 	int32				i;
@@ -527,18 +594,18 @@ int32_t tlsHMACMd5(ssl_t *ssl, int32 mode, unsigned char type,
 	if (mode == HMAC_CREATE) {
 		key = ssl->sec.writeMAC;
 		seq = ssl->sec.seq;
+		keyed = &ssl->sec.writeHmac;
 	} else { /* HMAC_VERIFY */
 		key = ssl->sec.readMAC;
 		seq = ssl->sec.remSeq;
+		keyed = &ssl->sec.readHmac;
 	}
 	/* Sanity */
-	if (key == NULL) {
+	if (key == NULL || keyed->type != HMAC_MD5) {
 		return PS_FAILURE;
 	}
 
-	if (psHmacMd5Init(&ctx, key, MD5_HASH_SIZE) < 0) {
-		return PS_FAIL;
-	}
+	psHmacMd5Cpy(&ctx, &keyed->u.md5);
 #ifdef USE_DTLS
 	if (ssl->flags & SSL_FLAGS_DTLS) {
 		if (mode == HMAC_CREATE) {
@@ -654,6 +721,12 @@ int32 sslActivateReadCipher(ssl_t *ssl)
 		memcpy(ssl->sec.readMAC, ssl->sec.rMACptr, ssl->deMacSize);
 		memcpy(ssl->sec.readKey, ssl->sec.rKeyptr, ssl->cipher->keySize);
 		memcpy(ssl->sec.readIV, ssl->sec.rIVptr, ssl->cipher->ivSize);
+#ifdef USE_TLS
+		if (tlsInitRecordHmac(&ssl->sec.readHmac, ssl->sec.readMAC,
+				ssl->nativeDeMacSize) < 0) {
+			return PS_FAILURE;
+		}
+#endif /* USE_TLS */
 /*
 		set up decrypt contexts
 */
@@ -732,6 +805,12 @@ int32 sslActivateWriteCipher(ssl_t *ssl)
 		memcpy(ssl->sec.writeMAC, ssl->sec.wMACptr, ssl->enMacSize);
 		memcpy(ssl->sec.writeKey, ssl->sec.wKeyptr, ssl->cipher->keySize);
 		memcpy(ssl->sec.writeIV, ssl->sec.wIVptr, ssl->cipher->ivSize);
+#ifdef USE_TLS
+		if (tlsInitRecordHmac(&ssl->sec.writeHmac, ssl->sec.writeMAC,
+				ssl->nativeEnMacSize) < 0) {
+			return PS_FAILURE;
+		}
+#endif /* USE_TLS */
 /*
 		set up encrypt contexts
  */